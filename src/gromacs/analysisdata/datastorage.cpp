@@ -46,6 +46,8 @@
 #include <limits>
 #include <vector>
 
+#include "thread_mpi/mutex.h"
+
 #include "gromacs/analysisdata/abstractdata.h"
 #include "gromacs/analysisdata/dataframe.h"
 #include "gromacs/analysisdata/datamodulemanager.h"
@@ -276,6 +278,14 @@ class AnalysisDataStorageImpl
          * frame (see \a frames_).
          */
         int                     nextIndex_;
+        /*! \brief
+         * Serializes access from concurrent users of the storage object.
+         *
+         * Held while frames are started and finished and while point sets
+         * are notified, but not while values are set for a frame, since each
+         * concurrent user works on its own frame.
+         */
+        tMPI::mutex             mutex_;
 };
 
 /********************************************************************
@@ -545,6 +555,7 @@ AnalysisDataStorageImpl::notifyNextFrames(size_t firstLocation)
 void
 AnalysisDataStorageImpl::finishFrame(int index)
 {
+    tMPI::lock_guard<tMPI::mutex> lock(mutex_);
     const int storageIndex = computeStorageLocation(index);
     GMX_RELEASE_ASSERT(storageIndex >= 0, "Out of bounds frame index");
 
@@ -631,9 +642,10 @@ void
 AnalysisDataStorageFrameData::addPointSet(int dataSetIndex, int firstColumn,
                                           ValueIterator begin, ValueIterator end)
 {
-    const int                valueCount = end - begin;
-    AnalysisDataPointSetInfo pointSetInfo(0, valueCount,
-                                          dataSetIndex, firstColumn);
+    tMPI::lock_guard<tMPI::mutex> lock(storageImpl().mutex_);
+    const int                     valueCount = end - begin;
+    AnalysisDataPointSetInfo      pointSetInfo(0, valueCount,
+                                               dataSetIndex, firstColumn);
     AnalysisDataPointSetRef  pointSet(header(), pointSetInfo,
                                       constArrayRefFromVector<AnalysisDataValue>(begin, end));
     storageImpl().modules_->notifyParallelPointsAdd(pointSet);
@@ -885,6 +897,7 @@ AnalysisDataStorageFrame &
 AnalysisDataStorage::startFrame(const AnalysisDataFrameHeader &header)
 {
     GMX_ASSERT(header.isValid(), "Invalid header");
+    tMPI::lock_guard<tMPI::mutex>           lock(impl_->mutex_);
     internal::AnalysisDataStorageFrameData *storedFrame;
     if (impl_->storeAll())
     {
@@ -928,6 +941,7 @@ AnalysisDataStorage::startFrame(int index, real x, real dx)
 AnalysisDataStorageFrame &
 AnalysisDataStorage::currentFrame(int index)
 {
+    tMPI::lock_guard<tMPI::mutex> lock(impl_->mutex_);
     const int storageIndex = impl_->computeStorageLocation(index);
     GMX_RELEASE_ASSERT(storageIndex >= 0, "Out of bounds frame index");
 
@@ -258,8 +258,10 @@ class AnalysisDataStorageFrame
  * take the responsibility of calling all the notification methods in
  * AnalysisDataModuleManager,
  *
- * \todo
- * Proper multi-threaded implementation.
+ * With startParallelDataStorage(), these methods can be called concurrently
+ * from different threads, as long as each thread works on a different frame.
+ * Notifications are serialized with an internal mutex, such that the
+ * attached modules do not need to be thread-safe.
  *
  * \inlibraryapi
  * \ingroup module_analysisdata
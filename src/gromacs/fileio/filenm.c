@@ -204,6 +204,7 @@ static const t_deffile
     { eftASC, ".edi", "sam",    NULL, "ED sampling input"},
     { eftASC, ".cub", "pot",  NULL, "Gaussian cube file" },
     { eftASC, ".xpm", "root", NULL, "X PixMap compatible matrix file" },
+    { eftXDR, ".sqa", "sfact", NULL, "Accumulated structure factor for continuing an analysis" },
     { eftASC, "", "rundir", NULL, "Run directory" }
 };
 
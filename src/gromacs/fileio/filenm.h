@@ -62,6 +62,7 @@ enum {
     efEDI,
     efCUB,
     efXPM,
+    efSQA,
     efRND,
     efNR
 };
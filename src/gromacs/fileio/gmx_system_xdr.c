@@ -814,6 +814,176 @@ xdrstdio_putuint32 (XDR *xdrs, xdr_uint32_t *ip)
     return TRUE;
 }
 
+
+
+static bool_t xdrmem_getbytes (XDR *, char *, unsigned int);
+static bool_t xdrmem_putbytes (XDR *, char *, unsigned int);
+static unsigned int xdrmem_getpos (XDR *);
+static bool_t xdrmem_setpos (XDR *, unsigned int);
+static xdr_int32_t *xdrmem_inline (XDR *, int);
+static void xdrmem_destroy (XDR *);
+static bool_t xdrmem_getint32 (XDR *, xdr_int32_t *);
+static bool_t xdrmem_putint32 (XDR *, xdr_int32_t *);
+static bool_t xdrmem_getuint32 (XDR *, xdr_uint32_t *);
+static bool_t xdrmem_putuint32 (XDR *, xdr_uint32_t *);
+
+/*
+ * Ops vector for memory type XDR
+ */
+static const struct xdr_ops xdrmem_ops =
+{
+    xdrmem_getbytes,    /* deserialize counted bytes */
+    xdrmem_putbytes,    /* serialize counted bytes */
+    xdrmem_getpos,      /* get offset in the stream */
+    xdrmem_setpos,      /* set offset in the stream */
+    xdrmem_inline,      /* prime stream for inline macros */
+    xdrmem_destroy,     /* destroy stream */
+    xdrmem_getint32,    /* deserialize a int */
+    xdrmem_putint32,    /* serialize a int */
+    xdrmem_getuint32,   /* deserialize a int */
+    xdrmem_putuint32    /* serialize a int */
+};
+
+/*
+ * Initialize a memory xdr stream.
+ * Sets the xdr stream handle xdrs for use on the size bytes at addr.
+ * x_base holds the start of the memory, x_private the current position
+ * and x_handy the number of bytes left.
+ * Operation flag is set to op.
+ */
+void
+xdrmem_create (XDR *xdrs, char *addr, unsigned int size, enum xdr_op op)
+{
+    xdrs->x_op      = op;
+    xdrs->x_ops     = (struct xdr_ops *) &xdrmem_ops;
+    xdrs->x_private = xdrs->x_base = addr;
+    xdrs->x_handy   = size;
+}
+
+static void
+xdrmem_destroy (XDR *xdrs)
+{
+    (void)xdrs;
+}
+
+static bool_t
+xdrmem_getbytes (XDR *xdrs, char *addr, unsigned int len)
+{
+    if ((unsigned int) xdrs->x_handy < len)
+    {
+        return FALSE;
+    }
+    memcpy (addr, xdrs->x_private, len);
+    xdrs->x_private += len;
+    xdrs->x_handy   -= len;
+    return TRUE;
+}
+
+static bool_t
+xdrmem_putbytes (XDR *xdrs, char *addr, unsigned int len)
+{
+    if ((unsigned int) xdrs->x_handy < len)
+    {
+        return FALSE;
+    }
+    memcpy (xdrs->x_private, addr, len);
+    xdrs->x_private += len;
+    xdrs->x_handy   -= len;
+    return TRUE;
+}
+
+static unsigned int
+xdrmem_getpos (XDR *xdrs)
+{
+    return (unsigned int) (xdrs->x_private - xdrs->x_base);
+}
+
+static bool_t
+xdrmem_setpos (XDR *xdrs, unsigned int pos)
+{
+    char *newaddr  = xdrs->x_base + pos;
+    char *lastaddr = xdrs->x_private + xdrs->x_handy;
+
+    if (newaddr > lastaddr)
+    {
+        return FALSE;
+    }
+    xdrs->x_private = newaddr;
+    xdrs->x_handy   = (int) (lastaddr - newaddr);
+    return TRUE;
+}
+
+static xdr_int32_t *
+xdrmem_inline (XDR *xdrs, int len)
+{
+    (void)xdrs;
+    (void)len;
+    /* The callers in Gromacs never use the inline macros */
+    return NULL;
+}
+
+static bool_t
+xdrmem_getint32 (XDR *xdrs, xdr_int32_t *ip)
+{
+    xdr_int32_t mycopy;
+
+    if (xdrs->x_handy < 4)
+    {
+        return FALSE;
+    }
+    memcpy (&mycopy, xdrs->x_private, 4);
+    xdrs->x_private += 4;
+    xdrs->x_handy   -= 4;
+    *ip              = xdr_ntohl (mycopy);
+    return TRUE;
+}
+
+static bool_t
+xdrmem_putint32 (XDR *xdrs, xdr_int32_t *ip)
+{
+    xdr_int32_t mycopy = xdr_htonl (*ip);
+
+    if (xdrs->x_handy < 4)
+    {
+        return FALSE;
+    }
+    memcpy (xdrs->x_private, &mycopy, 4);
+    xdrs->x_private += 4;
+    xdrs->x_handy   -= 4;
+    return TRUE;
+}
+
+static bool_t
+xdrmem_getuint32 (XDR *xdrs, xdr_uint32_t *ip)
+{
+    xdr_uint32_t mycopy;
+
+    if (xdrs->x_handy < 4)
+    {
+        return FALSE;
+    }
+    memcpy (&mycopy, xdrs->x_private, 4);
+    xdrs->x_private += 4;
+    xdrs->x_handy   -= 4;
+    *ip              = xdr_ntohl (mycopy);
+    return TRUE;
+}
+
+static bool_t
+xdrmem_putuint32 (XDR *xdrs, xdr_uint32_t *ip)
+{
+    xdr_uint32_t mycopy = xdr_htonl (*ip);
+
+    if (xdrs->x_handy < 4)
+    {
+        return FALSE;
+    }
+    memcpy (xdrs->x_private, &mycopy, 4);
+    xdrs->x_private += 4;
+    xdrs->x_handy   -= 4;
+    return TRUE;
+}
+
 #else
 int
     gmx_system_xdr_empty;
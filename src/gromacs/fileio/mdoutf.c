@@ -34,11 +34,18 @@
  */
 #include "mdoutf.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread_mpi/threads.h"
+
 #include "gromacs/legacyheaders/xvgr.h"
 #include "gromacs/legacyheaders/mdrun.h"
 #include "gromacs/legacyheaders/types/commrec.h"
 #include "gromacs/legacyheaders/mvdata.h"
 #include "gromacs/legacyheaders/domdec.h"
+#include "gromacs/legacyheaders/md_logging.h"
+#include "gromacs/legacyheaders/gmx_thread_affinity.h"
 #include "trnio.h"
 #include "xtcio.h"
 #include "tngio.h"
@@ -50,9 +57,38 @@
 #include "gromacs/utility/smalloc.h"
 #include "gromacs/timing/wallcycle.h"
 
+/* A compressed-position frame queued for the XTC output thread */
+typedef struct {
+    gmx_int64_t step;
+    double      t;
+    matrix      box;
+    rvec       *x;
+} t_xtc_frame;
+
+/* Asynchronous XTC output.
+ * The MD thread copies the frame into one of two buffers and continues,
+ * while a separate thread compresses and writes the other buffer.
+ * The MD thread only waits when both buffers are still in use.
+ */
+typedef struct {
+    t_fileio           *fio;
+    int                 natoms;
+    real                prec;
+    t_xtc_frame         frame[2];
+    int                 head;    /* next buffer the MD thread fills    */
+    int                 tail;    /* next buffer the writer writes      */
+    int                 nfilled; /* number of buffers queued or being written */
+    gmx_bool            bError;  /* a write failed                     */
+    gmx_bool            bStop;   /* the writer should exit when idle   */
+    tMPI_Thread_t       thread;
+    tMPI_Thread_mutex_t mtx;
+    tMPI_Thread_cond_t  cond;
+} t_xtc_async;
+
 struct gmx_mdoutf {
     t_fileio         *fp_trn;
     t_fileio         *fp_xtc;
+    t_xtc_async      *xtc_async; /* NULL when XTC output is written directly */
     tng_trajectory_t  tng;
     tng_trajectory_t  tng_low_prec;
     int               x_compression_precision; /* only used by XTC output */
@@ -72,6 +108,187 @@ struct gmx_mdoutf {
 };
 
 
+static void *xtc_async_thread(void *arg)
+{
+    t_xtc_async *xa = (t_xtc_async *)arg;
+    t_xtc_frame *fr;
+    gmx_bool     bOK;
+
+    /* This thread is started after mdrun pinned the master thread and
+     * inherits its single-core mask. Use the mask from before pinning,
+     * so the compression runs on an idle core when there is one,
+     * instead of time-sharing the core of the master thread.
+     */
+    gmx_reset_thread_affinity();
+
+    while (TRUE)
+    {
+        tMPI_Thread_mutex_lock(&xa->mtx);
+        while (xa->nfilled == 0 && !xa->bStop)
+        {
+            tMPI_Thread_cond_wait(&xa->cond, &xa->mtx);
+        }
+        if (xa->nfilled == 0)
+        {
+            tMPI_Thread_mutex_unlock(&xa->mtx);
+            break;
+        }
+        fr = &xa->frame[xa->tail];
+        tMPI_Thread_mutex_unlock(&xa->mtx);
+
+        /* The buffer is not touched by the MD thread, write without the lock */
+        bOK = (write_xtc(xa->fio, xa->natoms, fr->step, fr->t,
+                         fr->box, fr->x, xa->prec) != 0);
+
+        tMPI_Thread_mutex_lock(&xa->mtx);
+        if (!bOK)
+        {
+            xa->bError = TRUE;
+        }
+        xa->tail = 1 - xa->tail;
+        xa->nfilled--;
+        tMPI_Thread_cond_broadcast(&xa->cond);
+        tMPI_Thread_mutex_unlock(&xa->mtx);
+    }
+
+    return NULL;
+}
+
+/* Starts the XTC output thread, returns NULL when XTC output should be
+ * written on the MD thread.
+ */
+static t_xtc_async *init_xtc_async(FILE *fplog, t_fileio *fio, int natoms, real prec)
+{
+    t_xtc_async *xa;
+    int          i;
+
+    if (getenv("GMX_NO_XTC_THREAD") != NULL)
+    {
+        return NULL;
+    }
+
+    snew(xa, 1);
+    xa->fio    = fio;
+    xa->natoms = natoms;
+    xa->prec   = prec;
+    for (i = 0; i < 2; i++)
+    {
+        snew(xa->frame[i].x, natoms);
+    }
+    tMPI_Thread_mutex_init(&xa->mtx);
+    tMPI_Thread_cond_init(&xa->cond);
+    if (tMPI_Thread_create(&xa->thread, xtc_async_thread, xa) != 0)
+    {
+        md_print_warn(NULL, fplog, "Could not start the XTC output thread, "
+                      "writing compressed positions on the MD thread");
+        tMPI_Thread_cond_destroy(&xa->cond);
+        tMPI_Thread_mutex_destroy(&xa->mtx);
+        for (i = 0; i < 2; i++)
+        {
+            sfree(xa->frame[i].x);
+        }
+        sfree(xa);
+        return NULL;
+    }
+
+    return xa;
+}
+
+static void xtc_async_check_error(t_xtc_async *xa)
+{
+    if (xa->bError)
+    {
+        gmx_fatal(FARGS, "XTC error - maybe you are out of disk space?");
+    }
+}
+
+/* Waits until all queued frames have been written */
+static void xtc_async_flush(t_xtc_async *xa)
+{
+    tMPI_Thread_mutex_lock(&xa->mtx);
+    while (xa->nfilled > 0)
+    {
+        tMPI_Thread_cond_wait(&xa->cond, &xa->mtx);
+    }
+    tMPI_Thread_mutex_unlock(&xa->mtx);
+
+    xtc_async_check_error(xa);
+}
+
+/* Writes all queued frames, stops the thread and frees xa */
+static void done_xtc_async(t_xtc_async *xa)
+{
+    int i;
+
+    tMPI_Thread_mutex_lock(&xa->mtx);
+    xa->bStop = TRUE;
+    tMPI_Thread_cond_broadcast(&xa->cond);
+    tMPI_Thread_mutex_unlock(&xa->mtx);
+    tMPI_Thread_join(xa->thread, NULL);
+
+    xtc_async_check_error(xa);
+
+    tMPI_Thread_cond_destroy(&xa->cond);
+    tMPI_Thread_mutex_destroy(&xa->mtx);
+    for (i = 0; i < 2; i++)
+    {
+        sfree(xa->frame[i].x);
+    }
+    sfree(xa);
+}
+
+/* Copies the positions of the compressed-output group from x_global to x */
+static void copy_x_compressed(gmx_mdoutf_t of, rvec *x_global, rvec *x)
+{
+    int i, j;
+
+    if (of->natoms_x_compressed == of->natoms_global)
+    {
+        memcpy(x, x_global, of->natoms_global*sizeof(rvec));
+    }
+    else
+    {
+        for (i = 0, j = 0; (i < of->natoms_global); i++)
+        {
+            if (ggrpnr(of->groups, egcCompressedX, i) == 0)
+            {
+                copy_rvec(x_global[i], x[j++]);
+            }
+        }
+    }
+}
+
+/* Queues a frame for the XTC output thread, waits only when both
+ * buffers are still in use by earlier frames.
+ */
+static void xtc_async_write(gmx_mdoutf_t of, gmx_int64_t step, double t,
+                            matrix box, rvec *x_global)
+{
+    t_xtc_async *xa = of->xtc_async;
+    t_xtc_frame *fr;
+
+    tMPI_Thread_mutex_lock(&xa->mtx);
+    while (xa->nfilled == 2)
+    {
+        tMPI_Thread_cond_wait(&xa->cond, &xa->mtx);
+    }
+    fr = &xa->frame[xa->head];
+    tMPI_Thread_mutex_unlock(&xa->mtx);
+
+    xtc_async_check_error(xa);
+
+    fr->step = step;
+    fr->t    = t;
+    copy_mat(box, fr->box);
+    copy_x_compressed(of, x_global, fr->x);
+
+    tMPI_Thread_mutex_lock(&xa->mtx);
+    xa->head = 1 - xa->head;
+    xa->nfilled++;
+    tMPI_Thread_cond_broadcast(&xa->cond);
+    tMPI_Thread_mutex_unlock(&xa->mtx);
+}
+
 gmx_mdoutf_t init_mdoutf(FILE *fplog, int nfile, const t_filenm fnm[],
                          int mdrun_flags, const t_commrec *cr,
                          const t_inputrec *ir, gmx_mtop_t *top_global,
@@ -87,6 +304,7 @@ gmx_mdoutf_t init_mdoutf(FILE *fplog, int nfile, const t_filenm fnm[],
     of->fp_trn       = NULL;
     of->fp_ene       = NULL;
     of->fp_xtc       = NULL;
+    of->xtc_async    = NULL;
     of->tng          = NULL;
     of->tng_low_prec = NULL;
     of->fp_dhdl      = NULL;
@@ -209,6 +427,12 @@ gmx_mdoutf_t init_mdoutf(FILE *fplog, int nfile, const t_filenm fnm[],
                 of->natoms_x_compressed++;
             }
         }
+
+        if (of->fp_xtc)
+        {
+            of->xtc_async = init_xtc_async(fplog, of->fp_xtc, of->natoms_x_compressed,
+                                           of->x_compression_precision);
+        }
     }
 
     if (bCiteTng)
@@ -304,6 +528,11 @@ void mdoutf_write_to_trajectory_files(FILE *fplog, t_commrec *cr,
         {
             fflush_tng(of->tng);
             fflush_tng(of->tng_low_prec);
+            if (of->xtc_async)
+            {
+                /* The checkpoint stores the size and checksum of the xtc file */
+                xtc_async_flush(of->xtc_async);
+            }
             write_checkpoint(of->fn_cpt, of->bKeepAndNumCPT,
                              fplog, cr, of->eIntegrator, of->simulation_part,
                              of->bExpanded, of->elamstats, step, t, state_global);
@@ -331,7 +560,11 @@ void mdoutf_write_to_trajectory_files(FILE *fplog, t_commrec *cr,
                            (mdof_flags & MDOF_V) ? (const rvec *) global_v : NULL,
                            (mdof_flags & MDOF_F) ? (const rvec *) f_global : NULL);
         }
-        if (mdof_flags & MDOF_X_COMPRESSED)
+        if ((mdof_flags & MDOF_X_COMPRESSED) && of->xtc_async)
+        {
+            xtc_async_write(of, step, t, state_local->box, state_global->x);
+        }
+        else if (mdof_flags & MDOF_X_COMPRESSED)
         {
             rvec *xxtc = NULL;
 
@@ -346,16 +579,8 @@ void mdoutf_write_to_trajectory_files(FILE *fplog, t_commrec *cr,
                 /* We are writing the positions of only a subset of
                    the atoms to the compressed output, so we have to
                    make a copy of the subset of coordinates. */
-                int i, j;
-
                 snew(xxtc, of->natoms_x_compressed);
-                for (i = 0, j = 0; (i < of->natoms_global); i++)
-                {
-                    if (ggrpnr(of->groups, egcCompressedX, i) == 0)
-                    {
-                        copy_rvec(state_global->x[i], xxtc[j++]);
-                    }
-                }
+                copy_x_compressed(of, state_global->x, xxtc);
             }
             if (write_xtc(of->fp_xtc, of->natoms_x_compressed, step, t,
                           state_local->box, xxtc, of->x_compression_precision) == 0)
@@ -397,6 +622,10 @@ void done_mdoutf(gmx_mdoutf_t of)
     {
         close_enx(of->fp_ene);
     }
+    if (of->xtc_async)
+    {
+        done_xtc_async(of->xtc_async);
+    }
     if (of->fp_xtc)
     {
         close_xtc(of->fp_xtc);
@@ -0,0 +1,246 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2013,2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+/*! \internal \file
+ * \brief
+ * Tests for the xtc frame index and random-access reader
+ *
+ * \ingroup module_fileio
+ */
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include <string>
+
+#include "gromacs/fileio/xtcindex.h"
+#include "gromacs/fileio/xtcio.h"
+#include "gromacs/utility/smalloc.h"
+
+#include "testutils/testfilemanager.h"
+
+namespace
+{
+
+class XtcIndexTest : public ::testing::Test
+{
+    public:
+        XtcIndexTest()
+        {
+            xtcFile_   = fileManager_.getTemporaryFilePath("traj.xtc");
+            // Make sure the sidecar is cleaned up with the trajectory
+            indexFile_ = fileManager_.getTemporaryFilePath("traj.xtc.idx");
+        }
+
+        //! Writes nframes frames of natoms atoms, frame f at time 0.5*f
+        void writeTrajectory(int natoms, int nframes)
+        {
+            t_fileio *fio = open_xtc(xtcFile_.c_str(), "w");
+            rvec     *x;
+            matrix    box = {{3, 0, 0}, {0, 3, 0}, {0, 0, 3}};
+
+            snew(x, natoms);
+            for (int f = 0; f < nframes; f++)
+            {
+                for (int i = 0; i < natoms; i++)
+                {
+                    x[i][XX] = 0.01*i + 0.1*f;
+                    x[i][YY] = 0.02*i*f;
+                    x[i][ZZ] = 1.5 - 0.003*i;
+                }
+                ASSERT_TRUE(write_xtc(fio, natoms, 10*f, 0.5*f, box, x, 1000) != 0);
+            }
+            close_xtc(fio);
+            sfree(x);
+        }
+
+        //! Overwrites the 4-byte big-endian word at byte pos of the sidecar
+        void patchIndexWord(long pos, unsigned int w)
+        {
+            unsigned char b[4] = {
+                static_cast<unsigned char>(w >> 24), static_cast<unsigned char>(w >> 16),
+                static_cast<unsigned char>(w >> 8), static_cast<unsigned char>(w)
+            };
+            FILE         *fp = std::fopen(indexFile_.c_str(), "r+b");
+            ASSERT_TRUE(fp != NULL);
+            ASSERT_EQ(0, std::fseek(fp, pos, SEEK_SET));
+            ASSERT_EQ(4u, std::fwrite(b, 1, 4, fp));
+            std::fclose(fp);
+        }
+
+        //! Byte position in the sidecar of the low word of offset[f]
+        static long offsetPos(int f) { return 32 + 8*f + 4; }
+        //! Byte position in the sidecar of the time of frame f
+        static long timePos(int nframes, int f) { return 32 + 8*(nframes + 1) + 8*f + 4; }
+
+        gmx::test::TestFileManager      fileManager_;
+        std::string                     xtcFile_;
+        std::string                     indexFile_;
+};
+
+TEST_F(XtcIndexTest, RandomAccessMatchesSequentialRead)
+{
+    const int natoms  = 50;
+    const int nframes = 13;
+
+    writeTrajectory(natoms, nframes);
+
+    t_xtcreader      *rd = open_xtc_reader(xtcFile_.c_str());
+    ASSERT_TRUE(rd != NULL);
+    const t_xtcindex *idx = xtc_reader_index(rd);
+    EXPECT_EQ(natoms, idx->natoms);
+    EXPECT_EQ(nframes, idx->nframes);
+
+    t_fileio         *fio = open_xtc(xtcFile_.c_str(), "r");
+    rvec             *x, *xr;
+    matrix            box, boxr;
+    int               n, step, stepr;
+    real              t, tr, prec, precr;
+    gmx_bool          bOK;
+
+    snew(xr, natoms);
+    ASSERT_TRUE(read_first_xtc(fio, &n, &step, &t, box, &x, &prec, &bOK) != 0);
+    for (int f = 0; f < nframes; f++)
+    {
+        if (f > 0)
+        {
+            ASSERT_TRUE(read_next_xtc(fio, natoms, &step, &t, box, x, &prec, &bOK) != 0);
+        }
+        EXPECT_EQ(step, idx->step[f]);
+        EXPECT_EQ(t, idx->time[f]);
+        /* Read the frames in reverse order from the reader */
+        ASSERT_TRUE(xtc_reader_read_frame(rd, nframes - 1 - f, &stepr, &tr, boxr, xr, &precr));
+        ASSERT_TRUE(xtc_reader_read_frame(rd, f, &stepr, &tr, boxr, xr, &precr));
+        EXPECT_EQ(step, stepr);
+        EXPECT_EQ(t, tr);
+        for (int i = 0; i < natoms; i++)
+        {
+            for (int d = 0; d < DIM; d++)
+            {
+                EXPECT_EQ(x[i][d], xr[i][d]);
+            }
+        }
+    }
+    EXPECT_EQ(6, xtc_index_find_time(idx, 3.0));
+    EXPECT_EQ(7, xtc_index_find_time(idx, 3.1));
+    EXPECT_EQ(nframes, xtc_index_find_time(idx, 100));
+    close_xtc(fio);
+    close_xtc_reader(rd);
+    sfree(x);
+    sfree(xr);
+}
+
+TEST_F(XtcIndexTest, SidecarIsReusedAndIgnoresIncompleteFrames)
+{
+    writeTrajectory(20, 5);
+
+    t_xtcindex *idx = xtc_index_get(xtcFile_.c_str());
+    ASSERT_TRUE(idx != NULL);
+    EXPECT_EQ(5, idx->nframes);
+
+    /* The second call reads the sidecar. The frame times are not checked
+     * against the xtc file, so a changed time in the sidecar shows that
+     * it was used.
+     */
+    const float  tmark = 1234.5;
+    unsigned int w;
+    std::memcpy(&w, &tmark, sizeof(w));
+    patchIndexWord(timePos(idx->nframes, 2), w);
+    t_xtcindex *idx2 = xtc_index_get(xtcFile_.c_str());
+    ASSERT_TRUE(idx2 != NULL);
+    EXPECT_EQ(idx->nframes, idx2->nframes);
+    for (int f = 0; f <= idx->nframes; f++)
+    {
+        EXPECT_EQ(idx->offset[f], idx2->offset[f]);
+    }
+    EXPECT_EQ(tmark, idx2->time[2]);
+    done_xtc_index(idx2);
+
+    /* Appending a truncated frame changes the file size, so the index
+     * is rebuilt, without the incomplete frame.
+     */
+    FILE *fp = fopen(xtcFile_.c_str(), "ab");
+    ASSERT_TRUE(fp != NULL);
+    char  junk[40] = { 0, 0, 7, (char)203 };
+    fwrite(junk, 1, sizeof(junk), fp);
+    fclose(fp);
+    idx2 = xtc_index_get(xtcFile_.c_str());
+    ASSERT_TRUE(idx2 != NULL);
+    EXPECT_EQ(idx->nframes, idx2->nframes);
+    EXPECT_EQ(idx->offset[idx->nframes], idx2->offset[idx2->nframes]);
+    done_xtc_index(idx2);
+    done_xtc_index(idx);
+}
+
+TEST_F(XtcIndexTest, InconsistentSidecarIsRebuilt)
+{
+    writeTrajectory(20, 5);
+
+    t_xtcindex *idx = xtc_index_get(xtcFile_.c_str());
+    ASSERT_TRUE(idx != NULL);
+
+    /* Offsets that are not increasing */
+    patchIndexWord(offsetPos(3), static_cast<unsigned int>(idx->offset[2]));
+    t_xtcindex *idx2 = xtc_index_get(xtcFile_.c_str());
+    ASSERT_TRUE(idx2 != NULL);
+    EXPECT_EQ(idx->offset[3], idx2->offset[3]);
+    done_xtc_index(idx2);
+
+    /* The end of the last frame beyond the end of the file */
+    patchIndexWord(offsetPos(idx->nframes), static_cast<unsigned int>(idx->offset[idx->nframes] + 4));
+    idx2 = xtc_index_get(xtcFile_.c_str());
+    ASSERT_TRUE(idx2 != NULL);
+    EXPECT_EQ(idx->offset[idx->nframes], idx2->offset[idx2->nframes]);
+    done_xtc_index(idx2);
+
+    /* A number of atoms that differs from the first frame */
+    patchIndexWord(24, idx->natoms + 1);
+    idx2 = xtc_index_get(xtcFile_.c_str());
+    ASSERT_TRUE(idx2 != NULL);
+    EXPECT_EQ(idx->natoms, idx2->natoms);
+    done_xtc_index(idx2);
+
+    /* Each rebuild rewrote a consistent sidecar */
+    idx2 = xtc_index_get(xtcFile_.c_str());
+    ASSERT_TRUE(idx2 != NULL);
+    for (int f = 0; f <= idx->nframes; f++)
+    {
+        EXPECT_EQ(idx->offset[f], idx2->offset[f]);
+    }
+    done_xtc_index(idx2);
+    done_xtc_index(idx);
+}
+
+} // namespace
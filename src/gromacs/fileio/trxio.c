@@ -60,6 +60,7 @@
 #include "vec.h"
 #include "futil.h"
 #include "xtcio.h"
+#include "xtcindex.h"
 #include "pdbio.h"
 #include "confio.h"
 #include "checkpoint.h"
@@ -84,6 +85,8 @@ struct t_trxstatus
     double                  DT, BOX[3];
     gmx_bool                bReadBox;
     char                   *persistent_line; /* Persistent line for reading g96 trajectories */
+    t_xtcindex             *xtcidx;          /* Frame index of an xtc file, used for skipping frames */
+    int                     xtcframe;        /* Index of the next xtc frame in the file */
 };
 
 /* utility functions */
@@ -161,6 +164,8 @@ static void status_init(t_trxstatus *status)
     status->__frame         = -1;
     status->persistent_line = NULL;
     status->tng             = NULL;
+    status->xtcidx          = NULL;
+    status->xtcframe        = 0;
 }
 
 
@@ -616,6 +621,10 @@ int write_trx(t_trxstatus *status, int nind, const atom_id *ind, t_atoms *atoms,
 
 void close_trx(t_trxstatus *status)
 {
+    if (status->xtcidx)
+    {
+        done_xtc_index(status->xtcidx);
+    }
     gmx_tng_close(&status->tng);
     if (status->fio)
     {
@@ -787,6 +796,53 @@ static int pdb_first_x(t_trxstatus *status, FILE *fp, t_trxframe *fr)
     return fr->natoms;
 }
 
+/* Moves the xtc file of status to the next frame that is not skipped
+ * by -b, -e and -dt, using the times in the frame index so the frames in
+ * between are not decoded. Returns FALSE when the next frame is past -e.
+ */
+static gmx_bool xtc_index_skip(t_trxstatus *status, t_trxframe *fr)
+{
+    const t_xtcindex *idx = status->xtcidx;
+    int               f, fb, ct;
+
+    f = status->xtcframe;
+    if (bTimeSet(TBEGIN) && f < idx->nframes && idx->time[f] < rTimeValue(TBEGIN))
+    {
+        fb = xtc_index_find_time(idx, rTimeValue(TBEGIN));
+        if (fb >= idx->nframes)
+        {
+            gmx_fatal(FARGS, "Specified frame (time %f) doesn't exist or file corrupt/inconsistent.",
+                      rTimeValue(TBEGIN));
+        }
+        if (fb > f)
+        {
+            f = fb;
+        }
+    }
+    ct = -1;
+    while (f < idx->nframes &&
+           (ct = check_times2(idx->time[f], fr->t0, fr->bDouble)) < 0)
+    {
+        f++;
+    }
+    if (ct > 0)
+    {
+        return FALSE;
+    }
+    /* Past the indexed frames the remainder, if any, is read as usual */
+    if (f != status->xtcframe)
+    {
+        if (gmx_fio_seek(status->fio, idx->offset[f]) != 0)
+        {
+            gmx_fatal(FARGS, "Could not seek to frame %d of %s",
+                      f, gmx_fio_getname(status->fio));
+        }
+        status->xtcframe = f;
+    }
+
+    return TRUE;
+}
+
 gmx_bool read_next_frame(const output_env_t oenv, t_trxstatus *status, t_trxframe *fr)
 {
     real     pt;
@@ -835,7 +891,15 @@ gmx_bool read_next_frame(const output_env_t oenv, t_trxstatus *status, t_trxfram
                 /* DvdS 2005-05-31: this has been fixed along with the increased
                  * accuracy of the control over -b and -e options.
                  */
-                if (bTimeSet(TBEGIN) && (fr->tf < rTimeValue(TBEGIN)))
+                if (status->xtcidx && !(fr->flags & TRX_DONT_SKIP))
+                {
+                    if (!xtc_index_skip(status, fr))
+                    {
+                        bRet = FALSE;
+                        break;
+                    }
+                }
+                else if (bTimeSet(TBEGIN) && (fr->tf < rTimeValue(TBEGIN)))
                 {
                     if (xtc_seek_time(status->fio, rTimeValue(TBEGIN), fr->natoms, TRUE))
                     {
@@ -846,6 +910,7 @@ gmx_bool read_next_frame(const output_env_t oenv, t_trxstatus *status, t_trxfram
                 }
                 bRet = read_next_xtc(status->fio, fr->natoms, &fr->step, &fr->time, fr->box,
                                      fr->x, &fr->prec, &bOK);
+                status->xtcframe++;
                 fr->bPrec = (bRet && fr->prec > 0);
                 fr->bStep = bRet;
                 fr->bTime = bRet;
@@ -977,6 +1042,14 @@ int read_first_frame(const output_env_t oenv, t_trxstatus **status,
             fio = (*status)->fio = gmx_fio_open(fn, "r");
             break;
         case efXTC:
+            if (!(flags & TRX_DONT_SKIP) &&
+                (bTimeSet(TBEGIN) || bTimeSet(TDELTA)))
+            {
+                /* The frame index lets us skip frames without decoding them.
+                 * With only -e the frames up to the end are all read anyway.
+                 */
+                (*status)->xtcidx = xtc_index_get(fn);
+            }
             if (read_first_xtc(fio, &fr->natoms, &fr->step, &fr->time, fr->box, &fr->x,
                                &fr->prec, &bOK) == 0)
             {
@@ -990,6 +1063,7 @@ int read_first_frame(const output_env_t oenv, t_trxstatus **status,
             }
             else
             {
+                (*status)->xtcframe = 1;
                 fr->bPrec = (fr->prec > 0);
                 fr->bStep = TRUE;
                 fr->bTime = TRUE;
@@ -1104,6 +1178,10 @@ gmx_bool read_next_x(const output_env_t oenv, t_trxstatus *status, real *t,
 
 void close_trj(t_trxstatus *status)
 {
+    if (status->xtcidx)
+    {
+        done_xtc_index(status->xtcidx);
+    }
     gmx_tng_close(&status->tng);
     if (status->fio)
     {
@@ -1120,6 +1198,7 @@ void close_trj(t_trxstatus *status)
 void rewind_trj(t_trxstatus *status)
 {
     initcount(status);
+    status->xtcframe = 0;
 
     gmx_fio_rewind(status->fio);
 }
@@ -0,0 +1,208 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread_mpi/threads.h"
+
+#include "gromacs/fileio/trxio.h"
+#include "gromacs/fileio/trxprefetch.h"
+#include "gromacs/legacyheaders/gmx_fatal.h"
+#include "gromacs/legacyheaders/vec.h"
+#include "gromacs/utility/smalloc.h"
+
+#define TRX_PREFETCH_DEFAULT 2
+
+typedef struct {
+    real     t;
+    rvec    *x;
+    matrix   box;
+    gmx_bool bEnd; /* no frame, the reader reached the end */
+} t_prefetch_slot;
+
+struct t_trxprefetch {
+    output_env_t        oenv;
+    t_trxstatus        *status;
+    int                 natoms;
+    int                 nslot;
+    t_prefetch_slot    *slot;
+    int                 head;     /* next slot the reader fills      */
+    int                 tail;     /* next slot the consumer takes    */
+    int                 nfilled;  /* number of filled slots          */
+    gmx_bool            bStop;    /* the consumer asks the reader to stop */
+    gmx_bool            bThread;  /* the reader thread is running    */
+    tMPI_Thread_t       thread;
+    tMPI_Thread_mutex_t mtx;
+    tMPI_Thread_cond_t  cond;
+};
+
+static void *prefetch_thread(void *arg)
+{
+    t_trxprefetch   *pf = (t_trxprefetch *)arg;
+    t_prefetch_slot *s;
+    gmx_bool         bStop, bEnd;
+
+    do
+    {
+        tMPI_Thread_mutex_lock(&pf->mtx);
+        while (pf->nfilled == pf->nslot && !pf->bStop)
+        {
+            tMPI_Thread_cond_wait(&pf->cond, &pf->mtx);
+        }
+        s     = &pf->slot[pf->head];
+        bStop = pf->bStop;
+        tMPI_Thread_mutex_unlock(&pf->mtx);
+
+        if (bStop)
+        {
+            break;
+        }
+
+        /* The slot is not visible to the consumer, decode without the lock */
+        bEnd    = !read_next_x(pf->oenv, pf->status, &s->t, s->x, s->box);
+        s->bEnd = bEnd;
+
+        tMPI_Thread_mutex_lock(&pf->mtx);
+        pf->head = (pf->head + 1) % pf->nslot;
+        pf->nfilled++;
+        tMPI_Thread_cond_broadcast(&pf->cond);
+        tMPI_Thread_mutex_unlock(&pf->mtx);
+    }
+    while (!bEnd);
+
+    return NULL;
+}
+
+int read_first_x_prefetch(const output_env_t oenv, t_trxprefetch **pf,
+                          const char *fn, real *t, rvec **x, matrix box)
+{
+    t_trxprefetch *p;
+    char          *env;
+    int            i;
+
+    snew(p, 1);
+    p->oenv   = oenv;
+    p->natoms = read_first_x(oenv, &p->status, fn, t, x, box);
+
+    p->nslot = TRX_PREFETCH_DEFAULT;
+    if ((env = getenv("GMX_TRX_PREFETCH")) != NULL)
+    {
+        p->nslot = strtol(env, NULL, 10);
+    }
+    if (p->natoms > 0 && p->nslot > 0)
+    {
+        snew(p->slot, p->nslot);
+        for (i = 0; i < p->nslot; i++)
+        {
+            snew(p->slot[i].x, p->natoms);
+        }
+        tMPI_Thread_mutex_init(&p->mtx);
+        tMPI_Thread_cond_init(&p->cond);
+        p->bThread = (tMPI_Thread_create(&p->thread, prefetch_thread, p) == 0);
+        if (!p->bThread)
+        {
+            fprintf(stderr, "\nCould not start the trajectory prefetch thread, reading frames serially\n");
+        }
+    }
+    *pf = p;
+
+    return p->natoms;
+}
+
+gmx_bool read_next_x_prefetch(t_trxprefetch *pf, real *t, rvec x[], matrix box)
+{
+    t_prefetch_slot *s;
+    gmx_bool         bRet;
+
+    if (!pf->bThread)
+    {
+        return read_next_x(pf->oenv, pf->status, t, x, box);
+    }
+
+    tMPI_Thread_mutex_lock(&pf->mtx);
+    while (pf->nfilled == 0)
+    {
+        tMPI_Thread_cond_wait(&pf->cond, &pf->mtx);
+    }
+    s = &pf->slot[pf->tail];
+    tMPI_Thread_mutex_unlock(&pf->mtx);
+
+    bRet = !s->bEnd;
+    if (bRet)
+    {
+        *t = s->t;
+        memcpy(x, s->x, pf->natoms*sizeof(rvec));
+        copy_mat(s->box, box);
+
+        tMPI_Thread_mutex_lock(&pf->mtx);
+        pf->tail = (pf->tail + 1) % pf->nslot;
+        pf->nfilled--;
+        tMPI_Thread_cond_broadcast(&pf->cond);
+        tMPI_Thread_mutex_unlock(&pf->mtx);
+    }
+    /* The end slot stays filled, so further calls also return FALSE */
+
+    return bRet;
+}
+
+void close_trj_prefetch(t_trxprefetch *pf)
+{
+    int i;
+
+    if (pf->bThread)
+    {
+        tMPI_Thread_mutex_lock(&pf->mtx);
+        pf->bStop = TRUE;
+        tMPI_Thread_cond_broadcast(&pf->cond);
+        tMPI_Thread_mutex_unlock(&pf->mtx);
+        tMPI_Thread_join(pf->thread, NULL);
+    }
+    if (pf->slot)
+    {
+        tMPI_Thread_cond_destroy(&pf->cond);
+        tMPI_Thread_mutex_destroy(&pf->mtx);
+        for (i = 0; i < pf->nslot; i++)
+        {
+            sfree(pf->slot[i].x);
+        }
+        sfree(pf->slot);
+    }
+    close_trj(pf->status);
+    sfree(pf);
+}
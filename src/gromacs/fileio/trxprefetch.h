@@ -0,0 +1,77 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+#ifndef GMX_FILEIO_TRXPREFETCH_H
+#define GMX_FILEIO_TRXPREFETCH_H
+
+#include "../legacyheaders/types/simple.h"
+#include "../legacyheaders/oenv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Prefetching replacement for read_first_x/read_next_x/close_trj.
+ *
+ * After the first frame has been read, a background thread decodes the
+ * following frames into a ring of preallocated coordinate buffers, so
+ * decompression overlaps with the analysis of the current frame.
+ * The number of buffered frames is set with the environment variable
+ * GMX_TRX_PREFETCH (default 2); 0 reads the frames on the calling thread,
+ * as does a failure to start the thread.
+ * Only the prefetch thread reads from the file, so no other calls on
+ * the underlying t_trxstatus are possible.
+ */
+typedef struct t_trxprefetch t_trxprefetch;
+
+int read_first_x_prefetch(const output_env_t oenv, t_trxprefetch **pf,
+                          const char *fn, real *t, rvec **x, matrix box);
+/* As read_first_x: returns the number of atoms, or 0 when something is
+ * wrong, and allocates x. Starts prefetching the next frames.
+ */
+
+gmx_bool read_next_x_prefetch(t_trxprefetch *pf, real *t, rvec x[], matrix box);
+/* As read_next_x: copies the next frame to x, which should hold the
+ * number of atoms returned by read_first_x_prefetch.
+ * Returns FALSE at the end of the trajectory.
+ */
+
+void close_trj_prefetch(t_trxprefetch *pf);
+/* Stops the prefetch thread, closes the file and frees the buffers */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,575 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "thread_mpi/threads.h"
+
+#include "gromacs/fileio/futil.h"
+#include "gromacs/fileio/xtcindex.h"
+#include "gromacs/fileio/xtcio.h"
+#include "gromacs/legacyheaders/gmx_fatal.h"
+#include "gromacs/legacyheaders/typedefs.h"
+#include "gromacs/utility/smalloc.h"
+
+#define XTC_MAGIC           1995
+/* Number of 4-byte words in a frame up to the number of atoms of the
+ * coordinates: magic, natoms, step, time, box and natoms again
+ */
+#define XTC_HEADER_WORDS    14
+/* Number of words after the header for compressed coordinates:
+ * precision, minint, maxint, smallidx and the byte count
+ */
+#define XTC_COMPR_WORDS     9
+
+#define XTC_INDEX_MAGIC     0x47584958 /* "GXIX" */
+#define XTC_INDEX_VERSION   1
+
+/* Reads n big-endian (XDR) 4-byte words from fp */
+static gmx_bool xtc_index_read_words(FILE *fp, int n, unsigned int w[])
+{
+    unsigned char b[4*(XTC_HEADER_WORDS + XTC_COMPR_WORDS)];
+    int           i;
+
+    if (fread(b, 4, n, fp) != (size_t)n)
+    {
+        return FALSE;
+    }
+    for (i = 0; i < n; i++)
+    {
+        w[i] = ((unsigned int)b[4*i] << 24) | ((unsigned int)b[4*i+1] << 16) |
+            ((unsigned int)b[4*i+2] << 8) | (unsigned int)b[4*i+3];
+    }
+    return TRUE;
+}
+
+static gmx_bool xtc_index_write_word(FILE *fp, unsigned int w)
+{
+    unsigned char b[4];
+
+    b[0] = (w >> 24) & 0xff;
+    b[1] = (w >> 16) & 0xff;
+    b[2] = (w >> 8) & 0xff;
+    b[3] = w & 0xff;
+
+    return (fwrite(b, 4, 1, fp) == 1);
+}
+
+static gmx_bool xtc_index_write_int64(FILE *fp, gmx_int64_t i)
+{
+    return (xtc_index_write_word(fp, (unsigned int)((gmx_uint64_t)i >> 32)) &&
+            xtc_index_write_word(fp, (unsigned int)((gmx_uint64_t)i & 0xffffffffU)));
+}
+
+static float xtc_index_word2float(unsigned int w)
+{
+    float f;
+
+    /* XDR floats are IEEE single precision, as are ours */
+    memcpy(&f, &w, sizeof(f));
+
+    return f;
+}
+
+static unsigned int xtc_index_float2word(float f)
+{
+    unsigned int w;
+
+    memcpy(&w, &f, sizeof(w));
+
+    return w;
+}
+
+/* Returns the size and modification time of file fn */
+static gmx_bool xtc_index_stat(const char *fn, gmx_off_t *size, gmx_int64_t *mtime)
+{
+    struct stat st;
+
+    if (stat(fn, &st) != 0)
+    {
+        return FALSE;
+    }
+    *size  = st.st_size;
+    *mtime = st.st_mtime;
+
+    return TRUE;
+}
+
+static void xtc_index_alloc(t_xtcindex *idx, int nalloc)
+{
+    srenew(idx->offset, nalloc + 1);
+    srenew(idx->step, nalloc);
+    srenew(idx->time, nalloc);
+}
+
+/* Builds the index of fn, of size fsize, by walking the frame headers.
+ * An incomplete last frame is left out.
+ */
+static t_xtcindex *xtc_index_build(const char *fn, gmx_off_t fsize)
+{
+    FILE        *fp;
+    t_xtcindex  *idx;
+    unsigned int w[XTC_HEADER_WORDS + XTC_COMPR_WORDS];
+    gmx_off_t    offset, size;
+    int          natoms, nalloc;
+
+    fp = gmx_ffopen(fn, "rb");
+
+    snew(idx, 1);
+    nalloc = 0;
+    offset = 0;
+    while (xtc_index_read_words(fp, XTC_HEADER_WORDS, w) && w[0] == XTC_MAGIC)
+    {
+        natoms = (int)w[1];
+        if (idx->nframes == 0)
+        {
+            idx->natoms = natoms;
+        }
+        else if (natoms != idx->natoms)
+        {
+            fprintf(stderr, "\nWARNING: frame %d of %s has %d atoms instead of %d, "
+                    "the frame index ends there\n",
+                    idx->nframes, fn, natoms, idx->natoms);
+            break;
+        }
+        if (natoms <= 9)
+        {
+            /* Small systems are stored uncompressed */
+            size = 4*XTC_HEADER_WORDS + 3*4*natoms;
+        }
+        else
+        {
+            if (!xtc_index_read_words(fp, XTC_COMPR_WORDS, w + XTC_HEADER_WORDS))
+            {
+                break;
+            }
+            size = 4*(XTC_HEADER_WORDS + XTC_COMPR_WORDS) +
+                ((w[XTC_HEADER_WORDS + XTC_COMPR_WORDS - 1] + 3) & ~3U);
+        }
+        if (offset + size > fsize)
+        {
+            break;
+        }
+        if (idx->nframes >= nalloc)
+        {
+            nalloc = over_alloc_large(idx->nframes + 1);
+            xtc_index_alloc(idx, nalloc);
+        }
+        idx->offset[idx->nframes] = offset;
+        idx->step[idx->nframes]   = (int)w[2];
+        idx->time[idx->nframes]   = xtc_index_word2float(w[3]);
+        idx->nframes++;
+
+        offset += size;
+        if (gmx_fseek(fp, offset, SEEK_SET) != 0)
+        {
+            break;
+        }
+    }
+    gmx_ffclose(fp);
+
+    if (idx->nframes == 0)
+    {
+        done_xtc_index(idx);
+        return NULL;
+    }
+    idx->offset[idx->nframes] = offset;
+
+    return idx;
+}
+
+/* Checks that the offsets in idx are strictly increasing and end within
+ * the fsize bytes of xtc file fn, and that the first frame header in fn
+ * has the number of atoms of idx.
+ */
+static gmx_bool xtc_index_check(const t_xtcindex *idx, const char *fn, gmx_off_t fsize)
+{
+    FILE        *fp;
+    unsigned int w[2];
+    gmx_bool     bOK;
+    int          i;
+
+    if (idx->offset[0] < 0 || idx->offset[idx->nframes] > fsize)
+    {
+        return FALSE;
+    }
+    for (i = 0; i < idx->nframes; i++)
+    {
+        if (idx->offset[i+1] <= idx->offset[i])
+        {
+            return FALSE;
+        }
+    }
+    fp = fopen(fn, "rb");
+    if (fp == NULL)
+    {
+        return FALSE;
+    }
+    bOK = (gmx_fseek(fp, idx->offset[0], SEEK_SET) == 0 &&
+           xtc_index_read_words(fp, 2, w) &&
+           w[0] == XTC_MAGIC && (int)w[1] == idx->natoms);
+    fclose(fp);
+
+    return bOK;
+}
+
+/* Reads the sidecar fn_idx of xtc file fn, returns NULL when it does not
+ * exist, does not match the size and modification time of the xtc file
+ * or is inconsistent with it.
+ */
+static t_xtcindex *xtc_index_read_sidecar(const char *fn_idx, const char *fn,
+                                          gmx_off_t fsize, gmx_int64_t mtime)
+{
+    FILE        *fp;
+    t_xtcindex  *idx;
+    unsigned int w[8];
+    gmx_bool     bOK;
+    int          i;
+
+    fp = fopen(fn_idx, "rb");
+    if (fp == NULL)
+    {
+        return NULL;
+    }
+    if (!xtc_index_read_words(fp, 8, w) ||
+        w[0] != XTC_INDEX_MAGIC || w[1] != XTC_INDEX_VERSION ||
+        (gmx_off_t)(((gmx_uint64_t)w[2] << 32) | w[3]) != fsize ||
+        (gmx_int64_t)(((gmx_uint64_t)w[4] << 32) | w[5]) != mtime ||
+        (int)w[7] <= 0 || (gmx_off_t)w[7] > fsize/(4*XTC_HEADER_WORDS))
+    {
+        fclose(fp);
+        return NULL;
+    }
+    snew(idx, 1);
+    idx->natoms  = (int)w[6];
+    idx->nframes = (int)w[7];
+    xtc_index_alloc(idx, idx->nframes);
+    bOK = TRUE;
+    for (i = 0; i <= idx->nframes && bOK; i++)
+    {
+        bOK            = xtc_index_read_words(fp, 2, w);
+        idx->offset[i] = (gmx_off_t)(((gmx_uint64_t)w[0] << 32) | w[1]);
+    }
+    for (i = 0; i < idx->nframes && bOK; i++)
+    {
+        bOK          = xtc_index_read_words(fp, 2, w);
+        idx->step[i] = (int)w[0];
+        idx->time[i] = xtc_index_word2float(w[1]);
+    }
+    fclose(fp);
+    if (!bOK || !xtc_index_check(idx, fn, fsize))
+    {
+        if (debug)
+        {
+            fprintf(debug, "Ignoring inconsistent xtc frame index %s\n", fn_idx);
+        }
+        done_xtc_index(idx);
+        return NULL;
+    }
+
+    return idx;
+}
+
+/* Writes the sidecar fn_idx. It is written under a unique temporary name
+ * and then renamed, so readers never see a partially written index, also
+ * when several processes index the same file at the same time.
+ */
+static void xtc_index_write_sidecar(const char *fn_idx, gmx_off_t fsize, gmx_int64_t mtime,
+                                    const t_xtcindex *idx)
+{
+    FILE    *fp;
+    char    *fn_tmp;
+    gmx_bool bOK;
+    int      i;
+#ifndef GMX_NATIVE_WINDOWS
+    int      fd;
+#endif
+
+    /* Not gmx_tmpnam, failing to create the file should not be fatal */
+    snew(fn_tmp, strlen(fn_idx) + 7);
+    sprintf(fn_tmp, "%sXXXXXX", fn_idx);
+#ifdef GMX_NATIVE_WINDOWS
+    fp = (_mktemp(fn_tmp) != NULL) ? fopen(fn_tmp, "wb") : NULL;
+#else
+    fp = NULL;
+    fd = mkstemp(fn_tmp);
+    if (fd >= 0)
+    {
+        /* mkstemp creates the file only readable by the owner */
+        fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        fp = fdopen(fd, "wb");
+        if (fp == NULL)
+        {
+            close(fd);
+            remove(fn_tmp);
+        }
+    }
+#endif
+    if (fp == NULL)
+    {
+        if (debug)
+        {
+            fprintf(debug, "Can not write xtc frame index %s, keeping it in memory\n", fn_idx);
+        }
+        sfree(fn_tmp);
+        return;
+    }
+    bOK = (xtc_index_write_word(fp, XTC_INDEX_MAGIC) &&
+           xtc_index_write_word(fp, XTC_INDEX_VERSION) &&
+           xtc_index_write_int64(fp, fsize) &&
+           xtc_index_write_int64(fp, mtime) &&
+           xtc_index_write_word(fp, idx->natoms) &&
+           xtc_index_write_word(fp, idx->nframes));
+    for (i = 0; i <= idx->nframes && bOK; i++)
+    {
+        bOK = xtc_index_write_int64(fp, idx->offset[i]);
+    }
+    for (i = 0; i < idx->nframes && bOK; i++)
+    {
+        bOK = (xtc_index_write_word(fp, idx->step[i]) &&
+               xtc_index_write_word(fp, xtc_index_float2word(idx->time[i])));
+    }
+    if (fclose(fp) != 0 || !bOK || gmx_file_rename(fn_tmp, fn_idx) != 0)
+    {
+        /* Do not leave a truncated index behind */
+        remove(fn_tmp);
+    }
+    sfree(fn_tmp);
+}
+
+t_xtcindex *xtc_index_get(const char *fn)
+{
+    t_xtcindex *idx;
+    char       *fn_idx;
+    gmx_off_t   fsize;
+    gmx_int64_t mtime;
+
+    if (!xtc_index_stat(fn, &fsize, &mtime))
+    {
+        return NULL;
+    }
+    snew(fn_idx, strlen(fn) + 5);
+    sprintf(fn_idx, "%s.idx", fn);
+
+    idx = xtc_index_read_sidecar(fn_idx, fn, fsize, mtime);
+    if (idx == NULL)
+    {
+        idx = xtc_index_build(fn, fsize);
+        if (idx != NULL)
+        {
+            xtc_index_write_sidecar(fn_idx, fsize, mtime, idx);
+        }
+    }
+    sfree(fn_idx);
+
+    return idx;
+}
+
+void done_xtc_index(t_xtcindex *idx)
+{
+    sfree(idx->offset);
+    sfree(idx->step);
+    sfree(idx->time);
+    sfree(idx);
+}
+
+int xtc_index_find_time(const t_xtcindex *idx, real t)
+{
+    int lo, hi, mid, i;
+
+    for (i = 1; i < idx->nframes; i++)
+    {
+        if (idx->time[i] < idx->time[i-1])
+        {
+            break;
+        }
+    }
+    if (i < idx->nframes)
+    {
+        /* The times do not increase, search from the start */
+        for (i = 0; i < idx->nframes && idx->time[i] < t; i++)
+        {
+            ;
+        }
+        return i;
+    }
+
+    lo = 0;
+    hi = idx->nframes;
+    while (lo < hi)
+    {
+        mid = (lo + hi)/2;
+        if (idx->time[mid] < t)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+struct t_xtcreader {
+    t_xtcindex         *idx;
+    char               *map;  /* the mapped file, NULL when not mapped */
+    size_t              mapsize;
+    FILE               *fp;   /* used when the file is not mapped      */
+    tMPI_Thread_mutex_t mtx;  /* protects fp                           */
+};
+
+t_xtcreader *open_xtc_reader(const char *fn)
+{
+    t_xtcreader *rd;
+    t_xtcindex  *idx;
+
+    idx = xtc_index_get(fn);
+    if (idx == NULL)
+    {
+        return NULL;
+    }
+
+    snew(rd, 1);
+    rd->idx = idx;
+    rd->map = NULL;
+#ifdef HAVE_SYS_MMAN_H
+    {
+        int   fd;
+        void *map;
+
+        rd->mapsize = (size_t)idx->offset[idx->nframes];
+        fd          = open(fn, O_RDONLY);
+        if (fd >= 0 && (gmx_off_t)rd->mapsize == idx->offset[idx->nframes])
+        {
+            map = mmap(NULL, rd->mapsize, PROT_READ, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                rd->map = (char *)map;
+            }
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+#endif
+    if (rd->map == NULL)
+    {
+        rd->fp = gmx_ffopen(fn, "rb");
+        tMPI_Thread_mutex_init(&rd->mtx);
+    }
+
+    return rd;
+}
+
+const t_xtcindex *xtc_reader_index(const t_xtcreader *rd)
+{
+    return rd->idx;
+}
+
+gmx_bool xtc_reader_read_frame(t_xtcreader *rd, int frame,
+                               int *step, real *time, matrix box,
+                               rvec *x, real *prec)
+{
+    char        *buf;
+    unsigned int nbytes;
+    gmx_bool     bOK;
+
+    if (frame < 0 || frame >= rd->idx->nframes)
+    {
+        gmx_fatal(FARGS, "Frame %d requested from an xtc file with %d frames",
+                  frame, rd->idx->nframes);
+    }
+    nbytes = (unsigned int)(rd->idx->offset[frame+1] - rd->idx->offset[frame]);
+
+    if (rd->map != NULL)
+    {
+        buf = rd->map + rd->idx->offset[frame];
+    }
+    else
+    {
+        snew(buf, nbytes);
+        tMPI_Thread_mutex_lock(&rd->mtx);
+        bOK = (gmx_fseek(rd->fp, rd->idx->offset[frame], SEEK_SET) == 0 &&
+               fread(buf, 1, nbytes, rd->fp) == nbytes);
+        tMPI_Thread_mutex_unlock(&rd->mtx);
+        if (!bOK)
+        {
+            sfree(buf);
+            return FALSE;
+        }
+    }
+
+    read_xtc_frame_mem(buf, nbytes, rd->idx->natoms, step, time, box, x, prec, &bOK);
+
+    if (rd->map == NULL)
+    {
+        sfree(buf);
+    }
+
+    return bOK;
+}
+
+void close_xtc_reader(t_xtcreader *rd)
+{
+#ifdef HAVE_SYS_MMAN_H
+    if (rd->map != NULL)
+    {
+        munmap(rd->map, rd->mapsize);
+    }
+#endif
+    if (rd->map == NULL)
+    {
+        gmx_ffclose(rd->fp);
+        tMPI_Thread_mutex_destroy(&rd->mtx);
+    }
+    done_xtc_index(rd->idx);
+    sfree(rd);
+}
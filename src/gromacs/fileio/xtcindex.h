@@ -0,0 +1,111 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+#ifndef GMX_FILEIO_XTCINDEX_H
+#define GMX_FILEIO_XTCINDEX_H
+
+#include "../legacyheaders/types/simple.h"
+#include "futil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Frame index of an xtc file.
+ *
+ * The index stores the file offset, step and time of every complete
+ * frame. It is built by walking the frame headers, which skips over the
+ * compressed coordinates without decoding them, and is stored in the
+ * sidecar file <file>.idx together with the size and modification time
+ * of the xtc file. When these still match and the offsets are consistent
+ * with the xtc file, later runs read the sidecar instead of walking the
+ * file again. When the sidecar can not be written, the index is only kept
+ * in memory.
+ */
+typedef struct t_xtcindex {
+    int        natoms;  /* number of atoms in the first frame             */
+    int        nframes; /* number of complete frames                      */
+    gmx_off_t *offset;  /* file offset of each frame, offset[nframes] is
+                         * the end of the last complete frame             */
+    int       *step;    /* step of each frame                             */
+    real      *time;    /* time of each frame                             */
+} t_xtcindex;
+
+t_xtcindex *xtc_index_get(const char *fn);
+/* Returns the frame index of xtc file fn, from the sidecar file when it
+ * is up to date, otherwise it is built and the sidecar is (re)written.
+ * Returns NULL when fn is not an xtc file or has no complete frames.
+ */
+
+void done_xtc_index(t_xtcindex *idx);
+/* Frees idx */
+
+int xtc_index_find_time(const t_xtcindex *idx, real t);
+/* Returns the first frame with time >= t, or idx->nframes when there
+ * is none. Uses bisection when the times increase.
+ */
+
+/* Random-access reader on top of the frame index.
+ *
+ * The xtc file is memory-mapped where this is supported, otherwise
+ * the bytes of a frame are read under a mutex. Frames are decoded
+ * from memory, so several threads can decode any frames concurrently
+ * with one reader, e.g. disjoint frame ranges per thread.
+ */
+typedef struct t_xtcreader t_xtcreader;
+
+t_xtcreader *open_xtc_reader(const char *fn);
+/* Opens xtc file fn for random access, building its index when needed.
+ * Returns NULL when fn is not an xtc file or has no complete frames.
+ */
+
+const t_xtcindex *xtc_reader_index(const t_xtcreader *rd);
+/* Returns the frame index of rd */
+
+gmx_bool xtc_reader_read_frame(t_xtcreader *rd, int frame,
+                               int *step, real *time, matrix box,
+                               rvec *x, real *prec);
+/* Decodes frame (0 <= frame < nframes) into x, which should have space
+ * for xtc_reader_index(rd)->natoms atoms. Thread-safe.
+ * Returns FALSE when the frame is corrupt.
+ */
+
+void close_xtc_reader(t_xtcreader *rd);
+/* Unmaps and closes the file and frees rd */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
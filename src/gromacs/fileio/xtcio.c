@@ -292,3 +292,33 @@ int read_next_xtc(t_fileio* fio,
 
     return *bOK;
 }
+
+int read_xtc_frame_mem(char *buf, unsigned int nbytes,
+                       int natoms, int *step, real *time,
+                       matrix box, rvec *x, real *prec, gmx_bool *bOK)
+{
+    int  magic;
+    int  n, result;
+    XDR  xd;
+
+    *bOK = TRUE;
+    xdrmem_create(&xd, buf, nbytes, XDR_DECODE);
+
+    result = xtc_header(&xd, &magic, &n, step, time, TRUE, bOK);
+    if (result)
+    {
+        check_xtc_magic(magic);
+
+        if (n > natoms)
+        {
+            gmx_fatal(FARGS, "Frame contains more atoms (%d) than expected (%d)",
+                      n, natoms);
+        }
+
+        *bOK   = xtc_coord(&xd, &natoms, box, x, prec, TRUE);
+        result = *bOK;
+    }
+    xdr_destroy(&xd);
+
+    return result;
+}
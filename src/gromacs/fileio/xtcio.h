@@ -65,6 +65,14 @@ int read_next_xtc(t_fileio *fio,
                   matrix box, rvec *x, real *prec, gmx_bool *bOK);
 /* Read subsequent frames */
 
+int read_xtc_frame_mem(char *buf, unsigned int nbytes,
+                       int natoms, int *step, real *time,
+                       matrix box, rvec *x, real *prec, gmx_bool *bOK);
+/* Decode a single frame from the nbytes of an xtc file at buf,
+ * e.g. a memory-mapped file, without using a t_fileio.
+ * x should have space for natoms atoms. Is thread-safe.
+ */
+
 int write_xtc(t_fileio *fio,
               int natoms, int step, real time,
               matrix box, rvec *x, real prec);
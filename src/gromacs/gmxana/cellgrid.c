@@ -0,0 +1,187 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+
+#include "cellgrid.h"
+#include "pbc.h"
+#include "vec.h"
+#include "gromacs/utility/smalloc.h"
+
+void init_cellgrid(t_cellgrid *grid)
+{
+    grid->bGrid       = FALSE;
+    clear_ivec(grid->nc);
+    clear_rvec(grid->invcw);
+    grid->ncell       = 0;
+    grid->ncell_alloc = 0;
+    grid->cell_index  = NULL;
+    grid->na          = 0;
+    grid->na_alloc    = 0;
+    grid->a           = NULL;
+    grid->ci          = NULL;
+}
+
+static gmx_inline int cellgrid_cell_1d(const t_cellgrid *grid, int d, real x)
+{
+    int c;
+
+    c = (int)floor(x*grid->invcw[d]) % grid->nc[d];
+    if (c < 0)
+    {
+        c += grid->nc[d];
+    }
+    return c;
+}
+
+void put_on_cellgrid(t_cellgrid *grid, int ePBC, matrix box, real rcut,
+                     int n, rvec x[])
+{
+    int d, i, c;
+
+    grid->bGrid = (ePBC == epbcXYZ && !TRICLINIC(box) && rcut > 0);
+    for (d = 0; d < DIM && grid->bGrid; d++)
+    {
+        grid->nc[d] = (int)(box[d][d]/rcut);
+        if (grid->nc[d] < 3)
+        {
+            grid->bGrid = FALSE;
+        }
+        else
+        {
+            grid->invcw[d] = grid->nc[d]/box[d][d];
+        }
+    }
+    if (!grid->bGrid)
+    {
+        return;
+    }
+
+    grid->ncell = grid->nc[XX]*grid->nc[YY]*grid->nc[ZZ];
+    if (grid->ncell + 1 > grid->ncell_alloc)
+    {
+        grid->ncell_alloc = over_alloc_large(grid->ncell + 1);
+        srenew(grid->cell_index, grid->ncell_alloc);
+    }
+    grid->na = n;
+    if (n > grid->na_alloc)
+    {
+        grid->na_alloc = over_alloc_large(n);
+        srenew(grid->a, grid->na_alloc);
+        srenew(grid->ci, grid->na_alloc);
+    }
+
+    /* Counting sort of the positions over the cells */
+    for (c = 0; c <= grid->ncell; c++)
+    {
+        grid->cell_index[c] = 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        grid->ci[i] = (cellgrid_cell_1d(grid, XX, x[i][XX])*grid->nc[YY] +
+                       cellgrid_cell_1d(grid, YY, x[i][YY]))*grid->nc[ZZ] +
+            cellgrid_cell_1d(grid, ZZ, x[i][ZZ]);
+        grid->cell_index[grid->ci[i] + 1]++;
+    }
+    for (c = 0; c < grid->ncell; c++)
+    {
+        grid->cell_index[c + 1] += grid->cell_index[c];
+    }
+    for (i = 0; i < n; i++)
+    {
+        grid->a[grid->cell_index[grid->ci[i]]++] = i;
+    }
+    for (c = grid->ncell; c > 0; c--)
+    {
+        grid->cell_index[c] = grid->cell_index[c - 1];
+    }
+    grid->cell_index[0] = 0;
+}
+
+int cellgrid_nbcells(const t_cellgrid *grid, const rvec xi, int nbcell[])
+{
+    ivec ic;
+    int  d, dx, dy, dz, cx, cy, cz, n;
+
+    for (d = 0; d < DIM; d++)
+    {
+        ic[d] = cellgrid_cell_1d(grid, d, xi[d]);
+    }
+    n = 0;
+    for (dx = -1; dx <= 1; dx++)
+    {
+        cx = (ic[XX] + dx + grid->nc[XX]) % grid->nc[XX];
+        for (dy = -1; dy <= 1; dy++)
+        {
+            cy = (ic[YY] + dy + grid->nc[YY]) % grid->nc[YY];
+            for (dz = -1; dz <= 1; dz++)
+            {
+                cz          = (ic[ZZ] + dz + grid->nc[ZZ]) % grid->nc[ZZ];
+                nbcell[n++] = (cx*grid->nc[YY] + cy)*grid->nc[ZZ] + cz;
+            }
+        }
+    }
+    return n;
+}
+
+void done_cellgrid(t_cellgrid *grid)
+{
+    sfree(grid->cell_index);
+    sfree(grid->a);
+    sfree(grid->ci);
+    init_cellgrid(grid);
+}
+
+void excl_bitmap_mark(unsigned char *bits, const t_blocka *excl, atom_id ix, gmx_bool bSet)
+{
+    int     j;
+    atom_id a;
+
+    for (j = excl->index[ix]; j < excl->index[ix+1]; j++)
+    {
+        a = excl->a[j];
+        if (bSet)
+        {
+            bits[a >> 3] |= (unsigned char)(1 << (a & 7));
+        }
+        else
+        {
+            bits[a >> 3] &= (unsigned char)~(1 << (a & 7));
+        }
+    }
+}
@@ -0,0 +1,105 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+
+#ifndef _cellgrid_h
+#define _cellgrid_h
+
+#include "typedefs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Simple cell list for the pair loops of the legacy analysis tools.
+ *
+ * The positions of one group are sorted into cells that are at least
+ * the cut-off wide, so that all partners of a reference position within
+ * the cut-off are found in the (at most 27) surrounding cells.
+ * The grid is only used for full 3D pbc with a rectangular box and
+ * at least 3 cells along each dimension; otherwise bGrid is FALSE and
+ * the caller should loop over all positions.
+ */
+typedef struct t_cellgrid {
+    gmx_bool bGrid;       /* TRUE when the grid is in use for this frame */
+    ivec     nc;          /* number of cells along each dimension */
+    rvec     invcw;       /* inverse cell width along each dimension */
+    int      ncell;       /* total number of cells */
+    int      ncell_alloc; /* allocation size of cell_index */
+    int     *cell_index;  /* a[cell_index[c]..cell_index[c+1]] are in cell c */
+    int      na;          /* number of positions on the grid */
+    int      na_alloc;    /* allocation size of a and ci */
+    int     *a;           /* position indices sorted by cell */
+    int     *ci;          /* cell of each position */
+} t_cellgrid;
+
+/* Initializes an empty grid */
+void init_cellgrid(t_cellgrid *grid);
+
+/* Sorts the n positions x onto grid for cut-off rcut.
+ * Memory is only reallocated when the grid or the number of positions
+ * grows, so this can be called every frame.
+ */
+void put_on_cellgrid(t_cellgrid *grid, int ePBC, matrix box, real rcut,
+                     int n, rvec x[]);
+
+/* Returns the number of cells around position xi and stores their
+ * indices in nbcell, which should have space for 27 cells.
+ * Should only be called when grid->bGrid is TRUE.
+ */
+int cellgrid_nbcells(const t_cellgrid *grid, const rvec xi, int nbcell[]);
+
+/* Frees the memory of grid */
+void done_cellgrid(t_cellgrid *grid);
+
+/* Exclusions of a single reference atom are marked in a bitmap with one
+ * bit per atom, which replaces storing a pair list per reference atom.
+ * Allocate the bitmap with snew(bits, EXCL_BITMAP_SIZE(natoms)).
+ */
+#define EXCL_BITMAP_SIZE(natoms) (((natoms) >> 3) + 1)
+
+/* Sets (bSet=TRUE) or clears (bSet=FALSE) the bits of the atoms excluded from ix */
+void excl_bitmap_mark(unsigned char *bits, const t_blocka *excl, atom_id ix, gmx_bool bSet);
+
+/* Returns whether atom a is marked in bits */
+static gmx_inline gmx_bool excl_bitmap_test(const unsigned char *bits, atom_id a)
+{
+    return (bits[a >> 3] >> (a & 7)) & 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
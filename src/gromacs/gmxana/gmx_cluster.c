@@ -65,6 +65,72 @@
 #include "gromacs/linearalgebra/eigensolver.h"
 #include "gromacs/math/do_fit.h"
 #include "gromacs/legacyheaders/gmx_fatal.h"
+#include "gromacs/utility/gmxomp.h"
+
+/* The frame pairs of the RMSD matrix are processed in square tiles of
+ * this many frames, so the frames of a tile stay in cache.
+ */
+#define RMSD_TILE 32
+
+/* Computes the RMSD, after fitting when bFit, of all pairs of the nf
+ * frames in xx, which should be centered. The fit uses the QCP method,
+ * which directly gives the RMSD. The tiles are distributed over threads.
+ */
+static void calc_rmsd_matrix(int nf, int isize, real *mass, rvec **xx,
+                             gmx_bool bFit, t_mat *rms)
+{
+    int         ntile, npair, nthreads;
+    int         p, t1, t2, end1, end2, i1, i2;
+    gmx_int64_t nrms;
+
+    ntile    = (nf + RMSD_TILE - 1)/RMSD_TILE;
+    npair    = ntile*(ntile + 1)/2;
+    nthreads = gmx_omp_get_max_threads();
+    nrms     = ((gmx_int64_t)nf*((gmx_int64_t)nf-1))/2;
+    fprintf(stderr, "Using %d tiles of %d frames on %d threads\n",
+            npair, RMSD_TILE, nthreads);
+
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic) private(t1, t2, end1, end2, i1, i2)
+    for (p = 0; p < npair; p++)
+    {
+        /* Convert the pair index to tiles t1 <= t2 */
+        t1 = 0;
+        t2 = p;
+        while (t2 >= ntile - t1)
+        {
+            t2 -= ntile - t1;
+            t1++;
+        }
+        t2  += t1;
+        end1 = min(nf, (t1 + 1)*RMSD_TILE);
+        end2 = min(nf, (t2 + 1)*RMSD_TILE);
+        for (i1 = t1*RMSD_TILE; i1 < end1; i1++)
+        {
+            for (i2 = max(i1 + 1, t2*RMSD_TILE); i2 < end2; i2++)
+            {
+                if (bFit)
+                {
+                    rms->mat[i1][i2] = calc_fit_R_qcp(isize, mass, xx[i2], xx[i1], NULL);
+                }
+                else
+                {
+                    rms->mat[i1][i2] = rmsdev(isize, mass, xx[i2], xx[i1]);
+                }
+            }
+        }
+    }
+
+    /* Set the statistics and the lower half in the original order */
+    for (i1 = 0; i1 < nf; i1++)
+    {
+        for (i2 = i1+1; i2 < nf; i2++)
+        {
+            set_mat_entry(rms, i1, i2, rms->mat[i1][i2]);
+        }
+        nrms -= (gmx_int64_t) (nf-i1-1);
+    }
+    fprintf(stderr, "\r# RMSD calculations left: " "%"GMX_PRId64 "   ", nrms);
+}
 
 /* print to two file pointers at once (i.e. stderr and log) */
 static gmx_inline
@@ -1418,7 +1484,7 @@ int gmx_cluster(int argc, char *argv[])
     gmx_int64_t        nrms = 0;
 
     matrix             box;
-    rvec              *xtps, *usextps, *x1, **xx = NULL;
+    rvec              *xtps, *usextps, **xx = NULL;
     const char        *fn, *trx_out_fn;
     t_clusters         clust;
     t_mat             *rms, *orig = NULL;
@@ -1432,7 +1498,7 @@ int gmx_cluster(int argc, char *argv[])
     int                isize = 0, ifsize = 0, iosize = 0;
     atom_id           *index = NULL, *fitidx, *outidx;
     char              *grpname;
-    real               rmsd, **d1, **d2, *time = NULL, time_invfac, *mass = NULL;
+    real              **d1, **d2, *time = NULL, time_invfac, *mass = NULL;
     char               buf[STRLEN], buf1[80], title[STRLEN];
     gmx_bool           bAnalyze, bUseRmsdCut, bJP_RMSD = FALSE, bReadMat, bReadTraj, bPBC = TRUE;
 
@@ -1754,27 +1820,7 @@ int gmx_cluster(int argc, char *argv[])
         if (!bRMSdist)
         {
             fprintf(stderr, "Computing %dx%d RMS deviation matrix\n", nf, nf);
-            /* Initialize work array */
-            snew(x1, isize);
-            for (i1 = 0; i1 < nf; i1++)
-            {
-                for (i2 = i1+1; i2 < nf; i2++)
-                {
-                    for (i = 0; i < isize; i++)
-                    {
-                        copy_rvec(xx[i1][i], x1[i]);
-                    }
-                    if (bFit)
-                    {
-                        do_fit(isize, mass, xx[i2], x1);
-                    }
-                    rmsd = rmsdev(isize, mass, xx[i2], x1);
-                    set_mat_entry(rms, i1, i2, rmsd);
-                }
-                nrms -= (gmx_int64_t) (nf-i1-1);
-                fprintf(stderr, "\r# RMSD calculations left: " "%"GMX_PRId64 "   ", nrms);
-            }
-            sfree(x1);
+            calc_rmsd_matrix(nf, isize, mass, xx, bFit, rms);
         }
         else /* bRMSdist */
         {
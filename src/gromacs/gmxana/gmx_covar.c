@@ -69,9 +69,217 @@
 #include "gromacs/fileio/trxio.h"
 
 #include "gromacs/linearalgebra/eigensolver.h"
+#include "gromacs/linearalgebra/gmx_arpack.h"
 #include "gromacs/math/do_fit.h"
 #include "gromacs/legacyheaders/gmx_fatal.h"
 
+/* Multiplies vector v with minus the covariance matrix, stored implicitly
+ * as the nframes deviations from the average of length ndim in xdev,
+ * i.e. covv = -1/nframes sum_f xdev_f (xdev_f . v)
+ */
+static void covar_matvec(int nframes, gmx_int64_t ndim, const real *xdev,
+                         const real *v, real *covv)
+{
+    const real *xf;
+    double      dot;
+    gmx_int64_t i;
+    int         f;
+
+    for (i = 0; i < ndim; i++)
+    {
+        covv[i] = 0;
+    }
+    for (f = 0; f < nframes; f++)
+    {
+        xf  = xdev + f*ndim;
+        dot = 0;
+        for (i = 0; i < ndim; i++)
+        {
+            dot += xf[i]*v[i];
+        }
+        dot /= nframes;
+        for (i = 0; i < ndim; i++)
+        {
+            covv[i] -= dot*xf[i];
+        }
+    }
+}
+
+/* Returns the size of the Lanczos basis for neig eigenvectors */
+static int covar_lanczos_ncv(int ndim, int neig)
+{
+    /* A larger basis than the usual 2*neig speeds up the convergence
+     * when only a few eigenvectors are requested
+     */
+    return min(max(2*neig, neig + 20), ndim);
+}
+
+/* Determines the neig largest eigenvalues and eigenvectors of the covariance
+ * matrix with the ARPACK implicitly restarted Lanczos method, without
+ * constructing the matrix. The eigenvalues and vectors are returned
+ * in descending order, the eigenvectors as rows of length ndim.
+ * As for the normal modes, the smallest eigenvalues are searched,
+ * here of minus the covariance matrix.
+ * The rank of the matrix, at most nframes, should be larger than the
+ * Lanczos basis, otherwise the iterations break down.
+ */
+static void covar_lanczos(int nframes, int ndim, const real *xdev, int neig,
+                          real *eigenvalues, real *eigenvectors)
+{
+    int      iwork[80];
+    int      iparam[11];
+    int      ipntr[11];
+    real    *resid, *workd, *workl, *v, *eval;
+    int      ido, info, lworkl, i, ncv, dovec, iter;
+    int     *select;
+    real     abstol;
+    int      maxiter = 100000;
+
+    ncv = covar_lanczos_ncv(ndim, neig);
+
+    for (i = 0; i < 11; i++)
+    {
+        iparam[i] = ipntr[i] = 0;
+    }
+    iparam[0] = 1;       /* Don't use explicit shifts */
+    iparam[2] = maxiter; /* Max number of iterations */
+    iparam[6] = 1;       /* Standard symmetric eigenproblem */
+
+    lworkl = ncv*(8+ncv);
+    snew(resid, ndim);
+    snew(workd, 3*ndim+4);
+    snew(workl, lworkl);
+    snew(select, ncv);
+    snew(v, (gmx_int64_t)ndim*ncv);
+    snew(eval, neig);
+
+    abstol = 0;
+    ido    = info = 0;
+    iter   = 1;
+    do
+    {
+#ifdef GMX_DOUBLE
+        F77_FUNC(dsaupd, DSAUPD) (&ido, "I", &ndim, "SA", &neig, &abstol,
+                                  resid, &ncv, v, &ndim, iparam, ipntr,
+                                  workd, iwork, workl, &lworkl, &info);
+#else
+        F77_FUNC(ssaupd, SSAUPD) (&ido, "I", &ndim, "SA", &neig, &abstol,
+                                  resid, &ncv, v, &ndim, iparam, ipntr,
+                                  workd, iwork, workl, &lworkl, &info);
+#endif
+        if (ido == -1 || ido == 1)
+        {
+            covar_matvec(nframes, ndim, xdev, workd+ipntr[0]-1, workd+ipntr[1]-1);
+        }
+
+        fprintf(stderr, "\rIteration %4d: %3d out of %3d Ritz values converged.", iter++, iparam[4], neig);
+    }
+    while (info == 0 && (ido == -1 || ido == 1));
+    fprintf(stderr, "\n");
+
+    if (info == 1)
+    {
+        gmx_fatal(FARGS,
+                  "Maximum number of iterations (%d) reached in Lanczos\n"
+                  "diagonalization, but only %d of %d eigenvectors converged.\n",
+                  maxiter, iparam[4], neig);
+    }
+    else if (info != 0)
+    {
+        gmx_fatal(FARGS, "Unspecified error from Lanczos diagonalization:%d\n", info);
+    }
+
+    dovec = 1;
+#ifdef GMX_DOUBLE
+    F77_FUNC(dseupd, DSEUPD) (&dovec, "A", select, eval, eigenvectors,
+                              &ndim, NULL, "I", &ndim, "SA", &neig, &abstol,
+                              resid, &ncv, v, &ndim, iparam, ipntr,
+                              workd, workl, &lworkl, &info);
+#else
+    F77_FUNC(sseupd, SSEUPD) (&dovec, "A", select, eval, eigenvectors,
+                              &ndim, NULL, "I", &ndim, "SA", &neig, &abstol,
+                              resid, &ncv, v, &ndim, iparam, ipntr,
+                              workd, workl, &lworkl, &info);
+#endif
+    if (info != 0)
+    {
+        gmx_fatal(FARGS, "Error extracting the Lanczos eigenvectors:%d\n", info);
+    }
+
+    /* ARPACK returns the eigenvalues in ascending order */
+    for (i = 0; i < neig; i++)
+    {
+        eigenvalues[i] = -eval[i];
+    }
+
+    sfree(v);
+    sfree(resid);
+    sfree(workd);
+    sfree(workl);
+    sfree(select);
+    sfree(eval);
+}
+
+/* As covar_lanczos, but for few frames: the non-zero eigenvalues of the
+ * covariance matrix X^T X/nframes, with X the nframes x ndim deviations,
+ * are those of the nframes x nframes matrix X X^T/nframes, with
+ * eigenvectors u, and the eigenvectors of the covariance matrix are X^T u.
+ */
+static void covar_gram(int nframes, int ndim, const real *xdev, int neig,
+                       real *eigenvalues, real *eigenvectors)
+{
+    real       *gram, *eval, *evec, *v;
+    double      dot, norm;
+    gmx_int64_t i;
+    int         f, g, e;
+
+    snew(gram, nframes*nframes);
+    for (f = 0; f < nframes; f++)
+    {
+        for (g = 0; g <= f; g++)
+        {
+            dot = 0;
+            for (i = 0; i < ndim; i++)
+            {
+                dot += xdev[f*ndim+i]*xdev[g*ndim+i];
+            }
+            gram[f*nframes+g] = dot/nframes;
+            gram[g*nframes+f] = dot/nframes;
+        }
+    }
+    snew(eval, nframes);
+    snew(evec, nframes*nframes);
+    eigensolver(gram, nframes, 0, nframes, eval, evec);
+
+    /* eigensolver returns the eigenvalues in ascending order */
+    for (e = 0; e < neig; e++)
+    {
+        eigenvalues[e] = eval[nframes-1-e];
+        v              = eigenvectors + e*ndim;
+        for (f = 0; f < nframes; f++)
+        {
+            for (i = 0; i < ndim; i++)
+            {
+                v[i] += evec[(nframes-1-e)*nframes+f]*xdev[f*ndim+i];
+            }
+        }
+        dot = 0;
+        for (i = 0; i < ndim; i++)
+        {
+            dot += v[i]*v[i];
+        }
+        norm = (dot > 0) ? 1/sqrt(dot) : 0;
+        for (i = 0; i < ndim; i++)
+        {
+            v[i] *= norm;
+        }
+    }
+
+    sfree(gram);
+    sfree(eval);
+    sfree(evec);
+}
+
 int gmx_covar(int argc, char *argv[])
 {
     const char     *desc[] = {
@@ -105,10 +313,20 @@ int gmx_covar(int argc, char *argv[])
         "of atoms involved. It is easy to run out of memory, in which",
         "case this tool will probably exit with a 'Segmentation fault'. You",
         "should consider carefully whether a reduced set of atoms will meet",
-        "your needs for lower costs."
+        "your needs for lower costs.",
+        "[PAR]",
+        "With [TT]-lanczos[tt] only the given number of eigenvectors with the",
+        "largest eigenvalues is computed, with the iterative Lanczos method.",
+        "The covariance matrix is then never constructed: the deviations of",
+        "all frames from the average are stored instead and the Lanczos",
+        "iterations only need products of the matrix with a vector.",
+        "This requires memory proportional to the number of frames times",
+        "the number of atoms, instead of the square of the number of atoms,",
+        "which makes the analysis of large systems feasible.",
+        "The matrix output options can not be used with [TT]-lanczos[tt]."
     };
     static gmx_bool bFit = TRUE, bRef = FALSE, bM = FALSE, bPBC = TRUE;
-    static int      end  = -1;
+    static int      end  = -1, nlanczos = 0;
     t_pargs         pa[] = {
         { "-fit",  FALSE, etBOOL, {&bFit},
           "Fit to a reference structure"},
@@ -119,7 +337,9 @@ int gmx_covar(int argc, char *argv[])
         { "-last",  FALSE, etINT, {&end},
           "Last eigenvector to write away (-1 is till the last)" },
         { "-pbc",  FALSE,  etBOOL, {&bPBC},
-          "Apply corrections for periodic boundary conditions" }
+          "Apply corrections for periodic boundary conditions" },
+        { "-lanczos", FALSE, etINT, {&nlanczos},
+          "Only compute this number of largest eigenvectors with the matrix-free Lanczos method (0 is all with full diagonalization)" }
     };
     FILE           *out = NULL; /* initialization makes all compilers happy */
     t_trxstatus    *status;
@@ -147,7 +367,8 @@ int gmx_covar(int argc, char *argv[])
     time_t          now;
     char            timebuf[STRLEN];
     t_rgb           rlo, rmi, rhi;
-    real           *eigenvectors;
+    real           *eigenvectors, *xdev;
+    gmx_int64_t     nalloc;
     output_env_t    oenv;
     gmx_rmpbc_t     gpbc = NULL;
 
@@ -184,6 +405,15 @@ int gmx_covar(int argc, char *argv[])
     xpmfile    = opt2fn_null("-xpm", NFILE, fnm);
     xpmafile   = opt2fn_null("-xpma", NFILE, fnm);
 
+    if (nlanczos < 0)
+    {
+        gmx_fatal(FARGS, "The number of Lanczos eigenvectors should be >= 0 (now %d)", nlanczos);
+    }
+    if (nlanczos > 0 && (asciifile || xpmfile || xpmafile))
+    {
+        gmx_fatal(FARGS, "Options -ascii, -xpm and -xpma need the covariance matrix, which is not constructed with -lanczos");
+    }
+
     read_tps_conf(fitfile, str, &top, &ePBC, &xref, NULL, box, TRUE);
     atoms = &top.atoms;
 
@@ -269,11 +499,17 @@ int gmx_covar(int argc, char *argv[])
     snew(x, natoms);
     snew(xav, natoms);
     ndim = natoms*DIM;
-    if (sqrt(GMX_INT64_MAX) < ndim)
+    mat  = NULL;
+    xdev = NULL;
+    if (nlanczos == 0)
     {
-        gmx_fatal(FARGS, "Number of degrees of freedoms to large for matrix.\n");
+        if (sqrt(GMX_INT64_MAX) < ndim)
+        {
+            gmx_fatal(FARGS, "Number of degrees of freedoms to large for matrix.\n");
+        }
+        snew(mat, ndim*ndim);
     }
-    snew(mat, ndim*ndim);
+    nalloc = 0;
 
     fprintf(stderr, "Calculating the average structure ...\n");
     nframes0 = 0;
@@ -316,7 +552,15 @@ int gmx_covar(int argc, char *argv[])
                            atoms, xread, NULL, epbcNONE, zerobox, natoms, index);
     sfree(xread);
 
-    fprintf(stderr, "Constructing covariance matrix (%dx%d) ...\n", (int)ndim, (int)ndim);
+    if (nlanczos > 0)
+    {
+        fprintf(stderr, "Storing the deviations from the %s structure ...\n",
+                bRef ? "reference" : "average");
+    }
+    else
+    {
+        fprintf(stderr, "Constructing covariance matrix (%dx%d) ...\n", (int)ndim, (int)ndim);
+    }
     nframes = 0;
     nat     = read_first_x(oenv, &status, trxfile, &t, &xread, box);
     tstart  = t;
@@ -349,18 +593,38 @@ int gmx_covar(int argc, char *argv[])
             }
         }
 
-        for (j = 0; j < natoms; j++)
+        if (nlanczos > 0)
         {
-            for (dj = 0; dj < DIM; dj++)
+            /* store the mass-weighted deviations of this frame */
+            if (nframes*ndim > nalloc)
             {
-                k  = ndim*(DIM*j+dj);
-                xj = x[j][dj];
-                for (i = j; i < natoms; i++)
+                nalloc = over_alloc_large(nframes)*ndim;
+                srenew(xdev, nalloc);
+            }
+            k = (nframes-1)*ndim;
+            for (i = 0; i < natoms; i++)
+            {
+                for (d = 0; d < DIM; d++)
                 {
-                    l = k+DIM*i;
-                    for (d = 0; d < DIM; d++)
+                    xdev[k+DIM*i+d] = x[i][d]*sqrtm[i];
+                }
+            }
+        }
+        else
+        {
+            for (j = 0; j < natoms; j++)
+            {
+                for (dj = 0; dj < DIM; dj++)
+                {
+                    k  = ndim*(DIM*j+dj);
+                    xj = x[j][dj];
+                    for (i = j; i < natoms; i++)
                     {
-                        mat[l+d] += x[i][d]*xj;
+                        l = k+DIM*i;
+                        for (d = 0; d < DIM; d++)
+                        {
+                            mat[l+d] += x[i][d]*xj;
+                        }
                     }
                 }
             }
@@ -387,36 +651,48 @@ int gmx_covar(int argc, char *argv[])
         xproj = xav;
     }
 
-    /* correct the covariance matrix for the mass */
-    inv_nframes = 1.0/nframes;
-    for (j = 0; j < natoms; j++)
+    if (nlanczos == 0)
     {
-        for (dj = 0; dj < DIM; dj++)
+        /* correct the covariance matrix for the mass */
+        inv_nframes = 1.0/nframes;
+        for (j = 0; j < natoms; j++)
         {
-            for (i = j; i < natoms; i++)
+            for (dj = 0; dj < DIM; dj++)
             {
-                k = ndim*(DIM*j+dj)+DIM*i;
-                for (d = 0; d < DIM; d++)
+                for (i = j; i < natoms; i++)
                 {
-                    mat[k+d] = mat[k+d]*inv_nframes*sqrtm[i]*sqrtm[j];
+                    k = ndim*(DIM*j+dj)+DIM*i;
+                    for (d = 0; d < DIM; d++)
+                    {
+                        mat[k+d] = mat[k+d]*inv_nframes*sqrtm[i]*sqrtm[j];
+                    }
                 }
             }
         }
-    }
 
-    /* symmetrize the matrix */
-    for (j = 0; j < ndim; j++)
-    {
-        for (i = j; i < ndim; i++)
+        /* symmetrize the matrix */
+        for (j = 0; j < ndim; j++)
         {
-            mat[ndim*i+j] = mat[ndim*j+i];
+            for (i = j; i < ndim; i++)
+            {
+                mat[ndim*i+j] = mat[ndim*j+i];
+            }
         }
-    }
 
-    trace = 0;
-    for (i = 0; i < ndim; i++)
+        trace = 0;
+        for (i = 0; i < ndim; i++)
+        {
+            trace += mat[i*ndim+i];
+        }
+    }
+    else
     {
-        trace += mat[i*ndim+i];
+        inv_nframes = 1.0/nframes;
+        trace       = 0;
+        for (i = 0; i < nframes*ndim; i++)
+        {
+            trace += xdev[i]*xdev[i]*inv_nframes;
+        }
     }
     fprintf(stderr, "\nTrace of the covariance matrix: %g (%snm^2)\n",
             trace, bM ? "u " : "");
@@ -528,13 +804,39 @@ int gmx_covar(int argc, char *argv[])
     /* call diagonalization routine */
 
     snew(eigenvalues, ndim);
-    snew(eigenvectors, ndim*ndim);
+    if (nlanczos > 0)
+    {
+        /* There are at most nframes-1 non-zero eigenvalues */
+        nlanczos = min(nlanczos, min(nframes-1, ndim-1));
+        if (nlanczos < 1)
+        {
+            gmx_fatal(FARGS, "Need at least 2 frames and 2 degrees of freedom for -lanczos");
+        }
+        snew(mat, nlanczos*ndim);
+        if (covar_lanczos_ncv(ndim, nlanczos) + 1 >= nframes)
+        {
+            fprintf(stderr, "\nDiagonalizing the %dx%d frame overlap matrix ...\n", nframes, nframes);
+            fflush(stderr);
+            covar_gram(nframes, ndim, xdev, nlanczos, eigenvalues, mat);
+        }
+        else
+        {
+            fprintf(stderr, "\nDetermining the %d largest eigenvalues with Lanczos ...\n", nlanczos);
+            fflush(stderr);
+            covar_lanczos(nframes, ndim, xdev, nlanczos, eigenvalues, mat);
+        }
+        sfree(xdev);
+    }
+    else
+    {
+        snew(eigenvectors, ndim*ndim);
 
-    memcpy(eigenvectors, mat, ndim*ndim*sizeof(real));
-    fprintf(stderr, "\nDiagonalizing ...\n");
-    fflush(stderr);
-    eigensolver(eigenvectors, ndim, 0, ndim, eigenvalues, mat);
-    sfree(eigenvectors);
+        memcpy(eigenvectors, mat, ndim*ndim*sizeof(real));
+        fprintf(stderr, "\nDiagonalizing ...\n");
+        fflush(stderr);
+        eigensolver(eigenvectors, ndim, 0, ndim, eigenvalues, mat);
+        sfree(eigenvectors);
+    }
 
     /* now write the output */
 
@@ -543,22 +845,34 @@ int gmx_covar(int argc, char *argv[])
     {
         sum += eigenvalues[i];
     }
-    fprintf(stderr, "\nSum of the eigenvalues: %g (%snm^2)\n",
-            sum, bM ? "u " : "");
-    if (fabs(trace-sum) > 0.01*trace)
+    if (nlanczos > 0)
     {
-        fprintf(stderr, "\nWARNING: eigenvalue sum deviates from the trace of the covariance matrix\n");
+        fprintf(stderr, "\nSum of the %d largest eigenvalues: %g (%snm^2), %.1f%% of the trace\n",
+                nlanczos, sum, bM ? "u " : "", 100*sum/trace);
+    }
+    else
+    {
+        fprintf(stderr, "\nSum of the eigenvalues: %g (%snm^2)\n",
+                sum, bM ? "u " : "");
+        if (fabs(trace-sum) > 0.01*trace)
+        {
+            fprintf(stderr, "\nWARNING: eigenvalue sum deviates from the trace of the covariance matrix\n");
+        }
     }
 
     /* Set 'end', the maximum eigenvector and -value index used for output */
-    if (end == -1)
+    if (nlanczos > 0 && (end == -1 || end > nlanczos))
+    {
+        end = nlanczos;
+    }
+    else if (end == -1)
     {
         if (nframes-1 < ndim)
         {
             end = nframes-1;
-            fprintf(out, "WARNING: there are fewer frames in your trajectory than there are\n");
-            fprintf(out, "degrees of freedom in your system. Only generating the first\n");
-            fprintf(out, "%d out of %d eigenvectors and eigenvalues.\n", end, (int)ndim);
+            fprintf(stderr, "WARNING: there are fewer frames in your trajectory than there are\n");
+            fprintf(stderr, "degrees of freedom in your system. Only generating the first\n");
+            fprintf(stderr, "%d out of %d eigenvectors and eigenvalues.\n", end, (int)ndim);
         }
         else
         {
@@ -574,7 +888,8 @@ int gmx_covar(int argc, char *argv[])
                    "Eigenvector index", str, oenv);
     for (i = 0; (i < end); i++)
     {
-        fprintf (out, "%10d %g\n", (int)i+1, eigenvalues[ndim-1-i]);
+        /* Lanczos returns the largest first, the full diagonalization last */
+        fprintf (out, "%10d %g\n", (int)i+1, eigenvalues[nlanczos > 0 ? i : ndim-1-i]);
     }
     gmx_ffclose(out);
 
@@ -600,7 +915,7 @@ int gmx_covar(int argc, char *argv[])
         WriteXref = eWXR_NOFIT;
     }
 
-    write_eigenvectors(eigvecfile, natoms, mat, TRUE, 1, end,
+    write_eigenvectors(eigvecfile, natoms, mat, nlanczos == 0, 1, end,
                        WriteXref, x, bDiffMass1, xproj, bM, eigenvalues);
 
     out = gmx_ffopen(logfile, "w");
@@ -640,7 +955,15 @@ int gmx_covar(int argc, char *argv[])
     {
         fprintf(out, "Fit is %smass weighted\n", bDiffMass1 ? "" : "non-");
     }
-    fprintf(out, "Diagonalized the %dx%d covariance matrix\n", (int)ndim, (int)ndim);
+    if (nlanczos > 0)
+    {
+        fprintf(out, "Determined the %d largest eigenvalues of the %dx%d covariance matrix with Lanczos\n",
+                nlanczos, (int)ndim, (int)ndim);
+    }
+    else
+    {
+        fprintf(out, "Diagonalized the %dx%d covariance matrix\n", (int)ndim, (int)ndim);
+    }
     fprintf(out, "Trace of the covariance matrix before diagonalizing: %g\n",
             trace);
     fprintf(out, "Trace of the covariance matrix after diagonalizing: %g\n\n",
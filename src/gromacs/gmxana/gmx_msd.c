@@ -54,9 +54,12 @@
 #include "gromacs/statistics/statistics.h"
 #include "gromacs/fileio/tpxio.h"
 #include "gromacs/fileio/trxio.h"
+#include "gromacs/fileio/trxprefetch.h"
 #include "pbc.h"
 #include "vec.h"
 #include "gromacs/fileio/confio.h"
+#include "gromacs/fft/fft.h"
+#include "gromacs/utility/gmxomp.h"
 #include "gmx_ana.h"
 
 #include "gromacs/legacyheaders/gmx_fatal.h"
@@ -654,13 +657,13 @@ int corr_loop(t_corr *curr, const char *fn, t_topology *top, int ePBC,
     rvec             com = {0};
     real             t, t_prev = 0;
     int              natoms, i, j, cur = 0, maxframes = 0;
-    t_trxstatus     *status;
+    t_trxprefetch   *status;
 #define        prev (1-cur)
     matrix           box;
     gmx_bool         bFirst;
     gmx_rmpbc_t      gpbc = NULL;
 
-    natoms = read_first_x(oenv, &status, fn, &curr->t0, &(x[cur]), box);
+    natoms = read_first_x_prefetch(oenv, &status, fn, &curr->t0, &(x[cur]), box);
 #ifdef DEBUG
     fprintf(stderr, "Read %d atoms for first frame\n", natoms);
 #endif
@@ -824,7 +827,7 @@ int corr_loop(t_corr *curr, const char *fn, t_topology *top, int ePBC,
 
         curr->nframes++;
     }
-    while (read_next_x(oenv, status, &t, x[cur], box));
+    while (read_next_x_prefetch(status, &t, x[cur], box));
     fprintf(stderr, "\nUsed %d restart points spaced %g %s over %g %s\n\n",
             curr->nrestart,
             output_env_conv_time(oenv, dt), output_env_get_time_unit(oenv),
@@ -836,7 +839,477 @@ int corr_loop(t_corr *curr, const char *fn, t_topology *top, int ePBC,
         gmx_rmpbc_done(gpbc);
     }
 
-    close_trj(status);
+    close_trj_prefetch(status);
+
+    return natoms;
+}
+
+/* Unwrapped coordinates of all frames for the FFT-based MSD, stored frame
+ * after frame. They are kept in memory up to nmax coordinates in total,
+ * beyond that all frames go to a temporary file.
+ */
+typedef struct {
+    int     ncoord;  /* number of coordinates per frame */
+    int     nframes; /* number of stored frames */
+    size_t  nmax;    /* maximum number of coordinates kept in memory */
+    int     nalloc;  /* number of frames allocated in x */
+    rvec   *x;       /* the frames, while in memory */
+    FILE   *fp;      /* the frames, once on file */
+    char    fn[STRLEN];
+} t_msd_frames;
+
+static void msd_frames_add(t_msd_frames *fr, rvec x[])
+{
+    if (fr->fp == NULL && (size_t)(fr->nframes + 1)*fr->ncoord > fr->nmax)
+    {
+        strcpy(fr->fn, "msdXXXXXX");
+        gmx_tmpnam(fr->fn);
+        fr->fp = gmx_ffopen(fr->fn, "wb+");
+        fprintf(stderr, "\nThe coordinates exceed the memory limit, storing them in %s\n", fr->fn);
+        if (fr->nframes > 0 &&
+            fwrite(fr->x, sizeof(rvec), (size_t)fr->nframes*fr->ncoord, fr->fp) != (size_t)fr->nframes*fr->ncoord)
+        {
+            gmx_fatal(FARGS, "Could not write to %s", fr->fn);
+        }
+        sfree(fr->x);
+        fr->x = NULL;
+    }
+    if (fr->fp != NULL)
+    {
+        if (fwrite(x, sizeof(rvec), fr->ncoord, fr->fp) != (size_t)fr->ncoord)
+        {
+            gmx_fatal(FARGS, "Could not write to %s", fr->fn);
+        }
+    }
+    else
+    {
+        if (fr->nframes >= fr->nalloc)
+        {
+            /* Do not over-allocate beyond the memory limit */
+            fr->nalloc = over_alloc_large(fr->nframes + 1);
+            fr->nalloc = min(fr->nalloc, (int)(fr->nmax/fr->ncoord));
+            srenew(fr->x, (size_t)fr->nalloc*fr->ncoord);
+        }
+        memcpy(fr->x + (size_t)fr->nframes*fr->ncoord, x, fr->ncoord*sizeof(rvec));
+    }
+    fr->nframes++;
+}
+
+/* Copies coordinates c0 to c0+nc-1 of all frames to xb, coordinate after
+ * coordinate, using buf of nc elements
+ */
+static void msd_frames_get(t_msd_frames *fr, int c0, int nc, rvec *xb, rvec *buf)
+{
+    int   t, c;
+    rvec *xt;
+
+    for (t = 0; t < fr->nframes; t++)
+    {
+        if (fr->fp != NULL)
+        {
+            gmx_fseek(fr->fp, ((gmx_off_t)t*fr->ncoord + c0)*sizeof(rvec), SEEK_SET);
+            if (fread(buf, sizeof(rvec), nc, fr->fp) != (size_t)nc)
+            {
+                gmx_fatal(FARGS, "Could not read from %s", fr->fn);
+            }
+            xt = buf;
+        }
+        else
+        {
+            xt = fr->x + (size_t)t*fr->ncoord + c0;
+        }
+        for (c = 0; c < nc; c++)
+        {
+            copy_rvec(xt[c], xb[(size_t)c*fr->nframes + t]);
+        }
+    }
+}
+
+static void done_msd_frames(t_msd_frames *fr)
+{
+    sfree(fr->x);
+    if (fr->fp != NULL)
+    {
+        gmx_ffclose(fr->fp);
+        remove(fr->fn);
+    }
+}
+
+/* Returns the smallest product of powers of 2, 3, 5 and 7 that is >= n */
+static int msd_fft_size(int n)
+{
+    int m, f, nfft;
+
+    for (nfft = n; ; nfft++)
+    {
+        m = nfft;
+        for (f = 2; f <= 7; f++)
+        {
+            while (m % f == 0)
+            {
+                m /= f;
+            }
+        }
+        if (m == 1)
+        {
+            return nfft;
+        }
+    }
+}
+
+/* Per thread work space of the FFT-based MSD */
+typedef struct {
+    gmx_fft_t  fft;
+    real      *in;     /* real-space input and output */
+    real      *xd[DIM]; /* coordinates minus their mean, zero padded */
+    t_complex *ft[DIM]; /* transforms of the coordinates */
+    t_complex *prod;   /* product of two transforms */
+    double    *psum;   /* running sums of products of coordinates */
+    double    *sum;    /* sum over origins per lag */
+    double    *acc;    /* sum of the weighted displacements per group and lag */
+    double    *accm;   /* the same for the 6 tensor elements */
+} t_msd_fftwork;
+
+/* Sets sum[m] = sum_{t=0}^{T-m-1} (a(t+m) - a(t))(b(t+m) - b(t)) for the
+ * coordinates a and b, given their transforms fa and fb of length nfft,
+ * using the correlation theorem for the cross terms
+ */
+static void msd_fft_pair(t_msd_fftwork *w, int T, int nfft, const real *a, const real *b,
+                         const t_complex *fa, const t_complex *fb, double *sum)
+{
+    int    k, m;
+    double s;
+
+    for (k = 0; k < nfft/2 + 1; k++)
+    {
+        w->prod[k].re = fa[k].re*fb[k].re + fa[k].im*fb[k].im;
+        w->prod[k].im = fa[k].re*fb[k].im - fa[k].im*fb[k].re;
+    }
+    gmx_fft_1d_real(w->fft, GMX_FFT_COMPLEX_TO_REAL, w->prod, w->in);
+    /* in[m] = nfft sum_t a(t) b(t+m), in[nfft-m] = nfft sum_t b(t) a(t+m) */
+    w->psum[0] = 0;
+    for (m = 0; m < T; m++)
+    {
+        w->psum[m+1] = w->psum[m] + (double)a[m]*b[m];
+    }
+    for (m = 0; m < T; m++)
+    {
+        s      = (w->psum[T-m] - w->psum[0]) + (w->psum[T] - w->psum[m]);
+        sum[m] = s - ((double)w->in[m] + w->in[m == 0 ? 0 : nfft-m])/nfft;
+    }
+}
+
+/* The MSD over all time origins with FFTs. For a coordinate x(t) of T frames
+ *   sum_{t=0}^{T-m-1} (x(t+m) - x(t))^2 = S1(m) - 2 sum_t x(t) x(t+m),
+ * where S1 follows from running sums of x^2 and the correlation from one
+ * forward and one backward FFT of length >= 2T, which makes the cost
+ * O(T log T) per coordinate instead of O(T^2) for all origins. Frames in
+ * memory are read in place, frames on file are read in blocks of atoms
+ * that fit in what is left of memlimit bytes. The atoms of a block are
+ * processed in parallel.
+ */
+static void calc_msd_fft(t_corr *curr, t_msd_frames *fr, int *cgrp, real *cw, double *wsum,
+                         gmx_bool bTen, double memlimit, int nthreads)
+{
+    const int      pair[6][2] = { {XX, XX}, {YY, YY}, {ZZ, ZZ}, {YY, XX}, {ZZ, XX}, {ZZ, YY} };
+    int            T, nfft, nblock, c0, nc, th, d, g, m, k, p, ndim, dims[DIM];
+    size_t         stride;
+    double         budget;
+    rvec          *xb, *buf;
+    t_msd_fftwork *work;
+
+    T    = fr->nframes;
+    nfft = msd_fft_size(2*T);
+    ndim = 0;
+    for (d = 0; d < DIM; d++)
+    {
+        if ((curr->type == NORMAL) ||
+            (curr->type == LATERAL && d != curr->axis) ||
+            (curr->type - X == d))
+        {
+            dims[ndim++] = d;
+        }
+    }
+    if (fr->fp == NULL)
+    {
+        /* All frames are in memory, gather each time series from there */
+        nblock = fr->ncoord;
+        stride = fr->ncoord;
+        xb     = NULL;
+        buf    = NULL;
+    }
+    else
+    {
+        /* Transposed blocks of T frames plus a read buffer per coordinate,
+         * within what is left of the budget after the frames in memory
+         */
+        budget = memlimit;
+        if (fr->x != NULL)
+        {
+            budget -= (double)fr->nalloc*fr->ncoord*sizeof(rvec);
+        }
+        nblock = (int)(budget/((double)(T + 1)*sizeof(rvec)));
+        nblock = max(1, min(nblock, fr->ncoord));
+        stride = 1;
+        snew(xb, (size_t)nblock*T);
+        snew(buf, nblock);
+    }
+    fprintf(stderr, "MSD over all %d time origins with FFTs of length %d, %d coordinates at a time on %d threads\n",
+            T, nfft, nblock, nthreads);
+
+    snew(work, nthreads);
+    for (th = 0; th < nthreads; th++)
+    {
+        gmx_fft_init_1d_real(&work[th].fft, nfft, GMX_FFT_FLAG_NONE);
+        snew(work[th].in, nfft + 2);
+        for (d = 0; d < DIM; d++)
+        {
+            snew(work[th].xd[d], nfft + 2);
+            snew(work[th].ft[d], nfft/2 + 1);
+        }
+        snew(work[th].prod, nfft/2 + 1);
+        snew(work[th].psum, T + 1);
+        snew(work[th].sum, T);
+        snew(work[th].acc, (size_t)curr->ngrp*T);
+        if (bTen)
+        {
+            snew(work[th].accm, (size_t)curr->ngrp*T*6);
+        }
+    }
+
+    for (c0 = 0; c0 < fr->ncoord; c0 += nblock)
+    {
+        nc = min(nblock, fr->ncoord - c0);
+        if (xb != NULL)
+        {
+            msd_frames_get(fr, c0, nc, xb, buf);
+        }
+#pragma omp parallel for num_threads(nthreads) schedule(static) private(d, g, m, p)
+        for (k = 0; k < nc; k++)
+        {
+            t_msd_fftwork *w  = &work[gmx_omp_get_thread_num()];
+            const rvec    *xk = (xb != NULL ? xb + (size_t)k*T : fr->x + c0 + k);
+            real           wk = cw[c0+k];
+            double         mean;
+
+            if (wk == 0)
+            {
+                continue;
+            }
+            g = cgrp[c0+k];
+            /* The MSD does not depend on the mean position, subtracting it
+             * keeps the cancellation in S1 - 2 S2 small
+             */
+            for (p = 0; p < ndim; p++)
+            {
+                d    = dims[p];
+                mean = 0;
+                for (m = 0; m < T; m++)
+                {
+                    mean += xk[m*stride][d];
+                }
+                mean /= T;
+                for (m = 0; m < T; m++)
+                {
+                    w->xd[d][m] = xk[m*stride][d] - mean;
+                }
+                gmx_fft_1d_real(w->fft, GMX_FFT_REAL_TO_COMPLEX, w->xd[d], w->ft[d]);
+            }
+            if (bTen)
+            {
+                for (p = 0; p < 6; p++)
+                {
+                    msd_fft_pair(w, T, nfft, w->xd[pair[p][0]], w->xd[pair[p][1]],
+                                 w->ft[pair[p][0]], w->ft[pair[p][1]], w->sum);
+                    for (m = 0; m < T; m++)
+                    {
+                        w->accm[((size_t)g*T + m)*6 + p] += wk*w->sum[m];
+                        if (p < DIM)
+                        {
+                            w->acc[(size_t)g*T + m] += wk*w->sum[m];
+                        }
+                    }
+                }
+            }
+            else
+            {
+                for (p = 0; p < ndim; p++)
+                {
+                    d = dims[p];
+                    msd_fft_pair(w, T, nfft, w->xd[d], w->xd[d], w->ft[d], w->ft[d], w->sum);
+                    for (m = 0; m < T; m++)
+                    {
+                        w->acc[(size_t)g*T + m] += wk*w->sum[m];
+                    }
+                }
+            }
+        }
+    }
+
+    /* Reduce in thread order, data/ndata is then the average over origins */
+    for (g = 0; g < curr->ngrp; g++)
+    {
+        for (m = 0; m < T; m++)
+        {
+            double a = 0, am[6] = { 0 };
+
+            for (th = 0; th < nthreads; th++)
+            {
+                a += work[th].acc[(size_t)g*T + m];
+                for (p = 0; p < 6 && bTen; p++)
+                {
+                    am[p] += work[th].accm[((size_t)g*T + m)*6 + p];
+                }
+            }
+            curr->data[g][m]  = a/wsum[g];
+            curr->ndata[g][m] = T - m;
+            if (bTen)
+            {
+                clear_mat(curr->datam[g][m]);
+                for (p = 0; p < 6; p++)
+                {
+                    curr->datam[g][m][pair[p][0]][pair[p][1]] = am[p]/wsum[g];
+                }
+            }
+        }
+    }
+
+    for (th = 0; th < nthreads; th++)
+    {
+        gmx_fft_destroy(work[th].fft);
+        sfree(work[th].in);
+        for (d = 0; d < DIM; d++)
+        {
+            sfree(work[th].xd[d]);
+            sfree(work[th].ft[d]);
+        }
+        sfree(work[th].prod);
+        sfree(work[th].psum);
+        sfree(work[th].sum);
+        sfree(work[th].acc);
+        sfree(work[th].accm);
+    }
+    sfree(work);
+    sfree(xb);
+    sfree(buf);
+}
+
+/* The frame loop for the FFT-based MSD, which uses every frame as time
+ * origin. The unwrapped coordinates of the groups, with the center of
+ * mass motion removed when requested, are stored for all frames and the
+ * MSD is computed after the last frame.
+ */
+static int corr_loop_fft(t_corr *curr, const char *fn, t_topology *top,
+                         int gnx[], atom_id *index[], gmx_bool bMW, gmx_bool bTen,
+                         int *gnx_com, atom_id *index_com[], real maxmem,
+                         const output_env_t oenv)
+{
+    rvec          *x[2], *xs, com = {0};
+    real           t, *cw;
+    int            natoms, i, j, c, cur = 0, maxframes = 0, nthreads, *cgrp;
+    double        *wsum;
+    t_trxprefetch *status;
+    t_msd_frames   fr;
+    matrix         box;
+
+    natoms = read_first_x_prefetch(oenv, &status, fn, &curr->t0, &(x[cur]), box);
+    if ((gnx_com != NULL) && natoms < top->atoms.nr)
+    {
+        fprintf(stderr, "WARNING: The trajectory only contains part of the system (%d of %d atoms) and therefore the COM motion of only this part of the system will be removed\n", natoms, top->atoms.nr);
+    }
+    snew(x[prev], natoms);
+    memcpy(x[prev], x[cur], natoms*sizeof(x[cur][0]));
+
+    /* The coordinates of all groups after each other, with their group and weight */
+    fr.ncoord = 0;
+    for (i = 0; i < curr->ngrp; i++)
+    {
+        fr.ncoord += gnx[i];
+    }
+    snew(xs, fr.ncoord);
+    snew(cgrp, fr.ncoord);
+    snew(cw, fr.ncoord);
+    snew(wsum, curr->ngrp);
+    for (i = 0, c = 0; i < curr->ngrp; i++)
+    {
+        for (j = 0; j < gnx[i]; j++, c++)
+        {
+            cgrp[c]  = i;
+            cw[c]    = bMW ? curr->mass[index[i][j]] : 1;
+            wsum[i] += cw[c];
+        }
+    }
+    fr.nframes = 0;
+    fr.nmax    = (size_t)(maxmem*1024*1024/sizeof(rvec));
+    fr.nalloc  = 0;
+    fr.x       = NULL;
+    fr.fp      = NULL;
+
+    t = curr->t0;
+    do
+    {
+        if (curr->nframes >= maxframes)
+        {
+            maxframes = over_alloc_large(curr->nframes + 1);
+            srenew(curr->time, maxframes);
+        }
+        curr->time[curr->nframes] = t - curr->t0;
+        if (curr->nframes >= 2 &&
+            fabs(curr->time[curr->nframes] - curr->time[curr->nframes-1] - curr->time[1]) > 1e-3*curr->time[1])
+        {
+            gmx_fatal(FARGS, "The FFT-based MSD needs frames at a constant time interval, frame %d at time %g is not",
+                      curr->nframes, t);
+        }
+
+        for (i = 0; i < curr->ngrp; i++)
+        {
+            prep_data(FALSE, gnx[i], index[i], x[cur], x[prev], box);
+        }
+        if (gnx_com)
+        {
+            prep_data(FALSE, gnx_com[0], index_com[0], x[cur], x[prev], box);
+            calc_com(FALSE, gnx_com[0], index_com[0], x[cur], x[prev], box,
+                     &top->atoms, com);
+        }
+        for (i = 0, c = 0; i < curr->ngrp; i++)
+        {
+            for (j = 0; j < gnx[i]; j++, c++)
+            {
+                rvec_sub(x[cur][index[i][j]], com, xs[c]);
+            }
+        }
+        msd_frames_add(&fr, xs);
+
+        cur = prev;
+        curr->nframes++;
+    }
+    while (read_next_x_prefetch(status, &t, x[cur], box));
+    close_trj_prefetch(status);
+    curr->nrestart = curr->nframes;
+
+    for (i = 0; i < curr->ngrp; i++)
+    {
+        snew(curr->data[i], curr->nframes);
+        snew(curr->ndata[i], curr->nframes);
+        if (bTen)
+        {
+            snew(curr->datam[i], curr->nframes);
+        }
+    }
+    nthreads = gmx_omp_get_max_threads();
+    calc_msd_fft(curr, &fr, cgrp, cw, wsum, bTen, maxmem*1024*1024, nthreads);
+    fprintf(stderr, "\nUsed all %d frames over %g %s as time origins\n\n",
+            curr->nframes,
+            output_env_conv_time(oenv, curr->time[curr->nframes-1]),
+            output_env_get_time_unit(oenv));
+
+    done_msd_frames(&fr);
+    sfree(xs);
+    sfree(cgrp);
+    sfree(cw);
+    sfree(wsum);
+    sfree(x[0]);
+    sfree(x[1]);
 
     return natoms;
 }
@@ -880,7 +1353,8 @@ void do_corr(const char *trx_file, const char *ndx_file, const char *msd_file,
              int nrgrp, t_topology *top, int ePBC,
              gmx_bool bTen, gmx_bool bMW, gmx_bool bRmCOMM,
              int type, real dim_factor, int axis,
-             real dt, real beginfit, real endfit, const output_env_t oenv)
+             real dt, real beginfit, real endfit, gmx_bool bFFT, real fftmem,
+             const output_env_t oenv)
 {
     t_corr        *msd;
     int           *gnx;   /* the selected groups' sizes */
@@ -920,11 +1394,20 @@ void do_corr(const char *trx_file, const char *ndx_file, const char *msd_file,
                     mol_file == NULL ? 0 : gnx[0], bTen, bMW, dt, top,
                     beginfit, endfit);
 
-    nat_trx =
-        corr_loop(msd, trx_file, top, ePBC, mol_file ? gnx[0] : 0, gnx, index,
-                  (mol_file != NULL) ? calc1_mol : (bMW ? calc1_mw : calc1_norm),
-                  bTen, gnx_com, index_com, dt, t_pdb,
-                  pdb_file ? &x : NULL, box, oenv);
+    if (bFFT)
+    {
+        nat_trx =
+            corr_loop_fft(msd, trx_file, top, gnx, index, bMW, bTen,
+                          gnx_com, index_com, fftmem, oenv);
+    }
+    else
+    {
+        nat_trx =
+            corr_loop(msd, trx_file, top, ePBC, mol_file ? gnx[0] : 0, gnx, index,
+                      (mol_file != NULL) ? calc1_mol : (bMW ? calc1_mw : calc1_norm),
+                      bTen, gnx_com, index_com, dt, t_pdb,
+                      pdb_file ? &x : NULL, box, oenv);
+    }
 
     /* Correct for the number of points */
     for (j = 0; (j < msd->ngrp); j++)
@@ -1071,7 +1554,17 @@ int gmx_msd(int argc, char *argv[])
         "Option [TT]-pdb[tt] writes a [TT].pdb[tt] file with the coordinates of the frame",
         "at time [TT]-tpdb[tt] with in the B-factor field the square root of",
         "the diffusion coefficient of the molecule.",
-        "This option implies option [TT]-mol[tt]."
+        "This option implies option [TT]-mol[tt].[PAR]",
+        "With [TT]-fft[tt] every frame is used as reference point and",
+        "[TT]-trestart[tt] is ignored. The sum over all reference points",
+        "is then computed with fast Fourier transforms, at a cost of",
+        "O(T log T) per atom for T frames, instead of O(T^2). This requires",
+        "frames at a constant time interval. The unwrapped coordinates",
+        "of all frames are kept in memory up to [TT]-fftmem[tt] MB,",
+        "beyond that they are stored in a temporary file in the current",
+        "directory and processed for blocks of atoms at a time.",
+        "The atoms are processed in parallel using OpenMP threads.",
+        "[TT]-fft[tt] can not be combined with [TT]-mol[tt]."
     };
     static const char *normtype[] = { NULL, "no", "x", "y", "z", NULL };
     static const char *axtitle[]  = { NULL, "no", "x", "y", "z", NULL };
@@ -1083,6 +1576,8 @@ int gmx_msd(int argc, char *argv[])
     static gmx_bool    bTen       = FALSE;
     static gmx_bool    bMW        = TRUE;
     static gmx_bool    bRmCOMM    = FALSE;
+    static gmx_bool    bFFT       = FALSE;
+    static real        fftmem     = 2000;
     t_pargs            pa[]       = {
         { "-type",    FALSE, etENUM, {normtype},
           "Compute diffusion coefficient in one direction" },
@@ -1103,7 +1598,11 @@ int gmx_msd(int argc, char *argv[])
         { "-beginfit", FALSE, etTIME, {&beginfit},
           "Start time for fitting the MSD (%t), -1 is 10%" },
         { "-endfit", FALSE, etTIME, {&endfit},
-          "End time for fitting the MSD (%t), -1 is 90%" }
+          "End time for fitting the MSD (%t), -1 is 90%" },
+        { "-fft", FALSE, etBOOL, {&bFFT},
+          "Use all frames as reference points and compute the MSD with FFTs" },
+        { "-fftmem", FALSE, etREAL, {&fftmem},
+          "Memory (MB) for the coordinates with [TT]-fft[tt], beyond that a temporary file is used" }
     };
 
     t_filenm           fnm[] = {
@@ -1158,6 +1657,15 @@ int gmx_msd(int argc, char *argv[])
     }
 
 
+    if (mol_file && bFFT)
+    {
+        gmx_fatal(FARGS, "Option -fft can not be combined with -mol");
+    }
+    if (bFFT && fftmem <= 0)
+    {
+        gmx_fatal(FARGS, "Option -fftmem should be positive (now %g)", fftmem);
+    }
+
     if (mol_file)
     {
         bMW  = TRUE;
@@ -1200,7 +1708,7 @@ int gmx_msd(int argc, char *argv[])
 
     do_corr(trx_file, ndx_file, msd_file, mol_file, pdb_file, t_pdb, ngroup,
             &top, ePBC, bTen, bMW, bRmCOMM, type, dim_factor, axis, dt, beginfit, endfit,
-            oenv);
+            bFFT, fftmem, oenv);
 
     view_all(oenv, NFILE, fnm);
 
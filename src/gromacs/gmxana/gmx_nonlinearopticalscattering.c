@@ -39,7 +39,9 @@
 #include <config.h>
 #endif
 
+#include <ctype.h>
 #include <math.h>
+#include <stdlib.h>
 
 #include "sysstuff.h"
 #include "typedefs.h"
@@ -51,6 +53,7 @@
 #include "gromacs/commandline/pargs.h"
 #include "gromacs/fileio/tpxio.h"
 #include "gromacs/fileio/trxio.h"
+#include "gromacs/fileio/trxprefetch.h"
 #include "physics.h"
 #include "index.h"
 #include "gromacs/utility/smalloc.h"
@@ -61,34 +64,713 @@
 #include "gromacs/fileio/matio.h"
 #include "gmx_ana.h"
 #include "hyperpol.h"
+#include "qloop.h"
+#include "pairsum.h"
+#include "molframes.h"
+#include "sqaccum.h"
+#include "sqgrid.h"
+#include "gromacs/utility/gmxomp.h"
 #include "names.h"
 
 #include "gromacs/legacyheaders/gmx_fatal.h"
 
+/* The q grid of this tool is uniform along the direction kvec,
+ * q_k = (minq + k*dq)*kvec, so for nrecur > 0 the q loops below are
+ * evaluated with the angle-addition recurrence, re-seeded every nrecur
+ * q points, instead of one sin/cos per q point.
+ */
+static void shs_cos_qdx(const t_qvec_soa *qsoa, const rvec kvec, real minq, real dq,
+                        int nrecur, const rvec dx, real w, real *acc)
+{
+    real kdx;
+
+    if (nrecur > 0)
+    {
+        kdx = iprod(kvec, dx);
+        qloop_cossin_recur(qsoa->n, minq*kdx, dq*kdx, nrecur, w, acc, NULL);
+    }
+    else
+    {
+        qloop_cos_qdx(qsoa, dx, w, acc);
+    }
+}
+
+static void shs_cossin_qx(const t_qvec_soa *qsoa, const rvec kvec, real minq, real dq,
+                          int nrecur, const rvec x, real w, real *cacc, real *sacc)
+{
+    real kx;
+
+    if (nrecur > 0)
+    {
+        kx = iprod(kvec, x);
+        qloop_cossin_recur(qsoa->n, minq*kx, dq*kx, nrecur, w, cacc, sacc);
+    }
+    else
+    {
+        qloop_cossin_qx(qsoa, x, w, cacc, sacc);
+    }
+}
+
+/* shs_cossin_qx for npol weights w[c] with accumulators cacc[c] and sacc[c] */
+static void shs_cossin_qx_multi(const t_qvec_soa *qsoa, const rvec kvec, real minq, real dq,
+                                int nrecur, const rvec x, int npol, const real w[],
+                                real *cacc[], real *sacc[])
+{
+    real kx;
+    int  c;
+
+    if (nrecur > 0)
+    {
+        kx = iprod(kvec, x);
+        for (c = 0; c < npol; c++)
+        {
+            qloop_cossin_recur(qsoa->n, minq*kx, dq*kx, nrecur, w[c], cacc[c], sacc[c]);
+        }
+    }
+    else
+    {
+        qloop_cossin_qx_multi(qsoa, x, npol, w, cacc, sacc);
+    }
+}
+
+/* Parses the polarization channels in str, three letters for the outgoing
+ * and the two incoming beams per channel, separated by commas or spaces,
+ * e.g. "PPP,PSS,SPS,SSP". P is Z for the outgoing and X for the incoming
+ * beams, S is Y, and X, Y or Z give a lab axis directly. Stores the axes
+ * of channel c in pol[c] and its name in name[c], returns the number of
+ * channels.
+ */
+static int shs_parse_pol(const char *str, ivec pol[], char name[][DIM+1])
+{
+    const char *p = str;
+    int         n = 0, b, c;
+
+    while (*p != '\0')
+    {
+        if (*p == ',' || isspace(*p))
+        {
+            p++;
+            continue;
+        }
+        if (n == PAIRSUM_MAXCHAN)
+        {
+            gmx_fatal(FARGS, "More than %d polarization channels in '%s'", PAIRSUM_MAXCHAN, str);
+        }
+        for (b = 0; b < DIM; b++)
+        {
+            switch (toupper(p[b]))
+            {
+                case 'X': pol[n][b] = XX; break;
+                case 'S':
+                case 'Y': pol[n][b] = YY; break;
+                case 'Z': pol[n][b] = ZZ; break;
+                case 'P': pol[n][b] = (b == 0) ? ZZ : XX; break;
+                default:
+                    gmx_fatal(FARGS, "A polarization channel should be three of the letters P, S, X, Y and Z, not '%s'", p);
+            }
+            name[n][b] = toupper(p[b]);
+        }
+        name[n][DIM] = '\0';
+        p           += DIM;
+        if (*p != '\0' && *p != ',' && !isspace(*p))
+        {
+            gmx_fatal(FARGS, "A polarization channel should be three of the letters P, S, X, Y and Z, found '%s' in '%s'", name[n], str);
+        }
+        for (c = 0; c < n; c++)
+        {
+            if (pol[c][XX] == pol[n][XX] && pol[c][YY] == pol[n][YY] && pol[c][ZZ] == pol[n][ZZ])
+            {
+                gmx_fatal(FARGS, "Polarization channels %s and %s are the same", name[c], name[n]);
+            }
+        }
+        n++;
+    }
+    if (n == 0)
+    {
+        gmx_fatal(FARGS, "No polarization channels in '%s'", str);
+    }
+
+    return n;
+}
+
+/* Projects the molecular beta of the frames in mf on the npol polarization
+ * channels pol, the lab-frame beta of channel c goes to beta_pol[c]
+ */
+static void shs_contract_pol(t_molframes *mf, real ***beta_mol, int npol, ivec pol[],
+                             real *beta_pol[])
+{
+    rvec unit_dir[DIM] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+    int  c;
+
+    for (c = 0; c < npol; c++)
+    {
+        molframes_contract(mf, beta_mol, unit_dir[pol[c][0]], unit_dir[pol[c][1]],
+                           unit_dir[pol[c][2]], beta_pol[c]);
+    }
+}
+
+/* Sets up pbc for the box of a new frame and returns the inverse volume.
+ * The pbc is only rebuilt when the box differs from box_pbc, the box of
+ * the previous call, so this is cheap for NVT trajectories. With pbc the
+ * cut-off rmax2 of the first frame is limited to what the current box
+ * allows and returned in rmax2_frame.
+ */
+static real shs_frame_pbc(t_pbc *pbc, int ePBC, gmx_bool bPBC, matrix box, matrix box_pbc,
+                          real rmax2, real *rmax2_frame)
+{
+    int      d, e;
+    gmx_bool bChanged = FALSE;
+
+    for (d = 0; d < DIM; d++)
+    {
+        for (e = 0; e < DIM; e++)
+        {
+            bChanged = bChanged || (box[d][e] != box_pbc[d][e]);
+        }
+    }
+    if (bChanged)
+    {
+        copy_mat(box, box_pbc);
+        set_pbc(pbc, ePBC, box_pbc);
+        *rmax2_frame = bPBC ? min(rmax2, max_cutoff2(epbcXYZ, box_pbc)) : rmax2;
+    }
+
+    return 1/det(box_pbc);
+}
+
+/* Sets up shell averaging over many q vectors: all reciprocal lattice
+ * vectors of box with 0 < |q| <= maxq, or those with the lattice indices
+ * listed in fnQVEC. Only one of each pair q, -q is used, as both give the
+ * same intensity. The vectors are binned by |q| in *nbinq bins of width
+ * maxq/(*nbinq); empty bins are removed, which updates *nbinq and gives
+ * in arr_q the mean |q| of each remaining bin. Returns the vectors in
+ * qvec, their bins in qbin and in qw one over the number of vectors in
+ * their bin, such that summing qw times the intensity over the vectors
+ * gives the shell average.
+ */
+static int shs_qshells(const char *fnQVEC, matrix box, real maxq, int *nbinq,
+                       real **arr_q, rvec **qvec, int **qbin, real **qw)
+{
+    FILE  *fp = NULL;
+    char   line[STRLEN];
+    matrix invbox;
+    ivec   nmax, nq;
+    rvec   q;
+    real   width, qnorm, *qsum;
+    int    d, nalloc = 0, nvec = 0, ndrop = 0, nocc, b, *nbvec, *newbin;
+
+    m_inv_ur0(box, invbox);
+    width = maxq/(*nbinq);
+    for (d = 0; d < DIM; d++)
+    {
+        /* The lattice index along d is q.a_d/(2 pi) */
+        nmax[d] = (int)(maxq*norm(box[d])/(2*M_PI));
+    }
+    if (fnQVEC)
+    {
+        fp = gmx_ffopen(fnQVEC, "r");
+    }
+    snew(nbvec, *nbinq);
+    snew(qsum, *nbinq);
+    nq[XX] = 0;
+    nq[YY] = -nmax[YY];
+    nq[ZZ] = -nmax[ZZ] - 1;
+    while (TRUE)
+    {
+        if (fp)
+        {
+            if (fgets(line, STRLEN, fp) == NULL)
+            {
+                break;
+            }
+            if (line[0] == '#' || line[0] == '@' ||
+                sscanf(line, "%d %d %d", &nq[XX], &nq[YY], &nq[ZZ]) != 3)
+            {
+                continue;
+            }
+        }
+        else
+        {
+            /* Next lattice point of the half space n_x > 0, or n_x = 0
+             * and n_y > 0, or n_x = n_y = 0 and n_z > 0
+             */
+            if (++nq[ZZ] > nmax[ZZ])
+            {
+                nq[ZZ] = -nmax[ZZ];
+                if (++nq[YY] > nmax[YY])
+                {
+                    nq[YY] = -nmax[YY];
+                    if (++nq[XX] > nmax[XX])
+                    {
+                        break;
+                    }
+                }
+            }
+            if (nq[XX] == 0 && (nq[YY] < 0 || (nq[YY] == 0 && nq[ZZ] <= 0)))
+            {
+                continue;
+            }
+        }
+        for (d = 0; d < DIM; d++)
+        {
+            q[d] = 2*M_PI*(invbox[d][XX]*nq[XX] + invbox[d][YY]*nq[YY] + invbox[d][ZZ]*nq[ZZ]);
+        }
+        qnorm = norm(q);
+        if (qnorm == 0 || qnorm > maxq)
+        {
+            ndrop += (fp != NULL);
+            continue;
+        }
+        if (nvec >= nalloc)
+        {
+            nalloc = over_alloc_large(nvec + 1);
+            srenew(*qvec, nalloc);
+            srenew(*qbin, nalloc);
+        }
+        b = min((int)(qnorm/width), *nbinq - 1);
+        copy_rvec(q, (*qvec)[nvec]);
+        (*qbin)[nvec] = b;
+        nbvec[b]++;
+        qsum[b] += qnorm;
+        nvec++;
+    }
+    if (fp)
+    {
+        gmx_ffclose(fp);
+        if (ndrop > 0)
+        {
+            fprintf(stderr, "Note: %d q vectors in %s are zero or longer than maxq and were skipped\n",
+                    ndrop, fnQVEC);
+        }
+    }
+    if (nvec == 0)
+    {
+        gmx_fatal(FARGS, "There are no q vectors with 0 < |q| <= %g", maxq);
+    }
+
+    /* Remove the empty bins */
+    snew(newbin, *nbinq);
+    sfree(*arr_q);
+    snew(*arr_q, *nbinq);
+    nocc = 0;
+    for (b = 0; b < *nbinq; b++)
+    {
+        newbin[b] = nocc;
+        if (nbvec[b] > 0)
+        {
+            (*arr_q)[nocc] = qsum[b]/nbvec[b];
+            nocc++;
+        }
+    }
+    snew(*qw, nvec);
+    for (d = 0; d < nvec; d++)
+    {
+        (*qw)[d]   = 1.0/nbvec[(*qbin)[d]];
+        (*qbin)[d] = newbin[(*qbin)[d]];
+    }
+    fprintf(stderr, "Averaging over %d q vectors in %d shells of width %g nm^-1\n",
+            nvec, nocc, width);
+    *nbinq = nocc;
+    sfree(newbin);
+    sfree(nbvec);
+    sfree(qsum);
+
+    return nvec;
+}
+
+/* Plane-wave evaluation of the faded pair sum for the sumexp method.
+ *
+ * With the fading window f(r) of modsumexp, 1 up to fade and
+ * cos^2((r-fade)*inv_width) up to rmax, the windowed sum over all pairs
+ * including i = j is the convolution
+ *
+ *   sum_ij b_i b_j f(r_ij) cos(q.r_ij) = 1/V sum_k F(|q-k|) |rho(k)|^2
+ *
+ * over the reciprocal lattice vectors k, with rho(k) = sum_i b_i exp(i k.x_i)
+ * and F the Fourier transform of f. This holds for q on the reciprocal
+ * lattice as long as f vanishes within half the box. F decays quickly,
+ * so the sum is truncated to the k within nshell lattice spacings of q.
+ * The cost is then O(N) per k instead of O(N^2) per q; the sum of the
+ * retained weights, which is 1 without truncation, is reported.
+ */
+typedef struct {
+    int         nk;     /* number of distinct wave vectors k */
+    t_qvec_soa  ksoa;   /* the k vectors */
+    ivec       *kn;     /* lattice indices of the k vectors */
+    int         ndelta; /* number of lattice offsets k-q per q vector */
+    real       *w;      /* F(|k-q|)/V for each offset */
+    int        *kind;   /* index of q_v plus offset d in k, at v*ndelta+d */
+    real       *c1, *s1, *c2, *s2; /* plane-wave sums, padded for the q loops */
+} t_shs_fadeconv;
+
+#define SHS_KEY_OFFSET 1048576
+
+static gmx_int64_t shs_lattice_key(const ivec n)
+{
+    return (((gmx_int64_t)(n[XX] + SHS_KEY_OFFSET) << 42) |
+            ((gmx_int64_t)(n[YY] + SHS_KEY_OFFSET) << 21) |
+            (gmx_int64_t)(n[ZZ] + SHS_KEY_OFFSET));
+}
+
+static int shs_key_comp(const void *a, const void *b)
+{
+    gmx_int64_t ka = *(const gmx_int64_t *)a, kb = *(const gmx_int64_t *)b;
+
+    return (ka < kb) ? -1 : (ka > kb);
+}
+
+/* Sets m to the lattice indices of the nqv vectors qvec, q = 2 pi m box^-1.
+ * Returns FALSE when a vector is not on the reciprocal lattice of box.
+ */
+static gmx_bool shs_lattice_index(matrix box, int nqv, rvec qvec[], ivec m[])
+{
+    real x;
+    int  v, d;
+
+    for (v = 0; v < nqv; v++)
+    {
+        for (d = 0; d < DIM; d++)
+        {
+            x       = iprod(qvec[v], box[d])/(2*M_PI);
+            m[v][d] = gmx_nint(x);
+            if (fabs(x - m[v][d]) > 1e-3)
+            {
+                return FALSE;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+/* Fourier transform of the fading window at wave number k */
+static real shs_window_ft(real k, real fade, real rmax, real inv_width)
+{
+    const int nr = 1000;
+    double    sum = 0, r, f, sinc;
+    int       i;
+
+    /* Simpson's rule, the integrand is smooth */
+    for (i = 0; i <= nr; i++)
+    {
+        r    = i*rmax/nr;
+        f    = (r <= fade) ? 1 : sqr(cos((r - fade)*inv_width));
+        sinc = (k*r > 1e-6) ? sin(k*r)/(k*r) : 1;
+        sum += ((i == 0 || i == nr) ? 1 : (i % 2 ? 4 : 2))*f*r*r*sinc;
+    }
+
+    return 4*M_PI*sum*rmax/(3*nr);
+}
+
+/* Sets up fc for the nqv vectors qvec. Returns FALSE, leaving fc
+ * unused, when a q vector is not on the reciprocal lattice of box.
+ */
+static gmx_bool init_shs_fadeconv(t_shs_fadeconv *fc, matrix box, int nqv, rvec qvec[],
+                                  real fade, real rmax, real inv_width, int nshell)
+{
+    matrix       invbox;
+    ivec         nmax, *nq, nd, n;
+    rvec         dk, *kvec;
+    real         kcut, bmin, wsum;
+    gmx_int64_t *keys, *uniq, key;
+    int          d, v, i, j, nalloc = 0, nd_tot = 0;
+    ivec        *delta = NULL;
+
+    m_inv_ur0(box, invbox);
+    snew(nq, nqv);
+    if (!shs_lattice_index(box, nqv, qvec, nq))
+    {
+        sfree(nq);
+        return FALSE;
+    }
+
+    /* Lattice offsets within nshell times the shortest reciprocal vector.
+     * F decays over a few times 1/(rmax - fade), which relative to the
+     * lattice spacing 2 pi/L does not depend on the box size.
+     */
+    if (nshell <= 0)
+    {
+        nshell = (int)ceil(2*rmax/(rmax - fade));
+    }
+    bmin = GMX_REAL_MAX;
+    for (d = 0; d < DIM; d++)
+    {
+        bmin = min(bmin, 2*M_PI*sqrt(sqr(invbox[XX][d]) + sqr(invbox[YY][d]) + sqr(invbox[ZZ][d])));
+    }
+    kcut = nshell*bmin;
+    for (d = 0; d < DIM; d++)
+    {
+        nmax[d] = (int)(kcut*norm(box[d])/(2*M_PI)) + 1;
+    }
+    fc->w = NULL;
+    wsum  = 0;
+    for (nd[XX] = -nmax[XX]; nd[XX] <= nmax[XX]; nd[XX]++)
+    {
+        for (nd[YY] = -nmax[YY]; nd[YY] <= nmax[YY]; nd[YY]++)
+        {
+            for (nd[ZZ] = -nmax[ZZ]; nd[ZZ] <= nmax[ZZ]; nd[ZZ]++)
+            {
+                for (d = 0; d < DIM; d++)
+                {
+                    dk[d] = 2*M_PI*(invbox[d][XX]*nd[XX] + invbox[d][YY]*nd[YY] + invbox[d][ZZ]*nd[ZZ]);
+                }
+                if (norm(dk) > kcut)
+                {
+                    continue;
+                }
+                if (nd_tot >= nalloc)
+                {
+                    nalloc = over_alloc_small(nd_tot + 1);
+                    srenew(delta, nalloc);
+                    srenew(fc->w, nalloc);
+                }
+                copy_ivec(nd, delta[nd_tot]);
+                fc->w[nd_tot] = shs_window_ft(norm(dk), fade, rmax, inv_width)/det(box);
+                wsum         += fc->w[nd_tot];
+                nd_tot++;
+            }
+        }
+    }
+    fc->ndelta = nd_tot;
+
+    /* The distinct k = q + offset */
+    snew(keys, nqv*nd_tot);
+    for (v = 0; v < nqv; v++)
+    {
+        for (i = 0; i < nd_tot; i++)
+        {
+            ivec_add(nq[v], delta[i], n);
+            keys[v*nd_tot+i] = shs_lattice_key(n);
+        }
+    }
+    snew(uniq, nqv*nd_tot);
+    memcpy(uniq, keys, nqv*nd_tot*sizeof(*keys));
+    qsort(uniq, nqv*nd_tot, sizeof(*uniq), shs_key_comp);
+    fc->nk = 0;
+    for (i = 0; i < nqv*nd_tot; i++)
+    {
+        if (fc->nk == 0 || uniq[i] != uniq[fc->nk-1])
+        {
+            uniq[fc->nk++] = uniq[i];
+        }
+    }
+    snew(fc->kind, nqv*nd_tot);
+    for (i = 0; i < nqv*nd_tot; i++)
+    {
+        fc->kind[i] = (gmx_int64_t *)bsearch(&keys[i], uniq, fc->nk, sizeof(*uniq), shs_key_comp) - uniq;
+    }
+    snew(kvec, fc->nk);
+    snew(fc->kn, fc->nk);
+    for (j = 0; j < fc->nk; j++)
+    {
+        key   = uniq[j];
+        n[ZZ] = (int)(key & ((1 << 21) - 1)) - SHS_KEY_OFFSET;
+        n[YY] = (int)((key >> 21) & ((1 << 21) - 1)) - SHS_KEY_OFFSET;
+        n[XX] = (int)(key >> 42) - SHS_KEY_OFFSET;
+        copy_ivec(n, fc->kn[j]);
+        for (d = 0; d < DIM; d++)
+        {
+            kvec[j][d] = 2*M_PI*(invbox[d][XX]*n[XX] + invbox[d][YY]*n[YY] + invbox[d][ZZ]*n[ZZ]);
+        }
+    }
+    init_qvec_soa(&fc->ksoa, fc->nk, kvec);
+    fc->c1 = qloop_snew(fc->nk);
+    fc->s1 = qloop_snew(fc->nk);
+    fc->c2 = qloop_snew(fc->nk);
+    fc->s2 = qloop_snew(fc->nk);
+    fprintf(stderr, "Fading as a convolution over %d offsets within %g nm^-1, %d wave vectors;"
+            " sum of the window weights %g (1 without truncation)\n",
+            nd_tot, kcut, fc->nk, wsum);
+
+    sfree(kvec);
+    sfree(uniq);
+    sfree(keys);
+    sfree(delta);
+    sfree(nq);
+
+    return TRUE;
+}
+
+/* Returns in acc the windowed sum for each of the nqv q vectors from the
+ * plane-wave sums (c1, s1) and (c2, s2) over the wave vectors of fc,
+ * which are the same arrays for the auto term.
+ */
+static void shs_fadeconv_apply(const t_shs_fadeconv *fc, int nqv, const real *c1,
+                               const real *s1, const real *c2, const real *s2, real *acc)
+{
+    int  v, d, k;
+    real sum;
+
+    for (v = 0; v < nqv; v++)
+    {
+        sum = 0;
+        for (d = 0; d < fc->ndelta; d++)
+        {
+            k    = fc->kind[v*fc->ndelta+d];
+            sum += fc->w[d]*(c1[k]*c2[k] + s1[k]*s2[k]);
+        }
+        acc[v] = sum;
+    }
+}
+
+static void done_shs_fadeconv(t_shs_fadeconv *fc)
+{
+    done_qvec_soa(&fc->ksoa);
+    sfree(fc->w);
+    sfree(fc->kind);
+    sfree(fc->kn);
+    qloop_sfree(fc->c1);
+    qloop_sfree(fc->s1);
+    qloop_sfree(fc->c2);
+    qloop_sfree(fc->s2);
+}
+
+/* Sets cacc and sacc to the real and imaginary part of the density with
+ * weights w of the n molecules at x[index] for the nm lattice vectors m,
+ * evaluated on the grid sg. The phase left by the interpolation cancels
+ * in the products of densities that make up the intensities.
+ */
+static void shs_grid_cossin(t_sqgrid *sg, matrix box, int n, rvec x[], const atom_id *index,
+                            const real w[], int nm, ivec m[], real *cacc, real *sacc)
+{
+    int v;
+
+    sqgrid_spread_fft(sg, box, n, x, index, w);
+    for (v = 0; v < nm; v++)
+    {
+        sqgrid_rho(sg, m[v], &cacc[v], &sacc[v]);
+    }
+}
+
+/* Writes the legends of the ng*npol sets of a block of the S(q) output,
+ * starting at set s0, as the term followed by the channel name and, for
+ * several groups, the group name
+ */
+static void shs_pol_legend(FILE *fp, int s0, const char *term, int ng, int npol,
+                           char polname[][DIM+1], char **grpname)
+{
+    int c, g;
+
+    for (c = 0; c < npol; c++)
+    {
+        for (g = 0; g < ng; g++)
+        {
+            fprintf(fp, "@    s%d legend \"%s %s", s0 + c*ng + g, term, polname[c]);
+            if (ng > 1)
+            {
+                fprintf(fp, " %s", grpname[g+1]);
+            }
+            fprintf(fp, "\"\n");
+        }
+    }
+}
+
+/* Writes the block-averaged total and coherent intensity of the first
+ * group of each of the npol polarization channels with errors to fn.
+ * The accumulator columns are laid out as in shs_accumulate().
+ */
+static void shs_write_err(const char *fn, const t_sqaccum *acc, int ng, int npol,
+                          char polname[][DIM+1], int nbinq, const real *arr_q,
+                          const output_env_t oenv)
+{
+    const char *term[] = { "total", "coherent" };
+    char        buf[2*PAIRSUM_MAXCHAN][32];
+    const char *legend[2*PAIRSUM_MAXCHAN];
+    int         col0[2*PAIRSUM_MAXCHAN], c, k;
+
+    for (c = 0; c < npol; c++)
+    {
+        for (k = 0; k < 2; k++)
+        {
+            col0[2*c+k] = (k*npol + c)*ng*nbinq;
+            if (npol > 1)
+            {
+                sprintf(buf[2*c+k], "%s %s", term[k], polname[c]);
+                legend[2*c+k] = buf[2*c+k];
+            }
+            else
+            {
+                legend[2*c+k] = term[k];
+            }
+        }
+    }
+    sqaccum_write_xvg(acc, fn, "ESHS", "S(q)", nbinq, arr_q, 2*npol, col0, legend, 0, oenv);
+}
+
+/* Passes the contributions of the last frame at time t in s_method,
+ * s_method_coh and s_method_incoh, with its inverse volume, to the
+ * accumulator and clears them. s_method has npol*ng sets, set c*ng+g for
+ * channel c and group g, s_method_incoh npol values. When this completes
+ * a block, the intermediate intensity with errors and the checkpoint are
+ * written.
+ */
+static void shs_accumulate(t_sqaccum *acc, double *val, real **s_method, real **s_method_coh,
+                           real *s_method_incoh, real invvol, real t, int ng, int npol,
+                           char polname[][DIM+1], int nbinq,
+                           const real *arr_q, const char *fnERR, const char *fnCPO,
+                           const output_env_t oenv)
+{
+    int g, qq, c, nset;
+
+    nset = npol*ng;
+    for (g = 0; g < nset; g++)
+    {
+        for (qq = 0; qq < nbinq; qq++)
+        {
+            val[g*nbinq+qq]        = s_method[g][qq];
+            val[(nset+g)*nbinq+qq] = s_method_coh[g][qq];
+            s_method[g][qq]        = 0;
+            s_method_coh[g][qq]    = 0;
+        }
+    }
+    for (c = 0; c < npol; c++)
+    {
+        val[2*nset*nbinq+c] = s_method_incoh[c];
+        s_method_incoh[c]   = 0;
+    }
+    val[2*nset*nbinq+npol] = invvol;
+    if (!sqaccum_add(acc, val, 1, t))
+    {
+        return;
+    }
+    if (fnERR)
+    {
+        shs_write_err(fnERR, acc, ng, npol, polname, nbinq, arr_q, oenv);
+    }
+    if (fnCPO)
+    {
+        sqaccum_write(acc, "nonlinearopticalscattering", fnCPO);
+    }
+}
+
 static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
                    const char *fnSFACT, const char *fnOSRDF, const char *fnORDF, const char *fnOTHETA,
+                   const char *fnERR, const char *fnCPI, const char *fnCPO, int nblock,
                    const char *method,
                    gmx_bool bPBC, gmx_bool bNormalize, gmx_bool bKleinmannsymm, gmx_bool bSpectrum, gmx_bool bCross,
-                   real maxq,  int nbinq, real kx, real ky, real kz, 
+                   real maxq,  int nbinq, real kx, real ky, real kz,
+                   gmx_bool bQshell, const char *fnQVEC, const char *polstr,
                    int p_out, int p_in1, int p_in2 ,real binwidth,
-                   real faderatio, real faderdf, int *isize, int  *molindex[], char **grpname, int ng,
-                   const output_env_t oenv,gmx_bool bGPU,gmx_bool bFADE)
+                   real faderatio, real faderdf, int nfadek, int nrecur, int nthreads,
+                   real fspacing, int gridorder, int *isize, int  *molindex[], char **grpname, int ng,
+                   const output_env_t oenv,gmx_bool bGPU,gmx_bool bFADE,
+                   const char *fnBETA)
 {
     FILE          *fp;
     FILE          *fpn;
-    t_trxstatus   *status;
+    t_trxprefetch *status;
     char           outf1[STRLEN], outf2[STRLEN];
     char           title[STRLEN], gtitle[STRLEN], refgt[30];
     int            g, natoms, i, j, k, nbin, qq, n, nframes;
     int          **count;
     real         **s_method, **s_method_coh, *s_method_nospectrum, *temp_method, temp_method_0 ,*s_method_coh_nospectrum, s_method_coh_temp = 0.0;
     real         **s_method_g_r,  *arr_q, qel, minq;
-    real          *cos_q, *sin_q, *cos_q2, *sin_q2, ***beta_mol, *beta_mol_1d, *beta_lab, beta_lab_i, *beta_lab_t2, s_method_incoh = 0.0, beta_lab_sq_t = 0.0, beta_lab_1 = 0.0, beta_lab_2;
+    real          *cos_q, *sin_q, *cos_q2, *sin_q2, ***beta_mol, *beta_mol_1d, *beta_lab, beta_lab_i, *beta_lab_t2, *s_method_incoh, beta_lab_sq_t = 0.0, beta_lab_1 = 0.0, beta_lab_2;
     int            nrdf = 0, max_i, isize0, *ind0;
     real           t, rmax2, rmax,  r, r_dist, r2, q_xi, dq, invhbinw, normfac, norm_x, norm_z, mod_f, inv_width, bl = 0.0,  bsq = 0.0;
     real           segvol, spherevol, prev_spherevol, **rdf, invsize0;
-    rvec          *x, dx,  *x_i1, xi, xj ,x01, x02, *arr_qvec, qvec_0 ,pol_out, pol_in1, pol_in2; 
-    real          *inv_segvol, invvol, invvol_sum, rho, *ftheta, temp, fade;
+    rvec          *x, dx,  *x_i1, xi, xj ,x01, x02, *arr_qvec, qvec_0 ,pol_out, pol_in1, pol_in2, kvec; 
+    real          *inv_segvol, invvol, invvol_sum, rho, *ftheta, temp, fade, rmax2_frame;
     matrix         box, box_pbc;
     int            ePBC = -1, ePBCrdf = -1;
     t_block       *mols = NULL;
@@ -96,6 +778,30 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
     t_pbc          pbc, *pbc_var;
     gmx_rmpbc_t    gpbc = NULL;
     int            mol, a;
+    t_qvec_soa     qsoa;
+    int            nqv, v, *qbin = NULL;
+    real          *qw = NULL, *arr_qnorm;
+    t_pairsum     *ps = NULL;
+    t_shs_fadeconv fc;
+    gmx_bool       bFadeConv = FALSE;
+    double         cost_pair, cost_pw;
+    t_molframes    mf;
+    t_molbeta     *mb  = NULL;
+    int            nmb = 0;
+    t_sqaccum      acc;
+    double        *acc_val;
+    rvec           unit_x = {1, 0, 0}, unit_z = {0, 0, 1};
+    int            npol, nset, c;
+    ivec           pol[PAIRSUM_MAXCHAN];
+    char           polname[PAIRSUM_MAXCHAN][DIM+1];
+    real         **beta_pol, **temp_pol, **cos_pol, **sin_pol, w_pol[PAIRSUM_MAXCHAN];
+    t_sqgrid       sg;
+    gmx_bool       bGrid;
+    ivec          *qm = NULL, *gm, ngrid;
+    int            ngm, d;
+    matrix         invbox;
+    rvec           gq;
+    real           gqmax;
 
     atom = top->atoms.atom;
     mols = &(top->mols);
@@ -103,7 +809,7 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
     invsize0 = 1.0/isize0;
     snew(ind0,isize0);
     fprintf(stderr,"\nAbout to read trajectory\n");
-    natoms = read_first_x(oenv, &status, fnTRX, &t, &x, box);
+    natoms = read_first_x_prefetch(oenv, &status, fnTRX, &t, &x, box);
        
     fprintf(stderr,"\nNumber of Atoms %d\n",natoms);
     fprintf(stderr,"\nNumber of Molecules %d\n",isize0);
@@ -155,10 +861,49 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
     invhbinw = 2.0 / binwidth;
     rmax     = sqrt(rmax2);
 
+    /* The polarization channels are evaluated in the same pass, their
+     * intensities are kept in set c*ng+g of s_method and s_method_coh
+     */
+    if (polstr != NULL && polstr[0] != '\0')
+    {
+        npol = shs_parse_pol(polstr, pol, polname);
+        if (npol > 1 && bCross)
+        {
+            gmx_fatal(FARGS, "-cross can not be combined with several polarization channels");
+        }
+        if (npol > 1 && fnOTHETA)
+        {
+            gmx_fatal(FARGS, "S(theta) can only be computed for a single polarization channel");
+        }
+        p_out = pol[0][0];
+        p_in1 = pol[0][1];
+        p_in2 = pol[0][2];
+    }
+    else
+    {
+        npol = 1;
+        if (p_out < 0 || p_out >= DIM || p_in1 < 0 || p_in1 >= DIM || p_in2 < 0 || p_in2 >= DIM)
+        {
+            gmx_fatal(FARGS, "The polarizations should be 0, 1 or 2, not %d %d %d", p_out, p_in1, p_in2);
+        }
+        pol[0][0] = p_out;
+        pol[0][1] = p_in1;
+        pol[0][2] = p_in2;
+        sprintf(polname[0], "%c%c%c", 'X'+p_out, 'X'+p_in1, 'X'+p_in2);
+    }
+    nset = npol*ng;
+    fprintf(stderr, "Computing %d polarization channel%s:", npol, npol > 1 ? "s" : "");
+    for (c = 0; c < npol; c++)
+    {
+        fprintf(stderr, " %s", polname[c]);
+    }
+    fprintf(stderr, "\n");
+
     snew(count, ng);
     snew(ftheta, 101);
-    snew(s_method, ng);
-    snew(s_method_coh, ng);
+    snew(s_method, nset);
+    snew(s_method_coh, nset);
+    snew(s_method_incoh, npol);
     snew(s_method_nospectrum, ng);
     snew(s_method_coh_nospectrum, ng);
     snew(s_method_g_r, ng);
@@ -209,16 +954,9 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
     {
         /* this is THE array */
         snew(count[g], nbin+1);
-        /*allocate memory for s_method array */
-        snew(s_method[g], nbinq);
-        snew(s_method_coh[g], nbinq);
         snew(s_method_g_r[g], nbinq);
         snew(arr_q,nbinq);
         snew(arr_qvec,nbinq);
-        snew(cos_q,nbinq);
-        snew(sin_q,nbinq);
-        snew(cos_q2,nbinq);
-        snew(sin_q2,nbinq);
         if ((kx != 0.0 && abs(kx) != 1.0 ) || ( ky != 0.0 && abs(ky) != 1.0) || ( kz != 0.0 && abs(kz) != 1.0))
         {
           gmx_fatal(FARGS,"qx, qy, or qz have to be equal to 1 or 0 qx=%f qy=%f qz=%f\n",kx,ky,kz);
@@ -276,87 +1014,259 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
             arr_qvec[qq][ZZ] = arr_q[qq]*kz;
         }
     }
+    /*allocate memory for s_method array */
+    for (g = 0; g < nset; g++)
+    {
+        snew(s_method[g], nbinq);
+        snew(s_method_coh[g], nbinq);
+    }
     copy_rvec(arr_qvec[0],qvec_0);
+    kvec[XX] = kx;
+    kvec[YY] = ky;
+    kvec[ZZ] = kz;
+    /* The loops below evaluate nqv q vectors per frame, vector v adds
+     * with weight qw[v] to the output bin qbin[v]. Without shells these
+     * are the nbinq points along kvec.
+     */
+    if (bQshell || fnQVEC)
+    {
+        sfree(arr_qvec);
+        arr_qvec = NULL;
+        nqv      = shs_qshells(fnQVEC, box, maxq, &nbinq, &arr_q, &arr_qvec, &qbin, &qw);
+        for (g = 0; g < nset; g++)
+        {
+            sfree(s_method[g]);
+            sfree(s_method_coh[g]);
+            snew(s_method[g], nbinq);
+            snew(s_method_coh[g], nbinq);
+        }
+        for (g = 0; g < ng; g++)
+        {
+            sfree(s_method_g_r[g]);
+            snew(s_method_g_r[g], nbinq);
+        }
+        if (nrecur > 0)
+        {
+            fprintf(stderr,"Note: the q recurrence needs a uniform q grid, it is not used with q shells\n");
+            nrecur = 0;
+        }
+    }
+    else
+    {
+        nqv = nbinq;
+        snew(qbin, nqv);
+        snew(qw, nqv);
+        for (v = 0; v < nqv; v++)
+        {
+            qbin[v] = v;
+            qw[v]   = 1;
+        }
+    }
+    /* |q| of the output bins */
+    snew(arr_qnorm, nbinq);
+    for (qq = 0; qq < nbinq; qq++)
+    {
+        arr_qnorm[qq] = (bQshell || fnQVEC) ? arr_q[qq] : norm(arr_qvec[qq]);
+    }
+    if (nrecur > 0)
+    {
+        fprintf(stderr,"q loops use the angle-addition recurrence, re-seeded every %d q points\n", nrecur);
+    }
+    /* q vectors and accumulators laid out for the SIMD q-loop kernels */
+    init_qvec_soa(&qsoa, nqv, arr_qvec);
+    temp_method = qloop_snew(nqv);
+    cos_q       = qloop_snew(nqv);
+    sin_q       = qloop_snew(nqv);
+    cos_q2      = qloop_snew(nqv);
+    sin_q2      = qloop_snew(nqv);
+    /* The grid method is sumexp with the densities from an FFT */
+    bGrid = (method[0] == 'g');
+    if (bGrid)
+    {
+        method = "sumexp";
+    }
+    /* With fading, sumexp applies the window as a convolution over
+     * wave vectors, which needs commensurate q vectors
+     */
+    if (bFADE && method[0] != 'm')
+    {
+        bFadeConv = init_shs_fadeconv(&fc, box, nqv, arr_qvec, fade, rmax, inv_width, nfadek);
+        if (!bFadeConv && method[0] == 's')
+        {
+            gmx_fatal(FARGS, "Fading with the sumexp method needs q vectors on the reciprocal lattice of the box, use -qshell or -qvec");
+        }
+    }
+    if (method[0] == 'a')
+    {
+        /* Estimated number of q-loop terms per molecule group and frame:
+         * pairs times q vectors for modsumexp, molecules times wave
+         * vectors for sumexp
+         */
+        cost_pair = 0.5*isize0*(double)isize0*nqv;
+        cost_pw   = (double)isize0*(bFadeConv ? fc.nk : nqv)*(bCross ? 2 : 1);
+        /* Only with fading do both methods compute the same quantity, so
+         * only then choose by cost. Without fading keep modsumexp, the
+         * default, unless the cross term is asked for, which modsumexp
+         * only has with fading.
+         */
+        if (bFADE ? (!bFadeConv || cost_pair < cost_pw) : !bCross)
+        {
+            method = "modsumexp";
+            if (bFadeConv)
+            {
+                done_shs_fadeconv(&fc);
+                bFadeConv = FALSE;
+            }
+        }
+        else
+        {
+            method = "sumexp";
+        }
+        if (bFADE)
+        {
+            fprintf(stderr, "Estimated cost %g terms per frame for modsumexp, %g for sumexp: using %s\n",
+                    cost_pair, cost_pw, method);
+        }
+        else
+        {
+            fprintf(stderr, "Without fading the methods differ, using %s\n", method);
+        }
+    }
+    /* Per channel lab-frame beta and q-loop sums, the plane-wave sums run
+     * over the wave vectors of the fading convolution when that is used
+     */
+    snew(beta_pol, npol);
+    snew(temp_pol, npol);
+    snew(cos_pol, npol);
+    snew(sin_pol, npol);
+    for (c = 0; c < npol; c++)
+    {
+        snew(beta_pol[c], isize0);
+        temp_pol[c] = qloop_snew(nqv);
+        cos_pol[c]  = qloop_snew(bFadeConv ? fc.nk : nqv);
+        sin_pol[c]  = qloop_snew(bFadeConv ? fc.nk : nqv);
+    }
+    if (bGrid)
+    {
+        /* The densities are needed at the wave vectors of the convolution
+         * with fading, at the q vectors otherwise
+         */
+        if (bFadeConv)
+        {
+            ngm = fc.nk;
+            gm  = fc.kn;
+        }
+        else
+        {
+            snew(qm, nqv);
+            if (!shs_lattice_index(box, nqv, arr_qvec, qm))
+            {
+                gmx_fatal(FARGS, "The grid method needs q vectors on the reciprocal lattice of the box, use -qshell or -qvec");
+            }
+            ngm = nqv;
+            gm  = qm;
+        }
+        m_inv_ur0(box, invbox);
+        gqmax = 0;
+        for (v = 0; v < ngm; v++)
+        {
+            for (d = 0; d < DIM; d++)
+            {
+                gq[d] = 2*M_PI*(invbox[d][XX]*gm[v][XX] + invbox[d][YY]*gm[v][YY] + invbox[d][ZZ]*gm[v][ZZ]);
+            }
+            gqmax = max(gqmax, norm(gq));
+        }
+        sqgrid_size(stderr, box, fspacing, gqmax, ngrid);
+        nthreads = min((nthreads <= 0) ? INT_MAX : nthreads, gmx_omp_get_max_threads());
+        init_sqgrid(&sg, ngrid, gridorder, nthreads);
+        for (v = 0; v < ngm; v++)
+        {
+            if (!sqgrid_has(&sg, gm[v]))
+            {
+                gmx_fatal(FARGS, "Lattice vector %d %d %d is beyond the Nyquist limit of the %d x %d x %d grid, decrease -fspacing",
+                          gm[v][XX], gm[v][YY], gm[v][ZZ], ngrid[XX], ngrid[YY], ngrid[ZZ]);
+            }
+        }
+        fprintf(stderr, "Evaluating the densities at %d wave vectors on a %d x %d x %d grid with B-splines of order %d\n",
+                ngm, ngrid[XX], ngrid[YY], ngrid[ZZ], gridorder);
+    }
+    if (method[0] == 'm' && bCross == FALSE)
+    {
+        nthreads = min((nthreads <= 0) ? INT_MAX : nthreads, gmx_omp_get_max_threads());
+        ps       = init_pairsum(stderr, bGPU ? epairsumACCEL : epairsumCPU, nthreads, isize0, npol,
+                                &qsoa, bFADE, fade, inv_width);
+        pairsum_set_recurrence(ps, kvec, minq, dq, nrecur);
+    }
 
 
     snew(x_i1, max_i);
-    nframes    = 0;
-    invvol_sum = 0;
-    //if (bPBC && (NULL != top))
-    //{
-    //    gpbc = gmx_rmpbc_init(&top->idef, ePBC, natoms);
-    //}
-    //dump_pbc(stderr,&pbc);
+    init_molframes(&mf);
+    if (fnBETA)
+    {
+        nmb = read_molbeta(fnBETA, &mb);
+        molframes_set_types(&mf, nmb, mb, &top->atoms);
+        fprintf(stderr, "Using the frames and hyperpolarizabilities of %d molecule types from %s\n",
+                nmb, fnBETA);
+    }
+    rmax2_frame = rmax2;
+    /* The loops below leave the contributions of each frame in s_method,
+     * s_method_coh and s_method_incoh, the sums over frames are kept in acc
+     */
+    init_sqaccum(&acc, 2*nset*nbinq + npol + 1, 0, nblock);
+    snew(acc_val, acc.ncol);
+    sqaccum_set_grid(&acc, bGrid ? "grid" : method, DIM*nqv, arr_qvec[0]);
+    if (fnCPI)
+    {
+        sqaccum_read(&acc, "nonlinearopticalscattering", fnCPI);
+        fprintf(stderr, "Continuing from %d frames in %s, skipping frames up to time %g\n",
+                acc.nframes, fnCPI, acc.tlast);
+        while (t <= acc.tlast)
+        {
+            if (!read_next_x_prefetch(status, &t, x, box))
+            {
+                gmx_fatal(FARGS, "The trajectory has no frames after time %g, the last frame in %s",
+                          acc.tlast, fnCPI);
+            }
+        }
+    }
+    /* Molecules are not made whole, all intramolecular vectors use pbc_dx */
     if (method[0] == 'm' && bSpectrum == TRUE && bFADE == FALSE && bCross == FALSE)
     {
        fprintf(stderr,"modified direct method (modsumexp)\n");
        do
        {
-//            copy_mat(box, box_pbc);
-//            if (top != NULL)
-//             {
-//                gmx_rmpbc(gpbc, natoms, box, x);
-//             }
-//            set_pbc(&pbc, ePBCrdf, box_pbc);
-//
-//            invvol      = 1/det(box_pbc);
-//            invvol_sum += invvol;
+            invvol      = shs_frame_pbc(&pbc, ePBCrdf, bPBC, box, box_pbc, rmax2, &rmax2_frame);
             for (g = 0; g < ng; g++)
             {
-                beta_lab_sq_t = 0.0;
-                snew(temp_method, nbinq);
+                calc_molframes(&mf, &pbc, isize0, ind0, x, norm_x, norm_z);
+                shs_contract_pol(&mf, beta_mol, npol, pol, beta_pol);
                 for (i = 0; i < isize0; i++)
                 {
                     copy_rvec(x[ind0[i]], x_i1[i]);
-                    pbc_dx(&pbc, x_i1[i], x[ind0[i]+1], x01);
-                    pbc_dx(&pbc, x_i1[i], x[ind0[i]+2], x02);
-                    beta_lab[i] = rotate_beta(norm_x, norm_z, x01, x02, pol_out, pol_in1, pol_in2, beta_mol_1d );
-                    beta_lab_sq_t += sqr(beta_lab[i]);
-                }
-  
-                if (bGPU) {
-                   if (nframes==0) fprintf(stderr,"*************** GPU Acceleration ***************\n");
- //                   double_sum(&pbc,beta_lab,x_i1,isize0,rmax2,arr_qvec,nbinq,temp_method);
-                }
-
-                else {  
-                      
-                      for (i = 0; i < isize0 -1.0; i++) 
-                      {
-                          copy_rvec(x_i1[i],xi);
-                          beta_lab_i = beta_lab[i];
-                         
-
-                          for (j = i + 1; j < isize0 ; j++)
-                          { 
-                              temp=0; 
-
-                              pbc_dx_aiuc(&pbc, xi, x_i1[j], dx);
-                              r2 = iprod(dx, dx);
-                              if (r2 > 0 && r2 <= rmax2 )
-                              {
-                                  mod_f = beta_lab_i*beta_lab[j]  ; 
-      
-                                  for (qq = 0; qq < nbinq; qq++)
-                                  { 
-                                     temp=mod_f*cos(iprod(arr_qvec[qq],dx));
-                                     temp_method[qq] += mod_f*cos(iprod(arr_qvec[qq],dx));
-                                  }
-                              }
-                          }                      
-                     }
                 }
-                s_method_incoh += beta_lab_sq_t*invsize0 ;
-                for (qq = 0; qq < nbinq; qq++)
+                /* One pass over the pairs for all channels */
+                pairsum_calc_multi(ps, &pbc, isize0, x_i1, npol, (const real **)beta_pol,
+                                   rmax2_frame, temp_pol);
+                for (c = 0; c < npol; c++)
                 {
-                   s_method_coh[g][qq] += 2.0*temp_method[qq]*invsize0 ;
-                   s_method[g][qq] += (2.0*temp_method[qq] + beta_lab_sq_t)*invsize0 ;
+                    beta_lab_sq_t = 0.0;
+                    for (i = 0; i < isize0; i++)
+                    {
+                        beta_lab_sq_t += sqr(beta_pol[c][i]);
+                    }
+                    s_method_incoh[c] += beta_lab_sq_t*invsize0 ;
+                    for (v = 0; v < nqv; v++)
+                    {
+                       qq = qbin[v];
+                       s_method_coh[c*ng+g][qq] += qw[v]*2.0*temp_pol[c][v]*invsize0 ;
+                       s_method[c*ng+g][qq] += qw[v]*(2.0*temp_pol[c][v] + beta_lab_sq_t)*invsize0 ;
+                    }
                 }
-                sfree(temp_method);
             }
-            nframes++;
+            shs_accumulate(&acc, acc_val, s_method, s_method_coh, s_method_incoh, invvol, t,
+                           ng, npol, polname, nbinq, arr_qnorm, fnERR, fnCPO, oenv);
         }
-        while (read_next_x(oenv, status, &t, x, box));
+        while (read_next_x_prefetch(status, &t, x, box));
     }
 
     else if (method[0] == 'm' && bSpectrum == TRUE && bFADE == TRUE && bCross == FALSE)
@@ -364,77 +1274,38 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
        fprintf(stderr,"modified direct method (modsumexp) with fading and spectrum\n");
        do
        {
-//            copy_mat(box, box_pbc);
-//           if (top != NULL)
-//           {
-//                gmx_rmpbc(gpbc, natoms, box, x);
-//            }
-//            set_pbc(&pbc, ePBCrdf, box_pbc);
-//
-//            invvol      = 1/det(box_pbc);
-//            invvol_sum += invvol;
+            invvol      = shs_frame_pbc(&pbc, ePBCrdf, bPBC, box, box_pbc, rmax2, &rmax2_frame);
             for (g = 0; g < ng; g++)
             {
-                beta_lab_sq_t = 0.0;
-                snew(temp_method, nbinq);
+                calc_molframes(&mf, &pbc, isize0, ind0, x, norm_x, norm_z);
+                shs_contract_pol(&mf, beta_mol, npol, pol, beta_pol);
                 for (i = 0; i < isize0; i++)
                 {
                     copy_rvec(x[ind0[i]], x_i1[i]);
-                    pbc_dx_aiuc(&pbc, x_i1[i], x[ind0[i]+1], x01);
-                    pbc_dx_aiuc(&pbc, x_i1[i], x[ind0[i]+2], x02);
-                    beta_lab[i] = rotate_beta(norm_x, norm_z, x01, x02, pol_out, pol_in1, pol_in2, beta_mol_1d );
-                    beta_lab_sq_t += sqr(beta_lab[i]);
                 }
-
-
-                if (bGPU) {
-                   if (nframes==0) fprintf(stderr,"*************** GPU Acceleration ***************\n");
-//                   double_sum_fade(&pbc,beta_lab,x_i1,isize0,rmax2,arr_qvec,nbinq,fade,inv_width,temp_method);
-                }
-
-                else {
-                    for (i = 0; i < isize0 -1.0; i++)
+                /* One pass over the pairs for all channels */
+                pairsum_calc_multi(ps, &pbc, isize0, x_i1, npol, (const real **)beta_pol,
+                                   rmax2_frame, temp_pol);
+                for (c = 0; c < npol; c++)
+                {
+                    beta_lab_sq_t = 0.0;
+                    for (i = 0; i < isize0; i++)
                     {
-                        copy_rvec(x_i1[i], xi);
-                        beta_lab_i = beta_lab[i];
-                        for (j = i + 1; j < isize0 ; j++)
-                        {
-                            pbc_dx_aiuc(&pbc, xi, x_i1[j], dx);
-                            r2 = iprod(dx, dx);
-                            if (r2 <= rmax2 )
-                            {
-                                r_dist = sqrt(r2);
-                                if (r_dist <= fade)
-                                {
-                                    mod_f = beta_lab_i*beta_lab[j]  ;
-                                    for (qq = 0; qq < nbinq; qq++)
-                                    {
-                                       temp_method[qq] += mod_f*cos(iprod(dx,arr_qvec[qq]));
-                                    }
-                                }
-                                else
-                                {
-                                    mod_f = beta_lab[i]*beta_lab[j]*sqr(cos((r_dist-fade)*inv_width)) ;
-                                    for (qq = 0; qq < nbinq; qq++)
-                                    {
-                                       temp_method[qq] += mod_f*cos(iprod(dx,arr_qvec[qq]));
-                                    }
-                                }
-                            }
-                        }
+                        beta_lab_sq_t += sqr(beta_pol[c][i]);
+                    }
+                    s_method_incoh[c] += beta_lab_sq_t*invsize0 ;
+                    for (v = 0; v < nqv; v++)
+                    {
+                       qq = qbin[v];
+                       s_method_coh[c*ng+g][qq] += qw[v]*2.0*temp_pol[c][v]*invsize0 ;
+                       s_method[c*ng+g][qq] += qw[v]*(2.0*temp_pol[c][v] + beta_lab_sq_t)*invsize0 ;
                     }
                 }
-                s_method_incoh += beta_lab_sq_t*invsize0 ;
-                for (qq = 0; qq < nbinq; qq++)
-                {
-                   s_method_coh[g][qq] += 2.0*temp_method[qq]*invsize0 ;
-                   s_method[g][qq] += (2.0*temp_method[qq] + beta_lab_sq_t)*invsize0 ;
-                }
-                sfree(temp_method);
             }
-            nframes++;
+            shs_accumulate(&acc, acc_val, s_method, s_method_coh, s_method_incoh, invvol, t,
+                           ng, npol, polname, nbinq, arr_qnorm, fnERR, fnCPO, oenv);
         }
-        while (read_next_x(oenv, status, &t, x, box));
+        while (read_next_x_prefetch(status, &t, x, box));
     }
 
     else if (method[0] == 'm' && bSpectrum == TRUE && bFADE == TRUE && bCross == TRUE)
@@ -442,28 +1313,22 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
        fprintf(stderr,"modified direct method (modsumexp) cross term with fading and spectrum\n");
        do
        {
-//            copy_mat(box, box_pbc);
-//            if (top != NULL)
-//            {
-//                gmx_rmpbc(gpbc, natoms, box, x);
-//            }
-//            set_pbc(&pbc, ePBCrdf, box_pbc);
-
-//            invvol      = 1/det(box_pbc);
-//            invvol_sum += invvol;
+            invvol      = shs_frame_pbc(&pbc, ePBCrdf, bPBC, box, box_pbc, rmax2, &rmax2_frame);
             for (g = 0; g < ng; g++)
             {
                 beta_lab_sq_t = 0.0;
-                snew(temp_method, nbinq);
+                for (v = 0; v < nqv; v++)
+                {
+                    temp_method[v] = 0;
+                }
+                /* beta_lab holds the x and beta_lab_t2 the z component of the induced dipole */
+                calc_molframes(&mf, &pbc, isize0, ind0, x, norm_x, norm_z);
+                molframes_contract(&mf, beta_mol, unit_x, pol_in1, pol_in2, beta_lab);
+                molframes_contract(&mf, beta_mol, unit_z, pol_in1, pol_in2, beta_lab_t2);
                 for (i = 0; i < isize0; i++)
                 {
                     copy_rvec(x[ind0[i]], x_i1[i]);
-                    pbc_dx(&pbc, x_i1[i], x[ind0[i]+1], x01);
-                    pbc_dx(&pbc, x_i1[i], x[ind0[i]+2], x02);
-                    rotate_beta_theta(norm_x, norm_z, x01, x02, pol_in1, pol_in2, beta_mol_1d, &beta_lab_2, &beta_lab_1 );
-                    beta_lab_sq_t += beta_lab_1*beta_lab_2;
-                    beta_lab[i] = beta_lab_1;
-                    beta_lab_t2[i] = beta_lab_2;
+                    beta_lab_sq_t += beta_lab[i]*beta_lab_t2[i];
                 }
                 for (i = 0; i < isize0 -1.0; i++)
                 {
@@ -472,139 +1337,247 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
                     {
                         pbc_dx_aiuc(&pbc, xi, x_i1[j], dx);
                         r2 = iprod(dx, dx);
-                        if (r2 <= rmax2 )
+                        if (r2 <= rmax2_frame)
                         {
                             r_dist = sqrt(r2);
                             if (r_dist <= fade)
                             {
                                 mod_f = beta_lab[i]*beta_lab_t2[j] + beta_lab[j]*beta_lab_t2[i]  ;
-                                for (qq = 0; qq < nbinq; qq++)
-                                {
-                                   temp_method[qq] += mod_f*cos(iprod(arr_qvec[qq],dx));
-                                }
+                                shs_cos_qdx(&qsoa, kvec, minq, dq, nrecur, dx, mod_f, temp_method);
                             }
                             else
                             {
                                 mod_f = (beta_lab[i]*beta_lab_t2[j] + beta_lab[j]*beta_lab_t2[i])*sqr(cos((r_dist-fade)*inv_width)) ;
-                                for (qq = 0; qq < nbinq; qq++)
-                                {
-                                   temp_method[qq] += mod_f*cos(iprod(arr_qvec[qq],dx));
-                                }
+                                shs_cos_qdx(&qsoa, kvec, minq, dq, nrecur, dx, mod_f, temp_method);
                             }
                         }
                     }
                 }
-                s_method_incoh += beta_lab_sq_t*invsize0 ;
-                for (qq = 0; qq < nbinq; qq++)
+                s_method_incoh[0] += beta_lab_sq_t*invsize0 ;
+                for (v = 0; v < nqv; v++)
                 {
-                   s_method_coh[g][qq] += 2.0*temp_method[qq]*invsize0 ;
-                   s_method[g][qq] += (2.0*temp_method[qq] + beta_lab_sq_t)*invsize0 ;
+                   qq = qbin[v];
+                   s_method_coh[g][qq] += qw[v]*2.0*temp_method[v]*invsize0 ;
+                   s_method[g][qq] += qw[v]*(2.0*temp_method[v] + beta_lab_sq_t)*invsize0 ;
                 }
-                sfree(temp_method);
             }
-            nframes++;
+            shs_accumulate(&acc, acc_val, s_method, s_method_coh, s_method_incoh, invvol, t,
+                           ng, npol, polname, nbinq, arr_qnorm, fnERR, fnCPO, oenv);
         }
-        while (read_next_x(oenv, status, &t, x, box));
+        while (read_next_x_prefetch(status, &t, x, box));
+    }
+    else if (method[0] == 's' && bSpectrum == TRUE && bFADE == TRUE)
+    {
+        fprintf(stderr,"loop with sumexp method and fading%s\n", bCross ? ", cross term" : "");
+        do
+        {
+            invvol      = shs_frame_pbc(&pbc, ePBCrdf, bPBC, box, box_pbc, rmax2, &rmax2_frame);
+            for (g = 0; g < ng; g++)
+            {
+                calc_molframes(&mf, &pbc, isize0, ind0, x, norm_x, norm_z);
+                if (bCross)
+                {
+                    for (k = 0; k < fc.nk; k++)
+                    {
+                        fc.c1[k] = 0;
+                        fc.s1[k] = 0;
+                        fc.c2[k] = 0;
+                        fc.s2[k] = 0;
+                    }
+                    beta_lab_sq_t = 0.0;
+                    molframes_contract(&mf, beta_mol, unit_x, pol_in1, pol_in2, beta_lab);
+                    molframes_contract(&mf, beta_mol, unit_z, pol_in1, pol_in2, beta_lab_t2);
+                    if (bGrid)
+                    {
+                        for (i = 0; i < isize0; i++)
+                        {
+                            beta_lab_sq_t += beta_lab[i]*beta_lab_t2[i];
+                        }
+                        shs_grid_cossin(&sg, box, isize0, x, ind0, beta_lab, fc.nk, fc.kn, fc.c1, fc.s1);
+                        shs_grid_cossin(&sg, box, isize0, x, ind0, beta_lab_t2, fc.nk, fc.kn, fc.c2, fc.s2);
+                    }
+                    else
+                    {
+                        for (i = 0; i < isize0; i++)
+                        {
+                            copy_rvec(x[ind0[i]], xi);
+                            beta_lab_sq_t += beta_lab[i]*beta_lab_t2[i];
+                            qloop_cossin_qx(&fc.ksoa, xi, beta_lab[i], fc.c1, fc.s1);
+                            qloop_cossin_qx(&fc.ksoa, xi, beta_lab_t2[i], fc.c2, fc.s2);
+                        }
+                    }
+                    shs_fadeconv_apply(&fc, nqv, fc.c1, fc.s1, fc.c2, fc.s2, temp_method);
+                    s_method_incoh[0] += beta_lab_sq_t*invsize0;
+                    for (v = 0; v < nqv; v++)
+                    {
+                        qq = qbin[v];
+                        s_method[g][qq] += qw[v]*temp_method[v]*invsize0;
+                        s_method_coh[g][qq] += qw[v]*(temp_method[v] - beta_lab_sq_t)*invsize0;
+                    }
+                    continue;
+                }
+                for (c = 0; c < npol; c++)
+                {
+                    for (k = 0; k < fc.nk; k++)
+                    {
+                        cos_pol[c][k] = 0;
+                        sin_pol[c][k] = 0;
+                    }
+                }
+                shs_contract_pol(&mf, beta_mol, npol, pol, beta_pol);
+                if (bGrid)
+                {
+                    for (c = 0; c < npol; c++)
+                    {
+                        shs_grid_cossin(&sg, box, isize0, x, ind0, beta_pol[c], fc.nk, fc.kn, cos_pol[c], sin_pol[c]);
+                    }
+                }
+                else
+                {
+                    for (i = 0; i < isize0; i++)
+                    {
+                        copy_rvec(x[ind0[i]], xi);
+                        for (c = 0; c < npol; c++)
+                        {
+                            w_pol[c] = beta_pol[c][i];
+                        }
+                        qloop_cossin_qx_multi(&fc.ksoa, xi, npol, w_pol, cos_pol, sin_pol);
+                    }
+                }
+                for (c = 0; c < npol; c++)
+                {
+                    beta_lab_sq_t = 0.0;
+                    for (i = 0; i < isize0; i++)
+                    {
+                        beta_lab_sq_t += sqr(beta_pol[c][i]);
+                    }
+                    shs_fadeconv_apply(&fc, nqv, cos_pol[c], sin_pol[c], cos_pol[c], sin_pol[c], temp_pol[c]);
+                    s_method_incoh[c] += beta_lab_sq_t*invsize0;
+                    for (v = 0; v < nqv; v++)
+                    {
+                        qq = qbin[v];
+                        s_method[c*ng+g][qq] += qw[v]*temp_pol[c][v]*invsize0;
+                        s_method_coh[c*ng+g][qq] += qw[v]*(temp_pol[c][v] - beta_lab_sq_t)*invsize0;
+                    }
+                }
+            }
+            shs_accumulate(&acc, acc_val, s_method, s_method_coh, s_method_incoh, invvol, t,
+                           ng, npol, polname, nbinq, arr_qnorm, fnERR, fnCPO, oenv);
+        }
+        while (read_next_x_prefetch(status, &t, x, box));
     }
     else if (method[0] == 's' && bSpectrum == TRUE && bCross == FALSE)
     {   
         fprintf(stderr,"loop with sumexp method and spectrum\n");
         do
         {
-            copy_mat(box, box_pbc);
-            if (top != NULL)
-            {
-                gmx_rmpbc(gpbc, natoms, box, x);
-            }
-            set_pbc(&pbc, ePBCrdf, box_pbc);
-            invvol      = 1/det(box_pbc);
-            invvol_sum += invvol;
+            invvol      = shs_frame_pbc(&pbc, ePBCrdf, bPBC, box, box_pbc, rmax2, &rmax2_frame);
             for (g = 0; g < ng; g++)
             {
-                snew(cos_q,nbinq);
-                snew(sin_q,nbinq);
-                beta_lab_sq_t = 0.0;
-                for (i = 0; i < isize0; i++)
+                for (c = 0; c < npol; c++)
                 {
-                    copy_rvec(x[ind0[i]], xi);
-                    pbc_dx(&pbc, xi, x[ind0[i]+1], x01);
-                    pbc_dx(&pbc, xi, x[ind0[i]+2], x02);
-                    beta_lab[i] = rotate_beta(norm_x, norm_z, x01, x02, pol_out, pol_in1, pol_in2, beta_mol_1d );
-                    
-                    beta_lab_sq_t += sqr(beta_lab[i]);
-                    for (qq = 0; qq < nbinq; qq++)
+                    for (v = 0; v < nqv; v++)
                     {
-                        q_xi = iprod(arr_qvec[qq],xi);
-                        cos_q[qq] += beta_lab[i]*cos(q_xi);
-                        sin_q[qq] += beta_lab[i]*sin(q_xi);
+                        cos_pol[c][v] = 0;
+                        sin_pol[c][v] = 0;
                     }
                 }
-                s_method_incoh += beta_lab_sq_t*invsize0;
-                for (qq = 0; qq < nbinq; qq++)
+                calc_molframes(&mf, &pbc, isize0, ind0, x, norm_x, norm_z);
+                shs_contract_pol(&mf, beta_mol, npol, pol, beta_pol);
+                if (bGrid)
                 {
-                    s_method[g][qq] += (sqr(cos_q[qq]) + sqr(sin_q[qq]))*invsize0;
-                    s_method_coh[g][qq] += (sqr(cos_q[qq]) + sqr(sin_q[qq]) - beta_lab_sq_t)*invsize0;
+                    for (c = 0; c < npol; c++)
+                    {
+                        shs_grid_cossin(&sg, box, isize0, x, ind0, beta_pol[c], nqv, qm, cos_pol[c], sin_pol[c]);
+                    }
+                }
+                else
+                {
+                    /* One sin/cos per molecule and q for all channels */
+                    for (i = 0; i < isize0; i++)
+                    {
+                        copy_rvec(x[ind0[i]], xi);
+                        for (c = 0; c < npol; c++)
+                        {
+                            w_pol[c] = beta_pol[c][i];
+                        }
+                        shs_cossin_qx_multi(&qsoa, kvec, minq, dq, nrecur, xi, npol, w_pol, cos_pol, sin_pol);
+                    }
+                }
+                for (c = 0; c < npol; c++)
+                {
+                    beta_lab_sq_t = 0.0;
+                    for (i = 0; i < isize0; i++)
+                    {
+                        beta_lab_sq_t += sqr(beta_pol[c][i]);
+                    }
+                    s_method_incoh[c] += beta_lab_sq_t*invsize0;
+                    for (v = 0; v < nqv; v++)
+                    {
+                        qq = qbin[v];
+                        s_method[c*ng+g][qq] += qw[v]*(sqr(cos_pol[c][v]) + sqr(sin_pol[c][v]))*invsize0;
+                        s_method_coh[c*ng+g][qq] += qw[v]*(sqr(cos_pol[c][v]) + sqr(sin_pol[c][v]) - beta_lab_sq_t)*invsize0;
+                    }
                 }
-                sfree(cos_q);
-                sfree(sin_q);
             }
-            nframes++;
+            shs_accumulate(&acc, acc_val, s_method, s_method_coh, s_method_incoh, invvol, t,
+                           ng, npol, polname, nbinq, arr_qnorm, fnERR, fnCPO, oenv);
         }
-        while (read_next_x(oenv, status, &t, x, box));
+        while (read_next_x_prefetch(status, &t, x, box));
     }
     else if (method[0] == 's' && bCross == TRUE && bSpectrum == TRUE)
     {
         fprintf(stderr,"loop with sumexp method cross term\n");
         do
         {
-            copy_mat(box, box_pbc);
-            if (top != NULL)
-            {
-                gmx_rmpbc(gpbc, natoms, box, x);
-            }
-            set_pbc(&pbc, ePBCrdf, box_pbc);
-            invvol      = 1/det(box_pbc);
-            invvol_sum += invvol;
+            invvol      = shs_frame_pbc(&pbc, ePBCrdf, bPBC, box, box_pbc, rmax2, &rmax2_frame);
             for (g = 0; g < ng; g++)
             {
-                snew(cos_q,nbinq);
-                snew(sin_q,nbinq);
-                snew(cos_q2,nbinq);
-                snew(sin_q2,nbinq);
+                for (v = 0; v < nqv; v++)
+                {
+                    cos_q[v]  = 0;
+                    sin_q[v]  = 0;
+                    cos_q2[v] = 0;
+                    sin_q2[v] = 0;
+                }
                 beta_lab_sq_t = 0.0;
-                for (i = 0; i < isize0; i++)
+                calc_molframes(&mf, &pbc, isize0, ind0, x, norm_x, norm_z);
+                molframes_contract(&mf, beta_mol, unit_x, pol_in1, pol_in2, beta_lab);
+                molframes_contract(&mf, beta_mol, unit_z, pol_in1, pol_in2, beta_lab_t2);
+                if (bGrid)
                 {
-                    copy_rvec(x[ind0[i]], xi);
-                    pbc_dx(&pbc, xi, x[ind0[i]+1], x01);
-                    pbc_dx(&pbc, xi, x[ind0[i]+2], x02);
-                    rotate_beta_theta(norm_x, norm_z, x01, x02, pol_in1, pol_in2, beta_mol_1d, &beta_lab_2, &beta_lab_1 );
-                    beta_lab_sq_t += beta_lab_1*beta_lab_2;
-                    for (qq = 0; qq < nbinq; qq++)
+                    for (i = 0; i < isize0; i++)
+                    {
+                        beta_lab_sq_t += beta_lab[i]*beta_lab_t2[i];
+                    }
+                    shs_grid_cossin(&sg, box, isize0, x, ind0, beta_lab, nqv, qm, cos_q, sin_q);
+                    shs_grid_cossin(&sg, box, isize0, x, ind0, beta_lab_t2, nqv, qm, cos_q2, sin_q2);
+                }
+                else
+                {
+                    for (i = 0; i < isize0; i++)
                     {
-                        q_xi = iprod(arr_qvec[qq],xi);
-                        cos_q[qq] += beta_lab_1*cos(q_xi);
-                        sin_q[qq] += beta_lab_1*sin(q_xi);
-                        cos_q2[qq] += beta_lab_2*cos(q_xi);
-                        sin_q2[qq] += beta_lab_2*sin(q_xi);
+                        copy_rvec(x[ind0[i]], xi);
+                        beta_lab_sq_t += beta_lab[i]*beta_lab_t2[i];
+                        shs_cossin_qx(&qsoa, kvec, minq, dq, nrecur, xi, beta_lab[i], cos_q, sin_q);
+                        shs_cossin_qx(&qsoa, kvec, minq, dq, nrecur, xi, beta_lab_t2[i], cos_q2, sin_q2);
                     }
                 }
-                s_method_incoh += beta_lab_sq_t*invsize0;
-                for (qq = 0; qq < nbinq; qq++)
+                s_method_incoh[0] += beta_lab_sq_t*invsize0;
+                for (v = 0; v < nqv; v++)
                 {
-                    s_method[g][qq] += (cos_q[qq]*cos_q2[qq] + sin_q[qq]*sin_q2[qq])*invsize0;
-                    s_method_coh[g][qq] += (cos_q[qq]*cos_q2[qq] + sin_q[qq]*sin_q2[qq] - beta_lab_sq_t)*invsize0;
+                    qq = qbin[v];
+                    s_method[g][qq] += qw[v]*(cos_q[v]*cos_q2[v] + sin_q[v]*sin_q2[v])*invsize0;
+                    s_method_coh[g][qq] += qw[v]*(cos_q[v]*cos_q2[v] + sin_q[v]*sin_q2[v] - beta_lab_sq_t)*invsize0;
                 }
-                sfree(cos_q);
-                sfree(sin_q);
-                sfree(cos_q2);
-                sfree(sin_q2);
             }
-            nframes++;
+            shs_accumulate(&acc, acc_val, s_method, s_method_coh, s_method_incoh, invvol, t,
+                           ng, npol, polname, nbinq, arr_qnorm, fnERR, fnCPO, oenv);
         }
-        while (read_next_x(oenv, status, &t, x, box));
+        while (read_next_x_prefetch(status, &t, x, box));
 
     }
-    else if ((method[0] == 's' && bFADE == TRUE) || bSpectrum == FALSE  )
+    else if (bSpectrum == FALSE)
     {
         gmx_fatal(FARGS,"Combination of method %c, spectrum %d and fading %d  unavailable", method[0], bSpectrum, fade);
     }
@@ -614,10 +1587,36 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
         gmx_rmpbc_done(gpbc);
     }
     
-    close_trj(status);
+    close_trj_prefetch(status);
 
     //sfree(x);
 
+    /* The output below is computed from the accumulated sums */
+    if (fnERR)
+    {
+        shs_write_err(fnERR, &acc, ng, npol, polname, nbinq, arr_qnorm, oenv);
+    }
+    if (fnCPO)
+    {
+        sqaccum_write(&acc, "nonlinearopticalscattering", fnCPO);
+    }
+    nframes = acc.nframes;
+    for (g = 0; g < nset; g++)
+    {
+        for (qq = 0; qq < nbinq; qq++)
+        {
+            s_method[g][qq]     = acc.sum[g*nbinq+qq];
+            s_method_coh[g][qq] = acc.sum[(nset+g)*nbinq+qq];
+        }
+    }
+    for (c = 0; c < npol; c++)
+    {
+        s_method_incoh[c] = acc.sum[2*nset*nbinq+c];
+    }
+    invvol_sum     = acc.sum[2*nset*nbinq+npol];
+    done_sqaccum(&acc);
+    sfree(acc_val);
+
     /* Average volume */
     invvol = invvol_sum/nframes;
     if (method[0]=='m' )
@@ -679,7 +1678,10 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
        }
        for (g = 0; g < ng; g++)
        {
-           s_method_incoh = s_method_incoh/(nframes) ;
+           for (c = 0; c < npol; c++)
+           {
+              s_method_incoh[c] = s_method_incoh[c]/(nframes) ;
+           }
            if (bSpectrum == FALSE)
            {
               s_method_nospectrum[g] = s_method_nospectrum[g]/(nframes) ;
@@ -689,8 +1691,11 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
            {
               for (qq = 0; qq < nbinq ; qq++)
               {
-                  s_method_coh[g][qq] = s_method_coh[g][qq]/(nframes) ;
-                  s_method[g][qq] = s_method[g][qq]/(nframes) ;
+                  for (c = 0; c < npol; c++)
+                  {
+                      s_method_coh[c*ng+g][qq] = s_method_coh[c*ng+g][qq]/(nframes) ;
+                      s_method[c*ng+g][qq] = s_method[c*ng+g][qq]/(nframes) ;
+                  }
                   for (i = 0; i< (nbin+1)/2 ; i++)
                   {
                       r = i*binwidth;
@@ -713,7 +1718,10 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
     {
        for (g = 0; g < ng; g++)
        {
-           s_method_incoh = s_method_incoh/(nframes) ;
+           for (c = 0; c < npol; c++)
+           {
+              s_method_incoh[c] = s_method_incoh[c]/(nframes) ;
+           }
            if (bSpectrum == FALSE)
            {
               s_method_nospectrum[g] = s_method_nospectrum[g]/(nframes)  ;
@@ -723,8 +1731,11 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
            {
                for (qq = 0; qq < nbinq ; qq++)
                {
-                  s_method[g][qq] = s_method[g][qq]/(nframes)  ;
-                  s_method_coh[g][qq] = s_method_coh[g][qq]/(nframes)  ;
+                  for (c = 0; c < npol; c++)
+                  {
+                      s_method[c*ng+g][qq] = s_method[c*ng+g][qq]/(nframes)  ;
+                      s_method_coh[c*ng+g][qq] = s_method_coh[c*ng+g][qq]/(nframes)  ;
+                  }
                }  
            }
        }
@@ -733,8 +1744,15 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
     sprintf(gtitle, "ESHS");
     fp = xvgropen(fnSFACT, gtitle, "q (nm-1)", "S(q)", oenv);
     sprintf(refgt, "%s", "");
-    fprintf(fp, "@    s0 legend \"coherent\" \n");
-    fprintf(fp, "@target G0.S0\n");
+    if (npol == 1)
+    {
+        fprintf(fp, "@    s0 legend \"coherent\" \n");
+        fprintf(fp, "@target G0.S0\n");
+    }
+    else
+    {
+        shs_pol_legend(fp, 0, "coherent", ng, npol, polname, grpname);
+    }
     if (ng == 1)
     {
         if (output_env_get_print_xvgr_codes(oenv))
@@ -748,19 +1766,22 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
         {
             fprintf(fp, "@ subtitle \"reference %s%s\"\n", grpname[0], refgt);
         }
-        xvgr_legend(fp, ng, (const char**)(grpname+1), oenv);
+        if (npol == 1)
+        {
+            xvgr_legend(fp, ng, (const char**)(grpname+1), oenv);
+        }
     }
     for (qq = 0; qq < nbinq  ; qq++)
     {
         if (bSpectrum == TRUE)
         {
-            fprintf(fp, "%10g", norm(arr_qvec[qq]));
+            fprintf(fp, "%10g", arr_qnorm[qq]);
         }
         else
         {
             fprintf(fp, "%10g", minq);
         }
-        for (g = 0; g < ng; g++)
+        for (g = 0; g < nset; g++)
         {   
             if (bSpectrum == TRUE)
             {
@@ -768,43 +1789,60 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
             }
             else
             {
-                fprintf(fp, " %10g", s_method_coh_nospectrum[g]);
+                fprintf(fp, " %10g", s_method_coh_nospectrum[g % ng]);
             }
         }
         fprintf(fp, "\n");
     }
     fprintf(fp,"&\n");
-    fprintf(fp, "@    s1 legend \"incoherent\"\n");
-    fprintf(fp, "@target G0.S1\n");
+    if (npol == 1)
+    {
+        fprintf(fp, "@    s1 legend \"incoherent\"\n");
+        fprintf(fp, "@target G0.S1\n");
+    }
+    else
+    {
+        shs_pol_legend(fp, nset, "incoherent", 1, npol, polname, grpname);
+    }
     fprintf(fp, "@type xy\n");
     for (qq = 0; qq < nbinq  ; qq++)
     {
         if (bSpectrum == TRUE) 
         {
-           fprintf(fp, "%10g", norm(arr_qvec[qq]));
+           fprintf(fp, "%10g", arr_qnorm[qq]);
         }
         else
         {
           fprintf(fp, "%10g", minq);
         }
-        fprintf(fp, " %10g", s_method_incoh);
+        for (c = 0; c < npol; c++)
+        {
+            fprintf(fp, " %10g", s_method_incoh[c]);
+        }
         fprintf(fp, "\n");
     }
     fprintf(fp,"&\n");
-    fprintf(fp, "@    s2 legend \"total\"\n");
-    fprintf(fp, "@target G0.S2\n");
+    if (npol == 1)
+    {
+        fprintf(fp, "@    s2 legend \"total\"\n");
+        fprintf(fp, "@target G0.S2\n");
+    }
+    else
+    {
+        shs_pol_legend(fp, nset + npol, "total", ng, npol, polname, grpname);
+    }
     fprintf(fp, "@type xy\n");
     for (qq = 0; qq < nbinq  ; qq++)
     {
         if (bSpectrum == TRUE) 
         {
-           fprintf(fp, "%10g", norm(arr_qvec[qq]));
+           fprintf(fp, "%10g", arr_qnorm[qq]);
         }
         else
         {
           fprintf(fp, "%10g", minq);
         }
-        for (g = 0; g < ng; g++)
+        for (g = 0; g < nset; g++)
         {
             if (bSpectrum == TRUE)
             {
@@ -812,7 +1850,7 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
             }
             else
             {
-                fprintf(fp, " %10g", s_method_nospectrum[g]);
+                fprintf(fp, " %10g", s_method_nospectrum[g % ng]);
             }
         }
         fprintf(fp, "\n");
@@ -835,7 +1873,7 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
        for (i = 0; i <= 100  ; i++)
        {
            fprintf(fp, "%10g", (-M_PI*0.5 +M_PI*i/100)*180.0/M_PI);
-           fprintf(fp, " %10g", ftheta[i]*s_method_incoh);
+           fprintf(fp, " %10g", ftheta[i]*s_method_incoh[0]);
            fprintf(fp, "\n");
        }
        fprintf(fp,"&\n");
@@ -924,23 +1962,15 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
        for (g = 0; g < ng; g++)
        {
           sfree(rdf[g]);
-          sfree(s_method[g]);
-          sfree(s_method_coh[g]);
           sfree(s_method_g_r[g]);
        }
        sfree(ind0);
        sfree(rdf);
-       sfree(s_method);
-       sfree(s_method_coh);
        sfree(s_method_nospectrum);
        sfree(s_method_coh_nospectrum);
        sfree(s_method_g_r);
        sfree(arr_q);      
        sfree(arr_qvec);
-       sfree(cos_q);
-       sfree(sin_q);
-       sfree(cos_q2);
-       sfree(sin_q2);
        sfree(beta_lab);
        sfree(beta_lab_t2);
        sfree(beta_mol_1d);
@@ -949,21 +1979,56 @@ static void do_nonlinearopticalscattering(t_topology *top, const char *fnTRX,
 
     else if (method[0] == 's')  
     {
-       for (g = 0; g < ng; g++)
-       {
-          sfree(s_method[g]);
-          sfree(s_method_coh[g]);
-       }
        sfree(ind0);
-       sfree(s_method);
-       sfree(s_method_coh);
        sfree(arr_qvec);
        sfree(s_method_nospectrum);
        sfree(s_method_coh_nospectrum);
        sfree(arr_q);
-       sfree(temp_method);
        sfree(beta_mol_1d);
     }
+    if (ps != NULL)
+    {
+        done_pairsum(ps);
+    }
+    if (bGrid)
+    {
+        done_sqgrid(&sg);
+        sfree(qm);
+    }
+    if (bFadeConv)
+    {
+        done_shs_fadeconv(&fc);
+    }
+    done_molframes(&mf);
+    done_molbeta(nmb, mb);
+    for (g = 0; g < nset; g++)
+    {
+        sfree(s_method[g]);
+        sfree(s_method_coh[g]);
+    }
+    sfree(s_method);
+    sfree(s_method_coh);
+    sfree(s_method_incoh);
+    for (c = 0; c < npol; c++)
+    {
+        sfree(beta_pol[c]);
+        qloop_sfree(temp_pol[c]);
+        qloop_sfree(cos_pol[c]);
+        qloop_sfree(sin_pol[c]);
+    }
+    sfree(beta_pol);
+    sfree(temp_pol);
+    sfree(cos_pol);
+    sfree(sin_pol);
+    done_qvec_soa(&qsoa);
+    sfree(qbin);
+    sfree(qw);
+    sfree(arr_qnorm);
+    qloop_sfree(temp_method);
+    qloop_sfree(cos_q);
+    qloop_sfree(sin_q);
+    qloop_sfree(cos_q2);
+    qloop_sfree(sin_q2);
 
     for (i = 0; i < DIM; i++)
     {
@@ -1032,13 +2097,73 @@ int gmx_nonlinearopticalscattering(int argc, char *argv[])
         "pout, pin1, pin2 are the polarization directions of the three beams.",
         "Common polarization combinations are PPP (i.e. ZXX, default), PSS (ZYY), SPP (YXX), SSS (YYY).",
         "Under Kleinmann symmetry beta_ijj = beta_jij = beta_jji otherwise beta_ijj = beta_jij. [PAR]",
+        "With [TT]-pol[tt] several polarization channels are computed in the same pass,",
+        "e.g. [TT]-pol PPP,PSS,SPS,SSP[tt]. A channel is given by three letters for the",
+        "outgoing and the two incoming beams: P is Z for the outgoing and X for the",
+        "incoming beams, S is Y, and X, Y or Z select a lab axis directly. The molecular",
+        "frames, pair distances and sin/cos of q dot r are shared by all channels, only the",
+        "products of the lab-frame beta are accumulated per channel. The output then has",
+        "a column per channel in each of the coherent, incoherent and total sets;",
+        "[TT]-pol[tt] overrides [TT]-pout[tt], [TT]-pin1[tt] and [TT]-pin2[tt] and",
+        "can not be combined with [TT]-cross[tt].[PAR]",
+        "With [TT]-beta[tt] the hyperpolarizabilities are read from a file instead of",
+        "using the built-in values for water, which allows other solvents and mixtures.",
+        "Per molecule type the file lists the residue name, the numbers within the",
+        "molecule of the three atoms that define the molecular frame (apex, first and",
+        "second atom) and the 27 components beta_pqr in that frame, r running fastest.",
+        "z is along the sum of the two vectors from the first and second atom to the apex,",
+        "x along their difference made orthogonal to z, and y = x cross z, as for the",
+        "built-in water frame; [TT]-klein[tt] does not apply to such a tensor.[PAR]",
+        "The q points lie on a uniform grid, so with [TT]-recur[tt] the sums over q are evaluated with",
+        "the angle-addition recurrence, which needs one sin/cos per pair (or molecule) instead of one per q point.",
+        "The exact values are re-seeded every [TT]-recur[tt] q points to bound the rounding error, a value",
+        "around 64 keeps the relative error near single precision. This pays off for spectra with many q points.[PAR]",
+        "The pair sum of modsumexp runs on the CPU with [TT]-nthreads[tt] OpenMP threads, or with [TT]-gpu[tt]",
+        "on the accelerator backend selected when building (CUDA with GMX_GPU). With [TT]-debug[tt] the",
+        "accelerator result for the first frame is compared with the CPU reference.[PAR]",
+        "The sumexp method costs O(N) per q vector and frame, modsumexp O(N^2). With",
+        "[TT]-fade[tt], sumexp applies the fading window as a convolution in reciprocal",
+        "space: the windowed pair sum at q is 1/V sum_k F(|q-k|) |rho(k)|^2 with F the",
+        "Fourier transform of the window and rho(k) the beta-weighted density, which",
+        "is exact for q on the reciprocal lattice when the sum runs over all k. The sum",
+        "is truncated to k within [TT]-fadek[tt] lattice spacings of q, by default a number",
+        "set by the width of the fading range. The sum of the retained weights, printed",
+        "at the start, should be close to 1 and indicates the truncation error. This also",
+        "covers the cross term. Without fading, modsumexp only includes pairs within half",
+        "the box, while sumexp includes all periodic images, so the two give different",
+        "intensities. With [TT]-method auto[tt] and fading the cheaper of the two is used,",
+        "based on the number of molecules and q (or k) vectors. Without fading auto",
+        "uses modsumexp, or sumexp for the cross term.[PAR]",
+        "With [TT]-qshell[tt] the intensity is averaged over directions in one pass: all",
+        "reciprocal lattice vectors of the first box with |q| up to [TT]-maxq[tt] are",
+        "evaluated and averaged in [TT]-nbinq[tt] shells of |q|, empty shells are left out.",
+        "The lattice indices of a custom set of vectors can be given in a file with",
+        "[TT]-qvec[tt], three integers per line. The molecular frames, beta and the pair",
+        "distances are computed once per frame for all vectors.[PAR]",
+        "With [TT]-block[tt] the frames are divided in blocks of this many frames and the",
+        "total and coherent intensity with their block-averaged standard errors are written",
+        "to [TT]-oerr[tt] after every block. [TT]-cpo[tt] writes the accumulated sums to a",
+        "checkpoint file after every block and at the end, and [TT]-cpi[tt] continues from",
+        "such a file with the frames after the last accumulated time.[PAR]",
+        "[TT]-method grid[tt] is sumexp with the beta-weighted densities rho(k) of",
+        "all wave vectors from one 3D FFT per frame and channel, as for the reciprocal",
+        "part of PME: beta is spread on a grid with B-splines of order [TT]-order[tt]",
+        "and the transform is divided by the transform of the B-splines. The cost per",
+        "frame is O(N) for spreading plus O(K log K) for K grid points, independent of",
+        "the number of q vectors, and includes all periodic images. The q vectors, or",
+        "with [TT]-fade[tt] the wave vectors of the convolution, should be on the",
+        "reciprocal lattice. The spacing [TT]-fspacing[tt] by default gives 4 grid",
+        "points per wavelength at the largest wave vector, with order 6 the relative",
+        "error is then a few times 1e-4, order 8 reduces it ten-fold.[PAR]",
     };
-    static gmx_bool    bPBC = TRUE, bNormalize = TRUE, bKleinmannsymm = TRUE, bSpectrum = TRUE, bCross = FALSE;
+    static gmx_bool    bPBC = TRUE, bNormalize = TRUE, bKleinmannsymm = TRUE, bSpectrum = TRUE, bCross = FALSE, bQshell = FALSE;
     static int         ngroups = 1, nbinq = 20, pout = 2, pin1 = 0, pin2 = 0;
-    static real        binwidth = 0.002, maxq=20.0, faderatio = 25.0 , faderdf = 0.0;
+    static int         nrecur = 0, nthreads = 0, nblock = 0, nfadek = 0, gridorder = 6;
+    static real        binwidth = 0.002, maxq=20.0, faderatio = 25.0 , faderdf = 0.0, fspacing = 0;
     static real        kx = 1.0, ky = 0.0, kz = -1.0;
+    static const char *polstr = NULL;
     static gmx_bool    bGPU=FALSE,bFADE=FALSE;
-    static const char *methodt[] = { NULL, "modsumexp",  "sumexp", NULL }; 
+    static const char *methodt[] = { NULL, "modsumexp",  "sumexp", "auto", "grid", NULL };
 
     //maxq=nbinq;
  
@@ -1050,9 +2175,11 @@ int gmx_nonlinearopticalscattering(int argc, char *argv[])
         { "-qx",         FALSE, etREAL, {&kx}, "direction of q-vector in x (choose 1 or 0)" },
         { "-qy",         FALSE, etREAL, {&ky}, "direction of q-vector in y (choose 1 or 0)" },
         { "-qz",         FALSE, etREAL, {&kz}, "direction of q-vector in z , (choose 1 or 0)" },
+        { "-qshell",     FALSE, etBOOL, {&bQshell}, "Average over all commensurate q-vectors in shells of |q| instead of using one direction" },
         { "-pout",         FALSE, etINT, {&pout}, "polarization of outcoming beam (0, 1, or 2). For P choose 2 (i.e. Z), for S choose 1 (i.e. Y)" },
         { "-pin1",         FALSE, etINT, {&pin1}, "polarization of 1st incoming beam. For P choose 0 (i.e. X), for S choose 1 (i.e. Y) " },
         { "-pin2",         FALSE, etINT, {&pin2}, "polarization of 2nd incoming beam should the same as 1st for second harmonic scattering." },
+        { "-pol",          FALSE, etSTR, {&polstr}, "Polarization channels to compute in one pass, e.g. PPP,PSS,SPS,SSP, instead of -pout, -pin1 and -pin2" },
         { "-bin",      FALSE, etREAL, {&binwidth},
           "Binwidth for g(r) (nm)" },
         { "-method",     FALSE, etENUM, {methodt},
@@ -1072,9 +2199,24 @@ int gmx_nonlinearopticalscattering(int argc, char *argv[])
         { "-faderdf",     FALSE, etREAL, {&faderdf},
           "From this distance onwards the RDF is tranformed by g'(r) = 1 + [g(r)-1] exp(-(r/faderdf-1)^2 to make it go to 1 smoothly. "
           " If faderdf is 0.0 nothing is done." },
+        { "-fadek",     FALSE, etINT, {&nfadek},
+          "With sumexp and fading, the window is applied as a convolution over wave vectors within this many reciprocal lattice spacings of q. "
+          "0 uses 2*rmax/(rmax-fade), with rmax half the box." },
+        { "-recur",     FALSE, etINT, {&nrecur},
+          "Evaluate the q loops with the angle-addition recurrence over the uniform q grid, re-seeding the exact values every this many q points. "
+          "0 computes every cos/sin directly." },
+
+        { "-fspacing", FALSE, etREAL, {&fspacing},
+          "Grid spacing (nm) for the grid method, 0 gives 4 grid points per wavelength at the largest wave vector" },
+        { "-order", FALSE, etINT, {&gridorder},
+          "Order of the B-spline interpolation for the grid method" },
 
         { "-gpu", FALSE, etBOOL, {&bGPU},
-          "Utilize GPU acceleration" },
+          "Compute the pair sum of modsumexp with the accelerator backend of the build (GPU), falls back to the CPU when there is none" },
+        { "-nthreads", FALSE, etINT, {&nthreads},
+          "Number of threads for the pair sum of modsumexp on the CPU. nthreads <= 0 means maximum number of threads. Requires linking with OpenMP." },
+        { "-block",    FALSE, etINT, {&nblock},
+          "Number of frames per block for the error estimate, intermediate output and checkpoints. 0 means no blocks." },
 
     };
 #define NPA asize(pa)
@@ -1094,6 +2236,11 @@ int gmx_nonlinearopticalscattering(int argc, char *argv[])
         { efXVG, "-osrdf", "sfact_rdf", ffOPTWR },
         { efXVG, "-ordf", "rdf", ffOPTWR },
         { efXVG, "-otheta", "non_linear_sfact_vs_theta", ffOPTWR },
+        { efXVG, "-oerr", "non_linear_sfact_err", ffOPTWR },
+        { efDAT, "-qvec", "qvec", ffOPTRD },
+        { efDAT, "-beta", "beta", ffOPTRD },
+        { efSQA, "-cpi", "non_linear_sfact", ffOPTRD },
+        { efSQA, "-cpo", "non_linear_sfact", ffOPTWR },
     };
 #define NFILE asize(fnm)
     int            npargs;
@@ -1110,6 +2257,11 @@ int gmx_nonlinearopticalscattering(int argc, char *argv[])
         return 0;
     }
 
+    if (nblock < 0)
+    {
+        gmx_fatal(FARGS, "The block length should be 0 or positive, not %d", nblock);
+    }
+
     fnTPS = ftp2fn_null(efTPS, NFILE, fnm);
     fnNDX = ftp2fn_null(efNDX, NFILE, fnm);
 
@@ -1135,8 +2287,13 @@ int gmx_nonlinearopticalscattering(int argc, char *argv[])
     do_nonlinearopticalscattering(top, ftp2fn(efTRX, NFILE, fnm),
            opt2fn("-o", NFILE, fnm), opt2fn_null("-osrdf", NFILE, fnm),
            opt2fn_null("-ordf", NFILE, fnm), opt2fn_null("-otheta", NFILE, fnm),
-           methodt[0],  bPBC, bNormalize, bKleinmannsymm, bSpectrum, bCross, maxq, nbinq, kx, ky, kz, pout,
-           pin1, pin2 ,binwidth,faderatio, faderdf, gnx, grpindex, grpname, ngroups, oenv,bGPU,bFADE);
+           opt2fn_null("-oerr", NFILE, fnm), opt2fn_null("-cpi", NFILE, fnm),
+           opt2fn_null("-cpo", NFILE, fnm), nblock,
+           methodt[0],  bPBC, bNormalize, bKleinmannsymm, bSpectrum, bCross, maxq, nbinq, kx, ky, kz,
+           bQshell, opt2fn_null("-qvec", NFILE, fnm), polstr, pout,
+           pin1, pin2 ,binwidth,faderatio, faderdf, nfadek, nrecur, nthreads,
+           fspacing, gridorder, gnx, grpindex, grpname, ngroups, oenv,bGPU,bFADE,
+           opt2fn_null("-beta", NFILE, fnm));
 
     return 0;
 }
@@ -51,6 +51,7 @@
 #include "gromacs/commandline/pargs.h"
 #include "gromacs/fileio/tpxio.h"
 #include "gromacs/fileio/trxio.h"
+#include "gromacs/fileio/trxprefetch.h"
 #include "physics.h"
 #include "index.h"
 #include "gromacs/utility/smalloc.h"
@@ -61,28 +62,109 @@
 #include "gromacs/fileio/matio.h"
 #include "gmx_ana.h"
 #include "hyperpol.h"
+#include "qloop.h"
+#include "molframes.h"
+#include "sqaccum.h"
 #include "names.h"
 
 #include "gromacs/legacyheaders/gmx_fatal.h"
 
+/* Copies n values of a to val and clears a when bStore, otherwise
+ * copies n values of val back to a. Returns the number of values.
+ */
+static int shstheta_move(gmx_bool bStore, double *val, real *a, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (bStore)
+        {
+            val[i] = a[i];
+            a[i]   = 0;
+        }
+        else
+        {
+            a[i] = val[i];
+        }
+    }
+    return n;
+}
+
+/* Moves the intensities between the arrays and the accumulator columns
+ * val: total, coherent and incoherent for every group with nq values
+ * each, followed with nfaces > 0 by the theta-swipe arrays.
+ */
+static void shstheta_columns(gmx_bool bStore, double *val, int ng, int nq,
+                             real **s_method, real **s_method_coh, real **s_method_incoh,
+                             int nfaces, int nbintheta, int nbinq, real ****s_method_t,
+                             real ****s_method_coh_t, real ****s_method_incoh_t)
+{
+    int g, rr, tt, c = 0;
+
+    for (g = 0; g < ng; g++)
+    {
+        c += shstheta_move(bStore, val+c, s_method[g], nq);
+        c += shstheta_move(bStore, val+c, s_method_coh[g], nq);
+        c += shstheta_move(bStore, val+c, s_method_incoh[g], nq);
+    }
+    for (g = 0; g < ng && nfaces > 0; g++)
+    {
+        for (rr = 0; rr < nfaces; rr++)
+        {
+            for (tt = 0; tt < nbintheta; tt++)
+            {
+                c += shstheta_move(bStore, val+c, s_method_t[g][rr][tt], nbinq);
+                c += shstheta_move(bStore, val+c, s_method_coh_t[g][rr][tt], nbinq);
+                c += shstheta_move(bStore, val+c, s_method_incoh_t[g][rr][tt], nbinq);
+            }
+        }
+    }
+}
+
+/* Writes the block-averaged total, coherent and incoherent intensity of
+ * the first group with errors to fn.
+ */
+static void shstheta_write_err(const char *fn, const t_sqaccum *acc, int nq,
+                               rvec *arr_qvec, const output_env_t oenv)
+{
+    const char *legend[] = { "total", "coherent", "incoherent" };
+    int         col0[3], qq;
+    real       *q;
+
+    snew(q, nq);
+    for (qq = 0; qq < nq; qq++)
+    {
+        q[qq] = norm(arr_qvec[qq]);
+    }
+    col0[0] = 0;
+    col0[1] = nq;
+    col0[2] = 2*nq;
+    sqaccum_write_xvg(acc, fn, "Non-linear optical scattering", "S(q)", nq, q, 3, col0,
+                      legend, 0, oenv);
+    sfree(q);
+}
+
 static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fnNDX, const char *fnTPS,*/ const char *fnTRX,
-                   const char *fnSFACT, const char *fnTHETA, const char *method,
+                   const char *fnSFACT, const char *fnTHETA,
+                   const char *fnERR, const char *fnCPI, const char *fnCPO, int nblock,
+                   const char *method,
                    gmx_bool bPBC, gmx_bool bKleinmannsymm, gmx_bool bSpectrum , gmx_bool bThetaswipe,
                    int qbin, int nbinq, real koutx, real kouty, real koutz,
                    real kinx, real kiny, real kinz,
                    int nbintheta, int nbingamma ,real pin_angle, real pout_angle ,
                    real fade, int *isize, int  *molindex[], char **grpname, int ng,
-                   const output_env_t oenv)
+                   const output_env_t oenv, const char *fnBETA)
 {
     FILE          *fp;
     FILE          *fpn;
-    t_trxstatus   *status;
+    t_trxprefetch *status;
     char           outf1[STRLEN], outf2[STRLEN];
     char           title[STRLEN], gtitle[STRLEN], refgt[30];
     int            g, natoms, i, j, k, qq, n, c, tt, rr, nframes, nfaces;
-    real         **s_method, **s_method_coh, **s_method_incoh, *temp_method, ****s_method_t, ****s_method_coh_t, ****s_method_incoh_t, ***mu_sq_t ;
+    real         **s_method, **s_method_coh, **s_method_incoh, *temp_method, ****s_method_t, ****s_method_coh_t, ****s_method_incoh_t, *mu_sq_t ;
     real           qnorm, maxq, coh_temp = 0.0,  incoh_temp = 0.0, tot_temp = 0.0, gamma = 0.0 ,theta0 = 5.0;
-    real          *cos_t, *sin_t, ****cos_tq, ****sin_tq, *cq, *sq , *c_square, *s_square, *cs_sc ,***beta_mol, *beta_mol_1d, *beta_lab_2_t, *beta_lab_1_t, beta_fact, mu_ind =0.0, mu_sq =0.0 ;
+    real          *cos_t, *sin_t, *tq_arena = NULL, *cos_tq, *sin_tq, *cq, *sq , *c_square, *s_square, *cs_sc ,***beta_mol, *beta_mol_1d, *beta_lab_2_t, *beta_lab_1_t, beta_fact, mu_ind =0.0, mu_sq =0.0 ;
     real           beta_lab_sq_2 = 0.0, beta_lab_sq_1 = 0.0, beta_lab_1_2 =0.0, beta_lab_2 = 0.0, beta_lab_1 = 0.0, b22 = 0.0, b21 = 0.0, b12 = 0.0, b11 = 0.0;
     int            max_i, isize0, ind0;
     real           t, rmax2, rmax,  r, r_dist, r2, q_xi, dq, invhbinw, normfac, norm_x, norm_z, mod_f, inv_width;
@@ -97,6 +179,17 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
     t_pbc          pbc;
     gmx_rmpbc_t    gpbc = NULL;
     int            mol, a;
+    t_qvec_soa     qsoa, *qsoa_faces = NULL;
+    t_molframes    mf;
+    t_molbeta     *mb  = NULL;
+    int            nmb = 0;
+    t_sqaccum      acc;
+    double        *acc_val;
+    int            nq;
+    int            ngeom = 0, nqpad = 0, geom;
+    atom_id       *a0_mol;
+    real          *mu_mol;
+    rvec           unit_x = {1, 0, 0}, unit_z = {0, 0, 1};
 
     atom = top->atoms.atom;
     mols = &(top->mols);
@@ -104,7 +197,7 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
     nfaces = 6;
     invsize0 = 1.0/isize0;
     invgamma = 1.0/nbingamma;
-    natoms = read_first_x(oenv, &status, fnTRX, &t, &x, box);
+    natoms = read_first_x_prefetch(oenv, &status, fnTRX, &t, &x, box);
     
     fprintf(stderr,"\nnumber of atoms %d\n",natoms);
 
@@ -206,10 +299,10 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
             snew(s_method[g], nbintheta+1);
             snew(s_method_coh[g], nbintheta+1);
             snew(s_method_incoh[g], nbintheta+1);
-            snew(temp_method, nbintheta+1);
+            temp_method = qloop_snew(nbintheta+1);
             snew(arr_qvec, nbintheta+1);
-            snew(cos_t, nbintheta+1);
-            snew(sin_t, nbintheta+1);
+            cos_t = qloop_snew(nbintheta+1);
+            sin_t = qloop_snew(nbintheta+1);
             qnorm = M_PI*2.0/(rmax*2.0)*qbin;
             fprintf(stderr,"|q| = %f\n", qnorm);
             for (qq = 0; qq <= nbintheta; qq++)
@@ -230,7 +323,7 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
            snew(s_method[g], nbinq);
            snew(s_method_coh[g], nbinq);
            snew(s_method_incoh[g],nbinq);
-           snew(temp_method, nbinq);
+           temp_method = qloop_snew(nbinq);
            snew(arr_qvec,nbinq);
            /*initialize incoming and outcoming wave-vectors*/
            vec_kout[XX] = koutx; 
@@ -264,8 +357,8 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
            unitv(vec_polout, vec_polout);
            /*----------------------------------------------------------------------*/         
  
-           snew(cos_t, nbinq);
-           snew(sin_t, nbinq);
+           cos_t = qloop_snew(nbinq);
+           sin_t = qloop_snew(nbinq);
            theta0  = theta0*M_PI/180.0 ;
            qnorm = M_PI*2.0/(rmax*2.0)*qbin;
            fprintf(stderr,"direction of incoming wave-vector is %f %f %f\n", vec_2kin[XX], vec_2kin[YY], vec_2kin[ZZ]);
@@ -385,10 +478,67 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
            }
         }
     }
-    
+
+    /* q vectors laid out for the SIMD q-loop kernels */
+    if (bSpectrum == TRUE)
+    {
+        init_qvec_soa(&qsoa, nbinq, arr_qvec);
+        if (bThetaswipe == TRUE)
+        {
+            snew(qsoa_faces, nfaces);
+            for (rr = 0; rr < nfaces; rr++)
+            {
+                init_qvec_soa(&qsoa_faces[rr], nbinq, arr_qvec_faces[rr]);
+            }
+            /* The cos and sin sums of all geometries (face, theta, gamma)
+             * are stored in one arena with a stride of 2*nqpad per geometry,
+             * with the cos sums followed by the sin sums; mu_sq_t holds the
+             * sum of squared dipoles per geometry.
+             */
+            ngeom    = nfaces*nbintheta*nbingamma;
+            nqpad    = qloop_padded_size(nbinq);
+            tq_arena = qloop_snew(2*ngeom*nqpad);
+            snew(mu_sq_t, ngeom);
+            fprintf(stderr, "Theta swipe over %d geometries and %d q points, the accumulators use %.1f MB\n",
+                    ngeom, nbinq, (2.0*ngeom*nqpad + ngeom)*sizeof(real)/(1024.0*1024.0));
+        }
+    }
+
     snew(x_i1, max_i);
-    nframes    = 0;
-    invvol_sum = 0;
+    /* The molecular frames are computed once per frame, after which the
+     * lab-frame beta for all polarization geometries is a loop over molecules.
+     */
+    init_molframes(&mf);
+    if (fnBETA)
+    {
+        nmb = read_molbeta(fnBETA, &mb);
+        molframes_set_types(&mf, nmb, mb, &top->atoms);
+        fprintf(stderr, "Using the frames and hyperpolarizabilities of %d molecule types from %s\n",
+                nmb, fnBETA);
+    }
+    snew(a0_mol, max_i);
+    snew(mu_mol, max_i);
+    /* The loops below leave the contributions of each frame in the
+     * intensity arrays, the sums over frames are kept in acc
+     */
+    nq = bSpectrum ? nbinq : nbintheta + 1;
+    init_sqaccum(&acc, 3*ng*nq + (bThetaswipe ? 3*ng*nfaces*nbintheta*nbinq : 0) + 1, 0, nblock);
+    snew(acc_val, acc.ncol);
+    sqaccum_set_grid(&acc, method, DIM*nq, arr_qvec[0]);
+    if (fnCPI)
+    {
+        sqaccum_read(&acc, "nonlinearopticalscatteringtheta", fnCPI);
+        fprintf(stderr, "Continuing from %d frames in %s, skipping frames up to time %g\n",
+                acc.nframes, fnCPI, acc.tlast);
+        while (t <= acc.tlast)
+        {
+            if (!read_next_x_prefetch(status, &t, x, box))
+            {
+                gmx_fatal(FARGS, "The trajectory has no frames after time %g, the last frame in %s",
+                          acc.tlast, fnCPI);
+            }
+        }
+    }
     if (bPBC && (NULL != top))
     {
         gpbc = gmx_rmpbc_init(&top->idef, ePBC, natoms);
@@ -407,25 +557,28 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
             set_pbc(&pbc, ePBCrdf, box_pbc);
 
             invvol      = 1/det(box_pbc);
-            invvol_sum += invvol;
             for (g = 0; g < ng; g++)
             {
                 beta_lab_sq_1 = 0.0;
                 beta_lab_sq_2 = 0.0;
                 beta_lab_1_2 = 0.0 ;
-                snew(temp_method, nbinq);
+                for (qq = 0; qq < nbinq; qq++)
+                {
+                    temp_method[qq] = 0;
+                }
                 for (i = 0; i < isize0; i++)
                 {
-                    ind0  = mols->index[molindex[g][i]];
-                    copy_rvec(x[ind0], x_i1[i]);
-                    pbc_dx(&pbc, x_i1[i], x[ind0+1], x01);
-                    pbc_dx(&pbc, x_i1[i], x[ind0+2], x02);
-                    rotate_beta_theta(norm_x, norm_z, x01, x02, pol_in1, pol_in2, beta_mol_1d, &beta_lab_2, &beta_lab_1 );
-                    beta_lab_sq_2 += beta_lab_2*beta_lab_2 ;
-                    beta_lab_sq_1 += beta_lab_1*beta_lab_1 ;
-                    beta_lab_1_2  += beta_lab_1*beta_lab_2 ;
-                    beta_lab_2_t[i] = beta_lab_2;
-                    beta_lab_1_t[i] = beta_lab_1;
+                    a0_mol[i] = mols->index[molindex[g][i]];
+                    copy_rvec(x[a0_mol[i]], x_i1[i]);
+                }
+                calc_molframes(&mf, &pbc, isize0, a0_mol, x, norm_x, norm_z);
+                molframes_contract(&mf, beta_mol, unit_z, pol_in1, pol_in2, beta_lab_2_t);
+                molframes_contract(&mf, beta_mol, unit_x, pol_in1, pol_in2, beta_lab_1_t);
+                for (i = 0; i < isize0; i++)
+                {
+                    beta_lab_sq_2 += beta_lab_2_t[i]*beta_lab_2_t[i] ;
+                    beta_lab_sq_1 += beta_lab_1_t[i]*beta_lab_1_t[i] ;
+                    beta_lab_1_2  += beta_lab_1_t[i]*beta_lab_2_t[i] ;
                 }
                 for (i = 0; i < isize0 -1.0; i++)
                 {
@@ -447,19 +600,12 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
                             if ( r_dist <= fade)
                             {
                                 mod_f = b22*s_square[0] + b11*c_square[0] - (b12 + b21)*cs_sc[0] ;
-                                for (qq = 0; qq < nbinq; qq++)
-                                {
-                                   temp_method[qq] += mod_f*cos(iprod(arr_qvec[qq],dx));
-                                }
+                                qloop_cos_qdx(&qsoa, dx, mod_f, temp_method);
                             }
                             else
                             {
                                 mod_f = (b22*s_square[0] + b11*c_square[0] - (b12 + b21)*cs_sc[0])*sqr(cos((r_dist-fade)*inv_width)) ;
-                                for (qq = 0; qq < nbinq; qq++)
-                                {
-                                   /*fprintf(stderr,"s_method[g][qq] %f\n", mod_f*cos((minq+dq*qq)*iprod(arr_qvec,dx)) );*/
-                                   temp_method[qq] += mod_f*cos(iprod(arr_qvec[qq],dx));
-                                }
+                                qloop_cos_qdx(&qsoa, dx, mod_f, temp_method);
                             }
                         }
                     }
@@ -473,9 +619,23 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
                    s_method_incoh[g][qq] += incoh_temp;
                 }
             }
-            nframes++;
+            shstheta_columns(TRUE, acc_val, ng, nq, s_method, s_method_coh, s_method_incoh,
+                             bThetaswipe ? nfaces : 0, nbintheta, nbinq,
+                             s_method_t, s_method_coh_t, s_method_incoh_t);
+            acc_val[acc.ncol-1] = invvol;
+            if (sqaccum_add(&acc, acc_val, 1, t))
+            {
+                if (fnERR)
+                {
+                    shstheta_write_err(fnERR, &acc, nq, arr_qvec, oenv);
+                }
+                if (fnCPO)
+                {
+                    sqaccum_write(&acc, "nonlinearopticalscatteringtheta", fnCPO);
+                }
+            }
         }
-        while (read_next_x(oenv, status, &t, x, box));
+        while (read_next_x_prefetch(status, &t, x, box));
     }
 
     else if (method[0] == 's' && bSpectrum == TRUE && fade == 0.0 && bThetaswipe == FALSE )
@@ -491,26 +651,24 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
             }
             set_pbc(&pbc, ePBCrdf, box_pbc);
             invvol      = 1/det(box_pbc);
-            invvol_sum += invvol;
             for (g = 0; g < ng; g++)
             {
-                snew(cos_t,nbinq);
-                snew(sin_t,nbinq);
+                for (qq = 0; qq < nbinq; qq++)
+                {
+                    cos_t[qq] = 0;
+                    sin_t[qq] = 0;
+                }
                 mu_sq = 0.0;
                 for (i = 0; i < isize0; i++)
                 {
-                    ind0  = mols->index[molindex[g][i]];
-                    copy_rvec(x[ind0], xi);
-                    pbc_dx(&pbc, xi, x[ind0+1], x01);
-                    pbc_dx(&pbc, xi, x[ind0+2], x02);
-                    induced_second_order_dipole(norm_x, norm_z, x01, x02, vec_polout, vec_polin, beta_mol, &mu_ind);
-                    mu_sq += mu_ind*mu_ind; 
-                    for (qq = 0; qq < nbinq; qq++)
-                    {
-                       q_xi = iprod(arr_qvec[qq],xi);
-                       cos_t[qq] += mu_ind*cos(q_xi);
-                       sin_t[qq] += mu_ind*sin(q_xi);
-                    }
+                    a0_mol[i] = mols->index[molindex[g][i]];
+                }
+                calc_molframes(&mf, &pbc, isize0, a0_mol, x, norm_x, norm_z);
+                molframes_contract(&mf, beta_mol, vec_polout, vec_polin, vec_polin, mu_mol);
+                for (i = 0; i < isize0; i++)
+                {
+                    mu_sq += mu_mol[i]*mu_mol[i];
+                    qloop_cossin_qx(&qsoa, x[a0_mol[i]], mu_mol[i], cos_t, sin_t);
                 }
                 incoh_temp = (mu_sq)*invsize0;
                 for (qq = 0; qq < nbinq; qq++)
@@ -521,9 +679,23 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
                    s_method_incoh[g][qq] += incoh_temp ;
                 }
             }
-            nframes++;
+            shstheta_columns(TRUE, acc_val, ng, nq, s_method, s_method_coh, s_method_incoh,
+                             bThetaswipe ? nfaces : 0, nbintheta, nbinq,
+                             s_method_t, s_method_coh_t, s_method_incoh_t);
+            acc_val[acc.ncol-1] = invvol;
+            if (sqaccum_add(&acc, acc_val, 1, t))
+            {
+                if (fnERR)
+                {
+                    shstheta_write_err(fnERR, &acc, nq, arr_qvec, oenv);
+                }
+                if (fnCPO)
+                {
+                    sqaccum_write(&acc, "nonlinearopticalscatteringtheta", fnCPO);
+                }
+            }
         }
-        while (read_next_x(oenv, status, &t, x, box));
+        while (read_next_x_prefetch(status, &t, x, box));
     }
     else if (method[0] == 's' && bSpectrum == TRUE && fade == 0.0 && bThetaswipe == TRUE )
     {
@@ -538,53 +710,40 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
             }
             set_pbc(&pbc, ePBCrdf, box_pbc);
             invvol      = 1/det(box_pbc);
-            invvol_sum += invvol;
             for (g = 0; g < ng; g++)
             {
-                snew(cos_tq, nfaces);
-                snew(sin_tq, nfaces);
-                snew(mu_sq_t, nfaces); 
-
-                for (rr = 0; rr < nfaces; rr++)
+                for (k = 0; k < 2*ngeom*nqpad; k++)
                 {
-                   snew(cos_tq[rr], nbintheta);
-                   snew(sin_tq[rr], nbintheta);
-                   snew(mu_sq_t[rr], nbintheta);
-                   for (tt = 0; tt < nbintheta; tt++)
-                   {
-                       snew(cos_tq[rr][tt],nbingamma);
-                       snew(sin_tq[rr][tt],nbingamma);
-                       snew(mu_sq_t[rr][tt], nbintheta);
-                       for (c = 0; c <nbingamma; c++)
-                       {
-                           snew(cos_tq[rr][tt][c],nbinq);
-                           snew(sin_tq[rr][tt][c],nbinq);
-                       }
-                   }
+                    tq_arena[k] = 0;
+                }
+                for (geom = 0; geom < ngeom; geom++)
+                {
+                    mu_sq_t[geom] = 0;
                 }
                 for (i = 0; i < isize0; i++)
                 {
-                    ind0  = mols->index[molindex[g][i]];
-                    copy_rvec(x[ind0], xi);
-                    pbc_dx(&pbc, xi, x[ind0+1], x01);
-                    pbc_dx(&pbc, xi, x[ind0+2], x02);
-                    for (rr = 0; rr < nfaces; rr++)
+                    a0_mol[i] = mols->index[molindex[g][i]];
+                    copy_rvec(x[a0_mol[i]], x_i1[i]);
+                }
+                calc_molframes(&mf, &pbc, isize0, a0_mol, x, norm_x, norm_z);
+                for (rr = 0; rr < nfaces; rr++)
+                {
+                    for (tt = 0; tt < nbintheta; tt++ )
                     {
-                        for (tt = 0; tt < nbintheta; tt++ )
+                        for (c  = 0; c < nbingamma; c++)
                         {
-                            for (c  = 0; c < nbingamma; c++)
+                            geom   = (rr*nbintheta + tt)*nbingamma + c;
+                            cos_tq = tq_arena + 2*geom*nqpad;
+                            sin_tq = cos_tq + nqpad;
+                            molframes_contract(&mf, beta_mol, vec_pout_theta_gamma[rr][tt][c],
+                                               vec_pin_theta_gamma[rr][tt][c], vec_pin_theta_gamma[rr][tt][c], mu_mol);
+                            for (i = 0; i < isize0; i++)
                             {
-                                induced_second_order_dipole(norm_x, norm_z, x01, x02, vec_pout_theta_gamma[rr][tt][c], vec_pin_theta_gamma[rr][tt][c], beta_mol, &mu_ind);
-                                mu_sq_t[rr][tt][c] += mu_ind*mu_ind;
-                                for (qq = 0; qq < nbinq; qq++)
-                                {
-                                    q_xi = iprod(arr_qvec_faces[rr][qq],xi);
-                                    cos_tq[rr][tt][c][qq] += mu_ind*cos(q_xi);
-                                    sin_tq[rr][tt][c][qq] += mu_ind*sin(q_xi);
-                                }
+                                mu_sq_t[geom] += mu_mol[i]*mu_mol[i];
+                                qloop_cossin_qx(&qsoa_faces[rr], x_i1[i], mu_mol[i], cos_tq, sin_tq);
                             }
                         }
-                     }
+                    }
                 }
                 for (rr = 0; rr < nfaces; rr++)
                 {
@@ -592,10 +751,13 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
                    {
                        for (c = 0; c < nbingamma; c++)
                        {
-                           incoh_temp = mu_sq_t[rr][tt][c]*invsize0;
+                           geom       = (rr*nbintheta + tt)*nbingamma + c;
+                           cos_tq     = tq_arena + 2*geom*nqpad;
+                           sin_tq     = cos_tq + nqpad;
+                           incoh_temp = mu_sq_t[geom]*invsize0;
                            for (qq = 0; qq < nbinq; qq++)
                            {
-                              tot_temp = (cos_tq[rr][tt][c][qq]*cos_tq[rr][tt][c][qq] + sin_tq[rr][tt][c][qq]*sin_tq[rr][tt][c][qq])*invsize0;
+                              tot_temp = (cos_tq[qq]*cos_tq[qq] + sin_tq[qq]*sin_tq[qq])*invsize0;
                               s_method_t[g][rr][tt][qq] +=  tot_temp  ;
                               s_method_coh_t[g][rr][tt][qq] += tot_temp - incoh_temp;
                               s_method_incoh_t[g][rr][tt][qq] += incoh_temp ;
@@ -604,29 +766,23 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
                    }
                 }
             }
-            for (rr = 0; rr < nfaces; rr++)
+            shstheta_columns(TRUE, acc_val, ng, nq, s_method, s_method_coh, s_method_incoh,
+                             bThetaswipe ? nfaces : 0, nbintheta, nbinq,
+                             s_method_t, s_method_coh_t, s_method_incoh_t);
+            acc_val[acc.ncol-1] = invvol;
+            if (sqaccum_add(&acc, acc_val, 1, t))
             {
-               for (tt  = 0; tt < nbintheta; tt++)
-               {
-                   for (c = 0; c < nbingamma; c++)
-                   {
-                      sfree(cos_tq[rr][tt][c]);
-                      sfree(sin_tq[rr][tt][c]);
-                   }
-                   sfree(cos_tq[rr][tt]);
-                   sfree(sin_tq[rr][tt]);
-                   sfree(mu_sq_t[rr][tt]);
-               }
-               sfree(cos_tq[rr]);
-               sfree(sin_tq[rr]);
-               sfree(mu_sq_t[rr]);
+                if (fnERR)
+                {
+                    shstheta_write_err(fnERR, &acc, nq, arr_qvec, oenv);
+                }
+                if (fnCPO)
+                {
+                    sqaccum_write(&acc, "nonlinearopticalscatteringtheta", fnCPO);
+                }
             }
-            sfree(cos_tq);
-            sfree(sin_tq);
-            sfree(mu_sq_t);
-            nframes++;
         }
-        while (read_next_x(oenv, status, &t, x, box));
+        while (read_next_x_prefetch(status, &t, x, box));
     }
 
     else if ((fade == 0.0  && method[0]=='m') || (method[0] == 's' && fade != 0.0) || bSpectrum == FALSE  )
@@ -639,10 +795,27 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
         gmx_rmpbc_done(gpbc);
     }
     
-    close_trj(status);
+    close_trj_prefetch(status);
 
     sfree(x);
 
+    /* The output below is computed from the accumulated sums */
+    if (fnERR)
+    {
+        shstheta_write_err(fnERR, &acc, nq, arr_qvec, oenv);
+    }
+    if (fnCPO)
+    {
+        sqaccum_write(&acc, "nonlinearopticalscatteringtheta", fnCPO);
+    }
+    nframes = acc.nframes;
+    shstheta_columns(FALSE, acc.sum, ng, nq, s_method, s_method_coh, s_method_incoh,
+                     bThetaswipe ? nfaces : 0, nbintheta, nbinq,
+                     s_method_t, s_method_coh_t, s_method_incoh_t);
+    invvol_sum = acc.sum[acc.ncol-1];
+    done_sqaccum(&acc);
+    sfree(acc_val);
+
     /* Average volume */
     invvol = invvol_sum/nframes;
     if (bSpectrum == FALSE)
@@ -885,10 +1058,24 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
     sfree(beta_mol_1d);
     sfree(s_method);
     sfree(s_method_coh);
+    if (bSpectrum == TRUE)
+    {
+        done_qvec_soa(&qsoa);
+        if (bThetaswipe == TRUE)
+        {
+            for (rr = 0; rr < nfaces; rr++)
+            {
+                done_qvec_soa(&qsoa_faces[rr]);
+            }
+            sfree(qsoa_faces);
+            qloop_sfree(tq_arena);
+            sfree(mu_sq_t);
+        }
+    }
     sfree(arr_qvec);
-    sfree(cos_t);
-    sfree(sin_t);
-    sfree(temp_method);
+    qloop_sfree(cos_t);
+    qloop_sfree(sin_t);
+    qloop_sfree(temp_method);
     sfree(cq);
     sfree(sq);
     sfree(c_square);
@@ -896,6 +1083,10 @@ static void do_nonlinearopticalscatteringtheta(t_topology *top, /*const char *fn
     sfree(cs_sc);
     sfree(beta_lab_1_t);
     sfree(beta_lab_2_t);
+    done_molframes(&mf);
+    done_molbeta(nmb, mb);
+    sfree(a0_mol);
+    sfree(mu_mol);
 
 
     for (i = 0; i < DIM; i++)
@@ -1032,28 +1223,8 @@ void rotate_wave_vec(const rvec wave_vec, const int rot_label, rvec rot_vec)
 
 void induced_second_order_dipole(real invnormx, real invnormz, const rvec xv2, const rvec xv3, const rvec pout, const rvec pin, real ***betamol, real *mu_ind)
 {
-    int i, j, k;
-    int p, l, m;
-    rvec xvec, yvec, zvec;
-    //betal is the hyperpolarizability in lab frame
-    real ***betal, **cosdirmat, mu_temp = 0.0;
-
-    //initialize beta
-    snew(betal, DIM);
-    snew(cosdirmat, DIM);
-    for (i = 0; i < DIM; i++)
-    {
-        snew(betal[i], DIM);
-        snew(cosdirmat[i], DIM);
-    }
-    
-    for (i = 0; i < DIM; i++)
-    {
-        for (j = 0; j < DIM; j++)
-        {
-            snew(betal[i][j], DIM);
-        }
-    }
+    int  p, q, r;
+    rvec xvec, yvec, zvec, pout_mol, pin_mol;
 
     rvec_sub( xv2, xv3, xvec); /*this is x molecular axis*/
     svmul(invnormx, xvec ,xvec );
@@ -1061,69 +1232,27 @@ void induced_second_order_dipole(real invnormx, real invnormz, const rvec xv2, c
     svmul(invnormz, zvec, zvec ); /*this is z molecular axis*/
     cprod(xvec , zvec, yvec); /*this is y molecular axis*/
 
-    cosdirmat[0][0] = xvec[0]; cosdirmat[0][1] = yvec[0]; cosdirmat[0][2] = zvec[0];
-    cosdirmat[1][0] = xvec[1]; cosdirmat[1][1] = yvec[1]; cosdirmat[1][2] = zvec[1];
-    cosdirmat[2][0] = xvec[2]; cosdirmat[2][1] = yvec[2]; cosdirmat[2][2] = zvec[2];
+    //mu = sum (i,j,k) (eout dot i) (ein dot j) (ein dot k) beta_lab_i,j,k with
+    //beta_lab(i,j,k)=sum(p,q,r) c_i,p c_j,q c_k,r * beta_mol_p,q,r, so it is cheaper
+    //to project the polarization vectors on the molecular axes and contract with beta_mol
+    pout_mol[XX] = iprod(xvec, pout);
+    pout_mol[YY] = iprod(yvec, pout);
+    pout_mol[ZZ] = iprod(zvec, pout);
+    pin_mol[XX]  = iprod(xvec, pin);
+    pin_mol[YY]  = iprod(yvec, pin);
+    pin_mol[ZZ]  = iprod(zvec, pin);
 
-    //compute beta_lab as beta_lab(i,j,k)=sum(p,q,r) c_i,p c_j,q c_k,r * beta_mol_p,q,r
-    // the loops over p,q,r have been contracted using mathematica FullSimplify
-    for (i = 0; i < DIM; i++)
+    *mu_ind = 0;
+    for (p = 0; p < DIM; p++)
     {
-        for (j = 0; j < DIM; j++)
+        for (q = 0; q < DIM; q++)
         {
-           for (k = 0; k < DIM; k++)
-           {
-               betal[i][j][k] = cosdirmat[i][ 0]*(cosdirmat[j][ 0]*(betamol[0][ 0][ 0]*cosdirmat[k][ 0] + 
-                                   betamol[0][ 0][ 1]*cosdirmat[k][ 1] + betamol[0][ 0][ 2]*cosdirmat[k][ 2]) + 
-                                   cosdirmat[j][ 1]*(betamol[0][ 1][ 0]*cosdirmat[k][ 0] + betamol[0][ 1][ 1]*cosdirmat[k][ 1] + 
-                                   betamol[0][ 1][ 2]*cosdirmat[k][ 2]) + cosdirmat[j][ 2]*(betamol[0][2][ 0]*cosdirmat[k][ 0] + 
-                                   betamol[0][ 2][ 1]*cosdirmat[k][ 1] + betamol[0][ 2][ 2]*cosdirmat[k][ 2])) + 
-                                   cosdirmat[i][ 1]*(cosdirmat[j][ 0]*(betamol[1][ 0][ 0]*cosdirmat[k][ 0] + 
-                                   betamol[1][ 0][ 1]*cosdirmat[k][ 1] + betamol[1][ 0][ 2]*cosdirmat[k][ 2]) + 
-                                   cosdirmat[j][ 1]*(betamol[1][ 1][ 0]*cosdirmat[k][ 0] + betamol[1][ 1][ 1]*cosdirmat[k][ 1] + 
-                                   betamol[1][ 1][ 2]*cosdirmat[k][ 2]) + cosdirmat[j][ 2]*(betamol[1][ 2][ 0]*cosdirmat[k][ 0] + 
-                                   betamol[1][ 2][ 1]*cosdirmat[k][ 1] + betamol[1][ 2][ 2]*cosdirmat[k][ 2])) + 
-                                   cosdirmat[i][ 2]*(cosdirmat[j][ 0]*(betamol[2][ 0][ 0]*cosdirmat[k][ 0] + 
-                                   betamol[2][ 0][ 1]*cosdirmat[k][ 1] + betamol[2][ 0][ 2]*cosdirmat[k][ 2]) + 
-                                   cosdirmat[j][ 1]*(betamol[2][  1][ 0]*cosdirmat[k][ 0] + betamol[2][ 1][ 1]*cosdirmat[k][ 1] + 
-                                   betamol[2][ 1][ 2]*cosdirmat[k][ 2]) + cosdirmat[j][ 2]*(betamol[2][ 2][ 0]*cosdirmat[k][ 0] + 
-                                   betamol[2][ 2][ 1]*cosdirmat[k][ 1] + betamol[2][ 2][ 2]*cosdirmat[k][ 2])) ;
-           } 
-        }
-    }
- 
-    //compute induced dipole component as mu = sum (i,j,k) (eout dot i) (ein dot j) (ein dot k) beta_lab_i,j,k
-    // the loops over i,j,k have been contracted using mathematica FullSimplify
-    *mu_ind =  betal[0][ 0][ 0]*pin[0]*pin[0]*pout[0] + betal[0][ 0][ 1]*pin[0]*pin[1]*pout[0] +
-               betal[0][ 1][ 0]*pin[0]*pin[1]*pout[0] + betal[0][ 1][ 1]*pin[1]*pin[1]*pout[0] +
-               betal[0][ 0][ 2]*pin[0]*pin[2]*pout[0] + betal[0][ 2][ 0]*pin[0]*pin[2]*pout[0] +
-               betal[0][ 1][ 2]*pin[1]*pin[2]*pout[0] + betal[0][ 2][ 1]*pin[1]*pin[2]*pout[0] +
-               betal[0][ 2][ 2]*pin[2]*pin[2]*pout[0] + betal[1][ 0][ 0]*pin[0]*pin[0]*pout[1] +
-               betal[1][ 0][ 1]*pin[0]*pin[1]*pout[1] + betal[1][ 1][ 0]*pin[0]*pin[1]*pout[1] +
-               betal[1][ 1][ 1]*pin[1]*pin[1]*pout[1] + betal[1][ 0][ 2]*pin[0]*pin[2]*pout[1] + 
-               betal[1][ 2][ 0]*pin[0]*pin[2]*pout[1] + betal[1][ 1][ 2]*pin[1]*pin[2]*pout[1] + 
-               betal[1][ 2][ 1]*pin[1]*pin[2]*pout[1] + betal[1][ 2][ 2]*pin[2]*pin[2]*pout[1] + 
-               (betal[2][ 0][ 0]*pin[0]*pin[0] + pin[1]*((betal[2][ 0][ 1] + betal[2][ 1][ 0])*pin[0] + 
-               betal[2][ 1][ 1]*pin[1]) + ((betal[2][ 0][ 2] + betal[2][ 2][ 0])*pin[0] + 
-               (betal[2][ 1][ 2] + betal[2][ 2][ 1])*pin[1])*pin[2] + betal[2][ 2][ 2]*pin[2]*pin[2])*pout[2] ;
-
-    //FREE beta lab
-    for (i = 0; i < DIM; i++)
-    {
-        for (j = 0; j < DIM; j++)
-        {
-            sfree(betal[i][j]);
+            for (r = 0; r < DIM; r++)
+            {
+                *mu_ind += betamol[p][q][r]*pout_mol[p]*pin_mol[q]*pin_mol[r];
+            }
         }
     }
-    
-    for (j = 0; j < DIM; j++)
-    {
-        sfree(betal[j]);
-        sfree(cosdirmat[j]);
-    }
-    
-    sfree(betal);
-    sfree(cosdirmat);
 }
 
 void dipole_atom2mol(int *n, int *index, t_block *mols)
@@ -1174,11 +1303,25 @@ int gmx_nonlinearopticalscatteringtheta(int argc, char *argv[])
         "pout, pin1, pin2 are the polarization directions of the three beams.",
         "Common polarization combinations are PSS, PPP, SPP, SSS .",
         "Under Kleinmann symmetry (default) beta_ijj = beta_jij = beta_jji otherwise beta_ijj = beta_jij. [PAR]",
+        "With [TT]-beta[tt] the hyperpolarizabilities are read from a file instead of",
+        "using the built-in values for water, which allows other solvents and mixtures.",
+        "Per molecule type the file lists the residue name, the numbers within the",
+        "molecule of the three atoms that define the molecular frame (apex, first and",
+        "second atom) and the 27 components beta_pqr in that frame, r running fastest.",
+        "z is along the sum of the two vectors from the first and second atom to the apex,",
+        "x along their difference made orthogonal to z, and y = x cross z, as for the",
+        "built-in water frame; [TT]-klein[tt] does not apply to such a tensor.[PAR]",
+        "With [TT]-block[tt] the frames are divided in blocks of this many frames and the",
+        "intensity of the first group with its block-averaged standard error is written",
+        "to [TT]-oerr[tt] after every block (not with [TT]-thetaswipe[tt]). [TT]-cpo[tt] writes the accumulated sums, including",
+        "those of [TT]-thetaswipe[tt], to a checkpoint file after every block and at the end,",
+        "and [TT]-cpi[tt] continues from such a file with the frames after the last",
+        "accumulated time.[PAR]",
     };
     static gmx_bool    bPBC = TRUE, bKleinmannsymm = TRUE, bSpectrum = TRUE, bThetaswipe = FALSE;
     static real        fade = 0.0;
     static real        koutx = 1.0, kouty = 0.0 , koutz = 0.0, kinx = 0.0, kiny = 0.0, kinz = 1.0, pout_angle = 0.0 , pin_angle = 0.0;
-    static int         ngroups = 1, nbintheta = 10, nbingamma = 2 ,qbin = 1, nbinq = 10 ;
+    static int         ngroups = 1, nbintheta = 10, nbingamma = 2 ,qbin = 1, nbinq = 10, nblock = 0;
 
     static const char *methodt[] = { NULL, "modsumexp", "sumexp" ,NULL }; 
 
@@ -1211,10 +1354,12 @@ int gmx_nonlinearopticalscatteringtheta(int argc, char *argv[])
         { "-fade",     FALSE, etREAL, {&fade},
           "In the method the modification function cos((rij-fade)*pi/(2*(L/2-fade))) is used in the fourier transform."
           " If fade is 0.0 nothing is done." },
+        { "-block",    FALSE, etINT, {&nblock},
+          "Number of frames per block for the error estimate, intermediate output and checkpoints. 0 means no blocks." },
 
     };
 #define NPA asize(pa)
-    const char        *fnTPS, *fnNDX;
+    const char        *fnTPS, *fnNDX, *fnERR;
     output_env_t       oenv;
     int           *gnx;
     int            nFF[2];
@@ -1228,6 +1373,10 @@ int gmx_nonlinearopticalscatteringtheta(int argc, char *argv[])
         { efNDX, NULL,  NULL,     ffOPTRD },
         { efXVG, "-o",  "non_linear_sfact",    ffWRITE },
         { efXVG, "-otheta", "non_linear_sfact_vs_theta", ffOPTWR },
+        { efXVG, "-oerr", "non_linear_sfact_err", ffOPTWR },
+        { efDAT, "-beta", "beta", ffOPTRD },
+        { efSQA, "-cpi", "non_linear_sfact_theta", ffOPTRD },
+        { efSQA, "-cpo", "non_linear_sfact_theta", ffOPTWR },
 
     };
 #define NFILE asize(fnm)
@@ -1245,6 +1394,17 @@ int gmx_nonlinearopticalscatteringtheta(int argc, char *argv[])
         return 0;
     }
 
+    if (nblock < 0)
+    {
+        gmx_fatal(FARGS, "The block length should be 0 or positive, not %d", nblock);
+    }
+    fnERR = opt2fn_null("-oerr", NFILE, fnm);
+    if (bThetaswipe && fnERR)
+    {
+        fprintf(stderr, "\nNote: -oerr is not written with -thetaswipe\n");
+        fnERR = NULL;
+    }
+
     fnTPS = ftp2fn_null(efTPS, NFILE, fnm);
     fnNDX = ftp2fn_null(efNDX, NFILE, fnm);
 
@@ -1268,9 +1428,12 @@ int gmx_nonlinearopticalscatteringtheta(int argc, char *argv[])
     dipole_atom2mol(&gnx[0], grpindex[0], &(top->mols));
    
     do_nonlinearopticalscatteringtheta(top, ftp2fn(efTRX, NFILE, fnm),
-           opt2fn("-o", NFILE, fnm), opt2fn("-otheta", NFILE, fnm), methodt[0],  bPBC, bKleinmannsymm, bSpectrum , bThetaswipe, qbin, nbinq,
+           opt2fn("-o", NFILE, fnm), opt2fn("-otheta", NFILE, fnm),
+           fnERR, opt2fn_null("-cpi", NFILE, fnm),
+           opt2fn_null("-cpo", NFILE, fnm), nblock, methodt[0],  bPBC, bKleinmannsymm, bSpectrum , bThetaswipe, qbin, nbinq,
            koutx, kouty, koutz, kinx, kiny, kinz  ,nbintheta, nbingamma, pin_angle, pout_angle, 
-           fade, gnx, grpindex, grpname, ngroups, oenv);
+           fade, gnx, grpindex, grpname, ngroups, oenv,
+           opt2fn_null("-beta", NFILE, fnm));
 
     return 0;
 }
@@ -51,6 +51,7 @@
 #include "gromacs/commandline/pargs.h"
 #include "gromacs/fileio/tpxio.h"
 #include "gromacs/fileio/trxio.h"
+#include "gromacs/fileio/trxprefetch.h"
 #include "physics.h"
 #include "index.h"
 #include "gromacs/utility/smalloc.h"
@@ -61,6 +62,8 @@
 #include "gromacs/fileio/matio.h"
 #include "gmx_ana.h"
 #include "names.h"
+#include "cellgrid.h"
+#include "gromacs/utility/gmxomp.h"
 
 #include "gromacs/legacyheaders/gmx_fatal.h"
 
@@ -176,19 +179,65 @@ static void split_group(int isize, int *index, char *grpname,
     *coi_out = coi;
 }
 
+/* Adds the pairs between the reference position xi and n positions of
+ * the selection to the RDF histogram count. x and sel_index hold the
+ * positions and atom numbers of the selection. When jlist is not NULL
+ * the pairs are formed with selection positions jlist[0..n-1], otherwise
+ * with 0..n-1. Atoms marked in the exclusion bitmap exclbits (can be NULL)
+ * are skipped. When pbc is NULL plain distance vectors are used.
+ */
+static void rdf_count_ref(const t_pbc *pbc, gmx_bool bXY, const rvec xi,
+                          rvec *x, const atom_id *sel_index,
+                          const int *jlist, int n, const unsigned char *exclbits,
+                          real cut2, real rmax2, real invhbinw, int *count)
+{
+    int  j, jj;
+    rvec dx;
+    real r2;
+
+    for (j = 0; j < n; j++)
+    {
+        jj = (jlist != NULL) ? jlist[j] : j;
+        if (exclbits != NULL && excl_bitmap_test(exclbits, sel_index[jj]))
+        {
+            continue;
+        }
+        if (pbc != NULL)
+        {
+            pbc_dx(pbc, xi, x[jj], dx);
+        }
+        else
+        {
+            rvec_sub(xi, x[jj], dx);
+        }
+        if (bXY)
+        {
+            r2 = dx[XX]*dx[XX] + dx[YY]*dx[YY];
+        }
+        else
+        {
+            r2 = iprod(dx, dx);
+        }
+        if (r2 > cut2 && r2 <= rmax2)
+        {
+            count[(int)(sqrt(r2)*invhbinw)]++;
+        }
+    }
+}
+
 static void do_rdf(const char *fnNDX, const char *fnTPS, const char *fnTRX,
                    const char *fnRDF, const char *fnCNRDF, const char *fnHQ,
                    gmx_bool bCM, const char *close,
                    const char **rdft, gmx_bool bXY, gmx_bool bPBC, gmx_bool bNormalize,
-                   real cutoff, real maxq, real minq, int nbinq, real binwidth, real fade, real fade2, int ng,
-                   const output_env_t oenv)
+                   real cutoff, real maxq, real minq, int nbinq, real binwidth, real fade, real fade2,
+                   real rcut, int ng, int nthreads, const output_env_t oenv)
 {
     FILE          *fp;
-    t_trxstatus   *status;
+    t_trxprefetch *status;
     char           outf1[STRLEN], outf2[STRLEN];
     char           title[STRLEN], gtitle[STRLEN], refgt[30];
     int            g, natoms, i, ii, j, k, nbin, j0, j1, n, nframes;
-    int          **count;
+    int          **count, **thr_count, th, b;
     char         **grpname;
     int           *isize, isize_cm = 0, nrdf = 0, max_i, isize0, isize_g;
     atom_id      **index, *index_cm = NULL;
@@ -197,10 +246,11 @@ static void do_rdf(const char *fnNDX, const char *fnTPS, const char *fnTRX,
     real           segvol, spherevol, prev_spherevol, **rdf;
     rvec          *x, dx, *x0 = NULL, *x_i1, xi;
     real          *inv_segvol, invvol, invvol_sum, rho;
-    gmx_bool       bClose, *bExcl, bTop, bNonSelfExcl;
+    gmx_bool       bClose, bTop;
     matrix         box, box_pbc;
-    int          **npairs;
-    atom_id        ix, jx, ***pairs;
+    atom_id        ix;
+    unsigned char **thr_excl = NULL;
+    t_cellgrid     grid;
     t_topology    *top  = NULL;
     int            ePBC = -1, ePBCrdf = -1;
     t_block       *mols = NULL;
@@ -278,7 +328,7 @@ static void do_rdf(const char *fnNDX, const char *fnTPS, const char *fnTRX,
         isize0 = isize[0];
     }
 
-    natoms = read_first_x(oenv, &status, fnTRX, &t, &x, box);
+    natoms = read_first_x_prefetch(oenv, &status, fnTRX, &t, &x, box);
     if (!natoms)
     {
         gmx_fatal(FARGS, "Could not read coordinates from statusfile\n");
@@ -340,6 +390,10 @@ static void do_rdf(const char *fnNDX, const char *fnTPS, const char *fnTRX,
     {
         rmax2   = sqr(3*max(box[XX][XX], max(box[YY][YY], box[ZZ][ZZ])));
     }
+    if (rcut > 0 && sqr(rcut) < rmax2)
+    {
+        rmax2 = sqr(rcut);
+    }
     if (debug)
     {
         fprintf(debug, "rmax2 = %g\n", rmax2);
@@ -353,11 +407,13 @@ static void do_rdf(const char *fnNDX, const char *fnTPS, const char *fnTRX,
     inv_width = (fade2 == 0.0 ) ? 1.0 : M_PI*0.5/(sqrt(rmax2)-fade2) ;
     cut2     = sqr(cutoff);
 
-    snew(count, ng);
-    snew(pairs, ng);
-    snew(npairs, ng);
+    /* We can only have exclusions with atomic rdfs */
+    if (rdft[0][0] != 'a')
+    {
+        excl = NULL;
+    }
 
-    snew(bExcl, natoms);
+    snew(count, ng);
     max_i = 0;
     for (g = 0; g < ng; g++)
     {
@@ -368,63 +424,27 @@ static void do_rdf(const char *fnNDX, const char *fnTPS, const char *fnTRX,
 
         /* this is THE array */
         snew(count[g], nbin+1);
+    }
 
-        /* make pairlist array for groups and exclusions */
-        snew(pairs[g], isize[0]);
-        snew(npairs[g], isize[0]);
-        for (i = 0; i < isize[0]; i++)
+    /* Per thread an RDF histogram, reduced in thread order after each
+     * group, and when needed an exclusion bitmap of the reference atom.
+     */
+    nthreads = min((nthreads <= 0) ? INT_MAX : nthreads, gmx_omp_get_max_threads());
+    gmx_omp_set_num_threads(nthreads);
+    snew(thr_count, nthreads);
+    for (th = 0; th < nthreads; th++)
+    {
+        snew(thr_count[th], nbin+1);
+    }
+    if (excl)
+    {
+        snew(thr_excl, nthreads);
+        for (th = 0; th < nthreads; th++)
         {
-            /* We can only have exclusions with atomic rdfs */
-            if (!(bCM || bClose || rdft[0][0] != 'a'))
-            {
-                ix = index[0][i];
-                for (j = 0; j < natoms; j++)
-                {
-                    bExcl[j] = FALSE;
-                }
-                /* exclusions? */
-                if (excl)
-                {
-                    for (j = excl->index[ix]; j < excl->index[ix+1]; j++)
-                    {
-                        bExcl[excl->a[j]] = TRUE;
-                    }
-                }
-                k = 0;
-                snew(pairs[g][i], isize[g+1]);
-                bNonSelfExcl = FALSE;
-                for (j = 0; j < isize[g+1]; j++)
-                {
-                    jx = index[g+1][j];
-                    if (!bExcl[jx])
-                    {
-                        pairs[g][i][k++] = jx;
-                    }
-                    else if (ix != jx)
-                    {
-                        /* Check if we have exclusions other than self exclusions */
-                        bNonSelfExcl = TRUE;
-                    }
-                }
-                if (bNonSelfExcl)
-                {
-                    npairs[g][i] = k;
-                    srenew(pairs[g][i], npairs[g][i]);
-                }
-                else
-                {
-                    /* Save a LOT of memory and some cpu cycles */
-                    npairs[g][i] = -1;
-                    sfree(pairs[g][i]);
-                }
-            }
-            else
-            {
-                npairs[g][i] = -1;
-            }
+            snew(thr_excl[th], EXCL_BITMAP_SIZE(natoms));
         }
     }
-    sfree(bExcl);
+    init_cellgrid(&grid);
 
     snew(x_i1, max_i);
     nframes    = 0;
@@ -486,135 +506,118 @@ static void do_rdf(const char *fnNDX, const char *fnTPS, const char *fnTRX,
                 calc_comg(is[g+1], coi[g+1], index[g+1], rdft[0][6] == 'm', atom, x, x_i1);
             }
 
-            for (i = 0; i < isize0; i++)
+            if (rdft[0][0] == 'a')
             {
-                if (bClose)
-                {
-                    /* Special loop, since we need to determine the minimum distance
-                     * over all selected atoms in the reference molecule/residue.
-                     */
-                    if (rdft[0][0] == 'a')
-                    {
-                        isize_g = isize[g+1];
-                    }
-                    else
-                    {
-                        isize_g = is[g+1];
-                    }
-                    for (j = 0; j < isize_g; j++)
-                    {
-                        r2 = 1e30;
-                        /* Loop over the selected atoms in the reference molecule */
-                        for (ii = coi[0][i]; ii < coi[0][i+1]; ii++)
-                        {
-                            if (bPBC)
-                            {
-                                pbc_dx(&pbc, x[index[0][ii]], x_i1[j], dx);
-                            }
-                            else
-                            {
-                                rvec_sub(x[index[0][ii]], x_i1[j], dx);
-                            }
-                            if (bXY)
-                            {
-                                r2ii = dx[XX]*dx[XX] + dx[YY]*dx[YY];
-                            }
-                            else
-                            {
-                                r2ii = iprod(dx, dx);
-                            }
-                            if (r2ii < r2)
-                            {
-                                r2 = r2ii;
-                            }
-                        }
-                        if (r2 > cut2 && r2 <= rmax2)
-                        {
-                            count[g][(int)(sqrt(r2)*invhbinw)]++;
-                        }
-                    }
-                }
-                else
+                isize_g = isize[g+1];
+            }
+            else
+            {
+                isize_g = is[g+1];
+            }
+            if (bPBC && !bClose)
+            {
+                put_on_cellgrid(&grid, ePBCrdf, box_pbc, sqrt(rmax2), isize_g, x_i1);
+            }
+
+#pragma omp parallel num_threads(nthreads) private(th, i, ii, j, ix, r2, r2ii, dx, xi)
+            {
+                th = gmx_omp_get_thread_num();
+#pragma omp for schedule(static)
+                for (i = 0; i < isize0; i++)
                 {
-                    /* Real rdf between points in space */
-                    if (bCM || rdft[0][0] != 'a')
-                    {
-                        copy_rvec(x0[i], xi);
-                    }
-                    else
+                    if (bClose)
                     {
-                        copy_rvec(x[index[0][i]], xi);
-                    }
-                    if (rdft[0][0] == 'a' && npairs[g][i] >= 0)
-                    {
-                        /* Expensive loop, because of indexing */
-                        for (j = 0; j < npairs[g][i]; j++)
+                        /* Special loop, since we need to determine the minimum distance
+                         * over all selected atoms in the reference molecule/residue.
+                         */
+                        for (j = 0; j < isize_g; j++)
                         {
-                            jx = pairs[g][i][j];
-                            if (bPBC)
-                            {
-                                pbc_dx(&pbc, xi, x[jx], dx);
-                            }
-                            else
-                            {
-                                rvec_sub(xi, x[jx], dx);
-                            }
-
-                            if (bXY)
+                            r2 = 1e30;
+                            /* Loop over the selected atoms in the reference molecule */
+                            for (ii = coi[0][i]; ii < coi[0][i+1]; ii++)
                             {
-                                r2 = dx[XX]*dx[XX] + dx[YY]*dx[YY];
-                            }
-                            else
-                            {
-                                r2 = iprod(dx, dx);
+                                if (bPBC)
+                                {
+                                    pbc_dx(&pbc, x[index[0][ii]], x_i1[j], dx);
+                                }
+                                else
+                                {
+                                    rvec_sub(x[index[0][ii]], x_i1[j], dx);
+                                }
+                                if (bXY)
+                                {
+                                    r2ii = dx[XX]*dx[XX] + dx[YY]*dx[YY];
+                                }
+                                else
+                                {
+                                    r2ii = iprod(dx, dx);
+                                }
+                                if (r2ii < r2)
+                                {
+                                    r2 = r2ii;
+                                }
                             }
                             if (r2 > cut2 && r2 <= rmax2)
                             {
-                                count[g][(int)(sqrt(r2)*invhbinw)]++;
+                                thr_count[th][(int)(sqrt(r2)*invhbinw)]++;
                             }
                         }
                     }
                     else
                     {
-                        /* Cheaper loop, no exclusions */
-                        if (rdft[0][0] == 'a')
+                        /* Real rdf between points in space */
+                        if (bCM || rdft[0][0] != 'a')
                         {
-                            isize_g = isize[g+1];
+                            copy_rvec(x0[i], xi);
                         }
                         else
                         {
-                            isize_g = is[g+1];
+                            copy_rvec(x[index[0][i]], xi);
                         }
-                        for (j = 0; j < isize_g; j++)
+                        if (excl)
                         {
-                            if (bPBC)
-                            {
-                                pbc_dx(&pbc, xi, x_i1[j], dx);
-                            }
-                            else
-                            {
-                                rvec_sub(xi, x_i1[j], dx);
-                            }
-                            if (bXY)
-                            {
-                                r2 = dx[XX]*dx[XX] + dx[YY]*dx[YY];
-                            }
-                            else
-                            {
-                                r2 = iprod(dx, dx);
-                            }
-                            if (r2 > cut2 && r2 <= rmax2)
+                            ix = index[0][i];
+                            excl_bitmap_mark(thr_excl[th], excl, ix, TRUE);
+                        }
+                        if (grid.bGrid)
+                        {
+                            int nbcell[27], ncell, c;
+
+                            ncell = cellgrid_nbcells(&grid, xi, nbcell);
+                            for (c = 0; c < ncell; c++)
                             {
-                                count[g][(int)(sqrt(r2)*invhbinw)]++;
+                                rdf_count_ref(&pbc, bXY, xi, x_i1, index[g+1],
+                                              grid.a + grid.cell_index[nbcell[c]],
+                                              grid.cell_index[nbcell[c]+1] - grid.cell_index[nbcell[c]],
+                                              excl ? thr_excl[th] : NULL,
+                                              cut2, rmax2, invhbinw, thr_count[th]);
                             }
                         }
+                        else
+                        {
+                            rdf_count_ref(bPBC ? &pbc : NULL, bXY, xi, x_i1, index[g+1],
+                                          NULL, isize_g, excl ? thr_excl[th] : NULL,
+                                          cut2, rmax2, invhbinw, thr_count[th]);
+                        }
+                        if (excl)
+                        {
+                            excl_bitmap_mark(thr_excl[th], excl, ix, FALSE);
+                        }
                     }
                 }
             }
+            for (th = 0; th < nthreads; th++)
+            {
+                for (b = 0; b <= nbin; b++)
+                {
+                    count[g][b]        += thr_count[th][b];
+                    thr_count[th][b]    = 0;
+                }
+            }
         }
         nframes++;
     }
-    while (read_next_x(oenv, status, &t, x, box));
+    while (read_next_x_prefetch(status, &t, x, box));
     fprintf(stderr, "\n");
 
     if (bPBC && (NULL != top))
@@ -622,9 +625,20 @@ static void do_rdf(const char *fnNDX, const char *fnTPS, const char *fnTRX,
         gmx_rmpbc_done(gpbc);
     }
 
-    close_trj(status);
+    close_trj_prefetch(status);
 
     sfree(x);
+    for (th = 0; th < nthreads; th++)
+    {
+        sfree(thr_count[th]);
+        if (excl)
+        {
+            sfree(thr_excl[th]);
+        }
+    }
+    sfree(thr_count);
+    sfree(thr_excl);
+    done_cellgrid(&grid);
 
     /* Average volume */
     invvol = invvol_sum/nframes;
@@ -873,11 +887,17 @@ int gmx_rdf(int argc, char *argv[])
         "Note that all atoms in the selected groups are used, also the ones",
         "that don't have Lennard-Jones interactions.[PAR]",
         "Option [TT]-cn[tt] produces the cumulative number RDF,",
-        "i.e. the average number of particles within a distance r.[PAR]"
+        "i.e. the average number of particles within a distance r.[PAR]",
+        "With [TT]-rcut[tt] the RDF is limited to a range shorter than half the box,",
+        "the pairs are then found with a cell list instead of looping over all pairs.",
+        "The loop over the reference group is parallelized with OpenMP;",
+        "the histograms of the threads are summed, so the output does not",
+        "depend on the number of threads.[PAR]"
     };
     static gmx_bool    bCM     = FALSE, bXY = FALSE, bPBC = TRUE, bNormalize = TRUE;
     static real        cutoff  = 0, binwidth = 0.002, maxq=100.0, minq=2.0*M_PI/1000.0, fade = 0.0, fade2 = 0.0;
-    static int         ngroups = 1, nbinq = 100;
+    static real        rcut    = 0;
+    static int         ngroups = 1, nbinq = 100, nthreads = 0;
 
     static const char *closet[] = { NULL, "no", "mol", "res", NULL };
     static const char *rdft[]   = { NULL, "atom", "mol_com", "mol_cog", "res_com", "res_cog", NULL };
@@ -905,6 +925,10 @@ int gmx_rdf(int argc, char *argv[])
           "Use only the x and y components of the distance" },
         { "-cut",      FALSE, etREAL, {&cutoff},
           "Shortest distance (nm) to be considered"},
+        { "-rcut",     FALSE, etREAL, {&rcut},
+          "Maximum distance (nm) of the RDF. Pairs are then found with a cell list. If rcut is 0.0 half the shortest box vector is used." },
+        { "-nthreads", FALSE, etINT, {&nthreads},
+          "Number of threads used for the parallel loop over the reference group. nthreads <= 0 means maximum number of threads. Requires linking with OpenMP." },
         { "-ng",       FALSE, etINT, {&ngroups},
           "Number of secondary groups to compute RDFs around a central group" },
         { "-fade",     FALSE, etREAL, {&fade},
@@ -963,8 +987,8 @@ int gmx_rdf(int argc, char *argv[])
     do_rdf(fnNDX, fnTPS, ftp2fn(efTRX, NFILE, fnm),
            opt2fn("-o", NFILE, fnm), opt2fn_null("-cn", NFILE, fnm),
            opt2fn_null("-hq", NFILE, fnm),
-           bCM, closet[0], rdft, bXY, bPBC, bNormalize, cutoff, maxq, minq, nbinq, binwidth, fade, fade2, ngroups,
-           oenv);
+           bCM, closet[0], rdft, bXY, bPBC, bNormalize, cutoff, maxq, minq, nbinq, binwidth, fade, fade2,
+           rcut, ngroups, nthreads, oenv);
 
     return 0;
 }
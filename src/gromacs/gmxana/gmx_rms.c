@@ -59,6 +59,7 @@
 #include "gmx_ana.h"
 
 #include "gromacs/math/do_fit.h"
+#include "gromacs/utility/gmxomp.h"
 
 static void norm_princ(t_atoms *atoms, int isize, atom_id *index, int natoms,
                        rvec *x)
@@ -93,6 +94,97 @@ static void norm_princ(t_atoms *atoms, int isize, atom_id *index, int natoms,
     }
 }
 
+/* The frame pairs of the RMSD matrix are processed in square tiles of
+ * this many frames, so the frames of a tile stay in cache.
+ */
+#define RMSD_TILE 32
+
+/* Computes the RMSD (or rho) matrix elements of all frame pairs i < j,
+ * or all pairs with bFile2, distributing tiles of the matrix over
+ * threads. With bFitAll the frames of mat_x2 are fitted to those of
+ * mat_x with the QCP method, which gives the RMSD directly when the
+ * fit and RMSD atoms and weights are the same.
+ */
+static void calc_rmsd_matrix(int tel_mat, int tel_mat2, gmx_bool bFile2,
+                             gmx_bool bFitAll, gmx_bool bRho, int n_ind_m,
+                             real *w_rls_m, int nrms, atom_id *ind_rms_m,
+                             real *w_rms_m, rvec **mat_x, rvec **mat_x2,
+                             real **rmsd_mat)
+{
+    int       ntile1, ntile2, nthreads, p, t1, t2, i, j, k, m, ai;
+    gmx_bool  bFitIsRms;
+    rvec    **xrot;
+    matrix    R;
+
+    /* The fit gives the RMSD without rotating when it uses the same weights */
+    bFitIsRms = bFitAll && !bRho;
+    for (k = 0; k < n_ind_m && bFitIsRms; k++)
+    {
+        bFitIsRms = (w_rls_m[k] == w_rms_m[k]);
+    }
+
+    ntile1   = (tel_mat + RMSD_TILE - 1)/RMSD_TILE;
+    ntile2   = (tel_mat2 + RMSD_TILE - 1)/RMSD_TILE;
+    nthreads = gmx_omp_get_max_threads();
+    snew(xrot, nthreads);
+
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic) private(t1, t2, i, j, k, m, ai, R)
+    for (p = 0; p < ntile1*ntile2; p++)
+    {
+        int thread = gmx_omp_get_thread_num();
+
+        t1 = p/ntile2;
+        t2 = p - t1*ntile2;
+        if (!bFile2 && t2 < t1)
+        {
+            continue;
+        }
+        if (bFitAll && !bFitIsRms && xrot[thread] == NULL)
+        {
+            snew(xrot[thread], n_ind_m);
+        }
+        for (i = t1*RMSD_TILE; i < min(tel_mat, (t1 + 1)*RMSD_TILE); i++)
+        {
+            for (j = t2*RMSD_TILE; j < min(tel_mat2, (t2 + 1)*RMSD_TILE); j++)
+            {
+                if (!bFile2 && j <= i)
+                {
+                    continue;
+                }
+                if (bFitIsRms)
+                {
+                    rmsd_mat[i][j] = calc_fit_R_qcp(n_ind_m, w_rls_m, mat_x[i], mat_x2[j], NULL);
+                }
+                else if (bFitAll)
+                {
+                    calc_fit_R_qcp(n_ind_m, w_rls_m, mat_x[i], mat_x2[j], R);
+                    for (k = 0; k < nrms; k++)
+                    {
+                        ai = ind_rms_m[k];
+                        for (m = 0; m < DIM; m++)
+                        {
+                            xrot[thread][ai][m] = iprod(R[m], mat_x2[j][ai]);
+                        }
+                    }
+                    rmsd_mat[i][j] = calc_similar_ind(bRho, nrms, ind_rms_m,
+                                                      w_rms_m, mat_x[i], xrot[thread]);
+                }
+                else
+                {
+                    rmsd_mat[i][j] = calc_similar_ind(bRho, nrms, ind_rms_m,
+                                                      w_rms_m, mat_x[i], mat_x2[j]);
+                }
+            }
+        }
+    }
+
+    for (k = 0; k < nthreads; k++)
+    {
+        sfree(xrot[k]);
+    }
+    sfree(xrot);
+}
+
 int gmx_rms(int argc, char *argv[])
 {
     const char     *desc[] =
@@ -859,7 +951,17 @@ int gmx_rms(int argc, char *argv[])
             }
         }
 
-        if (bFitAll)
+        if (bMat)
+        {
+            for (i = 0; i < tel_mat; i++)
+            {
+                snew(rmsd_mat[i], tel_mat2);
+            }
+            calc_rmsd_matrix(tel_mat, tel_mat2, bFile2, bFitAll, ewhat != ewRMSD,
+                             n_ind_m, w_rls_m, irms[0], ind_rms_m, w_rms_m,
+                             mat_x, mat_x2, rmsd_mat);
+        }
+        if (bFitAll && bBond)
         {
             snew(mat_x2_j, natoms);
         }
@@ -867,17 +969,13 @@ int gmx_rms(int argc, char *argv[])
         {
             axis[i] = time[freq*i];
             fprintf(stderr, "\r element %5d; time %5.2f  ", i, axis[i]);
-            if (bMat)
-            {
-                snew(rmsd_mat[i], tel_mat2);
-            }
             if (bBond)
             {
                 snew(bond_mat[i], tel_mat2);
             }
             for (j = 0; j < tel_mat2; j++)
             {
-                if (bFitAll)
+                if (bFitAll && bBond)
                 {
                     for (k = 0; k < n_ind_m; k++)
                     {
@@ -893,9 +991,6 @@ int gmx_rms(int argc, char *argv[])
                 {
                     if (bFile2 || (i < j))
                     {
-                        rmsd_mat[i][j] =
-                            calc_similar_ind(ewhat != ewRMSD, irms[0], ind_rms_m,
-                                             w_rms_m, mat_x[i], mat_x2_j);
                         if (rmsd_mat[i][j] > rmsd_max)
                         {
                             rmsd_max = rmsd_mat[i][j];
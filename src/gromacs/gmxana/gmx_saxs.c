@@ -68,11 +68,13 @@ int gmx_saxs(int argc, char *argv[])
     const char  *desc[] = {
         "[THISMODULE] calculates SAXS structure factors for given index",
         "groups based on Cromer's method.",
-        "Both topology and trajectory files are required."
+        "Both topology and trajectory files are required.",
+        "The k-vectors of each frame are distributed over [TT]-nthreads[tt]",
+        "OpenMP threads."
     };
 
     static real  start_q = 0.0, end_q = 60.0, energy = 12.0;
-    static int   ngroups = 1;
+    static int   ngroups = 1, nthreads = 0;
 
     t_pargs      pa[] = {
         { "-ng",       FALSE, etINT, {&ngroups},
@@ -82,7 +84,9 @@ int gmx_saxs(int argc, char *argv[])
         {"-endq", FALSE, etREAL, {&end_q},
          "Ending q (1/nm)"},
         {"-energy", FALSE, etREAL, {&energy},
-         "Energy of the incoming X-ray (keV) "}
+         "Energy of the incoming X-ray (keV) "},
+        {"-nthreads", FALSE, etINT, {&nthreads},
+         "Number of threads over the k-vectors. nthreads <= 0 means maximum number of threads. Requires linking with OpenMP."}
     };
 #define NPA asize(pa)
     const char  *fnTPS, *fnTRX, *fnNDX, *fnDAT = NULL;
@@ -109,7 +113,7 @@ int gmx_saxs(int argc, char *argv[])
 
     do_scattering_intensity(fnTPS, fnNDX, opt2fn("-sq", NFILE, fnm),
                             fnTRX, fnDAT,
-                            start_q, end_q, energy, ngroups, oenv);
+                            start_q, end_q, energy, ngroups, nthreads, oenv);
 
     please_cite(stdout, "Cromer1968a");
 
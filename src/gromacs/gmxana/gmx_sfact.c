@@ -51,9 +51,11 @@
 #include "gromacs/commandline/pargs.h"
 #include "gromacs/fileio/tpxio.h"
 #include "gromacs/fileio/trxio.h"
+#include "gromacs/fileio/trxprefetch.h"
 #include "physics.h"
 #include "index.h"
 #include "gromacs/utility/smalloc.h"
+#include "gromacs/utility/cstringutil.h"
 #include "calcgrid.h"
 #include "nrnb.h"
 #include "coulomb.h"
@@ -62,24 +64,312 @@
 #include "gmx_ana.h"
 /*#include "sfactor_func.h"*/
 #include "names.h"
+#include "cellgrid.h"
+#include "qloop.h"
+#include "sqaccum.h"
+#include "sqgrid.h"
+#include "gromacs/utility/gmxomp.h"
 
 #include "gromacs/legacyheaders/gmx_fatal.h"
 
+/* Fine pair-distance histogram for the cosmo method.
+ * Instead of evaluating sin(q r) for every pair and q, the pair weights
+ * are binned on a fine r grid together with their first moment around
+ * the bin centre, and the q transform is done once at the end using
+ * sin(q r) ~ sin(q r_b) + q (r - r_b) cos(q r_b).
+ * The remainder is bounded by (q binw)^2/8 per pair term.
+ */
+typedef struct {
+    int     nbin;     /* number of bins up to rmax */
+    real    binw;     /* bin width */
+    real    invbinw;  /* 1/binw */
+    double *w0;       /* sum of pair weights per bin */
+    double *w1;       /* sum of pair weights times the offset from the bin centre */
+} t_sfact_finehist;
+
+static void init_sfact_finehist(t_sfact_finehist *fh, real rmax, real maxq, real tol)
+{
+    fh->binw    = sqrt(8*tol)/maxq;
+    fh->invbinw = 1.0/fh->binw;
+    fh->nbin    = (int)(rmax*fh->invbinw) + 1;
+    snew(fh->w0, fh->nbin);
+    snew(fh->w1, fh->nbin);
+}
+
+static void done_sfact_finehist(t_sfact_finehist *fh)
+{
+    sfree(fh->w0);
+    sfree(fh->w1);
+}
+
+static void clear_sfact_finehist(t_sfact_finehist *fh)
+{
+    int b;
+
+    for (b = 0; b < fh->nbin; b++)
+    {
+        fh->w0[b] = 0;
+        fh->w1[b] = 0;
+    }
+}
+
+/* Adds the fine histogram src to dest and clears src */
+static void sfact_finehist_reduce(t_sfact_finehist *dest, t_sfact_finehist *src)
+{
+    int b;
+
+    for (b = 0; b < dest->nbin; b++)
+    {
+        dest->w0[b] += src->w0[b];
+        dest->w1[b] += src->w1[b];
+        src->w0[b]   = 0;
+        src->w1[b]   = 0;
+    }
+}
+
+/* Returns sum_pairs w sin(q r) reconstructed from the fine histogram */
+static double sfact_finehist_transform(const t_sfact_finehist *fh, real q)
+{
+    int    b;
+    double rb, sum = 0;
+
+    for (b = 0; b < fh->nbin; b++)
+    {
+        if (fh->w0[b] != 0)
+        {
+            rb   = (b + 0.5)*fh->binw;
+            sum += fh->w0[b]*sin(q*rb) + q*fh->w1[b]*cos(q*rb);
+        }
+    }
+    return sum;
+}
+
+/* Adds the cosmo contribution of all pairs between the reference position
+ * xi and n positions of the selection to temp_method and the RDF
+ * histogram count. x and sel_index hold the positions and atom numbers
+ * of the selection. When jlist is not NULL the pairs are formed with
+ * selection positions jlist[0..n-1], otherwise with 0..n-1.
+ * Atoms marked in the exclusion bitmap exclbits (can be NULL) are skipped.
+ * When pbc is NULL plain distance vectors are used.
+ * When fh is not NULL the pair weights go to the fine histogram instead
+ * of temp_method. arr_q and temp_method should be allocated with qloop_snew.
+ */
+static void sfact_cosmo_ref(const t_pbc *pbc, const rvec xi, rvec *x, const atom_id *sel_index,
+                            const int *jlist, int n, const unsigned char *exclbits,
+                            real rmax2, real invhbinw, real fade, real inv_width,
+                            int nbinq, const real *arr_q, int *count, real *temp_method,
+                            t_sfact_finehist *fh)
+{
+    int  j, jj, b;
+    rvec dx;
+    real r2, r_dist, mod_f;
+
+    for (j = 0; j < n; j++)
+    {
+        jj = (jlist != NULL) ? jlist[j] : j;
+        if (exclbits != NULL && excl_bitmap_test(exclbits, sel_index[jj]))
+        {
+            continue;
+        }
+        if (pbc != NULL)
+        {
+            pbc_dx(pbc, xi, x[jj], dx);
+        }
+        else
+        {
+            rvec_sub(xi, x[jj], dx);
+        }
+        r2 = iprod(dx, dx);
+        if (r2 > 0.0 && r2 <= rmax2)
+        {
+            r_dist = sqrt(r2);
+            count[(int)(r_dist*invhbinw)]++;
+            if ((fade == 0.0) || (r_dist <= fade))
+            {
+                mod_f = 1.0/r_dist;
+            }
+            else
+            {
+                mod_f = sqr(cos((r_dist-fade)*inv_width))/r_dist;
+            }
+            if (fh != NULL)
+            {
+                b            = (int)(r_dist*fh->invbinw);
+                fh->w0[b]   += mod_f;
+                fh->w1[b]   += mod_f*(r_dist - (b + 0.5)*fh->binw);
+                continue;
+            }
+            qloop_sin_qr(nbinq, arr_q, r_dist, mod_f, temp_method);
+        }
+    }
+}
+
+/* Partial structure factors of a combined set of atoms with type labels.
+ * Every pair i < j of the set is handled once: its distance goes to the
+ * accumulators of type pair p = pairind[type[i]*ntype + type[j]], with the
+ * pairs of equal types counted twice in the RDF histogram as they are
+ * ordered pairs there, and twice in the histogram of all pairs, count[npair].
+ * The positions of the set are x, with atom numbers sel_index. The partners
+ * of i are the positions jlist[0..n-1], or 0..n-1 when jlist is NULL,
+ * of which only those after i are used. Otherwise as sfact_cosmo_ref,
+ * with temp[p] and fh[p] (when fh is not NULL) per type pair.
+ */
+static void sfact_partial_ref(const t_pbc *pbc, int i, rvec *x, const atom_id *sel_index,
+                              const int *type, int ntype, const int *pairind, int npair,
+                              const int *jlist, int n, const unsigned char *exclbits,
+                              real rmax2, real invhbinw, real fade, real inv_width,
+                              int nbinq, const real *arr_q, int **count, real **temp,
+                              t_sfact_finehist *fh)
+{
+    int  j, jj, p, b, hb;
+    rvec dx;
+    real r2, r_dist, mod_f;
+
+    for (j = 0; j < n; j++)
+    {
+        jj = (jlist != NULL) ? jlist[j] : j;
+        if (jj <= i || (exclbits != NULL && excl_bitmap_test(exclbits, sel_index[jj])))
+        {
+            continue;
+        }
+        if (pbc != NULL)
+        {
+            pbc_dx(pbc, x[i], x[jj], dx);
+        }
+        else
+        {
+            rvec_sub(x[i], x[jj], dx);
+        }
+        r2 = iprod(dx, dx);
+        if (r2 > 0.0 && r2 <= rmax2)
+        {
+            r_dist = sqrt(r2);
+            p      = pairind[type[i]*ntype + type[jj]];
+            hb     = (int)(r_dist*invhbinw);
+            count[p][hb]     += (type[i] == type[jj]) ? 2 : 1;
+            count[npair][hb] += 2;
+            if ((fade == 0.0) || (r_dist <= fade))
+            {
+                mod_f = 1.0/r_dist;
+            }
+            else
+            {
+                mod_f = sqr(cos((r_dist-fade)*inv_width))/r_dist;
+            }
+            if (fh != NULL)
+            {
+                b              = (int)(r_dist*fh[p].invbinw);
+                fh[p].w0[b]   += mod_f;
+                fh[p].w1[b]   += mod_f*(r_dist - (b + 0.5)*fh[p].binw);
+                continue;
+            }
+            qloop_sin_qr(nbinq, arr_q, r_dist, mod_f, temp[p]);
+        }
+    }
+}
+
+/* Sets the partial S(q) - 1 of the npair type pairs, and of all pairs in
+ * s_method[npair], from the pair sums psum[p] = sum_pairs sin(q r)/r of
+ * one or more frames. sub is the subtracted uniform-density integral,
+ * summed over the same frames. pairfac[p] is N/(N_a N_b) times the number
+ * of ordered pairs per stored pair, in the Faber-Ziman normalization.
+ */
+static void sfact_partial_sq(int npair, double **psum, const real *pairfac, int nsel,
+                             int nbinq, const real *arr_q, const real *sub, real **s_method)
+{
+    int    p, qq;
+    double tot;
+
+    for (qq = 0; qq < nbinq; qq++)
+    {
+        tot = 0;
+        for (p = 0; p < npair; p++)
+        {
+            s_method[p][qq] = pairfac[p]*psum[p][qq]/arr_q[qq] - sub[qq];
+            tot            += psum[p][qq];
+        }
+        s_method[npair][qq] = 2*tot/(nsel*arr_q[qq]) - sub[qq];
+    }
+}
+
+/* Writes the block-averaged S(q) of all groups with errors to fn */
+static void sfact_write_err(const char *fn, const t_sqaccum *acc, int ng, int nbinq,
+                            const real *arr_q, real offset, char **grpname,
+                            const output_env_t oenv)
+{
+    int  g, *col0;
+    char title[STRLEN];
+
+    snew(col0, ng);
+    for (g = 0; g < ng; g++)
+    {
+        col0[g] = g*nbinq;
+    }
+    sprintf(title, "Structure factor, reference %s", grpname[0]);
+    sqaccum_write_xvg(acc, fn, title, "S(q)", nbinq, arr_q, ng, col0,
+                      (const char **)(grpname+1), offset, oenv);
+    sfree(col0);
+}
+
+/* Passes the contribution of nfr frames in s_method, with the sum of
+ * their inverse volumes invvol, to the accumulator and clears s_method.
+ * When this completes a block, the intermediate S(q) with errors and the
+ * accumulator file are written, the latter including the RDF histograms.
+ */
+static void sfact_accumulate(t_sqaccum *acc, double *val, real **s_method, double invvol,
+                             int nfr, real t, int **count, int ng, int nbinq, int nbin,
+                             const real *arr_q, real offset, char **grpname,
+                             const char *fnERR, const char *fnCPO, const output_env_t oenv)
+{
+    int g, qq, i;
+
+    for (g = 0; g < ng; g++)
+    {
+        for (qq = 0; qq < nbinq; qq++)
+        {
+            val[g*nbinq+qq] = s_method[g][qq];
+            s_method[g][qq] = 0;
+        }
+    }
+    val[ng*nbinq] = invvol;
+    if (!sqaccum_add(acc, val, nfr, t))
+    {
+        return;
+    }
+    if (fnERR)
+    {
+        sfact_write_err(fnERR, acc, ng, nbinq, arr_q, offset, grpname, oenv);
+    }
+    if (fnCPO)
+    {
+        for (g = 0; g < ng; g++)
+        {
+            for (i = 0; i <= nbin; i++)
+            {
+                acc->extra[g*(nbin+1)+i] = count[g][i];
+            }
+        }
+        sqaccum_write(acc, "sfact", fnCPO);
+    }
+}
+
 static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
                    const char *fnSFACT, const char *fnOSRDF, const char *fnORDF, /*const char *fnHQ, */
+                   const char *fnERR, const char *fnCPI, const char *fnCPO,
                    const char *method,
                    gmx_bool bPBC, gmx_bool bNormalize,
                    real maxq, real minq, int nbinq, real kx, real ky, real kz, real binwidth, real fade,
-                   real faderdf, int ng, const output_env_t oenv)
+                   real faderdf, real fhtol, real rcut, int ng, int nthreads, int nblock,
+                   gmx_bool bPartial, real fspacing, int gridorder, const output_env_t oenv)
 {
     FILE          *fp;
     FILE          *fpn;
-    t_trxstatus   *status;
+    t_trxprefetch *status;
     char           outf1[STRLEN], outf2[STRLEN];
     char           title[STRLEN], gtitle[STRLEN], refgt[30];
     int            g, natoms, i, ii, j, k, nbin, qq, j0, j1, n, n_j ,nframes;
     int          **count;
-    real         **s_method, **s_method_g_r, *analytical_integral, *arr_q, qel, *temp_method, *cos_q, *sin_q;
+    real         **s_method, **s_method_g_r, *analytical_integral, *arr_q, qel, *temp_method, *cos_q, *sin_q, *qgrid;
     char         **grpname;
     int           *isize, isize_cm = 0, nrdf = 0, max_i, isize0, isize_g;
     atom_id      **index, *index_cm = NULL;
@@ -88,10 +378,9 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
     real           segvol, spherevol, prev_spherevol, **rdf;
     rvec          *x, dx, *x0 = NULL, *x_i1, xi, arr_qvec ;
     real          *inv_segvol, invvol, invvol_sum, rho;
-    gmx_bool       bClose, *bExcl, bTop, bNonSelfExcl;
+    gmx_bool       bClose, bTop;
     matrix         box, box_pbc;
-    int          **npairs; 
-    atom_id        ix, jx, ***pairs;
+    atom_id        ix;
     t_topology    *top  = NULL;
     int            ePBC = -1, ePBCrdf = -1;
     t_block       *mols = NULL;
@@ -100,9 +389,41 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
     t_pbc          pbc;
     gmx_rmpbc_t    gpbc = NULL;
     int           *is   = NULL, **coi = NULL, cur, mol, i1, res, a;
+    int            th, **thr_count;
+    real         **thr_temp, **thr_s;
+    t_sfact_finehist *fine = NULL, *thr_fine = NULL;
+    t_cellgrid     grid;
+    t_qvec_soa     qsoa;
+    rvec          *qvec;
+    unsigned char **thr_excl = NULL;
+    t_sqaccum      acc;
+    double        *acc_val, invvol_fine = 0;
+    int            nfine = 0;
+    real           offset;
+    gmx_bool       bGrid;
+    t_sqgrid       sg;
+    matrix         invbox;
+    ivec           nmax, m, ngrid, *gm = NULL;
+    int           *gbin = NULL, *gcount, ngm = 0, gm_nalloc = 0, d, v;
+    real           re, im, qn, *gsum;
+    rvec           q;
+    int            ntype = 0, npair = 0, *gtype, *atype = NULL, *ntype_sel, *pairind = NULL, p;
+    real          *pairfac = NULL, *psub = NULL, ***thr_ptemp;
+    double        *pairnorm, **psum = NULL, ***thr_psum;
+    int         ***thr_pcount;
+    char         **colname;
 
     excl = NULL;
 
+    /* The grid method is sumexp averaged over lattice vectors, with the
+     * density from an FFT
+     */
+    bGrid = (method[0] == 'g');
+    if (bGrid)
+    {
+        method = "sumexp";
+    }
+
     bClose = FALSE ; /*(method[0] != 'c'); */
     if (fnTPS)
     {
@@ -117,8 +438,16 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
     snew(grpname, ng+1);
     snew(isize, ng+1);
     snew(index, ng+1);
-    fprintf(stderr, "\nSelect a reference group and %d group%s\n",
-            ng, ng == 1 ? "" : "s");
+    if (bPartial)
+    {
+        fprintf(stderr, "\nSelect the group of all atoms and %d group%s of atom types\n",
+                ng, ng == 1 ? "" : "s");
+    }
+    else
+    {
+        fprintf(stderr, "\nSelect a reference group and %d group%s\n",
+                ng, ng == 1 ? "" : "s");
+    }
     fprintf(stderr, "ng is %d\n", ng);
     if (fnTPS)
     {
@@ -143,7 +472,7 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
         fprintf(stderr,"isize[0] %d isize[1] %d, isize[2] %d\n",isize[0], isize[1], isize[2]);
         
     }
-    natoms = read_first_x(oenv, &status, fnTRX, &t, &x, box);
+    natoms = read_first_x_prefetch(oenv, &status, fnTRX, &t, &x, box);
     if (!natoms)
     {
         gmx_fatal(FARGS, "Could not read coordinates from statusfile\n");
@@ -171,6 +500,92 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
         }
     }
 
+    /* Normalization of the RDF of each output column */
+    snew(pairnorm, ng);
+    for (g = 0; g < ng; g++)
+    {
+        pairnorm[g] = (double)isize0*isize[g+1];
+    }
+    if (bPartial)
+    {
+        /* The selection groups label the atoms of the reference group with
+         * their type. The output has a column per type pair and one for all
+         * pairs, all computed from the pairs of the reference group.
+         */
+        if (method[0] != 'c')
+        {
+            gmx_fatal(FARGS, "Partial structure factors are only computed with the cosmo method");
+        }
+        ntype = ng;
+        snew(gtype, natoms);
+        for (i = 0; i < natoms; i++)
+        {
+            gtype[i] = -1;
+        }
+        for (g = 0; g < ntype; g++)
+        {
+            for (j = 0; j < isize[g+1]; j++)
+            {
+                if (gtype[index[g+1][j]] >= 0 && gtype[index[g+1][j]] != g)
+                {
+                    gmx_fatal(FARGS, "Atom %d is in type groups %s and %s",
+                              index[g+1][j] + 1, grpname[gtype[index[g+1][j]]+1], grpname[g+1]);
+                }
+                gtype[index[g+1][j]] = g;
+            }
+        }
+        snew(atype, isize0);
+        snew(ntype_sel, ntype);
+        for (i = 0; i < isize0; i++)
+        {
+            atype[i] = gtype[index[0][i]];
+            if (atype[i] < 0)
+            {
+                gmx_fatal(FARGS, "Atom %d of group %s is in none of the type groups",
+                          index[0][i] + 1, grpname[0]);
+            }
+            ntype_sel[atype[i]]++;
+        }
+        npair = ntype*(ntype + 1)/2;
+        snew(pairind, ntype*ntype);
+        snew(pairfac, npair);
+        srenew(pairnorm, npair + 1);
+        snew(colname, npair + 2);
+        colname[0] = grpname[0];
+        p          = 0;
+        for (g = 0; g < ntype; g++)
+        {
+            for (j = g; j < ntype; j++)
+            {
+                if (ntype_sel[g] == 0 || ntype_sel[j] == 0)
+                {
+                    gmx_fatal(FARGS, "Type group %s has no atoms in group %s",
+                              grpname[ntype_sel[g] == 0 ? g+1 : j+1], grpname[0]);
+                }
+                pairind[g*ntype + j] = p;
+                pairind[j*ntype + g] = p;
+                pairfac[p]           = (g == j ? 2.0 : 1.0)*isize0/((double)ntype_sel[g]*ntype_sel[j]);
+                pairnorm[p]          = (double)ntype_sel[g]*ntype_sel[j];
+                snew(colname[p+1], strlen(grpname[g+1]) + strlen(grpname[j+1]) + 2);
+                sprintf(colname[p+1], "%s-%s", grpname[g+1], grpname[j+1]);
+                p++;
+            }
+        }
+        colname[npair+1] = gmx_strdup("all");
+        pairnorm[npair]  = (double)isize0*isize0;
+        /* Every column is computed from the reference group */
+        ng = npair + 1;
+        srenew(isize, ng + 1);
+        for (g = 0; g < ng; g++)
+        {
+            isize[g+1] = isize0;
+        }
+        grpname = colname;
+        fprintf(stderr, "Partial structure factors of %d atom types in %d type pairs\n", ntype, npair);
+        sfree(gtype);
+        sfree(ntype_sel);
+    }
+
     /* initialize some handy things */
     if (ePBC == -1)
     {
@@ -181,6 +596,10 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
     if (bPBC)
     {
         rmax2   = /*0.99*0.99* */ max_cutoff2(FALSE ? epbcXY : epbcXYZ, box_pbc);
+        if (rcut > 0 && sqr(rcut) < rmax2)
+        {
+            rmax2 = sqr(rcut);
+        }
         fprintf(stderr, "rmax2 = %f\n", rmax2);
         
     }
@@ -201,12 +620,11 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
     rmax     = sqrt(rmax2);
 
     snew(count, ng);
-    snew(pairs, ng);
-    snew(npairs, ng);
     snew(s_method, ng);
     snew(s_method_g_r, ng);
+    /* padded for the SIMD q-loop kernels */
+    arr_q = qloop_snew(nbinq);
 
-    snew(bExcl, natoms);
     max_i = 0;
     for (g = 0; g < ng; g++)
     {
@@ -217,16 +635,10 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
 
         /* this is THE array */
         snew(count[g], nbin+1);
-        /* make pairlist array for groups and exclusions */
-        snew(pairs[g], isize[0]);
-        snew(npairs[g], isize[0]);
         /*allocate memory for s_method array */
         snew(s_method[g], nbinq);
         snew(s_method_g_r[g], nbinq);
-        snew(arr_q,nbinq);
         snew(temp_method,nbinq);
-        snew(cos_q,nbinq);
-        snew(sin_q,nbinq);
         snew(analytical_integral,nbinq);
         normfac = 1.0/sqrt(kx*kx + ky*ky + kz*kz) ;
         arr_qvec[XX] = kx*normfac;
@@ -254,59 +666,366 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
 
             }                                                                 
         }
-        for (i = 0; i < isize[0]; i++)
-        {   
-            /* We can only have exclusions with atomic rdfs */
-            ix = index[0][i];
-            for (j = 0; j < natoms; j++)
+    }
+
+    snew(x_i1, max_i);
+    nframes    = 0;
+    invvol_sum = 0;
+    if (bPBC && (NULL != top))
+    {
+        gpbc = gmx_rmpbc_init(&top->idef, ePBC, natoms);
+    }
+
+    /* S(q) per group and q, and the inverse volume, are accumulated per frame.
+     * With cosmo S(q) is one plus the accumulated average.
+     */
+    init_sqaccum(&acc, ng*nbinq + 1, ng*(nbin+1), nblock);
+    snew(acc_val, acc.ncol);
+    /* A checkpoint is only valid for the same q values and direction */
+    snew(qgrid, nbinq + DIM);
+    for (qq = 0; qq < nbinq; qq++)
+    {
+        qgrid[qq] = arr_q[qq];
+    }
+    for (d = 0; d < DIM; d++)
+    {
+        qgrid[nbinq + d] = arr_qvec[d];
+    }
+    sqaccum_set_grid(&acc, method, nbinq + DIM, qgrid);
+    sfree(qgrid);
+    offset = (method[0] == 'c') ? 1 : 0;
+    if (fnCPI)
+    {
+        sqaccum_read(&acc, "sfact", fnCPI);
+        for (g = 0; g < ng; g++)
+        {
+            for (i = 0; i <= nbin; i++)
             {
-                bExcl[j] = FALSE;
+                count[g][i] = (int)acc.extra[g*(nbin+1)+i];
             }
-            if (excl)
+        }
+        fprintf(stderr, "Continuing from %d frames in %s, skipping frames up to time %g\n",
+                acc.nframes, fnCPI, acc.tlast);
+        while (t <= acc.tlast)
+        {
+            if (!read_next_x_prefetch(status, &t, x, box))
             {
-               for (j = excl->index[ix]; j < excl->index[ix+1]; j++)
-               {
-                   bExcl[excl->a[j]] = TRUE;
-               }
+                gmx_fatal(FARGS, "The trajectory has no frames after time %g, the last frame in %s",
+                          acc.tlast, fnCPI);
             }
-            k = 0;
-            snew(pairs[g][i], isize[g+1]);
-            bNonSelfExcl = FALSE;
-            for (j = 0; j < isize[g+1]; j++)
+        }
+    }
+
+    if (method[0] == 'c' && bPartial)
+    {
+        nthreads = min((nthreads <= 0) ? INT_MAX : nthreads, gmx_omp_get_max_threads());
+        gmx_omp_set_num_threads(nthreads);
+        fprintf(stderr, "Pair loop over atoms parallelized with OpenMP using %d threads\n", nthreads);
+        /* Per thread a pair sum and RDF histogram per type pair, reduced in
+         * thread order at the end of each frame. The sums of the pairs of
+         * one atom are added to double precision sums per thread.
+         */
+        snew(thr_ptemp, nthreads);
+        snew(thr_psum, nthreads);
+        snew(thr_pcount, nthreads);
+        for (th = 0; th < nthreads; th++)
+        {
+            snew(thr_ptemp[th], npair);
+            snew(thr_psum[th], npair);
+            for (p = 0; p < npair; p++)
+            {
+                thr_ptemp[th][p] = qloop_snew(nbinq);
+                snew(thr_psum[th][p], nbinq);
+            }
+            snew(thr_pcount[th], ng);
+            for (g = 0; g < ng; g++)
             {
-                jx = index[g+1][j];
-                if (!bExcl[jx])
+                snew(thr_pcount[th][g], nbin+1);
+            }
+        }
+        snew(psum, npair);
+        for (p = 0; p < npair; p++)
+        {
+            snew(psum[p], nbinq);
+        }
+        snew(psub, nbinq);
+        init_cellgrid(&grid);
+        if (excl)
+        {
+            snew(thr_excl, nthreads);
+            for (th = 0; th < nthreads; th++)
+            {
+                snew(thr_excl[th], EXCL_BITMAP_SIZE(natoms));
+            }
+        }
+        if (fhtol > 0)
+        {
+            snew(fine, npair);
+            snew(thr_fine, nthreads*npair);
+            for (p = 0; p < npair; p++)
+            {
+                init_sfact_finehist(&fine[p], rmax, maxq, fhtol);
+            }
+            for (i = 0; i < nthreads*npair; i++)
+            {
+                init_sfact_finehist(&thr_fine[i], rmax, maxq, fhtol);
+            }
+            fprintf(stderr, "Using a fine pair histogram with bin width %g nm (%d bins) for the q transform\n",
+                    fine[0].binw, fine[0].nbin);
+        }
+        do
+        {
+            /* Must init pbc every step because of pressure coupling */
+            copy_mat(box, box_pbc);
+            if (bPBC)
+            {
+                if (top != NULL)
                 {
-                    pairs[g][i][k++] = jx;
+                    gmx_rmpbc(gpbc, natoms, box, x);
                 }
-                else if (ix != jx)
+                set_pbc(&pbc, ePBCrdf, box_pbc);
+            }
+            invvol = 1/det(box_pbc);
+
+            for (i = 0; i < isize0; i++)
+            {
+                copy_rvec(x[index[0][i]], x_i1[i]);
+            }
+            if (bPBC)
+            {
+                put_on_cellgrid(&grid, ePBCrdf, box_pbc, sqrt(rmax2), isize0, x_i1);
+            }
+            /* Each pair is handled by its first atom, a cyclic schedule
+             * balances the decreasing number of partners
+             */
+#pragma omp parallel num_threads(nthreads) private(th, i, ix, p, qq)
+            {
+                th = gmx_omp_get_thread_num();
+#pragma omp for schedule(static, 1)
+                for (i = 0; i < isize0; i++)
                 {
-                    bNonSelfExcl = TRUE;
+                    ix = index[0][i];
+                    if (excl)
+                    {
+                        excl_bitmap_mark(thr_excl[th], excl, ix, TRUE);
+                    }
+                    if (grid.bGrid)
+                    {
+                        int nbcell[27], ncell, c;
+
+                        ncell = cellgrid_nbcells(&grid, x_i1[i], nbcell);
+                        for (c = 0; c < ncell; c++)
+                        {
+                            sfact_partial_ref(&pbc, i, x_i1, index[0], atype, ntype, pairind, npair,
+                                              grid.a + grid.cell_index[nbcell[c]],
+                                              grid.cell_index[nbcell[c]+1] - grid.cell_index[nbcell[c]],
+                                              excl ? thr_excl[th] : NULL,
+                                              rmax2, invhbinw, fade, inv_width, nbinq, arr_q,
+                                              thr_pcount[th], thr_ptemp[th], fine ? thr_fine + th*npair : NULL);
+                        }
+                    }
+                    else
+                    {
+                        sfact_partial_ref(bPBC ? &pbc : NULL, i, x_i1, index[0], atype, ntype, pairind, npair,
+                                          NULL, isize0, excl ? thr_excl[th] : NULL,
+                                          rmax2, invhbinw, fade, inv_width, nbinq, arr_q,
+                                          thr_pcount[th], thr_ptemp[th], fine ? thr_fine + th*npair : NULL);
+                    }
+                    if (excl)
+                    {
+                        excl_bitmap_mark(thr_excl[th], excl, ix, FALSE);
+                    }
+                    if (fine)
+                    {
+                        continue;
+                    }
+                    for (p = 0; p < npair; p++)
+                    {
+                        for (qq = 0; qq < nbinq; qq++)
+                        {
+                            thr_psum[th][p][qq] += thr_ptemp[th][p][qq];
+                            thr_ptemp[th][p][qq] = 0;
+                        }
+                    }
                 }
             }
-            if (bNonSelfExcl)
+            for (th = 0; th < nthreads; th++)
             {
-                npairs[g][i] = k;
-                srenew(pairs[g][i], npairs[g][i]);
+                for (p = 0; p < npair; p++)
+                {
+                    if (fine)
+                    {
+                        sfact_finehist_reduce(&fine[p], &thr_fine[th*npair+p]);
+                        continue;
+                    }
+                    for (qq = 0; qq < nbinq; qq++)
+                    {
+                        psum[p][qq]        += thr_psum[th][p][qq];
+                        thr_psum[th][p][qq] = 0;
+                    }
+                }
+                for (g = 0; g < ng; g++)
+                {
+                    for (i = 0; i <= nbin; i++)
+                    {
+                        count[g][i]          += thr_pcount[th][g][i];
+                        thr_pcount[th][g][i]  = 0;
+                    }
+                }
+            }
+            if (fine)
+            {
+                /* As for a single group, transformed at the end of each block */
+                nfine++;
+                invvol_fine += invvol;
+                if (nfine == sqaccum_block_remaining(&acc))
+                {
+                    for (p = 0; p < npair; p++)
+                    {
+                        for (qq = 0; qq < nbinq; qq++)
+                        {
+                            psum[p][qq] = sfact_finehist_transform(&fine[p], arr_q[qq]);
+                        }
+                        clear_sfact_finehist(&fine[p]);
+                    }
+                    for (qq = 0; qq < nbinq; qq++)
+                    {
+                        psub[qq] = analytical_integral[qq]*invvol_fine;
+                    }
+                    sfact_partial_sq(npair, psum, pairfac, isize0, nbinq, arr_q, psub, s_method);
+                    sfact_accumulate(&acc, acc_val, s_method, invvol_fine, nfine, t, count, ng, nbinq, nbin,
+                                     arr_q, offset, grpname, fnERR, fnCPO, oenv);
+                    nfine       = 0;
+                    invvol_fine = 0;
+                }
             }
             else
             {
-                npairs[g][i] = -1;
-                sfree(pairs[g][i]);
+                for (qq = 0; qq < nbinq; qq++)
+                {
+                    psub[qq] = analytical_integral[qq]*invvol;
+                }
+                sfact_partial_sq(npair, psum, pairfac, isize0, nbinq, arr_q, psub, s_method);
+                for (p = 0; p < npair; p++)
+                {
+                    for (qq = 0; qq < nbinq; qq++)
+                    {
+                        psum[p][qq] = 0;
+                    }
+                }
+                sfact_accumulate(&acc, acc_val, s_method, invvol, 1, t, count, ng, nbinq, nbin,
+                                 arr_q, offset, grpname, fnERR, fnCPO, oenv);
             }
         }
+        while (read_next_x_prefetch(status, &t, x, box));
+        if (fine)
+        {
+            /* The frames after the last complete block */
+            if (nfine > 0)
+            {
+                for (p = 0; p < npair; p++)
+                {
+                    for (qq = 0; qq < nbinq; qq++)
+                    {
+                        psum[p][qq] = sfact_finehist_transform(&fine[p], arr_q[qq]);
+                    }
+                }
+                for (qq = 0; qq < nbinq; qq++)
+                {
+                    psub[qq] = analytical_integral[qq]*invvol_fine;
+                }
+                sfact_partial_sq(npair, psum, pairfac, isize0, nbinq, arr_q, psub, s_method);
+                sfact_accumulate(&acc, acc_val, s_method, invvol_fine, nfine, t, count, ng, nbinq, nbin,
+                                 arr_q, offset, grpname, fnERR, fnCPO, oenv);
+            }
+            for (p = 0; p < npair; p++)
+            {
+                done_sfact_finehist(&fine[p]);
+            }
+            for (i = 0; i < nthreads*npair; i++)
+            {
+                done_sfact_finehist(&thr_fine[i]);
+            }
+            sfree(fine);
+            sfree(thr_fine);
+        }
+        for (th = 0; th < nthreads; th++)
+        {
+            for (p = 0; p < npair; p++)
+            {
+                qloop_sfree(thr_ptemp[th][p]);
+                sfree(thr_psum[th][p]);
+            }
+            for (g = 0; g < ng; g++)
+            {
+                sfree(thr_pcount[th][g]);
+            }
+            sfree(thr_ptemp[th]);
+            sfree(thr_psum[th]);
+            sfree(thr_pcount[th]);
+        }
+        sfree(thr_ptemp);
+        sfree(thr_psum);
+        sfree(thr_pcount);
+        for (p = 0; p < npair; p++)
+        {
+            sfree(psum[p]);
+        }
+        sfree(psum);
+        sfree(psub);
+        done_cellgrid(&grid);
+        if (excl)
+        {
+            for (th = 0; th < nthreads; th++)
+            {
+                sfree(thr_excl[th]);
+            }
+            sfree(thr_excl);
+        }
     }
-    sfree(bExcl);
-
-    snew(x_i1, max_i);
-    nframes    = 0;
-    invvol_sum = 0;
-    if (bPBC && (NULL != top))
-    {
-        gpbc = gmx_rmpbc_init(&top->idef, ePBC, natoms);
-    }
-    if (method[0] == 'c')
+    else if (method[0] == 'c')
     {
+        nthreads = min((nthreads <= 0) ? INT_MAX : nthreads, gmx_omp_get_max_threads());
+        gmx_omp_set_num_threads(nthreads);
+        fprintf(stderr, "Pair loop over reference atoms parallelized with OpenMP using %d threads\n", nthreads);
+        /* Each thread owns a private copy of the accumulators, which are
+         * reduced in thread order at the end of each frame. Together with
+         * the static schedule this gives reproducible output for a fixed
+         * number of threads.
+         */
+        snew(thr_temp, nthreads);
+        snew(thr_s, nthreads);
+        snew(thr_count, nthreads);
+        for (th = 0; th < nthreads; th++)
+        {
+            thr_temp[th] = qloop_snew(nbinq);
+            snew(thr_s[th], nbinq);
+            snew(thr_count[th], nbin+1);
+        }
+        init_cellgrid(&grid);
+        if (excl)
+        {
+            snew(thr_excl, nthreads);
+            for (th = 0; th < nthreads; th++)
+            {
+                snew(thr_excl[th], EXCL_BITMAP_SIZE(natoms));
+            }
+        }
+        if (fhtol > 0)
+        {
+            snew(fine, ng);
+            snew(thr_fine, nthreads);
+            for (g = 0; g < ng; g++)
+            {
+                init_sfact_finehist(&fine[g], rmax, maxq, fhtol);
+            }
+            for (th = 0; th < nthreads; th++)
+            {
+                init_sfact_finehist(&thr_fine[th], rmax, maxq, fhtol);
+            }
+            fprintf(stderr, "Using a fine pair histogram with bin width %g nm (%d bins) for the q transform\n",
+                    fine[0].binw, fine[0].nbin);
+        }
         do
         {
             /* Must init pbc every step because of pressure coupling */
@@ -318,20 +1037,19 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
                     gmx_rmpbc(gpbc, natoms, box, x);
                 }
                 set_pbc(&pbc, ePBCrdf, box_pbc);
-    
+
             }
             invvol      = 1/det(box_pbc);
-            invvol_sum += invvol;
-    
+
             for (g = 0; g < ng; g++)
             {
                 for (i = 0; i < isize[g+1]; i++)
                 {
                     copy_rvec(x[index[g+1][i]], x_i1[i]);
                 }
-                for (i = 0; i < isize0; i++)
+                if (bClose)
                 {
-                    if (bClose)
+                    for (i = 0; i < isize0; i++)
                     {
                         /* Special loop, since we need to determine the minimum distance
                          * over all selected atoms in the reference molecule/residue. */
@@ -362,114 +1080,280 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
                             }
                         }
                     }
-                    else
+                    continue;
+                }
+                if (bPBC)
+                {
+                    put_on_cellgrid(&grid, ePBCrdf, box_pbc, sqrt(rmax2), isize[g+1], x_i1);
+                }
+#pragma omp parallel num_threads(nthreads) private(th, i, qq, ix)
+                {
+                    real *temp_thr;
+                    real *s_thr;
+
+                    th       = gmx_omp_get_thread_num();
+                    temp_thr = thr_temp[th];
+                    s_thr    = thr_s[th];
+                    for (qq = 0; qq < nbinq; qq++)
+                    {
+                        s_thr[qq] = 0;
+                    }
+#pragma omp for schedule(static)
+                    for (i = 0; i < isize0; i++)
                     {
                         /* Real rdf between points in space */
-                        copy_rvec(x[index[0][i]], xi);
-                        if ( npairs[g][i] >= 0)
+                        for (qq = 0; qq < nbinq; qq++)
                         {
-                            /* Expensive loop, because of indexing */
-                            n_j=0.0;
-                            snew(temp_method,nbinq);
-                            fprintf(stderr,"npairs %d\n",npairs[g][i]);
-                            for (j = 0; j < npairs[g][i]; j++)
-                            {
-                                jx = pairs[g][i][j];
-                                if (bPBC)
-                                {
-                                    pbc_dx(&pbc, xi, x[jx], dx);
-                                }
-                                else
-                                {
-                                    rvec_sub(xi, x[jx], dx);
-                                }
-    
-                                r2 = iprod(dx, dx);
-                                if (r2 > 0.0 &&  r2 <= rmax2)
-                                {
-                                    r_dist = sqrt(r2);
-                                    count[g][(int)(r_dist*invhbinw)]++;
-                                    n_j ++ ;
-                                    if ((fade == 0.0) || (r_dist <= fade))
-                                    {
-                                        mod_f = 1.0 /r_dist ;
-                                        for (qq = 0; qq < nbinq; qq++)
-                                        {
-                                            temp_method[qq] += mod_f*sin(arr_q[qq]*r_dist)  ;
-                                        }
-                                    }
-                                    else
-                                    {
-                                        mod_f = sqr(cos((r_dist-fade)*inv_width))/r_dist ;
-                                        for (qq = 0; qq < nbinq; qq++)
-                                        {
-                                            temp_method[qq] += mod_f*sin(arr_q[qq]*r_dist)  ;
-                                        }                                    
-                                    }
-                                }
-                            }
-                            for (qq = 0; qq < nbinq; qq++)
+                            temp_thr[qq] = 0;
+                        }
+                        ix = index[0][i];
+                        if (excl)
+                        {
+                            excl_bitmap_mark(thr_excl[th], excl, ix, TRUE);
+                        }
+                        if (grid.bGrid)
+                        {
+                            /* Only the cells within the cut-off */
+                            int nbcell[27], ncell, c;
+
+                            ncell = cellgrid_nbcells(&grid, x[ix], nbcell);
+                            for (c = 0; c < ncell; c++)
                             {
-                                 s_method[g][qq] += temp_method[qq]*invsize0/arr_q[qq] - analytical_integral[qq]*invvol*invsize0 ;
+                                sfact_cosmo_ref(&pbc, x[ix], x_i1, index[g+1],
+                                                grid.a + grid.cell_index[nbcell[c]],
+                                                grid.cell_index[nbcell[c]+1] - grid.cell_index[nbcell[c]],
+                                                excl ? thr_excl[th] : NULL,
+                                                rmax2, invhbinw, fade, inv_width, nbinq, arr_q,
+                                                thr_count[th], temp_thr, fine ? &thr_fine[th] : NULL);
                             }
-                            sfree(temp_method);
                         }
                         else
                         {
-                            /* Cheaper loop, no exclusions */
-                            isize_g = isize[g+1];
-                            n_j = 0.0;
-                            snew(temp_method,nbinq);
-                            for (j = 0; j < isize_g; j++)
-                            {
-                                if (bPBC)
-                                {
-                                    pbc_dx(&pbc, xi, x_i1[j], dx);
-                                }
-                                else
-                                {
-                                    rvec_sub(xi, x_i1[j], dx);
-                                }
-                                r2 = iprod(dx, dx);
-                                if (r2 > 0.0 && r2 <= rmax2)
-                                {   
-                                    r_dist = sqrt(r2);
-                                    count[g][(int)(r_dist*invhbinw)]++;
-                                    n_j ++ ;
-                                    if ((fade == 0.0) || (r_dist <= fade))
-                                    {
-                                        mod_f = 1.0 /r_dist ;
-                                        for (qq = 0; qq < nbinq; qq++)
-                                        {
-                                            temp_method[qq] += mod_f*sin(arr_q[qq]*r_dist)  ;
-                                        }
-                                    }
-                                    else
-                                    {
-                                        mod_f = sqr(cos((r_dist-fade)*inv_width))/r_dist ;
-                                        for (qq = 0; qq < nbinq; qq++)
-                                        {
-                                            temp_method[qq] += mod_f*sin(arr_q[qq]*r_dist)  ;
-                                        }
-                                    }
-                                }
-                            }
-                            for (qq = 0; qq < nbinq; qq++)
-                            {
-                                 s_method[g][qq] += invsize0*temp_method[qq]/arr_q[qq] - analytical_integral[qq]*invvol*invsize0 ;
-                            }
-                            sfree(temp_method) ;
+                            sfact_cosmo_ref(bPBC ? &pbc : NULL, x[ix], x_i1, index[g+1], NULL, isize[g+1],
+                                            excl ? thr_excl[th] : NULL,
+                                            rmax2, invhbinw, fade, inv_width, nbinq, arr_q,
+                                            thr_count[th], temp_thr, fine ? &thr_fine[th] : NULL);
+                        }
+                        if (excl)
+                        {
+                            excl_bitmap_mark(thr_excl[th], excl, ix, FALSE);
+                        }
+                        if (fine)
+                        {
+                            /* The transform is done after the last frame */
+                            continue;
+                        }
+                        for (qq = 0; qq < nbinq; qq++)
+                        {
+                            s_thr[qq] += temp_thr[qq]*invsize0/arr_q[qq] - analytical_integral[qq]*invvol*invsize0;
+                        }
+                    }
+                }
+                for (th = 0; th < nthreads; th++)
+                {
+                    for (qq = 0; qq < nbinq; qq++)
+                    {
+                        s_method[g][qq] += thr_s[th][qq];
+                    }
+                    for (i = 0; i <= nbin; i++)
+                    {
+                        count[g][i]        += thr_count[th][i];
+                        thr_count[th][i]    = 0;
+                    }
+                    if (fine)
+                    {
+                        sfact_finehist_reduce(&fine[g], &thr_fine[th]);
+                    }
+                }
+            }
+            if (fine)
+            {
+                /* The fine histograms are transformed at the end of each
+                 * block, the analytical integral enters once per reference
+                 * atom per frame.
+                 */
+                nfine++;
+                invvol_fine += invvol;
+                if (nfine == sqaccum_block_remaining(&acc))
+                {
+                    for (g = 0; g < ng; g++)
+                    {
+                        for (qq = 0; qq < nbinq; qq++)
+                        {
+                            s_method[g][qq] = sfact_finehist_transform(&fine[g], arr_q[qq])*invsize0/arr_q[qq]
+                                - analytical_integral[qq]*invvol_fine;
                         }
+                        clear_sfact_finehist(&fine[g]);
                     }
+                    sfact_accumulate(&acc, acc_val, s_method, invvol_fine, nfine, t, count, ng, nbinq, nbin,
+                                     arr_q, offset, grpname, fnERR, fnCPO, oenv);
+                    nfine       = 0;
+                    invvol_fine = 0;
                 }
             }
-            nframes++;
+            else
+            {
+                sfact_accumulate(&acc, acc_val, s_method, invvol, 1, t, count, ng, nbinq, nbin,
+                                 arr_q, offset, grpname, fnERR, fnCPO, oenv);
+            }
+        }
+        while (read_next_x_prefetch(status, &t, x, box));
+        for (th = 0; th < nthreads; th++)
+        {
+            qloop_sfree(thr_temp[th]);
+            sfree(thr_s[th]);
+            sfree(thr_count[th]);
+        }
+        sfree(thr_temp);
+        sfree(thr_s);
+        sfree(thr_count);
+        done_cellgrid(&grid);
+        if (excl)
+        {
+            for (th = 0; th < nthreads; th++)
+            {
+                sfree(thr_excl[th]);
+            }
+            sfree(thr_excl);
+        }
+        if (fine)
+        {
+            /* The frames after the last complete block */
+            if (nfine > 0)
+            {
+                for (g = 0; g < ng; g++)
+                {
+                    for (qq = 0; qq < nbinq; qq++)
+                    {
+                        s_method[g][qq] = sfact_finehist_transform(&fine[g], arr_q[qq])*invsize0/arr_q[qq]
+                            - analytical_integral[qq]*invvol_fine;
+                    }
+                }
+                sfact_accumulate(&acc, acc_val, s_method, invvol_fine, nfine, t, count, ng, nbinq, nbin,
+                                 arr_q, offset, grpname, fnERR, fnCPO, oenv);
+            }
+            for (g = 0; g < ng; g++)
+            {
+                done_sfact_finehist(&fine[g]);
+            }
+            for (th = 0; th < nthreads; th++)
+            {
+                done_sfact_finehist(&thr_fine[th]);
+            }
+            sfree(fine);
+            sfree(thr_fine);
         }
-        while (read_next_x(oenv, status, &t, x, box));
+    }
+    else if (method[0] == 's' && bGrid)
+    {
+        /* All reciprocal lattice vectors of the first box, each assigned
+         * to the nearest q of the output and averaged per q
+         */
+        m_inv_ur0(box, invbox);
+        for (d = 0; d < DIM; d++)
+        {
+            nmax[d] = (int)(maxq*norm(box[d])/(2*M_PI)) + 1;
+        }
+        snew(gcount, nbinq);
+        for (m[XX] = -nmax[XX]; m[XX] <= nmax[XX]; m[XX]++)
+        {
+            for (m[YY] = -nmax[YY]; m[YY] <= nmax[YY]; m[YY]++)
+            {
+                for (m[ZZ] = -nmax[ZZ]; m[ZZ] <= nmax[ZZ]; m[ZZ]++)
+                {
+                    for (d = 0; d < DIM; d++)
+                    {
+                        q[d] = 2*M_PI*(invbox[d][XX]*m[XX] + invbox[d][YY]*m[YY] + invbox[d][ZZ]*m[ZZ]);
+                    }
+                    qn = norm(q);
+                    qq = gmx_nint((qn - minq)/dq);
+                    if (qn == 0 || qq < 0 || qq >= nbinq)
+                    {
+                        continue;
+                    }
+                    if (ngm >= gm_nalloc)
+                    {
+                        gm_nalloc = over_alloc_large(ngm + 1);
+                        srenew(gm, gm_nalloc);
+                        srenew(gbin, gm_nalloc);
+                    }
+                    copy_ivec(m, gm[ngm]);
+                    gbin[ngm] = qq;
+                    gcount[qq]++;
+                    ngm++;
+                }
+            }
+        }
+        for (qq = 0, n = 0; qq < nbinq; qq++)
+        {
+            n += (gcount[qq] == 0);
+        }
+        if (n > 0)
+        {
+            fprintf(stderr, "Note: %d of the %d q points have no reciprocal lattice vector within dq/2, their S(q) is 0\n",
+                    n, nbinq);
+        }
+        sqgrid_size(stderr, box, fspacing, maxq, ngrid);
+        nthreads = min((nthreads <= 0) ? INT_MAX : nthreads, gmx_omp_get_max_threads());
+        init_sqgrid(&sg, ngrid, gridorder, nthreads);
+        for (v = 0; v < ngm; v++)
+        {
+            if (!sqgrid_has(&sg, gm[v]))
+            {
+                gmx_fatal(FARGS, "Lattice vector %d %d %d is beyond the Nyquist limit of the %d x %d x %d grid, decrease -fspacing",
+                          gm[v][XX], gm[v][YY], gm[v][ZZ], ngrid[XX], ngrid[YY], ngrid[ZZ]);
+            }
+        }
+        fprintf(stderr, "loop with grid method, %d lattice vectors on a %d x %d x %d grid with B-splines of order %d\n",
+                ngm, ngrid[XX], ngrid[YY], ngrid[ZZ], gridorder);
+        snew(gsum, nbinq);
+        do
+        {
+            copy_mat(box, box_pbc);
+            invvol = 1/det(box_pbc);
+            for (qq = 0; qq < nbinq; qq++)
+            {
+                gsum[qq] = 0;
+            }
+            /* As for sumexp, the reference group for every group */
+            sqgrid_spread_fft(&sg, box, isize0, x, index[0], NULL);
+            for (v = 0; v < ngm; v++)
+            {
+                sqgrid_rho(&sg, gm[v], &re, &im);
+                gsum[gbin[v]] += sqr(re) + sqr(im);
+            }
+            for (g = 0; g < ng; g++)
+            {
+                for (qq = 0; qq < nbinq; qq++)
+                {
+                    if (gcount[qq] > 0)
+                    {
+                        s_method[g][qq] += gsum[qq]*invsize0/gcount[qq];
+                    }
+                }
+            }
+            sfact_accumulate(&acc, acc_val, s_method, invvol, 1, t, count, ng, nbinq, nbin,
+                             arr_q, offset, grpname, fnERR, fnCPO, oenv);
+        }
+        while (read_next_x_prefetch(status, &t, x, box));
+        done_sqgrid(&sg);
+        sfree(gm);
+        sfree(gbin);
+        sfree(gcount);
+        sfree(gsum);
     }
     else if (method[0] == 's')
     {   
         fprintf(stderr,"loop with sumexp method \n");
+        snew(qvec, nbinq);
+        for (qq = 0; qq < nbinq; qq++)
+        {
+            svmul(arr_q[qq], arr_qvec, qvec[qq]);
+        }
+        init_qvec_soa(&qsoa, nbinq, qvec);
+        sfree(qvec);
+        cos_q = qloop_snew(nbinq);
+        sin_q = qloop_snew(nbinq);
         do
         {
             /* Must init pbc every step because of pressure coupling */
@@ -484,32 +1368,30 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
     
             }
             invvol      = 1/det(box_pbc);
-            invvol_sum += invvol;
             for (g = 0; g < ng; g++)
             {
-                snew(cos_q,nbinq);
-                snew(sin_q,nbinq);
+                for (qq = 0; qq < nbinq; qq++)
+                {
+                    cos_q[qq] = 0;
+                    sin_q[qq] = 0;
+                }
                 for (i = 0; i < isize0; i++)
                 {
-                    copy_rvec(x[index[0][i]], xi);
                     /*isize_g = isize[g+1];*/
-                    for (qq = 0; qq < nbinq; qq++)
-                    {
-                        q_xi=(minq+dq*qq)*iprod(arr_qvec,xi);
-                        cos_q[qq] += cos(q_xi);
-                        sin_q[qq] += sin(q_xi);
-                    }
+                    qloop_cossin_qx(&qsoa, x[index[0][i]], 1.0, cos_q, sin_q);
                 }
                 for (qq = 0; qq < nbinq; qq++)
                 {
                     s_method[g][qq] += (sqr(cos_q[qq]) + sqr(sin_q[qq]))*invsize0;
                 }
-                sfree(cos_q);
-                sfree(sin_q);
             }
-            nframes++;
+            sfact_accumulate(&acc, acc_val, s_method, invvol, 1, t, count, ng, nbinq, nbin,
+                             arr_q, offset, grpname, fnERR, fnCPO, oenv);
         }
-        while (read_next_x(oenv, status, &t, x, box));
+        while (read_next_x_prefetch(status, &t, x, box));
+        done_qvec_soa(&qsoa);
+        qloop_sfree(cos_q);
+        qloop_sfree(sin_q);
     }
     fprintf(stderr, "\n");
     if (bPBC && (NULL != top))
@@ -517,10 +1399,38 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
         gmx_rmpbc_done(gpbc);
     }
     
-    close_trj(status);
+    close_trj_prefetch(status);
 
     sfree(x);
 
+    /* The output below is computed from the accumulated sums */
+    if (fnERR)
+    {
+        sfact_write_err(fnERR, &acc, ng, nbinq, arr_q, offset, grpname, oenv);
+    }
+    if (fnCPO)
+    {
+        for (g = 0; g < ng; g++)
+        {
+            for (i = 0; i <= nbin; i++)
+            {
+                acc.extra[g*(nbin+1)+i] = count[g][i];
+            }
+        }
+        sqaccum_write(&acc, "sfact", fnCPO);
+    }
+    nframes = acc.nframes;
+    for (g = 0; g < ng; g++)
+    {
+        for (qq = 0; qq < nbinq; qq++)
+        {
+            s_method[g][qq] = acc.sum[g*nbinq+qq];
+        }
+    }
+    invvol_sum = acc.sum[ng*nbinq];
+    done_sqaccum(&acc);
+    sfree(acc_val);
+
     /* Average volume */
     invvol = invvol_sum/nframes;
     if (method[0]=='c')
@@ -541,7 +1451,7 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
        for (g = 0; g < ng; g++)
        {
            /* We have to normalize by dividing by the number of frames */
-           normfac = 1.0/(nframes*invvol*isize0*isize[g+1]);
+           normfac = 1.0/(nframes*invvol*pairnorm[g]);
            /* Do the normalization */
            nrdf = max((nbin+1)/2, 1+2*faderdf/binwidth);
            snew(rdf[g], nrdf);
@@ -703,11 +1613,15 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
        }
        sfree(rdf);
        sfree(s_method);
+       if (bPartial)
+       {
+           sfree(atype);
+           sfree(pairind);
+           sfree(pairfac);
+       }
        sfree(analytical_integral);
        sfree(s_method_g_r);
-       sfree(arr_q);
-       sfree(cos_q);
-       sfree(sin_q);
+       qloop_sfree(arr_q);
     }
     else if (method[0] == 's')  
     {
@@ -717,8 +1631,9 @@ static void do_sfact(const char *fnNDX, const char *fnTPS, const char *fnTRX,
        }
        sfree(s_method);
        sfree(analytical_integral);
-       sfree(arr_q);
+       qloop_sfree(arr_q);
     }
+    sfree(pairnorm);
 }
 
 
@@ -733,13 +1648,52 @@ int gmx_sfact(int argc, char *argv[])
         "S(q)=1+ 1/N<sum_{ij} sin(q r_{ij})/(q r_{ij})> -4pi rho int r sin q r dr.",
         "Using this option (cosmo) and the option osrdf S(q) is also printed using the relation for an isotropic system c.f",
         "M.P. Allen and D.J. Tildesley pp. 58.[PAR]",
+        "With the cosmo method the loop over reference atoms is parallelized with OpenMP,",
+        "the number of threads can be set with [TT]-nthreads[tt]. For a fixed number of",
+        "threads the output is reproducible.[PAR]",
+        "With [TT]-fhtol[tt] the cosmo method does not evaluate sin(q r) for every pair,",
+        "but accumulates the pairs on a fine distance grid with bin width sqrt(8 fhtol)/maxq",
+        "and transforms the grid once after the last frame. The error of each",
+        "sin(q r_ij) term is then below fhtol, while the cost of the pair loop",
+        "no longer depends on the number of q points.[PAR]",
+        "With [TT]-rcut[tt] the pairs are limited to a cut-off shorter than half the box,",
+        "which are then found with a cell list instead of looping over all pairs.[PAR]",
+        "With [TT]-block[tt] the frames are divided in blocks of this many frames.",
+        "The standard error of S(q) is then estimated from the spread of the block",
+        "averages, and S(q) with this error is written to [TT]-oerr[tt] after every",
+        "block, so intermediate results are available while the analysis runs.",
+        "With [TT]-cpo[tt] the accumulated sums are written to a small checkpoint",
+        "file after every block and at the end. Passing this file to [TT]-cpi[tt]",
+        "continues the analysis with the frames after the last accumulated time,",
+        "either in the same trajectory after an interruption or in a continuation",
+        "of it. The method and the q values have to match those of the first run,",
+        "the other settings should also be the same.[PAR]",
+        "The method grid averages the sumexp expression over all reciprocal lattice",
+        "vectors of the first box, each assigned to the nearest of the [TT]-nbinq[tt]",
+        "q points. The density for all vectors follows from one 3D FFT per frame, as",
+        "for the reciprocal part of PME: the atoms are spread on a grid with B-splines",
+        "of order [TT]-order[tt] and the transform is divided by that of the B-splines.",
+        "The cost is O(N) plus O(K log K) for K grid points per frame and includes all",
+        "periodic images. The grid spacing [TT]-fspacing[tt] by default gives 4 points",
+        "per wavelength at [TT]-maxq[tt]. Points without lattice vectors, in particular",
+        "below 2 pi/L, are left at 0.[PAR]",
+        "With [TT]-partial[tt] the [TT]-ng[tt] selection groups label the atoms of the",
+        "first group with their type, e.g. O and H within all water atoms. All pair",
+        "distances of the first group are then computed once per frame and each pair",
+        "contributes to the column of its type pair, which gives the partial structure",
+        "factors S_ab(q) of all type pairs and the total S(q) of all pairs in one pass.",
+        "The partials are normalized as by Faber and Ziman,",
+        "S_ab(q) = 1 + N/(N_a N_b) < sum_{i in a, j in b} sin(q r_ij)/(q r_ij) > - 4 pi N/V int r sin(q r)/q dr,",
+        "so that S(q) = 1 + sum_ab c_a c_b (S_ab(q) - 1) with the fractions c_a = N_a/N.",
+        "The RDF output has the matching partial g_ab(r). This needs the cosmo method.[PAR]",
     };
-    static gmx_bool    bPBC = TRUE, bNormalize = TRUE;
-    static real        binwidth = 0.002, maxq=100.0, minq=2.0*M_PI/1000.0, fade = 0.0, faderdf = 0.0;
+    static gmx_bool    bPBC = TRUE, bNormalize = TRUE, bPartial = FALSE;
+    static real        binwidth = 0.002, maxq=100.0, minq=2.0*M_PI/1000.0, fade = 0.0, faderdf = 0.0, fhtol = 0.0, rcut = 0.0;
     static real        kx = 1, ky = 0, kz = 0;
-    static int         ngroups = 1, nbinq = 100;
+    static int         ngroups = 1, nbinq = 100, nthreads = 0, nblock = 0, gridorder = 6;
+    static real        fspacing = 0;
 
-    static const char *methodt[] = { NULL, "cosmo",  "sumexp",  NULL }; 
+    static const char *methodt[] = { NULL, "cosmo",  "sumexp",  "grid", NULL }; 
 
     t_pargs            pa[] = {
         { "-maxq",      FALSE, etREAL, {&maxq},
@@ -761,12 +1715,27 @@ int gmx_sfact(int argc, char *argv[])
           "Normalize for volume and density" },
         { "-ng",       FALSE, etINT, {&ngroups},
           "Number of secondary groups to compute RDFs around a central group" },
+        { "-partial",  FALSE, etBOOL, {&bPartial},
+          "Compute the partial structure factors of all pairs of the -ng atom type groups within the first group in one pass" },
         { "-fade",     FALSE, etREAL, {&fade},
           "In the cosmo method the modification function cos^2((rij-fade)*pi/(2*(L/2-fade))) is used in the fourier transform."
           " If fade is 0.0 nothing is done." },
         { "-faderdf",     FALSE, etREAL, {&faderdf},
           "From this distance onwards the RDF is tranformed by g'(r) = 1 + [g(r)-1] exp(-(r/faderdf-1)^2 to make it go to 1 smoothly. "
           " If faderdf is 0.0 nothing is done." },
+        { "-fhtol",    FALSE, etREAL, {&fhtol},
+          "In the cosmo method bin the pair distances on a fine grid and do the q transform once at the end, with this tolerance on each sin(q r_ij) term."
+          " If fhtol is 0.0 sin(q r_ij) is evaluated exactly for every pair." },
+        { "-rcut",     FALSE, etREAL, {&rcut},
+          "Cut-off for the pairs in the cosmo method (nm). Pairs are then found with a cell list. If rcut is 0.0 half the shortest box vector is used." },
+        { "-nthreads", FALSE, etINT, {&nthreads},
+          "Number of threads used for the parallel loop over reference atoms in the cosmo method. nthreads <= 0 means maximum number of threads. Requires linking with OpenMP." },
+        { "-block",    FALSE, etINT, {&nblock},
+          "Number of frames per block for the error estimate, intermediate output and checkpoints. 0 means no blocks." },
+        { "-fspacing", FALSE, etREAL, {&fspacing},
+          "Grid spacing (nm) for the grid method, 0 gives 4 grid points per wavelength at maxq" },
+        { "-order",    FALSE, etINT, {&gridorder},
+          "Order of the B-spline interpolation for the grid method" },
 
     };
 #define NPA asize(pa)
@@ -780,6 +1749,9 @@ int gmx_sfact(int argc, char *argv[])
         { efXVG, "-o",  "sfact",    ffWRITE },
         { efXVG, "-osrdf", "sfact_rdf", ffOPTWR },
         { efXVG, "-ordf", "rdf", ffOPTWR },
+        { efXVG, "-oerr", "sfact_err", ffOPTWR },
+        { efSQA, "-cpi", "sfact", ffOPTRD },
+        { efSQA, "-cpo", "sfact", ffOPTWR },
     };
 #define NFILE asize(fnm)
     if (!parse_common_args(&argc, argv, PCA_CAN_VIEW | PCA_CAN_TIME | PCA_BE_NICE,
@@ -788,6 +1760,11 @@ int gmx_sfact(int argc, char *argv[])
         return 0;
     }
 
+    if (nblock < 0)
+    {
+        gmx_fatal(FARGS, "The block length should be 0 or positive, not %d", nblock);
+    }
+
     fnTPS = ftp2fn_null(efTPS, NFILE, fnm);
     fnNDX = ftp2fn_null(efNDX, NFILE, fnm);
 
@@ -801,8 +1778,10 @@ int gmx_sfact(int argc, char *argv[])
            opt2fn("-o", NFILE, fnm), opt2fn_null("-osrdf", NFILE, fnm),
            opt2fn_null("-ordf", NFILE, fnm),
            /*opt2fn_null("-hq", NFILE, fnm),*/
-           /*bCM,*/ methodt[0],  bPBC, bNormalize,  maxq, minq, nbinq, kx, ky, kz, binwidth, fade, faderdf, ngroups,
-           oenv);
+           opt2fn_null("-oerr", NFILE, fnm), opt2fn_null("-cpi", NFILE, fnm),
+           opt2fn_null("-cpo", NFILE, fnm),
+           /*bCM,*/ methodt[0],  bPBC, bNormalize,  maxq, minq, nbinq, kx, ky, kz, binwidth, fade, faderdf, fhtol, rcut, ngroups,
+           nthreads, nblock, bPartial, fspacing, gridorder, oenv);
 
     return 0;
 }
@@ -24,279 +24,190 @@
 #include "gromacs/fileio/matio.h"
 #include "../gmx_ana.h"
 #include "../hyperpol.h"
+#include "../pairsum.h"
 #include "names.h"
 #include "cuda.h"
 #include "gromacs/legacyheaders/gmx_fatal.h"
 #include "gromacs/gmxlib/cuda_tools/cudautils.cuh"
 
 
-#define block_size 1024  // number of threads per block for kernel launching
+#define block_size 256  // number of threads per block for kernel launching, a power of 2
+#define max_grid_y 65535 // maximum number of blocks along y, over which the q vectors are distributed
 
-__global__ 
-void kernel(t_pbc *pbc,real beta_i,real *beta,rvec x_i,rvec *x,real rmax2,rvec qvec,real *result,int n,int N) {
+// Device data of the pair sum, allocated once and reused every frame
+struct gmx_pairsum_accel {
+  int nmax;        // maximum number of molecules
+  int nq;          // number of q vectors
+  int grid_x;      // number of blocks over the molecules for nmax
+  real *x_d;       // positions, 3 reals per molecule
+  real *beta_d;    // weights
+  real *qx_d,*qy_d,*qz_d; // q vectors
+  real *part_d;    // partial sums, grid_x per q vector
+  real *part_h;    // host copy of part_d
+  real *x_h;       // host buffer for the positions
+};
 
-  __shared__ real buffer[block_size];
-  int j,k;
-  rvec dx;
-  real r2,temp=0;
-
-  // Obtain the thread ID
-  j=threadIdx.x+blockIdx.x*blockDim.x;
-
-  // Prevent the unnecessary threads
-  if (j>=N)  return;
-
-  // Initialize the shared memory in each Block
-  //buffer[threadIdx.x]=0.0;
-
-  // Calculate vector from the ith to jth molecule
-  dx[XX]=(x[j][XX]-x_i[XX]);
-  dx[YY]=(x[j][YY]-x_i[YY]);
-  dx[ZZ]=(x[j][ZZ]-x_i[ZZ]);
-
-  // Apply PBC condition
-  dx[XX]-=rintf(dx[XX]/pbc->box[XX][XX])*pbc->box[XX][XX];
-  dx[YY]-=rintf(dx[YY]/pbc->box[YY][YY])*pbc->box[YY][YY];
-  dx[ZZ]-=rintf(dx[ZZ]/pbc->box[ZZ][ZZ])*pbc->box[ZZ][ZZ];
-
-  // Distance sqaure between ith and jth
-  r2=(dx[XX]*dx[XX]+dx[YY]*dx[YY]+dx[ZZ]*dx[ZZ]);
-
-  if (r2>0 && r2<=rmax2) {
-    temp=beta_i*beta[j]*cos(qvec[XX]*dx[XX]+qvec[YY]*dx[YY]+qvec[ZZ]*dx[ZZ]);
-  }
 
-  // Save each element to the shared memory
-  buffer[threadIdx.x]=temp; 
+// Each thread handles molecule i and loops over all j > i, for the
+// q vectors blockIdx.y, blockIdx.y + gridDim.y, ...
+// The thread sums are reduced in shared memory to one value per block.
+__global__
+void kernel_pairsum(int n,const real *x,const real *beta,real bx,real by,real bz,real rmax2,
+                    int bFade,real fade,real inv_width,
+                    int nq,const real *qx,const real *qy,const real *qz,real *part) {
 
-  // Synchronize all the threads
-  __syncthreads(); 
-
-  // Summation Reduction
-  k=blockDim.x*0.5;
-
-  while (k!=0) {
-    if (threadIdx.x<k) {
-      buffer[threadIdx.x]+=buffer[threadIdx.x+k];
+  __shared__ real buffer[block_size];
+  int i,j,k,q;
+  real xi,yi,zi,bi,dx,dy,dz,r,r2,w,sum;
+
+  i=threadIdx.x+blockIdx.x*blockDim.x;
+
+  for (q=blockIdx.y;q<nq;q+=gridDim.y) {
+    sum=0;
+    // Threads beyond n still take part in the reduction below
+    if (i<n) {
+      xi=x[3*i];
+      yi=x[3*i+1];
+      zi=x[3*i+2];
+      bi=beta[i];
+      for (j=i+1;j<n;j++) {
+        // Apply PBC condition, only rectangular boxes are supported
+        dx=x[3*j]-xi;
+        dy=x[3*j+1]-yi;
+        dz=x[3*j+2]-zi;
+        dx-=rint(dx/bx)*bx;
+        dy-=rint(dy/by)*by;
+        dz-=rint(dz/bz)*bz;
+        r2=dx*dx+dy*dy+dz*dz;
+        if (r2>0 && r2<=rmax2) {
+          w=bi*beta[j];
+          if (bFade) {
+            r=sqrt(r2);
+            if (r>fade) {
+              w*=cos((r-fade)*inv_width)*cos((r-fade)*inv_width);
+            }
+          }
+          sum+=w*cos(qx[q]*dx+qy[q]*dy+qz[q]*dz);
+        }
+      }
     }
-    __syncthreads();
-    k*=0.5;
-  }
-
-  // Return the first element which contains the sum of the block
-  if (threadIdx.x==0) {
-    result[blockIdx.x]=buffer[0];
-    //printf("result[%d][%d] = %f\n",blockIdx.x,blockIdx.y,buffer[0]);
-  }
-}
 
-
-extern void double_sum(t_pbc *pbc,real *beta,rvec *x,int n,real rmax2,rvec *qvec,int nbinq,real *temp_method) {
-
-  int i,j,q,N=0,grid_size=0;
-  t_pbc *pbc_d=NULL;
-  rvec *x_d=NULL,*qvec_d=NULL;
-  real *beta_d=NULL,*result=NULL,*result_d=NULL,*Sum=NULL;
-  //cudaError_t status;
-
-  // Determine grid_size of the kernel
-  grid_size=(int)(n+block_size-1)/block_size;
-
-  // Determine total number of threads
-  N=block_size*grid_size;
-
-  // Allocate Host Memory
-  result=(real *)calloc(grid_size,sizeof(real));
-  Sum=(real *)calloc(nbinq,sizeof(real));  
-
-  // Allocate Device Memory
-  cudaMalloc(&pbc_d,sizeof(t_pbc));
-  cudaMalloc(&x_d,sizeof(rvec)*n);
-  cudaMalloc(&qvec_d,sizeof(rvec)*nbinq);
-  cudaMalloc(&beta_d,sizeof(real)*n);
-  cudaMalloc(&result_d,sizeof(real)*grid_size);
-
-  // Copy memory from Host to Device
-  cudaMemcpy(pbc_d,pbc,sizeof(t_pbc),cudaMemcpyHostToDevice);
-  cudaMemcpy(x_d,x,sizeof(rvec)*n,cudaMemcpyHostToDevice);
-  cudaMemcpy(qvec_d,qvec,sizeof(rvec)*nbinq,cudaMemcpyHostToDevice);
-  cudaMemcpy(beta_d,beta,sizeof(real)*n,cudaMemcpyHostToDevice);
-
-  // Calculate individual water in series
-  for (i=0;i<n;i++) {  
-    for (q=0;q<nbinq;q++) {
-      // Launch kernel with N threads
-      kernel<<<grid_size,block_size>>>(pbc_d,beta[i],beta_d,x_d[i],x_d,rmax2,qvec_d[q],result_d,n,N);
-      //status=cudaGetLastError();
-      //printf("kernel: %s\n",cudaGetErrorString(status));
-
-      // Copy result back from Device to Host 
-      //status=
-      cudaMemcpy(result,result_d,sizeof(real)*grid_size,cudaMemcpyDeviceToHost);
-      //printf("copy D2H %s\n",cudaGetErrorString(status)); 
-
-      // Sum over the individual sum in each block
-      for (j=0;j<grid_size;j++) {      
-        Sum[q]+=result[j];
-        //printf("block = %d, q = %d, result = %f\n",j,q,result[j+grid_size*q]);
+    // Summation Reduction
+    buffer[threadIdx.x]=sum;
+    __syncthreads();
+    for (k=blockDim.x/2;k>0;k/=2) {
+      if (threadIdx.x<k) {
+        buffer[threadIdx.x]+=buffer[threadIdx.x+k];
       }
+      __syncthreads();
     }
-  }
 
-  // Send the number back
-  for (q=0;q<nbinq;q++) {
-    temp_method[q]=Sum[q]*0.5;
+    // The first element contains the sum of the block
+    if (threadIdx.x==0) {
+      part[q*gridDim.x+blockIdx.x]=buffer[0];
+    }
+    __syncthreads();
   }
-
-  // Free Device Memory
-  cudaFree(pbc_d);
-  cudaFree(x_d);   
-  cudaFree(beta_d); 
-  cudaFree(result_d);
-
-  // Free Host Memory
-  free(result);
-
-  return;
 }
 
 
+extern gmx_pairsum_accel_t init_pairsum_accel(int nmax,const t_qvec_soa *q) {
+
+  gmx_pairsum_accel_t accel;
+  cudaError_t stat;
+
+  snew(accel,1);
+  accel->nmax=nmax;
+  accel->nq=q->n;
+  accel->grid_x=(nmax+block_size-1)/block_size;
+
+  stat=cudaMalloc((void **)&accel->x_d,sizeof(real)*3*nmax);
+  CU_RET_ERR(stat,"cudaMalloc failed on x_d");
+  stat=cudaMalloc((void **)&accel->beta_d,sizeof(real)*nmax);
+  CU_RET_ERR(stat,"cudaMalloc failed on beta_d");
+  stat=cudaMalloc((void **)&accel->qx_d,sizeof(real)*q->n);
+  CU_RET_ERR(stat,"cudaMalloc failed on qx_d");
+  stat=cudaMalloc((void **)&accel->qy_d,sizeof(real)*q->n);
+  CU_RET_ERR(stat,"cudaMalloc failed on qy_d");
+  stat=cudaMalloc((void **)&accel->qz_d,sizeof(real)*q->n);
+  CU_RET_ERR(stat,"cudaMalloc failed on qz_d");
+  stat=cudaMalloc((void **)&accel->part_d,sizeof(real)*accel->grid_x*q->n);
+  CU_RET_ERR(stat,"cudaMalloc failed on part_d");
+
+  // The q vectors do not change, copy them only once
+  stat=cudaMemcpy(accel->qx_d,q->qx,sizeof(real)*q->n,cudaMemcpyHostToDevice);
+  CU_RET_ERR(stat,"cudaMemcpy failed on qx_d");
+  stat=cudaMemcpy(accel->qy_d,q->qy,sizeof(real)*q->n,cudaMemcpyHostToDevice);
+  CU_RET_ERR(stat,"cudaMemcpy failed on qy_d");
+  stat=cudaMemcpy(accel->qz_d,q->qz,sizeof(real)*q->n,cudaMemcpyHostToDevice);
+  CU_RET_ERR(stat,"cudaMemcpy failed on qz_d");
+
+  snew(accel->part_h,accel->grid_x*q->n);
+  snew(accel->x_h,3*nmax);
+
+  return accel;
+}
 
-__global__ 
-void kernel_fade(t_pbc *pbc,real beta_i,real *beta,rvec x_i,rvec *x,real rmax2,rvec qvec,real *result,int n,int N,
-                 real fade,real inv_width) {
-
-  __shared__ real buffer[block_size];
-  int j,k;
-  rvec dx;
-  real r,r2,temp=0;
-
-  // Obtain the thread ID
-  j=threadIdx.x+blockIdx.x*blockDim.x;
-
-  // Prevent the unnecessary threads
-  if (j>=N)  return;
-
-  // Initialize the shared memory in each Block
-  //buffer[threadIdx.x]=0.0;
-
-  // Calculate vector from the ith to jth molecule
-  dx[XX]=(x[j][XX]-x_i[XX]);
-  dx[YY]=(x[j][YY]-x_i[YY]);
-  dx[ZZ]=(x[j][ZZ]-x_i[ZZ]);
 
-  // Apply PBC condition
-  dx[XX]-=rintf(dx[XX]/pbc->box[XX][XX])*pbc->box[XX][XX];
-  dx[YY]-=rintf(dx[YY]/pbc->box[YY][YY])*pbc->box[YY][YY];
-  dx[ZZ]-=rintf(dx[ZZ]/pbc->box[ZZ][ZZ])*pbc->box[ZZ][ZZ];
+extern void pairsum_accel(gmx_pairsum_accel_t accel,const matrix box,
+                          int n,rvec x[],const real beta[],real rmax2,
+                          gmx_bool bFade,real fade,real inv_width,real *result) {
 
-  // Distance sqaure between ith and jth
-  r2=(dx[XX]*dx[XX]+dx[YY]*dx[YY]+dx[ZZ]*dx[ZZ]);
-  
-  if (r2>0 && r2<=rmax2) {
-    r=sqrt(r2);
+  int i,q,b,grid_x;
+  dim3 grid;
+  cudaError_t stat;
 
-    if (r<=fade) {
-      temp=beta_i*beta[j]*cos(qvec[XX]*dx[XX]+qvec[YY]*dx[YY]+qvec[ZZ]*dx[ZZ]);
-    }
-    else {
-       temp=beta_i*beta[j]*cos(qvec[XX]*dx[XX]+qvec[YY]*dx[YY]+qvec[ZZ]*dx[ZZ])*
-            (cos((r-fade)*inv_width))*(cos((r-fade)*inv_width));
-    }
+  if (n>accel->nmax) {
+    gmx_incons("pairsum_accel called with more molecules than allocated for");
   }
 
-  // Save each element to the shared memory
-  buffer[threadIdx.x]=temp; 
-
-  // Synchronize all the threads
-  __syncthreads(); 
-
-  // Summation Reduction
-  k=blockDim.x*0.5;
-
-  while (k!=0) {
-    if (threadIdx.x<k) {
-      buffer[threadIdx.x]+=buffer[threadIdx.x+k];
+  // Pack the positions, rvec arrays can not be used directly on the device
+  for (i=0;i<n;i++) {
+    accel->x_h[3*i]=x[i][XX];
+    accel->x_h[3*i+1]=x[i][YY];
+    accel->x_h[3*i+2]=x[i][ZZ];
+  }
+  stat=cudaMemcpy(accel->x_d,accel->x_h,sizeof(real)*3*n,cudaMemcpyHostToDevice);
+  CU_RET_ERR(stat,"cudaMemcpy failed on x_d");
+  stat=cudaMemcpy(accel->beta_d,beta,sizeof(real)*n,cudaMemcpyHostToDevice);
+  CU_RET_ERR(stat,"cudaMemcpy failed on beta_d");
+
+  // One launch per frame for all molecules and q vectors
+  grid_x=(n+block_size-1)/block_size;
+  grid.x=grid_x;
+  grid.y=(accel->nq<max_grid_y) ? accel->nq : max_grid_y;
+  grid.z=1;
+  kernel_pairsum<<<grid,block_size>>>(n,accel->x_d,accel->beta_d,box[XX][XX],box[YY][YY],box[ZZ][ZZ],rmax2,
+                                      bFade,fade,inv_width,
+                                      accel->nq,accel->qx_d,accel->qy_d,accel->qz_d,accel->part_d);
+  CU_LAUNCH_ERR("kernel_pairsum");
+
+  // Copy the block sums back from Device to Host and sum them
+  stat=cudaMemcpy(accel->part_h,accel->part_d,sizeof(real)*grid_x*accel->nq,cudaMemcpyDeviceToHost);
+  CU_RET_ERR(stat,"cudaMemcpy failed on part_d");
+  for (q=0;q<accel->nq;q++) {
+    result[q]=0;
+    for (b=0;b<grid_x;b++) {
+      result[q]+=accel->part_h[q*grid_x+b];
     }
-    __syncthreads();
-    k*=0.5;
   }
 
-  // Return the first element which contains the sum of the block
-  if (threadIdx.x==0) {
-    result[blockIdx.x]=buffer[0];
-    //printf("result[%d][%d] = %f\n",blockIdx.x,blockIdx.y,buffer[0]);
-  }
+  return;
 }
 
 
-extern void double_sum_fade(t_pbc *pbc,real *beta,rvec *x,int n,real rmax2,rvec *qvec,int nbinq,real fade,real inv_width,real *temp_method) {
-
-  int i,j,q,N=0,grid_size=0;
-  t_pbc *pbc_d=NULL;
-  rvec *x_d=NULL,*qvec_d=NULL;
-  real *beta_d=NULL,*result=NULL,*result_d=NULL,*Sum=NULL;
-  //cudaError_t status;
-
-  // Determine grid_size of the kernel
-  grid_size=(int)(n+block_size-1)/block_size;
-
-  // Determine total number of threads
-  N=block_size*grid_size;
-
-  // Allocate Host Memory
-  result=(real *)calloc(grid_size,sizeof(real));
-  Sum=(real *)calloc(nbinq,sizeof(real));  
-
-  // Allocate Device Memory
-  cudaMalloc(&pbc_d,sizeof(t_pbc));
-  cudaMalloc(&x_d,sizeof(rvec)*n);
-  cudaMalloc(&qvec_d,sizeof(rvec)*nbinq);
-  cudaMalloc(&beta_d,sizeof(real)*n);
-  cudaMalloc(&result_d,sizeof(real)*grid_size);
-
-  // Copy memory from Host to Device
-  cudaMemcpy(pbc_d,pbc,sizeof(t_pbc),cudaMemcpyHostToDevice);
-  cudaMemcpy(x_d,x,sizeof(rvec)*n,cudaMemcpyHostToDevice);
-  cudaMemcpy(qvec_d,qvec,sizeof(rvec)*nbinq,cudaMemcpyHostToDevice);
-  cudaMemcpy(beta_d,beta,sizeof(real)*n,cudaMemcpyHostToDevice);
-
-  // Calculate individual water in series
-  for (i=0;i<n;i++) {  
-    for (q=0;q<nbinq;q++) {
-      // Launch kernel with N threads
-      kernel_fade<<<grid_size,block_size>>>(pbc_d,beta[i],beta_d,x_d[i],x_d,rmax2,qvec_d[q],result_d,n,N,fade,inv_width);
-      //status=cudaGetLastError();
-      //printf("kernel: %s\n",cudaGetErrorString(status));
-
-      // Copy result back from Device to Host 
-      //status=
-      cudaMemcpy(result,result_d,sizeof(real)*grid_size,cudaMemcpyDeviceToHost);
-      //printf("copy D2H %s\n",cudaGetErrorString(status)); 
-
-      // Sum over the individual sum in each block
-      for (j=0;j<grid_size;j++) {      
-        Sum[q]+=result[j];
-        //printf("block = %d, q = %d, result = %f\n",j,q,result[j+grid_size*q]);
-      }
-    }
-  }
-
-  // Send the number back
-  for (q=0;q<nbinq;q++) {
-    temp_method[q]=Sum[q]*0.5;
-  }
+extern void done_pairsum_accel(gmx_pairsum_accel_t accel) {
 
   // Free Device Memory
-  cudaFree(pbc_d);
-  cudaFree(x_d);   
-  cudaFree(beta_d); 
-  cudaFree(result_d);
+  cudaFree(accel->x_d);
+  cudaFree(accel->beta_d);
+  cudaFree(accel->qx_d);
+  cudaFree(accel->qy_d);
+  cudaFree(accel->qz_d);
+  cudaFree(accel->part_d);
 
   // Free Host Memory
-  free(result);
-
-  return;
+  sfree(accel->part_h);
+  sfree(accel->x_h);
+  sfree(accel);
 }
-
-
@@ -60,9 +60,7 @@ void induced_second_order_dipole(real invnormx, real invnormz, const rvec xv2, c
 
 extern void dipole_atom2mol(int *n, int *index, t_block *mols);
 
-extern void double_sum_fade(t_pbc *pbc,real *beta,rvec *x,int n,real rmax2,rvec *qvec,int nbinq,real fade,real inv_width,real *temp_method);
-
-extern void double_sum(t_pbc *pbc,real *beta,rvec *x,int n,real rmax2,rvec *qvec,int nbinq,real *temp_method);
+/* The backends for the pair double sum are declared in pairsum.h */
 
 extern void calc_beta(t_pbc *pbc,int natoms,int n,int *ind,rvec *x,real norm_x,real norm_z,rvec pol_out,rvec pol_in1,rvec pol_in2,real *bete_mol_1d,real *beta);
 
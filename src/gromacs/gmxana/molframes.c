@@ -0,0 +1,438 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "molframes.h"
+#include "pbc.h"
+#include "vec.h"
+#include "gromacs/fileio/futil.h"
+#include "gromacs/utility/cstringutil.h"
+#include "gromacs/utility/smalloc.h"
+
+#include "gromacs/legacyheaders/gmx_fatal.h"
+
+void init_molframes(t_molframes *mf)
+{
+    int a, d;
+
+    mf->n      = 0;
+    mf->nalloc = 0;
+    for (a = 0; a < DIM; a++)
+    {
+        for (d = 0; d < DIM; d++)
+        {
+            mf->u[a][d] = NULL;
+        }
+    }
+    for (a = 0; a < 3; a++)
+    {
+        for (d = 0; d < DIM; d++)
+        {
+            mf->proj[a][d] = NULL;
+        }
+    }
+    mf->ntype  = 0;
+    mf->type   = NULL;
+    mf->atoms  = NULL;
+    mf->atype  = NULL;
+    mf->tstart = NULL;
+    mf->slot   = NULL;
+    mf->bslot  = NULL;
+}
+
+int read_molbeta(const char *fn, t_molbeta **mb)
+{
+    FILE  *fp;
+    char   line[STRLEN], *ptr, *tok, **token = NULL;
+    int    ntok = 0, nalloc = 0, ntype, t, i, k;
+    double val;
+
+    /* Collect all tokens, a type can be spread over several lines */
+    fp = gmx_ffopen(fn, "r");
+    while (fgets(line, STRLEN, fp) != NULL)
+    {
+        if ((ptr = strpbrk(line, ";#")) != NULL)
+        {
+            *ptr = '\0';
+        }
+        for (tok = strtok(line, " \t\r\n"); tok != NULL; tok = strtok(NULL, " \t\r\n"))
+        {
+            if (ntok >= nalloc)
+            {
+                nalloc = over_alloc_small(ntok + 1);
+                srenew(token, nalloc);
+            }
+            token[ntok++] = gmx_strdup(tok);
+        }
+    }
+    gmx_ffclose(fp);
+
+    if (ntok == 0 || ntok % (4 + DIM*DIM*DIM) != 0)
+    {
+        gmx_fatal(FARGS, "%s should contain per molecule type a name, 3 atom numbers and %d beta components, found %d values in total",
+                  fn, DIM*DIM*DIM, ntok);
+    }
+    ntype = ntok/(4 + DIM*DIM*DIM);
+    snew(*mb, ntype);
+    k = 0;
+    for (t = 0; t < ntype; t++)
+    {
+        (*mb)[t].name = gmx_strdup(token[k++]);
+        for (i = 0; i < 3; i++)
+        {
+            if (sscanf(token[k], "%d", &(*mb)[t].a[i]) != 1 || (*mb)[t].a[i] < 1)
+            {
+                gmx_fatal(FARGS, "Invalid atom number '%s' for molecule type %s in %s",
+                          token[k], (*mb)[t].name, fn);
+            }
+            (*mb)[t].a[i]--;
+            k++;
+        }
+        for (i = 0; i < DIM*DIM*DIM; i++)
+        {
+            if (sscanf(token[k], "%lf", &val) != 1)
+            {
+                gmx_fatal(FARGS, "Invalid beta component '%s' for molecule type %s in %s",
+                          token[k], (*mb)[t].name, fn);
+            }
+            (*mb)[t].beta[i/(DIM*DIM)][(i/DIM) % DIM][i % DIM] = val;
+            k++;
+        }
+    }
+    for (k = 0; k < ntok; k++)
+    {
+        sfree(token[k]);
+    }
+    sfree(token);
+
+    return ntype;
+}
+
+void done_molbeta(int ntype, t_molbeta *mb)
+{
+    int t;
+
+    for (t = 0; t < ntype; t++)
+    {
+        sfree(mb[t].name);
+    }
+    sfree(mb);
+}
+
+void molframes_set_types(t_molframes *mf, int ntype, const t_molbeta *mb,
+                         const t_atoms *atoms)
+{
+    int a, t;
+
+    mf->ntype = ntype;
+    mf->type  = mb;
+    mf->atoms = atoms;
+    srenew(mf->atype, atoms->nr);
+    srenew(mf->tstart, ntype + 1);
+    for (a = 0; a < atoms->nr; a++)
+    {
+        mf->atype[a] = -1;
+        for (t = 0; t < ntype && mf->atype[a] < 0; t++)
+        {
+            if (strcmp(*atoms->resinfo[atoms->atom[a].resind].name, mb[t].name) == 0)
+            {
+                mf->atype[a] = t;
+            }
+        }
+    }
+}
+
+static void molframes_realloc(t_molframes *mf, int n)
+{
+    int a, d;
+
+    if (n > mf->nalloc)
+    {
+        mf->nalloc = over_alloc_large(n);
+        for (a = 0; a < DIM; a++)
+        {
+            for (d = 0; d < DIM; d++)
+            {
+                srenew(mf->u[a][d], mf->nalloc);
+            }
+        }
+        for (a = 0; a < 3; a++)
+        {
+            for (d = 0; d < DIM; d++)
+            {
+                srenew(mf->proj[a][d], mf->nalloc);
+            }
+        }
+        srenew(mf->slot, mf->nalloc);
+        srenew(mf->bslot, mf->nalloc);
+    }
+}
+
+/* Sorts the molecules by type over the slots and computes their frames */
+static void calc_molframes_types(t_molframes *mf, const t_pbc *pbc, int n,
+                                 const atom_id *a0, rvec x[])
+{
+    const t_molbeta *mt;
+    int              i, t, s, d, ia, ib, ic;
+    rvec             r1, r2, xvec, yvec, zvec, tmp;
+
+    /* Counting sort, tstart is used as insertion point and shifted back */
+    for (t = 0; t <= mf->ntype; t++)
+    {
+        mf->tstart[t] = 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        t = mf->atype[a0[i]];
+        if (t < 0)
+        {
+            gmx_fatal(FARGS, "There is no molecule type for residue %s of the molecule starting at atom %d",
+                      *mf->atoms->resinfo[mf->atoms->atom[a0[i]].resind].name, a0[i] + 1);
+        }
+        mf->tstart[t+1]++;
+    }
+    for (t = 0; t < mf->ntype; t++)
+    {
+        mf->tstart[t+1] += mf->tstart[t];
+    }
+    for (i = 0; i < n; i++)
+    {
+        mf->slot[mf->tstart[mf->atype[a0[i]]]++] = i;
+    }
+    for (t = mf->ntype; t > 0; t--)
+    {
+        mf->tstart[t] = mf->tstart[t-1];
+    }
+    mf->tstart[0] = 0;
+
+    for (t = 0; t < mf->ntype; t++)
+    {
+        mt = &mf->type[t];
+        for (s = mf->tstart[t]; s < mf->tstart[t+1]; s++)
+        {
+            i  = mf->slot[s];
+            ia = a0[i] + mt->a[0];
+            ib = a0[i] + mt->a[1];
+            ic = a0[i] + mt->a[2];
+            if (pbc != NULL)
+            {
+                pbc_dx(pbc, x[ia], x[ib], r1);
+                pbc_dx(pbc, x[ia], x[ic], r2);
+            }
+            else
+            {
+                rvec_sub(x[ia], x[ib], r1);
+                rvec_sub(x[ia], x[ic], r2);
+            }
+            rvec_add(r1, r2, zvec);
+            unitv(zvec, zvec);
+            rvec_sub(r1, r2, xvec);
+            svmul(iprod(xvec, zvec), zvec, tmp);
+            rvec_dec(xvec, tmp);
+            unitv(xvec, xvec);
+            cprod(xvec, zvec, yvec);
+            for (d = 0; d < DIM; d++)
+            {
+                mf->u[XX][d][s] = xvec[d];
+                mf->u[YY][d][s] = yvec[d];
+                mf->u[ZZ][d][s] = zvec[d];
+            }
+        }
+    }
+}
+
+void calc_molframes(t_molframes *mf, const t_pbc *pbc, int n, const atom_id *a0,
+                    rvec x[], real invnormx, real invnormz)
+{
+    int  i, d;
+    rvec x01, x02, xvec, yvec, zvec;
+
+    molframes_realloc(mf, n);
+    mf->n = n;
+    if (mf->ntype > 0)
+    {
+        calc_molframes_types(mf, pbc, n, a0, x);
+        return;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (pbc != NULL)
+        {
+            pbc_dx(pbc, x[a0[i]], x[a0[i]+1], x01);
+            pbc_dx(pbc, x[a0[i]], x[a0[i]+2], x02);
+        }
+        else
+        {
+            rvec_sub(x[a0[i]], x[a0[i]+1], x01);
+            rvec_sub(x[a0[i]], x[a0[i]+2], x02);
+        }
+        rvec_sub(x01, x02, xvec);
+        svmul(invnormx, xvec, xvec);
+        rvec_add(x01, x02, zvec);
+        svmul(invnormz, zvec, zvec);
+        cprod(xvec, zvec, yvec);
+        for (d = 0; d < DIM; d++)
+        {
+            mf->u[XX][d][i] = xvec[d];
+            mf->u[YY][d][i] = yvec[d];
+            mf->u[ZZ][d][i] = zvec[d];
+        }
+    }
+}
+
+/* proj[a][i] = e_a(i) . v for all molecules */
+static void molframes_project(const t_molframes *mf, const rvec v, real *proj[DIM])
+{
+    int a, i;
+
+    for (a = 0; a < DIM; a++)
+    {
+        for (i = 0; i < mf->n; i++)
+        {
+            proj[a][i] = mf->u[a][XX][i]*v[XX] + mf->u[a][YY][i]*v[YY] + mf->u[a][ZZ][i]*v[ZZ];
+        }
+    }
+}
+
+/* The contraction with the beta of each type, over the slots of that type */
+static void molframes_contract_types(t_molframes *mf, real *beta_lab)
+{
+    int   t, s, s0, s1, p, q, r;
+    real  b, *po, *pi1, *pi2, *bs = mf->bslot;
+
+    for (s = 0; s < mf->n; s++)
+    {
+        bs[s] = 0;
+    }
+    for (t = 0; t < mf->ntype; t++)
+    {
+        s0 = mf->tstart[t];
+        s1 = mf->tstart[t+1];
+        for (p = 0; p < DIM; p++)
+        {
+            po = mf->proj[0][p];
+            for (q = 0; q < DIM; q++)
+            {
+                pi1 = mf->proj[1][q];
+                for (r = 0; r < DIM; r++)
+                {
+                    b   = mf->type[t].beta[p][q][r];
+                    pi2 = mf->proj[2][r];
+                    if (b != 0)
+                    {
+                        for (s = s0; s < s1; s++)
+                        {
+                            bs[s] += b*po[s]*pi1[s]*pi2[s];
+                        }
+                    }
+                }
+            }
+        }
+    }
+    for (s = 0; s < mf->n; s++)
+    {
+        beta_lab[mf->slot[s]] = bs[s];
+    }
+}
+
+void molframes_contract(t_molframes *mf, real ***beta_mol,
+                        const rvec pout, const rvec pin1, const rvec pin2,
+                        real *beta_lab)
+{
+    int   i, p, q, r;
+    real  b, *po, *pi1, *pi2;
+
+    molframes_project(mf, pout, mf->proj[0]);
+    molframes_project(mf, pin1, mf->proj[1]);
+    molframes_project(mf, pin2, mf->proj[2]);
+    if (mf->ntype > 0)
+    {
+        molframes_contract_types(mf, beta_lab);
+        return;
+    }
+    for (i = 0; i < mf->n; i++)
+    {
+        beta_lab[i] = 0;
+    }
+    for (p = 0; p < DIM; p++)
+    {
+        po = mf->proj[0][p];
+        for (q = 0; q < DIM; q++)
+        {
+            pi1 = mf->proj[1][q];
+            for (r = 0; r < DIM; r++)
+            {
+                b   = beta_mol[p][q][r];
+                pi2 = mf->proj[2][r];
+                if (b != 0)
+                {
+                    for (i = 0; i < mf->n; i++)
+                    {
+                        beta_lab[i] += b*po[i]*pi1[i]*pi2[i];
+                    }
+                }
+            }
+        }
+    }
+}
+
+void done_molframes(t_molframes *mf)
+{
+    int a, d;
+
+    for (a = 0; a < DIM; a++)
+    {
+        for (d = 0; d < DIM; d++)
+        {
+            sfree(mf->u[a][d]);
+        }
+    }
+    for (a = 0; a < 3; a++)
+    {
+        for (d = 0; d < DIM; d++)
+        {
+            sfree(mf->proj[a][d]);
+        }
+    }
+    sfree(mf->atype);
+    sfree(mf->tstart);
+    sfree(mf->slot);
+    sfree(mf->bslot);
+    init_molframes(mf);
+}
@@ -0,0 +1,128 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+
+#ifndef _molframes_h
+#define _molframes_h
+
+#include "typedefs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Molecular frames of the SHS tools.
+ *
+ * For water-like molecules with the first atom at the apex, the
+ * molecular x axis is along the difference and the z axis along the sum
+ * of the two bond vectors, y = x cross z. calc_molframes computes the
+ * axes of all molecules once per frame into a structure of arrays, after
+ * which the lab-frame contraction of the hyperpolarizability for any
+ * number of polarization geometries is a loop over molecules without
+ * recomputing the frames.
+ */
+typedef struct t_molframes {
+    int   n;             /* number of molecules */
+    int   nalloc;        /* allocation size of the arrays */
+    real *u[DIM][DIM];   /* u[a][d][i]: lab component d of molecular axis a of molecule i */
+    real *proj[3][DIM];  /* work arrays: axes projected on the polarization vectors */
+    /* Molecule types, only used after molframes_set_types */
+    int                     ntype;    /* number of types, 0 without types */
+    const struct t_molbeta *type;     /* the types */
+    const t_atoms          *atoms;    /* the atoms, for the residue names */
+    int                    *atype;    /* type of the molecule starting at each atom, -1: none */
+    int                    *tstart;   /* first slot of each type, ntype+1 */
+    int                    *slot;     /* molecule index of each slot, sorted by type */
+    real                   *bslot;    /* lab-frame beta of each slot */
+} t_molframes;
+
+/* Molecule type with a user hyperpolarizability.
+ *
+ * The molecular frame is built from three atoms of the molecule as for
+ * water: with r1 and r2 the vectors from atom a[1] and a[2] to the apex
+ * atom a[0], z is along r1 + r2, x along r1 - r2 made orthogonal to z,
+ * and y = x cross z. beta is given in this frame.
+ */
+typedef struct t_molbeta {
+    char *name;               /* residue name of the molecules of this type */
+    int   a[3];               /* apex, first and second atom, offsets in the molecule */
+    real  beta[DIM][DIM][DIM];
+} t_molbeta;
+
+/* Reads molecule types from fn, with per type on one or more lines the
+ * residue name, the numbers (from 1) in the molecule of the apex, first
+ * and second frame atom and the 27 components beta_pqr with r running
+ * fastest. Text after ';' or '#' is ignored. Returns the number of types.
+ */
+int read_molbeta(const char *fn, t_molbeta **mb);
+
+/* Frees the types read with read_molbeta */
+void done_molbeta(int ntype, t_molbeta *mb);
+
+/* Initializes an empty set of frames */
+void init_molframes(t_molframes *mf);
+
+/* Uses the ntype molecule types mb for the following calls, a molecule
+ * has the type whose name matches the residue name of its first atom.
+ * mb and atoms should stay valid while mf is used.
+ */
+void molframes_set_types(t_molframes *mf, int ntype, const t_molbeta *mb,
+                         const t_atoms *atoms);
+
+/* Computes the frames of the n molecules whose first atom is a0[i],
+ * the bond vectors are taken with pbc_dx when pbc is not NULL.
+ * Without types invnormx and invnormz normalize the x and z axes of
+ * water-like molecules, with types every axis is normalized.
+ */
+void calc_molframes(t_molframes *mf, const t_pbc *pbc, int n, const atom_id *a0,
+                    rvec x[], real invnormx, real invnormz);
+
+/* Stores the lab-frame hyperpolarizability of every molecule,
+ * beta_lab[i] = sum_pqr beta_mol[p][q][r] (e_p.pout) (e_q.pin1) (e_r.pin2),
+ * with e_p the molecular axes of molecule i. Zero elements of beta_mol
+ * are skipped. With types beta_mol is not used, the sum then runs over
+ * the molecules of each type with the beta of that type.
+ */
+void molframes_contract(t_molframes *mf, real ***beta_mol,
+                        const rvec pout, const rvec pin1, const rvec pin2,
+                        real *beta_lab);
+
+/* Frees the arrays of mf */
+void done_molframes(t_molframes *mf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+
+#include "pairsum.h"
+#include "macros.h"
+#include "pbc.h"
+#include "vec.h"
+#include "gromacs/utility/gmxomp.h"
+#include "gromacs/utility/smalloc.h"
+#include "gromacs/legacyheaders/gmx_fatal.h"
+
+/* Number of pairs that are collected before the q loops are run */
+#define PAIRSUM_TILE 64
+
+const char *epairsum_names[epairsumNR] = { "CPU", "accelerator" };
+
+#ifdef GMX_GPU
+gmx_bool pairsum_have_accel(void)
+{
+    return TRUE;
+}
+#else
+/* Without an accelerator in the build, init_pairsum never selects it */
+gmx_bool pairsum_have_accel(void)
+{
+    return FALSE;
+}
+
+gmx_pairsum_accel_t init_pairsum_accel(int gmx_unused nmax, const t_qvec_soa gmx_unused *q)
+{
+    gmx_incons("init_pairsum_accel called without an accelerator backend");
+
+    return NULL;
+}
+
+void pairsum_accel(gmx_pairsum_accel_t gmx_unused accel, const matrix gmx_unused box,
+                   int gmx_unused n, rvec gmx_unused x[], const real gmx_unused beta[],
+                   real gmx_unused rmax2, gmx_bool gmx_unused bFade,
+                   real gmx_unused fade, real gmx_unused inv_width,
+                   real gmx_unused *result)
+{
+    gmx_incons("pairsum_accel called without an accelerator backend");
+}
+
+void done_pairsum_accel(gmx_pairsum_accel_t gmx_unused accel)
+{
+}
+#endif
+
+t_pairsum *init_pairsum(FILE *fplog, int ebackend, int nthreads, int nmax,
+                        int nchan, const t_qvec_soa *q,
+                        gmx_bool bFade, real fade, real inv_width)
+{
+    t_pairsum *ps;
+    int        th;
+
+    if (nchan < 1 || nchan > PAIRSUM_MAXCHAN)
+    {
+        gmx_fatal(FARGS, "The pair sum supports 1 to %d channels, not %d", PAIRSUM_MAXCHAN, nchan);
+    }
+
+    snew(ps, 1);
+    if (ebackend == epairsumACCEL && !pairsum_have_accel())
+    {
+        if (fplog)
+        {
+            fprintf(fplog, "NOTE: this build has no accelerator backend for the pair sum, using the CPU\n");
+        }
+        ebackend = epairsumCPU;
+    }
+    ps->ebackend  = ebackend;
+    ps->nthreads  = max(1, nthreads);
+    ps->nchan     = nchan;
+    ps->q         = q;
+    ps->bFade     = bFade;
+    ps->fade      = fade;
+    ps->inv_width = inv_width;
+    ps->nrecur    = 0;
+    /* The CPU accumulators are also used when the accelerator
+     * falls back to the CPU or for validating the accelerator.
+     */
+    snew(ps->thr_acc, ps->nthreads*nchan);
+    for (th = 0; th < ps->nthreads*nchan; th++)
+    {
+        ps->thr_acc[th] = qloop_snew(q->n);
+    }
+    ps->accel = NULL;
+    if (ps->ebackend == epairsumACCEL)
+    {
+        ps->accel = init_pairsum_accel(nmax, q);
+    }
+    if (fplog)
+    {
+        fprintf(fplog, "Computing the pair sum on the %s", epairsum_names[ps->ebackend]);
+        if (ps->ebackend == epairsumCPU)
+        {
+            fprintf(fplog, " using %d thread%s", ps->nthreads, ps->nthreads > 1 ? "s" : "");
+        }
+        fprintf(fplog, "\n");
+    }
+
+    return ps;
+}
+
+void pairsum_set_recurrence(t_pairsum *ps, const rvec kvec, real q0, real dq, int nrecur)
+{
+    copy_rvec(kvec, ps->kvec);
+    ps->q0     = q0;
+    ps->dq     = dq;
+    ps->nrecur = nrecur;
+}
+
+/* Adds the cos(q.dx) terms of np pairs to the nchan accumulators acc,
+ * the weight of pair p in channel c is w[p*nchan+c]
+ */
+static void pairsum_flush(const t_pairsum *ps, int np, int nchan, rvec dx[], const real w[],
+                          real *acc[])
+{
+    int  p, c;
+    real kdx;
+
+    for (p = 0; p < np; p++)
+    {
+        if (ps->nrecur > 0)
+        {
+            /* The recurrence costs a few flops per q point, less than
+             * sharing it through a scratch array would
+             */
+            kdx = iprod(ps->kvec, dx[p]);
+            for (c = 0; c < nchan; c++)
+            {
+                qloop_cossin_recur(ps->q->n, ps->q0*kdx, ps->dq*kdx, ps->nrecur, w[p*nchan+c],
+                                   acc[c], NULL);
+            }
+        }
+        else
+        {
+            qloop_cos_qdx_multi(ps->q, dx[p], nchan, w + p*nchan, acc);
+        }
+    }
+}
+
+static void pairsum_cpu(t_pairsum *ps, const t_pbc *pbc, int n, rvec x[],
+                        int nchan, const real *beta[], real rmax2, real *acc[])
+{
+    int      nq, th, k, d, c;
+    gmx_bool bRect;
+    rvec     bs, inv_bs;
+
+    nq = ps->q->n;
+    /* For rectangular boxes the minimum image is computed inline, which
+     * is cheaper than pbc_dx_aiuc and also handles any number of shifts.
+     */
+    bRect = (pbc->ePBC == epbcXYZ && !TRICLINIC(pbc->box));
+    for (d = 0; d < DIM; d++)
+    {
+        bs[d]     = pbc->box[d][d];
+        inv_bs[d] = bRect ? 1/bs[d] : 0;
+    }
+#pragma omp parallel num_threads(ps->nthreads) private(th, k, c)
+    {
+        rvec  dx[PAIRSUM_TILE];
+        real  w[PAIRSUM_TILE*PAIRSUM_MAXCHAN], r2, r, f, **tacc;
+        int   i, j, np;
+
+        th   = gmx_omp_get_thread_num();
+        tacc = ps->thr_acc + th*ps->nchan;
+        for (c = 0; c < nchan; c++)
+        {
+            for (k = 0; k < nq; k++)
+            {
+                tacc[c][k] = 0;
+            }
+        }
+        /* The number of partners decreases with i, a cyclic static schedule
+         * balances the load while every i always goes to the same thread
+         */
+#pragma omp for schedule(static, 16)
+        for (i = 0; i < n - 1; i++)
+        {
+            np = 0;
+            for (j = i + 1; j < n; j++)
+            {
+                if (bRect)
+                {
+                    rvec_sub(x[i], x[j], dx[np]);
+                    dx[np][XX] -= bs[XX]*rint(dx[np][XX]*inv_bs[XX]);
+                    dx[np][YY] -= bs[YY]*rint(dx[np][YY]*inv_bs[YY]);
+                    dx[np][ZZ] -= bs[ZZ]*rint(dx[np][ZZ]*inv_bs[ZZ]);
+                }
+                else
+                {
+                    pbc_dx_aiuc(pbc, x[i], x[j], dx[np]);
+                }
+                r2 = norm2(dx[np]);
+                if (r2 > 0 && r2 <= rmax2)
+                {
+                    f = 1;
+                    if (ps->bFade)
+                    {
+                        r = sqrt(r2);
+                        if (r > ps->fade)
+                        {
+                            f = sqr(cos((r - ps->fade)*ps->inv_width));
+                        }
+                    }
+                    for (c = 0; c < nchan; c++)
+                    {
+                        w[np*nchan+c] = f*beta[c][i]*beta[c][j];
+                    }
+                    np++;
+                    if (np == PAIRSUM_TILE)
+                    {
+                        pairsum_flush(ps, np, nchan, dx, w, tacc);
+                        np = 0;
+                    }
+                }
+            }
+            pairsum_flush(ps, np, nchan, dx, w, tacc);
+        }
+    }
+
+    /* With the static schedule and the reduction in thread order the result
+     * only depends on the number of threads, not on timing
+     */
+    for (c = 0; c < nchan; c++)
+    {
+        for (k = 0; k < nq; k++)
+        {
+            acc[c][k] = 0;
+            for (th = 0; th < ps->nthreads; th++)
+            {
+                acc[c][k] += ps->thr_acc[th*ps->nchan+c][k];
+            }
+        }
+    }
+}
+
+void pairsum_calc(t_pairsum *ps, const t_pbc *pbc, int n, rvec x[],
+                  const real beta[], real rmax2, real *acc)
+{
+    pairsum_calc_multi(ps, pbc, n, x, 1, &beta, rmax2, &acc);
+}
+
+void pairsum_calc_multi(t_pairsum *ps, const t_pbc *pbc, int n, rvec x[],
+                        int nchan, const real *beta[], real rmax2, real *acc[])
+{
+    real *ref, maxdev, maxval;
+    int   k, c;
+
+    if (nchan > ps->nchan)
+    {
+        gmx_incons("More channels passed to the pair sum than it was set up for");
+    }
+
+    if (ps->ebackend == epairsumACCEL && TRICLINIC(pbc->box))
+    {
+        if (!ps->bNoteTric)
+        {
+            fprintf(stderr, "\nNOTE: the accelerator only supports rectangular boxes, the pair sum is computed on the CPU\n");
+            ps->bNoteTric = TRUE;
+        }
+        pairsum_cpu(ps, pbc, n, x, nchan, beta, rmax2, acc);
+    }
+    else if (ps->ebackend == epairsumACCEL)
+    {
+        for (c = 0; c < nchan; c++)
+        {
+            pairsum_accel(ps->accel, pbc->box, n, x, beta[c], rmax2,
+                          ps->bFade, ps->fade, ps->inv_width, acc[c]);
+        }
+        /* Validate the accelerator against the CPU reference once */
+        if (debug && ps->ncalls == 0)
+        {
+            ref = qloop_snew(ps->q->n);
+            pairsum_cpu(ps, pbc, n, x, 1, beta, rmax2, &ref);
+            maxdev = 0;
+            maxval = 0;
+            for (k = 0; k < ps->q->n; k++)
+            {
+                maxdev = max(maxdev, fabs(acc[0][k] - ref[k]));
+                maxval = max(maxval, fabs(ref[k]));
+            }
+            fprintf(debug, "pair sum: max. deviation of the %s from the CPU %g, max. value %g\n",
+                    epairsum_names[ps->ebackend], maxdev, maxval);
+            qloop_sfree(ref);
+        }
+    }
+    else
+    {
+        pairsum_cpu(ps, pbc, n, x, nchan, beta, rmax2, acc);
+    }
+    ps->ncalls++;
+}
+
+void done_pairsum(t_pairsum *ps)
+{
+    int th;
+
+    if (ps->accel != NULL)
+    {
+        done_pairsum_accel(ps->accel);
+    }
+    for (th = 0; th < ps->nthreads*ps->nchan; th++)
+    {
+        qloop_sfree(ps->thr_acc[th]);
+    }
+    sfree(ps->thr_acc);
+    sfree(ps);
+}
@@ -0,0 +1,142 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+
+#ifndef _pairsum_h
+#define _pairsum_h
+
+#include "typedefs.h"
+#include "qloop.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Backends for the pair double sum of the SHS tools,
+ *
+ *   acc[k] = sum_{i<j, 0 < r_ij^2 <= rmax2} beta_i beta_j f(r_ij) cos(q_k . r_ij)
+ *
+ * with the fading function f(r) = 1 for r <= fade and
+ * f(r) = cos^2((r - fade)*inv_width) beyond, when fading is enabled.
+ *
+ * The CPU backend is the reference: it is tiled over pairs and threaded
+ * with OpenMP. The accelerator backend is chosen at build time, with
+ * GMX_GPU it is the CUDA implementation in gpu_kernel/eshs.cu. Without
+ * an accelerator in the build, requesting it falls back to the CPU.
+ */
+enum {
+    epairsumCPU, epairsumACCEL, epairsumNR
+};
+
+/* Maximum number of beta weight sets (channels) in one pair sum, enough
+ * for all combinations of the three beam polarizations
+ */
+#define PAIRSUM_MAXCHAN 27
+
+extern const char *epairsum_names[epairsumNR];
+
+/* Abstract type for the accelerator data */
+typedef struct gmx_pairsum_accel *gmx_pairsum_accel_t;
+
+typedef struct t_pairsum {
+    int                 ebackend;  /* the backend in use */
+    int                 nthreads;  /* number of threads of the CPU backend */
+    int                 nchan;     /* maximum number of channels per call */
+    const t_qvec_soa   *q;         /* the q vectors */
+    gmx_bool            bFade;     /* whether to apply the fading function */
+    real                fade;      /* distance where the fading starts */
+    real                inv_width; /* pi/2 over the width of the fading range */
+    rvec                kvec;      /* direction of the uniform q grid */
+    real                q0;        /* first |q| of the uniform grid */
+    real                dq;        /* spacing of the uniform grid */
+    int                 nrecur;    /* re-seed interval of the recurrence, 0: not used */
+    real              **thr_acc;   /* per-thread and channel accumulators of the CPU backend,
+                                      channel c of thread th at th*nchan+c */
+    int                 ncalls;    /* number of calls to pairsum_calc */
+    gmx_bool            bNoteTric; /* whether the triclinic fall-back note was printed */
+    gmx_pairsum_accel_t accel;     /* accelerator data, NULL with the CPU backend */
+} t_pairsum;
+
+/* Returns whether this build contains an accelerator backend */
+gmx_bool pairsum_have_accel(void);
+
+/* Sets up the pair sum with backend ebackend for at most nmax molecules,
+ * nchan channels and the q vectors q. A request for the accelerator without one in the
+ * build falls back to the CPU backend with a note to fplog.
+ */
+t_pairsum *init_pairsum(FILE *fplog, int ebackend, int nthreads, int nmax,
+                        int nchan, const t_qvec_soa *q,
+                        gmx_bool bFade, real fade, real inv_width);
+
+/* Lets the CPU backend use the angle-addition recurrence over a uniform
+ * q grid q_k = (q0 + k*dq)*kvec, see qloop_cossin_recur.
+ * nrecur=0 turns the recurrence off.
+ */
+void pairsum_set_recurrence(t_pairsum *ps, const rvec kvec, real q0, real dq, int nrecur);
+
+/* Computes the pair sum for the n positions x with weights beta and
+ * stores the result in acc, which should have space for q->n elements.
+ * The accelerator only handles rectangular boxes, for triclinic boxes
+ * the CPU backend is used.
+ */
+void pairsum_calc(t_pairsum *ps, const t_pbc *pbc, int n, rvec x[],
+                  const real beta[], real rmax2, real *acc);
+
+/* As pairsum_calc for nchan <= ps->nchan sets of weights beta[c] at once,
+ * the result of set c goes to acc[c]. The CPU backend computes the pair
+ * distances, the fading function and cos(q . r) once for all sets, the
+ * accelerator is called for every set.
+ */
+void pairsum_calc_multi(t_pairsum *ps, const t_pbc *pbc, int n, rvec x[],
+                        int nchan, const real *beta[], real rmax2, real *acc[]);
+
+/* Frees ps and the backend data */
+void done_pairsum(t_pairsum *ps);
+
+/* The accelerator interface, implemented by the accelerator backend.
+ * result is overwritten with the pair sum, box should be rectangular.
+ */
+gmx_pairsum_accel_t init_pairsum_accel(int nmax, const t_qvec_soa *q);
+
+void pairsum_accel(gmx_pairsum_accel_t accel, const matrix box,
+                   int n, rvec x[], const real beta[], real rmax2,
+                   gmx_bool bFade, real fade, real inv_width, real *result);
+
+void done_pairsum_accel(gmx_pairsum_accel_t accel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,318 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+
+#include "qloop.h"
+#include "macros.h"
+#include "gromacs/simd/simd.h"
+#include "gromacs/simd/simd_math.h"
+#include "gromacs/utility/smalloc.h"
+
+#ifdef GMX_SIMD_HAVE_REAL
+#define QLOOP_WIDTH GMX_SIMD_REAL_WIDTH
+#else
+#define QLOOP_WIDTH 1
+#endif
+
+int qloop_padded_size(int n)
+{
+    return ((n + QLOOP_WIDTH - 1)/QLOOP_WIDTH)*QLOOP_WIDTH;
+}
+
+real *qloop_snew(int n)
+{
+    real *p;
+
+    /* Also for n=0 we return a valid pointer */
+    snew_aligned(p, qloop_padded_size(n) + QLOOP_WIDTH, QLOOP_WIDTH*sizeof(real));
+
+    return p;
+}
+
+void qloop_sfree(real *p)
+{
+    sfree_aligned(p);
+}
+
+void init_qvec_soa(t_qvec_soa *q, int n, rvec qvec[])
+{
+    int k;
+
+    q->n  = n;
+    q->qx = qloop_snew(n);
+    q->qy = qloop_snew(n);
+    q->qz = qloop_snew(n);
+    for (k = 0; k < n; k++)
+    {
+        q->qx[k] = qvec[k][XX];
+        q->qy[k] = qvec[k][YY];
+        q->qz[k] = qvec[k][ZZ];
+    }
+}
+
+void done_qvec_soa(t_qvec_soa *q)
+{
+    qloop_sfree(q->qx);
+    qloop_sfree(q->qy);
+    qloop_sfree(q->qz);
+    q->n = 0;
+}
+
+void qloop_sin_qr(int n, const real *q, real r, real w, real *acc)
+{
+    int             k;
+#ifdef GMX_SIMD_HAVE_REAL
+    gmx_simd_real_t r_S, w_S, s_S;
+
+    r_S = gmx_simd_set1_r(r);
+    w_S = gmx_simd_set1_r(w);
+    for (k = 0; k < n; k += GMX_SIMD_REAL_WIDTH)
+    {
+        s_S = gmx_simd_sin_r(gmx_simd_mul_r(gmx_simd_load_r(q + k), r_S));
+        gmx_simd_store_r(acc + k, gmx_simd_fmadd_r(w_S, s_S, gmx_simd_load_r(acc + k)));
+    }
+#else
+    for (k = 0; k < n; k++)
+    {
+        acc[k] += w*sin(q[k]*r);
+    }
+#endif
+}
+
+void qloop_cos_qdx(const t_qvec_soa *q, const rvec dx, real w, real *acc)
+{
+    int             k;
+#ifdef GMX_SIMD_HAVE_REAL
+    gmx_simd_real_t dx_S, dy_S, dz_S, w_S, qdx_S;
+
+    dx_S = gmx_simd_set1_r(dx[XX]);
+    dy_S = gmx_simd_set1_r(dx[YY]);
+    dz_S = gmx_simd_set1_r(dx[ZZ]);
+    w_S  = gmx_simd_set1_r(w);
+    for (k = 0; k < q->n; k += GMX_SIMD_REAL_WIDTH)
+    {
+        qdx_S = gmx_simd_mul_r(gmx_simd_load_r(q->qx + k), dx_S);
+        qdx_S = gmx_simd_fmadd_r(gmx_simd_load_r(q->qy + k), dy_S, qdx_S);
+        qdx_S = gmx_simd_fmadd_r(gmx_simd_load_r(q->qz + k), dz_S, qdx_S);
+        gmx_simd_store_r(acc + k, gmx_simd_fmadd_r(w_S, gmx_simd_cos_r(qdx_S), gmx_simd_load_r(acc + k)));
+    }
+#else
+    for (k = 0; k < q->n; k++)
+    {
+        acc[k] += w*cos(q->qx[k]*dx[XX] + q->qy[k]*dx[YY] + q->qz[k]*dx[ZZ]);
+    }
+#endif
+}
+
+void qloop_cossin_qx(const t_qvec_soa *q, const rvec x, real w, real *cacc, real *sacc)
+{
+    int             k;
+#ifdef GMX_SIMD_HAVE_REAL
+    gmx_simd_real_t x_S, y_S, z_S, w_S, qx_S, s_S, c_S;
+
+    x_S = gmx_simd_set1_r(x[XX]);
+    y_S = gmx_simd_set1_r(x[YY]);
+    z_S = gmx_simd_set1_r(x[ZZ]);
+    w_S = gmx_simd_set1_r(w);
+    for (k = 0; k < q->n; k += GMX_SIMD_REAL_WIDTH)
+    {
+        qx_S = gmx_simd_mul_r(gmx_simd_load_r(q->qx + k), x_S);
+        qx_S = gmx_simd_fmadd_r(gmx_simd_load_r(q->qy + k), y_S, qx_S);
+        qx_S = gmx_simd_fmadd_r(gmx_simd_load_r(q->qz + k), z_S, qx_S);
+        gmx_simd_sincos_r(qx_S, &s_S, &c_S);
+        gmx_simd_store_r(cacc + k, gmx_simd_fmadd_r(w_S, c_S, gmx_simd_load_r(cacc + k)));
+        gmx_simd_store_r(sacc + k, gmx_simd_fmadd_r(w_S, s_S, gmx_simd_load_r(sacc + k)));
+    }
+#else
+    real qx;
+
+    for (k = 0; k < q->n; k++)
+    {
+        qx       = q->qx[k]*x[XX] + q->qy[k]*x[YY] + q->qz[k]*x[ZZ];
+        cacc[k] += w*cos(qx);
+        sacc[k] += w*sin(qx);
+    }
+#endif
+}
+
+void qloop_cos_qdx_multi(const t_qvec_soa *q, const rvec dx, int nw, const real w[], real *acc[])
+{
+    int             c, k;
+#ifdef GMX_SIMD_HAVE_REAL
+    gmx_simd_real_t dx_S, dy_S, dz_S, qdx_S, c_S;
+
+    dx_S = gmx_simd_set1_r(dx[XX]);
+    dy_S = gmx_simd_set1_r(dx[YY]);
+    dz_S = gmx_simd_set1_r(dx[ZZ]);
+    for (k = 0; k < q->n; k += GMX_SIMD_REAL_WIDTH)
+    {
+        qdx_S = gmx_simd_mul_r(gmx_simd_load_r(q->qx + k), dx_S);
+        qdx_S = gmx_simd_fmadd_r(gmx_simd_load_r(q->qy + k), dy_S, qdx_S);
+        qdx_S = gmx_simd_fmadd_r(gmx_simd_load_r(q->qz + k), dz_S, qdx_S);
+        c_S   = gmx_simd_cos_r(qdx_S);
+        for (c = 0; c < nw; c++)
+        {
+            gmx_simd_store_r(acc[c] + k, gmx_simd_fmadd_r(gmx_simd_set1_r(w[c]), c_S, gmx_simd_load_r(acc[c] + k)));
+        }
+    }
+#else
+    real cqdx;
+
+    for (k = 0; k < q->n; k++)
+    {
+        cqdx = cos(q->qx[k]*dx[XX] + q->qy[k]*dx[YY] + q->qz[k]*dx[ZZ]);
+        for (c = 0; c < nw; c++)
+        {
+            acc[c][k] += w[c]*cqdx;
+        }
+    }
+#endif
+}
+
+void qloop_cossin_qx_multi(const t_qvec_soa *q, const rvec x, int nw, const real w[],
+                           real *cacc[], real *sacc[])
+{
+    int             c, k;
+#ifdef GMX_SIMD_HAVE_REAL
+    gmx_simd_real_t x_S, y_S, z_S, w_S, qx_S, s_S, c_S;
+
+    x_S = gmx_simd_set1_r(x[XX]);
+    y_S = gmx_simd_set1_r(x[YY]);
+    z_S = gmx_simd_set1_r(x[ZZ]);
+    for (k = 0; k < q->n; k += GMX_SIMD_REAL_WIDTH)
+    {
+        qx_S = gmx_simd_mul_r(gmx_simd_load_r(q->qx + k), x_S);
+        qx_S = gmx_simd_fmadd_r(gmx_simd_load_r(q->qy + k), y_S, qx_S);
+        qx_S = gmx_simd_fmadd_r(gmx_simd_load_r(q->qz + k), z_S, qx_S);
+        gmx_simd_sincos_r(qx_S, &s_S, &c_S);
+        for (c = 0; c < nw; c++)
+        {
+            w_S = gmx_simd_set1_r(w[c]);
+            gmx_simd_store_r(cacc[c] + k, gmx_simd_fmadd_r(w_S, c_S, gmx_simd_load_r(cacc[c] + k)));
+            gmx_simd_store_r(sacc[c] + k, gmx_simd_fmadd_r(w_S, s_S, gmx_simd_load_r(sacc[c] + k)));
+        }
+    }
+#else
+    real qx, cqx, sqx;
+
+    for (k = 0; k < q->n; k++)
+    {
+        qx  = q->qx[k]*x[XX] + q->qy[k]*x[YY] + q->qz[k]*x[ZZ];
+        cqx = cos(qx);
+        sqx = sin(qx);
+        for (c = 0; c < nw; c++)
+        {
+            cacc[c][k] += w[c]*cqx;
+            sacc[c][k] += w[c]*sqx;
+        }
+    }
+#endif
+}
+
+void qloop_cossin_recur(int n, real a0, real da, int nseed, real w,
+                        real *cacc, real *sacc)
+{
+    int             k, b, nblock;
+#ifdef GMX_SIMD_HAVE_REAL
+    real            lane_array[2*GMX_SIMD_REAL_WIDTH], *lane;
+    gmx_simd_real_t a0_S, da_S, w_S, cd_S, sd_S, c_S, s_S, t_S, lane_S;
+
+    /* Lane l of block b holds the angle a0 + (b*width + l)*da,
+     * every step rotates all lanes by width*da.
+     */
+    lane = gmx_simd_align_r(lane_array);
+    for (k = 0; k < GMX_SIMD_REAL_WIDTH; k++)
+    {
+        lane[k] = k;
+    }
+    lane_S = gmx_simd_load_r(lane);
+    a0_S   = gmx_simd_set1_r(a0);
+    da_S   = gmx_simd_set1_r(da);
+    w_S    = gmx_simd_set1_r(w);
+    cd_S   = gmx_simd_set1_r(cos(GMX_SIMD_REAL_WIDTH*(double)da));
+    sd_S   = gmx_simd_set1_r(sin(GMX_SIMD_REAL_WIDTH*(double)da));
+    c_S    = gmx_simd_setzero_r();
+    s_S    = gmx_simd_setzero_r();
+    nblock = max(1, nseed/GMX_SIMD_REAL_WIDTH);
+    for (k = 0, b = 0; k < n; k += GMX_SIMD_REAL_WIDTH, b++)
+    {
+        if (b % nblock == 0)
+        {
+            t_S = gmx_simd_add_r(gmx_simd_set1_r(k), lane_S);
+            gmx_simd_sincos_r(gmx_simd_fmadd_r(t_S, da_S, a0_S), &s_S, &c_S);
+        }
+        else
+        {
+            t_S = gmx_simd_fmsub_r(c_S, cd_S, gmx_simd_mul_r(s_S, sd_S));
+            s_S = gmx_simd_fmadd_r(s_S, cd_S, gmx_simd_mul_r(c_S, sd_S));
+            c_S = t_S;
+        }
+        gmx_simd_store_r(cacc + k, gmx_simd_fmadd_r(w_S, c_S, gmx_simd_load_r(cacc + k)));
+        if (sacc != NULL)
+        {
+            gmx_simd_store_r(sacc + k, gmx_simd_fmadd_r(w_S, s_S, gmx_simd_load_r(sacc + k)));
+        }
+    }
+#else
+    real c = 0, s = 0, t, cd, sd;
+
+    cd     = cos(da);
+    sd     = sin(da);
+    nblock = max(1, nseed);
+    for (k = 0, b = 0; k < n; k++, b++)
+    {
+        if (b % nblock == 0)
+        {
+            c = cos(a0 + k*da);
+            s = sin(a0 + k*da);
+        }
+        else
+        {
+            t = c*cd - s*sd;
+            s = s*cd + c*sd;
+            c = t;
+        }
+        cacc[k] += w*c;
+        if (sacc != NULL)
+        {
+            sacc[k] += w*s;
+        }
+    }
+#endif
+}
@@ -0,0 +1,114 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+
+#ifndef _qloop_h
+#define _qloop_h
+
+#include "gromacs/legacyheaders/types/simple.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Kernels for the inner loops over wave vectors q of the scattering tools.
+ *
+ * The loops are evaluated with the SIMD math functions when SIMD is
+ * available and with libm otherwise. All q and accumulator arrays passed
+ * to these kernels must be allocated with qloop_snew (or otherwise be
+ * aligned and zero-padded to qloop_padded_size elements), since the
+ * SIMD loop runs over whole SIMD registers. The padding elements of the
+ * accumulators contain garbage after a call and should be ignored.
+ */
+
+/* Structure-of-arrays copy of a set of q vectors */
+typedef struct t_qvec_soa {
+    int   n;  /* number of q vectors */
+    real *qx; /* x components, padded */
+    real *qy; /* y components, padded */
+    real *qz; /* z components, padded */
+} t_qvec_soa;
+
+/* Returns n rounded up to a multiple of the SIMD width */
+int qloop_padded_size(int n);
+
+/* Allocates a zeroed, aligned and padded array for n elements */
+real *qloop_snew(int n);
+
+/* Frees an array allocated with qloop_snew */
+void qloop_sfree(real *p);
+
+/* Fills q with the n vectors qvec */
+void init_qvec_soa(t_qvec_soa *q, int n, rvec qvec[]);
+
+/* Frees the arrays of q */
+void done_qvec_soa(t_qvec_soa *q);
+
+/* acc[k] += w*sin(q[k]*r) for k = 0..n-1 */
+void qloop_sin_qr(int n, const real *q, real r, real w, real *acc);
+
+/* acc[k] += w*cos(q_k . dx) for all q vectors in q */
+void qloop_cos_qdx(const t_qvec_soa *q, const rvec dx, real w, real *acc);
+
+/* cacc[k] += w*cos(q_k . x) and sacc[k] += w*sin(q_k . x) for all q vectors in q */
+void qloop_cossin_qx(const t_qvec_soa *q, const rvec x, real w, real *cacc, real *sacc);
+
+/* acc[c][k] += w[c]*cos(q_k . dx) for c = 0..nw-1 and all q vectors in q.
+ * The cosines are evaluated once for all nw weights.
+ */
+void qloop_cos_qdx_multi(const t_qvec_soa *q, const rvec dx, int nw, const real w[], real *acc[]);
+
+/* cacc[c][k] += w[c]*cos(q_k . x) and sacc[c][k] += w[c]*sin(q_k . x) for
+ * c = 0..nw-1 and all q vectors in q, with one sin/cos for all weights.
+ */
+void qloop_cossin_qx_multi(const t_qvec_soa *q, const rvec x, int nw, const real w[],
+                           real *cacc[], real *sacc[]);
+
+/* cacc[k] += w*cos(a0 + k*da) and sacc[k] += w*sin(a0 + k*da) for k = 0..n-1.
+ *
+ * For a uniform q grid q_k = q0 + k*dq this gives the terms of the two
+ * kernels above with a0 = q0*r and da = dq*r, using the angle-addition
+ * recurrence instead of evaluating sin/cos for every k. The sines and
+ * cosines are re-seeded exactly every nseed elements (rounded to the
+ * SIMD width) to bound the accumulation of rounding errors.
+ * sacc can be NULL when only the cosine terms are needed.
+ */
+void qloop_cossin_recur(int n, real a0, real da, int nseed, real w,
+                        real *cacc, real *sacc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#include "sqaccum.h"
+#include "macros.h"
+#include "xvgr.h"
+#include "gromacs/fileio/filenm.h"
+#include "gromacs/fileio/futil.h"
+#include "gromacs/fileio/gmxfio.h"
+#include "gromacs/math/utilities.h"
+#include "gromacs/utility/cstringutil.h"
+#include "gromacs/utility/smalloc.h"
+
+#include "gromacs/legacyheaders/gmx_fatal.h"
+
+#define SQACCUM_VERSION 2
+
+void init_sqaccum(t_sqaccum *acc, int ncol, int nextra, int nblock)
+{
+    acc->ncol     = ncol;
+    acc->nextra   = nextra;
+    acc->nblock   = nblock;
+    acc->nframes  = 0;
+    acc->tlast    = 0;
+    acc->nbframes = 0;
+    acc->nb       = 0;
+    snew(acc->sum, ncol);
+    snew(acc->bsum, ncol);
+    snew(acc->bav, ncol);
+    snew(acc->bav2, ncol);
+    snew(acc->extra, max(nextra, 1));
+    acc->method   = NULL;
+    acc->ngrid    = 0;
+    acc->grid     = NULL;
+}
+
+void sqaccum_set_grid(t_sqaccum *acc, const char *method, int ngrid,
+                      const real *grid)
+{
+    int i;
+
+    sfree(acc->method);
+    acc->method = gmx_strdup(method);
+    acc->ngrid  = ngrid;
+    srenew(acc->grid, max(ngrid, 1));
+    for (i = 0; i < ngrid; i++)
+    {
+        acc->grid[i] = grid[i];
+    }
+}
+
+int sqaccum_block_remaining(const t_sqaccum *acc)
+{
+    return (acc->nblock > 0) ? acc->nblock - acc->nbframes : INT_MAX;
+}
+
+gmx_bool sqaccum_add(t_sqaccum *acc, const double *val, int nfr, real t)
+{
+    double   bav;
+    int      c;
+
+    if (nfr > sqaccum_block_remaining(acc))
+    {
+        gmx_incons("sqaccum_add called with frames beyond the end of the block");
+    }
+    for (c = 0; c < acc->ncol; c++)
+    {
+        acc->sum[c]  += val[c];
+        acc->bsum[c] += val[c];
+    }
+    acc->nframes  += nfr;
+    acc->nbframes += nfr;
+    acc->tlast     = t;
+    if (acc->nblock == 0 || acc->nbframes < acc->nblock)
+    {
+        return FALSE;
+    }
+
+    for (c = 0; c < acc->ncol; c++)
+    {
+        bav           = acc->bsum[c]/acc->nblock;
+        acc->bav[c]  += bav;
+        acc->bav2[c] += bav*bav;
+        acc->bsum[c]  = 0;
+    }
+    acc->nb++;
+    acc->nbframes = 0;
+
+    return TRUE;
+}
+
+int sqaccum_average(const t_sqaccum *acc, double *av, double *err)
+{
+    double bmean, bvar;
+    int    c;
+
+    for (c = 0; c < acc->ncol; c++)
+    {
+        av[c] = (acc->nframes > 0) ? acc->sum[c]/acc->nframes : 0;
+        if (err == NULL)
+        {
+            continue;
+        }
+        err[c] = 0;
+        if (acc->nb >= 2)
+        {
+            /* The variance of the block averages, divided by the number
+             * of blocks, estimates the variance of their mean.
+             */
+            bmean  = acc->bav[c]/acc->nb;
+            bvar   = (acc->bav2[c] - acc->nb*bmean*bmean)/(acc->nb - 1);
+            err[c] = sqrt(max(bvar, 0)/acc->nb);
+        }
+    }
+
+    return acc->nb;
+}
+
+void sqaccum_write_xvg(const t_sqaccum *acc, const char *fn, const char *title,
+                       const char *ylabel, int nq, const real *q, int nset,
+                       const int *col0, const char **legend, real offset,
+                       const output_env_t oenv)
+{
+    FILE   *fp;
+    double *av, *err;
+    char    buf[STRLEN], **leg;
+    int     s, qq, nb;
+
+    snew(av, acc->ncol);
+    snew(err, acc->ncol);
+    nb = sqaccum_average(acc, av, err);
+    sprintf(buf, "%s, %d frames, error from %d blocks", title, acc->nframes, nb);
+    fp = xvgropen(fn, buf, "q (nm\\S-1\\N)", ylabel, oenv);
+    if (nset == 1)
+    {
+        if (output_env_get_print_xvgr_codes(oenv))
+        {
+            fprintf(fp, "@TYPE xydy\n");
+        }
+        xvgr_legend(fp, 1, legend, oenv);
+    }
+    else
+    {
+        snew(leg, 2*nset);
+        for (s = 0; s < nset; s++)
+        {
+            leg[2*s] = gmx_strdup(legend[s]);
+            sprintf(buf, "%s error", legend[s]);
+            leg[2*s+1] = gmx_strdup(buf);
+        }
+        xvgr_legend(fp, 2*nset, (const char**)leg, oenv);
+        for (s = 0; s < 2*nset; s++)
+        {
+            sfree(leg[s]);
+        }
+        sfree(leg);
+    }
+    for (qq = 0; qq < nq; qq++)
+    {
+        fprintf(fp, "%10g", q[qq]);
+        for (s = 0; s < nset; s++)
+        {
+            fprintf(fp, " %10g %10g", offset + av[col0[s]+qq], err[col0[s]+qq]);
+        }
+        fprintf(fp, "\n");
+    }
+    gmx_ffclose(fp);
+    sfree(av);
+    sfree(err);
+}
+
+/* Reads or writes everything except the header with the tool name, sizes,
+ * method and q grid
+ */
+static void do_sqaccum(t_fileio *fio, t_sqaccum *acc)
+{
+    gmx_fio_do_int(fio, acc->nframes);
+    gmx_fio_do_double(fio, acc->tlast);
+    gmx_fio_do_int(fio, acc->nbframes);
+    gmx_fio_do_int(fio, acc->nb);
+    gmx_fio_ndo_double(fio, acc->sum, acc->ncol);
+    gmx_fio_ndo_double(fio, acc->bsum, acc->ncol);
+    gmx_fio_ndo_double(fio, acc->bav, acc->ncol);
+    gmx_fio_ndo_double(fio, acc->bav2, acc->ncol);
+    gmx_fio_ndo_double(fio, acc->extra, acc->nextra);
+}
+
+void sqaccum_write(const t_sqaccum *acc, const char *tool, const char *fn)
+{
+    t_fileio  *fio;
+    t_sqaccum  tmp;
+    char       name[STRLEN], meth[STRLEN], *fntemp;
+    int        version = SQACCUM_VERSION;
+    size_t     ext;
+
+    /* Insert _tmp before the extension, which selects the XDR format */
+    ext = strlen(ftp2ext(fn2ftp(fn))) + 1;
+    snew(fntemp, strlen(fn)+5);
+    strcpy(fntemp, fn);
+    fntemp[strlen(fn) - ext] = '\0';
+    strcat(fntemp, "_tmp");
+    strcat(fntemp, fn + strlen(fn) - ext);
+    /* The fio routines take non-const pointers, also for writing */
+    tmp = *acc;
+    strncpy(name, tool, STRLEN-1);
+    name[STRLEN-1] = '\0';
+    strncpy(meth, acc->method ? acc->method : "", STRLEN-1);
+    meth[STRLEN-1] = '\0';
+
+    fio = gmx_fio_open(fntemp, "w");
+    gmx_fio_do_int(fio, version);
+    gmx_fio_do_string(fio, name);
+    gmx_fio_do_int(fio, tmp.ncol);
+    gmx_fio_do_int(fio, tmp.nextra);
+    gmx_fio_do_int(fio, tmp.nblock);
+    gmx_fio_do_string(fio, meth);
+    gmx_fio_do_int(fio, tmp.ngrid);
+    gmx_fio_ndo_double(fio, tmp.grid, tmp.ngrid);
+    do_sqaccum(fio, &tmp);
+    if (gmx_fio_flush(fio) != 0 || gmx_fio_close(fio) != 0)
+    {
+        gmx_file("Cannot write the accumulator file; maybe you are out of disk space?");
+    }
+    if (gmx_file_rename(fntemp, fn) != 0)
+    {
+        gmx_file("Cannot rename the accumulator file; maybe you are out of disk space?");
+    }
+    sfree(fntemp);
+}
+
+void sqaccum_read(t_sqaccum *acc, const char *tool, const char *fn)
+{
+    t_fileio *fio;
+    char      name[STRLEN], meth[STRLEN];
+    int       version, ncol, nextra, nblock, ngrid, i;
+    double   *grid;
+
+    fio = gmx_fio_open(fn, "r");
+    gmx_fio_do_int(fio, version);
+    if (version != SQACCUM_VERSION)
+    {
+        gmx_fatal(FARGS, "Accumulator file %s has version %d, expected version %d",
+                  fn, version, SQACCUM_VERSION);
+    }
+    gmx_fio_do_string(fio, name);
+    gmx_fio_do_int(fio, ncol);
+    gmx_fio_do_int(fio, nextra);
+    gmx_fio_do_int(fio, nblock);
+    if (strcmp(name, tool) != 0)
+    {
+        gmx_fatal(FARGS, "Accumulator file %s was written by %s, not by %s",
+                  fn, name, tool);
+    }
+    if (ncol != acc->ncol || nextra != acc->nextra || nblock != acc->nblock)
+    {
+        gmx_fatal(FARGS, "Accumulator file %s has %d columns, %d extra values and blocks of %d frames,\n"
+                  "while the current settings give %d columns, %d extra values and blocks of %d frames",
+                  fn, ncol, nextra, nblock, acc->ncol, acc->nextra, acc->nblock);
+    }
+    gmx_fio_do_string(fio, meth);
+    gmx_fio_do_int(fio, ngrid);
+    if (strcmp(meth, acc->method ? acc->method : "") != 0)
+    {
+        gmx_fatal(FARGS, "Accumulator file %s was written with method %s, while the current method is %s",
+                  fn, meth, acc->method ? acc->method : "");
+    }
+    if (ngrid != acc->ngrid)
+    {
+        gmx_fatal(FARGS, "Accumulator file %s has a q grid of %d values, while the current settings give %d",
+                  fn, ngrid, acc->ngrid);
+    }
+    snew(grid, max(ngrid, 1));
+    gmx_fio_ndo_double(fio, grid, ngrid);
+    for (i = 0; i < ngrid; i++)
+    {
+        /* The grids are computed in the same way, but the stored values
+         * passed through real precision
+         */
+        if (!gmx_within_tol(grid[i], acc->grid[i], 10*GMX_REAL_EPS))
+        {
+            gmx_fatal(FARGS, "Value %d of the q grid in accumulator file %s is %g, while the current settings give %g",
+                      i, fn, grid[i], acc->grid[i]);
+        }
+    }
+    sfree(grid);
+    do_sqaccum(fio, acc);
+    gmx_fio_close(fio);
+}
+
+void done_sqaccum(t_sqaccum *acc)
+{
+    sfree(acc->sum);
+    sfree(acc->bsum);
+    sfree(acc->bav);
+    sfree(acc->bav2);
+    sfree(acc->extra);
+    sfree(acc->method);
+    sfree(acc->grid);
+}
@@ -0,0 +1,133 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+
+#ifndef _sqaccum_h
+#define _sqaccum_h
+
+#include "typedefs.h"
+#include "types/oenv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Accumulator for time averages of the structure factor tools.
+ *
+ * A tool passes the contribution of every frame to a set of ncol
+ * columns, e.g. S(q) for all groups and q values. The accumulator keeps
+ * the sums in double precision, both over all frames and over blocks of
+ * nblock frames, from which the standard error of the average is
+ * estimated with block averaging. The complete state, together with
+ * nextra tool-specific values that are not averaged, can be written to
+ * and read from a small checkpoint file, such that an analysis of a
+ * long trajectory can be continued later.
+ */
+typedef struct t_sqaccum {
+    int     ncol;     /* number of averaged columns */
+    int     nextra;   /* number of additional values stored in checkpoints */
+    int     nblock;   /* number of frames per block, 0 means no blocks */
+    int     nframes;  /* number of frames accumulated */
+    double  tlast;    /* time of the last frame accumulated */
+    double *sum;      /* sum over all frames, ncol */
+    int     nbframes; /* number of frames in the current block */
+    double *bsum;     /* sum over the frames in the current block, ncol */
+    int     nb;       /* number of completed blocks */
+    double *bav;      /* sum over the completed blocks of the block averages */
+    double *bav2;     /* sum over the completed blocks of the squares */
+    double *extra;    /* tool-specific values, nextra */
+    char   *method;   /* method the sums were computed with, or NULL */
+    int     ngrid;    /* number of values describing the q grid */
+    double *grid;     /* the q grid, ngrid */
+} t_sqaccum;
+
+/* Initializes an empty accumulator */
+void init_sqaccum(t_sqaccum *acc, int ncol, int nextra, int nblock);
+
+/* Sets the method and the ngrid values describing the q grid that the
+ * sums are computed with, which sqaccum_read() checks against the values
+ * stored in the checkpoint.
+ */
+void sqaccum_set_grid(t_sqaccum *acc, const char *method, int ngrid,
+                      const real *grid);
+
+/* Adds val, the sum of the contributions of nfr frames with the last at
+ * time t, to the accumulator. Returns TRUE when this completes a block,
+ * which happens exactly when nfr equals sqaccum_block_remaining().
+ */
+gmx_bool sqaccum_add(t_sqaccum *acc, const double *val, int nfr, real t);
+
+/* Returns the number of frames that are missing to complete the current
+ * block, or INT_MAX when blocks are not used.
+ */
+int sqaccum_block_remaining(const t_sqaccum *acc);
+
+/* Stores the average of every column over all frames in av. When err is
+ * not NULL, stores the standard error of the average estimated from the
+ * spread of the block averages, or 0 with fewer than two blocks.
+ * Returns the number of completed blocks.
+ */
+int sqaccum_average(const t_sqaccum *acc, double *av, double *err);
+
+/* Writes the averages and standard errors of nset sets of nq columns as
+ * a function of q to the xvg file fn. Set s starts at column col0[s] and
+ * gives two output columns, offset plus the average and the error, with
+ * legend[s] as name.
+ */
+void sqaccum_write_xvg(const t_sqaccum *acc, const char *fn, const char *title,
+                       const char *ylabel, int nq, const real *q, int nset,
+                       const int *col0, const char **legend, real offset,
+                       const output_env_t oenv);
+
+/* Writes acc to the checkpoint file fn. The file is first written under
+ * a temporary name and then renamed, so an interrupted write leaves the
+ * previous checkpoint intact. tool identifies the writing tool.
+ */
+void sqaccum_write(const t_sqaccum *acc, const char *tool, const char *fn);
+
+/* Reads acc from the checkpoint file fn. Gives a fatal error when the file
+ * was written by a different tool or with a different number of columns,
+ * extra values or block length than acc was initialized with, or with a
+ * different method or q grid than set with sqaccum_set_grid().
+ */
+void sqaccum_read(t_sqaccum *acc, const char *tool, const char *fn);
+
+/* Frees the arrays of acc */
+void done_sqaccum(t_sqaccum *acc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+
+#include "sqgrid.h"
+#include "calcgrid.h"
+#include "macros.h"
+#include "vec.h"
+#include "gromacs/utility/gmxmpi.h"
+#include "gromacs/utility/gmxomp.h"
+#include "gromacs/utility/smalloc.h"
+
+#include "gromacs/legacyheaders/gmx_fatal.h"
+
+void sqgrid_size(FILE *fp, matrix box, real spacing, real qmax, ivec n)
+{
+    if (spacing <= 0)
+    {
+        spacing = 0.5*M_PI/qmax;
+    }
+    n[XX] = 0;
+    n[YY] = 0;
+    n[ZZ] = 0;
+    calc_grid(fp, box, spacing, &n[XX], &n[YY], &n[ZZ]);
+}
+
+void init_sqgrid(t_sqgrid *sg, const ivec n, int order, int nthreads)
+{
+    MPI_Comm comm[] = { MPI_COMM_NULL, MPI_COMM_NULL };
+    ivec     ndata, complex_order, local_ndata, local_offset;
+    real    *bsp_data, *mod;
+    rvec     fract0 = { 0, 0, 0 };
+    int      ind0   = 0, d, i;
+
+    if (order < 3 || order > PME_ORDER_MAX)
+    {
+        gmx_fatal(FARGS, "The B-spline order should be between 3 and %d, not %d", PME_ORDER_MAX, order);
+    }
+    copy_ivec(n, sg->n);
+    sg->order    = order;
+    sg->nthreads = max(1, nthreads);
+    copy_ivec(n, ndata);
+    gmx_parallel_3dfft_init(&sg->fft, ndata, &sg->rgrid, &sg->cgrid, comm, TRUE, sg->nthreads);
+    gmx_parallel_3dfft_real_limits(sg->fft, local_ndata, local_offset, sg->rsize);
+    gmx_parallel_3dfft_complex_limits(sg->fft, complex_order, local_ndata, local_offset, sg->csize);
+
+    for (d = 0; d < DIM; d++)
+    {
+        snew(sg->theta[d], order);
+        snew(sg->dtheta[d], order);
+    }
+    /* The B-spline moduli follow from the weights at integer offsets */
+    make_bsplines(sg->theta, sg->dtheta, order, &fract0, 1, &ind0, NULL, TRUE);
+    for (d = 0; d < DIM; d++)
+    {
+        snew(bsp_data, n[d]);
+        for (i = 0; i < order && i < n[d]; i++)
+        {
+            bsp_data[i] = sg->theta[d][i];
+        }
+        snew(mod, n[d]);
+        make_dft_mod(mod, bsp_data, n[d]);
+        snew(sg->bsp_rmod[d], n[d]);
+        for (i = 0; i < n[d]; i++)
+        {
+            sg->bsp_rmod[d][i] = 1/sqrt(mod[i]);
+        }
+        sfree(mod);
+        sfree(bsp_data);
+        snew(sg->wrap[d], n[d] + order);
+        for (i = 0; i < n[d] + order; i++)
+        {
+            sg->wrap[d][i] = i % n[d];
+        }
+    }
+    sg->nalloc = 0;
+    sg->fractx = NULL;
+    sg->idx    = NULL;
+    sg->ind    = NULL;
+}
+
+gmx_bool sqgrid_has(const t_sqgrid *sg, const ivec m)
+{
+    int d;
+
+    for (d = 0; d < DIM; d++)
+    {
+        if (2*abs(m[d]) >= sg->n[d])
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+void sqgrid_spread_fft(t_sqgrid *sg, matrix box, int n, rvec x[],
+                       const atom_id *index, const real w[])
+{
+    matrix invbox;
+    real  *xptr, s, wi, wx, wxy, *thx, *thy, *thz, *grid_x, *grid_xy;
+    int    i, d, e, ti, kx, ky, kz, ntot, order, th;
+
+    if (n > sg->nalloc)
+    {
+        sg->nalloc = over_alloc_large(n);
+        srenew(sg->fractx, sg->nalloc);
+        srenew(sg->idx, sg->nalloc);
+        srenew(sg->ind, sg->nalloc);
+        for (i = 0; i < sg->nalloc; i++)
+        {
+            sg->ind[i] = i;
+        }
+        for (d = 0; d < DIM; d++)
+        {
+            srenew(sg->theta[d], sg->nalloc*sg->order);
+            srenew(sg->dtheta[d], sg->nalloc*sg->order);
+        }
+    }
+    order = sg->order;
+
+    /* Fractional coordinates, which need not be in the unit cell */
+    m_inv_ur0(box, invbox);
+    for (i = 0; i < n; i++)
+    {
+        xptr = x[index != NULL ? index[i] : i];
+        for (e = 0; e < DIM; e++)
+        {
+            s = 0;
+            for (d = 0; d < DIM; d++)
+            {
+                s += xptr[d]*invbox[d][e];
+            }
+            s                 *= sg->n[e];
+            ti                 = (int)floor(s);
+            sg->fractx[i][e]   = s - ti;
+            ti                %= sg->n[e];
+            sg->idx[i][e]      = (ti < 0) ? ti + sg->n[e] : ti;
+        }
+    }
+    make_bsplines(sg->theta, sg->dtheta, order, sg->fractx, n, sg->ind, NULL, TRUE);
+
+    ntot = sg->rsize[XX]*sg->rsize[YY]*sg->rsize[ZZ];
+    for (i = 0; i < ntot; i++)
+    {
+        sg->rgrid[i] = 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        wi  = (w != NULL) ? w[i] : 1;
+        thx = sg->theta[XX] + i*order;
+        thy = sg->theta[YY] + i*order;
+        thz = sg->theta[ZZ] + i*order;
+        for (kx = 0; kx < order; kx++)
+        {
+            wx     = wi*thx[kx];
+            grid_x = sg->rgrid + sg->wrap[XX][sg->idx[i][XX] + kx]*sg->rsize[YY]*sg->rsize[ZZ];
+            for (ky = 0; ky < order; ky++)
+            {
+                wxy     = wx*thy[ky];
+                grid_xy = grid_x + sg->wrap[YY][sg->idx[i][YY] + ky]*sg->rsize[ZZ];
+                for (kz = 0; kz < order; kz++)
+                {
+                    grid_xy[sg->wrap[ZZ][sg->idx[i][ZZ] + kz]] += wxy*thz[kz];
+                }
+            }
+        }
+    }
+
+    /* As in PME, every thread executes its part of the FFT */
+#pragma omp parallel num_threads(sg->nthreads) private(th)
+    {
+        th = gmx_omp_get_thread_num();
+        gmx_parallel_3dfft_execute(sg->fft, GMX_FFT_REAL_TO_COMPLEX, th, NULL);
+    }
+}
+
+void sqgrid_rho(const t_sqgrid *sg, const ivec m, real *re, real *im)
+{
+    ivec       mw;
+    int        d;
+    real       sign, rmod;
+    t_complex *c;
+
+    /* Only half of the z range is stored, use rho(-m) = rho(m)* */
+    sign = (m[ZZ] < 0) ? -1 : 1;
+    for (d = 0; d < DIM; d++)
+    {
+        mw[d] = (int)sign*m[d];
+        if (mw[d] < 0)
+        {
+            mw[d] += sg->n[d];
+        }
+    }
+    c    = sg->cgrid + (mw[YY]*sg->csize[ZZ] + mw[ZZ])*sg->csize[XX] + mw[XX];
+    rmod = sg->bsp_rmod[XX][mw[XX]]*sg->bsp_rmod[YY][mw[YY]]*sg->bsp_rmod[ZZ][mw[ZZ]];
+    *re  = c->re*rmod;
+    *im  = sign*c->im*rmod;
+}
+
+void done_sqgrid(t_sqgrid *sg)
+{
+    int d;
+
+    gmx_parallel_3dfft_destroy(sg->fft);
+    for (d = 0; d < DIM; d++)
+    {
+        sfree(sg->bsp_rmod[d]);
+        sfree(sg->wrap[d]);
+        sfree(sg->theta[d]);
+        sfree(sg->dtheta[d]);
+    }
+    sfree(sg->fractx);
+    sfree(sg->idx);
+    sfree(sg->ind);
+}
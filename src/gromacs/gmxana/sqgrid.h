@@ -0,0 +1,121 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+
+#ifndef _sqgrid_h
+#define _sqgrid_h
+
+#include <stdio.h>
+
+#include "typedefs.h"
+#include "pme.h"
+#include "gromacs/fft/parallel_3dfft.h"
+#include "gromacs/math/gmxcomplex.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Weighted densities on the reciprocal lattice of the box through a grid.
+ *
+ * For a wave vector on the reciprocal lattice, q = 2 pi m . box^-1 with
+ * integer m, the sum rho(m) = sum_i w_i exp(i q . x_i) is the Fourier
+ * transform of the weighted density. As for the reciprocal part of PME,
+ * the weights are spread on a grid with cardinal B-splines, the grid is
+ * transformed with one 3D FFT, after which rho(m) for every m within the
+ * Nyquist limit of the grid is a look-up, divided by the modulus of the
+ * B-spline transform. This costs O(N order^3 + K log K) per frame for
+ * N particles and K grid points, instead of O(N) per wave vector.
+ *
+ * The interpolation leaves a phase on rho(m) that depends on m only, so
+ * only products rho_a(m) rho_b(m)* of densities on the same grid are
+ * meaningful. The relative error of those decreases with the order and
+ * with the number of grid points per wavelength, with 4 points and
+ * order 6 it is a few times 1e-4.
+ */
+typedef struct t_sqgrid {
+    ivec                 n;             /* number of grid points along each box vector */
+    int                  order;         /* order of the B-spline interpolation */
+    int                  nthreads;      /* number of threads for the FFT */
+    gmx_parallel_3dfft_t fft;           /* the FFT setup */
+    real                *rgrid;         /* real-space grid, allocated by the FFT setup */
+    t_complex           *cgrid;         /* transform of rgrid, allocated by the FFT setup */
+    ivec                 rsize;         /* allocated size of rgrid, stored x, y, z */
+    ivec                 csize;         /* allocated size of cgrid, stored y, z, x */
+    real                *bsp_rmod[DIM]; /* inverse modulus of the B-spline transform */
+    int                 *wrap[DIM];     /* grid index modulo n, for n+order indices */
+    int                  nalloc;        /* allocation size of the particle arrays */
+    rvec                *fractx;        /* offset of each particle within its grid cell */
+    ivec                *idx;           /* grid cell of each particle */
+    int                 *ind;           /* 0..nalloc-1, for make_bsplines */
+    splinevec            theta;         /* B-spline weights */
+    splinevec            dtheta;        /* derivatives, not used */
+} t_sqgrid;
+
+/* Sets n to the grid for box with a spacing of at most spacing, or with
+ * 4 points per wavelength at wave vector qmax when spacing <= 0. The
+ * grid is printed to fp when not NULL.
+ */
+void sqgrid_size(FILE *fp, matrix box, real spacing, real qmax, ivec n);
+
+/* Sets up sg for a grid of size n and B-splines of order order, the FFT
+ * runs on nthreads threads
+ */
+void init_sqgrid(t_sqgrid *sg, const ivec n, int order, int nthreads);
+
+/* Returns whether the lattice vector m is within the Nyquist limit of the
+ * grid, which is required for sqgrid_rho
+ */
+gmx_bool sqgrid_has(const t_sqgrid *sg, const ivec m);
+
+/* Spreads the weights w of the n positions x[index[i]] in box on the grid
+ * and transforms it. w can be NULL for unit weights, index NULL for the
+ * first n positions.
+ */
+void sqgrid_spread_fft(t_sqgrid *sg, matrix box, int n, rvec x[],
+                       const atom_id *index, const real w[]);
+
+/* Returns in re and im rho(m) of the last sqgrid_spread_fft, up to a
+ * phase depending only on m
+ */
+void sqgrid_rho(const t_sqgrid *sg, const ivec m, real *re, real *im);
+
+/* Frees the contents of sg */
+void done_sqgrid(t_sqgrid *sg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
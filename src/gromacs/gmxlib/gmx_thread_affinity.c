@@ -61,6 +61,12 @@
 #include "gmx_fatal.h"
 #include "gromacs/utility/gmxomp.h"
 
+#ifdef HAVE_SCHED_AFFINITY
+/* The affinity mask of the master rank before its threads were pinned */
+static cpu_set_t mask_before_pinning;
+static gmx_bool  bMaskBeforePinningSet = FALSE;
+#endif
+
 static int
 get_thread_affinity_layout(FILE *fplog,
                            const t_commrec *cr,
@@ -289,6 +295,16 @@ gmx_set_thread_affinity(FILE                *fplog,
      * Reducing these 0/1 values over the threads will give the total number
      * of threads on which we succeeded.
      */
+#ifdef HAVE_SCHED_AFFINITY
+    /* Remember the mask for helper threads started later by the master */
+    if (MASTER(cr))
+    {
+        CPU_ZERO(&mask_before_pinning);
+        bMaskBeforePinningSet =
+            (sched_getaffinity(0, sizeof(cpu_set_t), &mask_before_pinning) == 0);
+    }
+#endif
+
     nth_affinity_set = 0;
 #pragma omp parallel num_threads(nthread_local) reduction(+:nth_affinity_set)
     {
@@ -471,3 +487,16 @@ gmx_check_thread_affinity_set(FILE            gmx_unused *fplog,
     }
 #endif /* HAVE_SCHED_AFFINITY */
 }
+
+void
+gmx_reset_thread_affinity(void)
+{
+#ifdef HAVE_SCHED_AFFINITY
+    if (bMaskBeforePinningSet &&
+        sched_setaffinity(0, sizeof(cpu_set_t), &mask_before_pinning) != 0 &&
+        debug)
+    {
+        fprintf(debug, "Could not reset the affinity of a helper thread\n");
+    }
+#endif /* HAVE_SCHED_AFFINITY */
+}
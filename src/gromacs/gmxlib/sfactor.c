@@ -56,6 +56,9 @@
 #include "gromacs/fileio/matio.h"
 #include "names.h"
 #include "sfactor.h"
+#include "gromacs/simd/simd.h"
+#include "gromacs/simd/simd_math.h"
+#include "gromacs/utility/gmxomp.h"
 
 
 typedef struct gmx_structurefactors {
@@ -87,6 +90,7 @@ typedef struct structure_factor
     double  **F;
     int       nSteps;
     int       total_n_atoms;
+    int       nthreads; /* OpenMP threads over k, <= 0 means all */
 } structure_factor;
 
 
@@ -168,6 +172,131 @@ extern t_complex *** rc_tensor_allocation(int x, int y, int z)
 }
 
 
+/* Group atoms in SoA layout, sorted by atom type. Every type starts at a
+ * multiple of SFACT_WIDTH; padding atoms sit at the origin with weight 0.
+ */
+typedef struct {
+    int   ntype;  /* number of different atom types       */
+    int  *type;   /* the atom type of each segment         */
+    int  *start;  /* segment boundaries, ntype+1 entries   */
+    real *x, *y, *z;
+    real *w;      /* 1 for real atoms, 0 for padding       */
+} sfact_soa_t;
+
+#ifdef GMX_SIMD_HAVE_REAL
+#define SFACT_WIDTH GMX_SIMD_REAL_WIDTH
+#else
+#define SFACT_WIDTH 1
+#endif
+
+static void init_sfact_soa(sfact_soa_t *soa, reduced_atom *redt, int isize)
+{
+    int t, p, n, npad;
+
+    /* Not create_indexed_atom_type, which uses 0 as terminator while 0 is
+     * also a valid atom type.
+     */
+    snew(soa->type, isize);
+    soa->ntype = 0;
+    for (p = 0; p < isize; p++)
+    {
+        for (t = 0; t < soa->ntype && soa->type[t] != redt[p].t; t++)
+        {
+            ;
+        }
+        if (t == soa->ntype)
+        {
+            soa->type[soa->ntype++] = redt[p].t;
+        }
+    }
+    snew(soa->start, soa->ntype+1);
+
+    npad = 0;
+    for (t = 0; t < soa->ntype; t++)
+    {
+        n = 0;
+        for (p = 0; p < isize; p++)
+        {
+            n += (redt[p].t == soa->type[t]);
+        }
+        npad += ((n + SFACT_WIDTH - 1)/SFACT_WIDTH)*SFACT_WIDTH;
+    }
+
+    /* snew_aligned zeroes, which gives the padding its position and weight */
+    snew_aligned(soa->x, npad + SFACT_WIDTH, SFACT_WIDTH*sizeof(real));
+    snew_aligned(soa->y, npad + SFACT_WIDTH, SFACT_WIDTH*sizeof(real));
+    snew_aligned(soa->z, npad + SFACT_WIDTH, SFACT_WIDTH*sizeof(real));
+    snew_aligned(soa->w, npad + SFACT_WIDTH, SFACT_WIDTH*sizeof(real));
+
+    n = 0;
+    for (t = 0; t < soa->ntype; t++)
+    {
+        soa->start[t] = n;
+        for (p = 0; p < isize; p++)
+        {
+            if (redt[p].t == soa->type[t])
+            {
+                soa->x[n] = redt[p].x[XX];
+                soa->y[n] = redt[p].x[YY];
+                soa->z[n] = redt[p].x[ZZ];
+                soa->w[n] = 1;
+                n++;
+            }
+        }
+        n = ((n + SFACT_WIDTH - 1)/SFACT_WIDTH)*SFACT_WIDTH;
+    }
+    soa->start[soa->ntype] = n;
+}
+
+static void done_sfact_soa(sfact_soa_t *soa)
+{
+    sfree(soa->type);
+    sfree(soa->start);
+    sfree_aligned(soa->x);
+    sfree_aligned(soa->y);
+    sfree_aligned(soa->z);
+    sfree_aligned(soa->w);
+}
+
+/* Sum cos(k.x) and sin(k.x) over the atoms p0 to p1 of soa */
+static void sum_cossin_kx(const sfact_soa_t *soa, int p0, int p1,
+                          real kx, real ky, real kz, real *re, real *im)
+{
+    int             p;
+#ifdef GMX_SIMD_HAVE_REAL
+    gmx_simd_real_t kx_S, ky_S, kz_S, kdotx_S, w_S, s_S, c_S, re_S, im_S;
+
+    kx_S = gmx_simd_set1_r(kx);
+    ky_S = gmx_simd_set1_r(ky);
+    kz_S = gmx_simd_set1_r(kz);
+    re_S = gmx_simd_setzero_r();
+    im_S = gmx_simd_setzero_r();
+    for (p = p0; p < p1; p += GMX_SIMD_REAL_WIDTH)
+    {
+        kdotx_S = gmx_simd_mul_r(kx_S, gmx_simd_load_r(soa->x + p));
+        kdotx_S = gmx_simd_fmadd_r(ky_S, gmx_simd_load_r(soa->y + p), kdotx_S);
+        kdotx_S = gmx_simd_fmadd_r(kz_S, gmx_simd_load_r(soa->z + p), kdotx_S);
+        gmx_simd_sincos_r(kdotx_S, &s_S, &c_S);
+        w_S     = gmx_simd_load_r(soa->w + p);
+        re_S    = gmx_simd_fmadd_r(w_S, c_S, re_S);
+        im_S    = gmx_simd_fmadd_r(w_S, s_S, im_S);
+    }
+    *re = gmx_simd_reduce_r(re_S);
+    *im = gmx_simd_reduce_r(im_S);
+#else
+    real            kdotx;
+
+    *re = 0;
+    *im = 0;
+    for (p = p0; p < p1; p++)
+    {
+        kdotx = kx*soa->x[p] + ky*soa->y[p] + kz*soa->z[p];
+        *re  += soa->w[p]*cos(kdotx);
+        *im  += soa->w[p]*sin(kdotx);
+    }
+#endif
+}
+
 extern void compute_structure_factor (structure_factor_t * sft, matrix box,
                                       reduced_atom_t * red, int isize, real start_q,
                                       real end_q, int group, real **sf_table)
@@ -175,11 +304,11 @@ extern void compute_structure_factor (structure_factor_t * sft, matrix box,
     structure_factor *sf   = (structure_factor *)sft;
     reduced_atom     *redt = (reduced_atom *)red;
 
-    t_complex      ***tmpSF;
+    sfact_soa_t       soa;
     rvec              k_factor;
-    real              kdotx, asf, kx, ky, kz, krr;
-    int               kr, maxkx, maxky, maxkz, i, j, k, p, *counter;
-
+    int               maxkx, maxky, maxkz, nij, chunk, nthreads, th, kr;
+    double          **thr_shell;
+    int             **thr_count;
 
     k_factor[XX] = 2 * M_PI / box[XX][XX];
     k_factor[YY] = 2 * M_PI / box[YY][YY];
@@ -188,79 +317,115 @@ extern void compute_structure_factor (structure_factor_t * sft, matrix box,
     maxkx = (int) (end_q / k_factor[XX] + 0.5);
     maxky = (int) (end_q / k_factor[YY] + 0.5);
     maxkz = (int) (end_q / k_factor[ZZ] + 0.5);
+    nij   = maxkx*maxky;
+    /* A chunk size of 0 is not allowed, also not when there is no work */
+    chunk = max(maxky, 1);
 
-    snew (counter, sf->n_angles);
+    init_sfact_soa(&soa, redt, isize);
+
+    nthreads = min((sf->nthreads <= 0) ? INT_MAX : sf->nthreads, gmx_omp_get_max_threads());
+    nthreads = max(nthreads, 1);
+
+    /* Instead of the full (kx,ky,kz) tensor every thread only keeps the
+     * sum of |F(k)|^2 and the number of k-vectors for each |k| shell.
+     */
+    snew(thr_shell, nthreads);
+    snew(thr_count, nthreads);
+    for (th = 0; th < nthreads; th++)
+    {
+        snew(thr_shell[th], sf->n_angles);
+        snew(thr_count[th], sf->n_angles);
+    }
 
-    tmpSF = rc_tensor_allocation(maxkx, maxky, maxkz);
-/*
- * The big loop...
- * compute real and imaginary part of the structure factor for every
- * (kx,ky,kz))
- */
     fprintf(stderr, "\n");
-    for (i = 0; i < maxkx; i++)
+#pragma omp parallel num_threads(nthreads)
     {
-        fprintf (stderr, "\rdone %3.1f%%     ", (double)(100.0*(i+1))/maxkx);
-        kx = i * k_factor[XX];
-        for (j = 0; j < maxky; j++)
+        int     thread = gmx_omp_get_thread_num();
+        double *shell  = thr_shell[thread];
+        int    *count  = thr_count[thread];
+        int     ij, i, j, k, t, kr;
+        real    kx, ky, kz, krr, re, im, re_t, im_t, asf;
+
+        /* Whole kx rows are dealt out cyclically, a static schedule keeps
+         * the partial sums of each thread the same from run to run
+         */
+#pragma omp for schedule(static, chunk)
+        for (ij = 0; ij < nij; ij++)
         {
+            i  = ij / maxky;
+            j  = ij % maxky;
+            kx = i * k_factor[XX];
             ky = j * k_factor[YY];
+            if (thread == 0 && j == 0)
+            {
+                fprintf (stderr, "\rdone %3.1f%%     ", (double)(100.0*(i+1))/maxkx);
+            }
             for (k = 0; k < maxkz; k++)
             {
-                if (i != 0 || j != 0 || k != 0)
+                if (i == 0 && j == 0 && k == 0)
+                {
+                    continue;
+                }
+                kz  = k * k_factor[ZZ];
+                krr = sqrt (sqr (kx) + sqr (ky) + sqr (kz));
+                if (krr < start_q || krr > end_q)
                 {
-                    kz  = k * k_factor[ZZ];
-                    krr = sqrt (sqr (kx) + sqr (ky) + sqr (kz));
-                    if (krr >= start_q && krr <= end_q)
-                    {
-                        kr = (int) (krr/sf->ref_k + 0.5);
-                        if (kr < sf->n_angles)
-                        {
-                            counter[kr]++; /* will be used for the copmutation
-                                              of the average*/
-                            for (p = 0; p < isize; p++)
-                            {
-                                asf = sf_table[redt[p].t][kr];
-
-                                kdotx = kx * redt[p].x[XX] +
-                                    ky * redt[p].x[YY] + kz * redt[p].x[ZZ];
-
-                                tmpSF[i][j][k].re += cos (kdotx) * asf;
-                                tmpSF[i][j][k].im += sin (kdotx) * asf;
-                            }
-                        }
-                    }
+                    continue;
                 }
+                kr = (int) (krr/sf->ref_k + 0.5);
+                if (kr >= sf->n_angles)
+                {
+                    continue;
+                }
+                /* The atomic scattering factor only depends on type and |k| */
+                re = 0;
+                im = 0;
+                for (t = 0; t < soa.ntype; t++)
+                {
+                    sum_cossin_kx(&soa, soa.start[t], soa.start[t+1], kx, ky, kz, &re_t, &im_t);
+                    asf = sf_table[soa.type[t]][kr];
+                    re += asf*re_t;
+                    im += asf*im_t;
+                }
+                shell[kr] += sqr(re) + sqr(im);
+                count[kr]++;
             }
         }
-    }               /* end loop on i */
+    }
+    fprintf (stderr, "\rdone %3.1f%%     ", 100.0);
+
 /*
  *  compute the square modulus of the structure factor, averaging on the surface
  *  kx*kx + ky*ky + kz*kz = krr*krr
  *  note that this is correct only for a (on the macroscopic scale)
  *  isotropic system.
+ *  With the static schedule and the reduction in thread order, the result
+ *  is reproducible for a given number of threads.
  */
-    for (i = 0; i < maxkx; i++)
+    for (th = 1; th < nthreads; th++)
     {
-        kx = i * k_factor[XX]; for (j = 0; j < maxky; j++)
+        for (kr = 0; kr < sf->n_angles; kr++)
         {
-            ky = j * k_factor[YY]; for (k = 0; k < maxkz; k++)
-            {
-                kz = k * k_factor[ZZ]; krr = sqrt (sqr (kx) + sqr (ky)
-                                                   + sqr (kz)); if (krr >= start_q && krr <= end_q)
-                {
-                    kr = (int) (krr / sf->ref_k + 0.5);
-                    if (kr < sf->n_angles && counter[kr] != 0)
-                    {
-                        sf->F[group][kr] +=
-                            (sqr (tmpSF[i][j][k].re) +
-                             sqr (tmpSF[i][j][k].im))/ counter[kr];
-                    }
-                }
-            }
+            thr_shell[0][kr] += thr_shell[th][kr];
+            thr_count[0][kr] += thr_count[th][kr];
+        }
+    }
+    for (kr = 0; kr < sf->n_angles; kr++)
+    {
+        if (thr_count[0][kr] != 0)
+        {
+            sf->F[group][kr] += thr_shell[0][kr]/thr_count[0][kr];
         }
     }
-    sfree (counter); free(tmpSF[0][0]); free(tmpSF[0]); free(tmpSF);
+
+    for (th = 0; th < nthreads; th++)
+    {
+        sfree(thr_shell[th]);
+        sfree(thr_count[th]);
+    }
+    sfree(thr_shell);
+    sfree(thr_count);
+    done_sfact_soa(&soa);
 }
 
 
@@ -451,7 +616,8 @@ extern int do_scattering_intensity (const char* fnTPS, const char* fnNDX,
                                     const char* fnXVG, const char *fnTRX,
                                     const char* fnDAT,
                                     real start_q, real end_q,
-                                    real energy, int ng, const output_env_t oenv)
+                                    real energy, int ng, int nthreads,
+                                    const output_env_t oenv)
 {
     int                     i, *isize, flags = TRX_READ_X, **index_atp;
     t_trxstatus            *status;
@@ -481,7 +647,8 @@ extern int do_scattering_intensity (const char* fnTPS, const char* fnNDX,
     success = gmx_structurefactors_get_sf(gmx_sf, 0, a, b, &c);
 
     snew (sf, 1);
-    sf->energy = energy;
+    sf->energy   = energy;
+    sf->nthreads = nthreads;
 
     /* Read the topology informations */
     read_tps_conf (fnTPS, title, &top, &ePBC, &xtop, NULL, box, TRUE);
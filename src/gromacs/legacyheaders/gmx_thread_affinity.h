@@ -67,6 +67,17 @@ gmx_check_thread_affinity_set(FILE *fplog, const t_commrec *cr,
                               gmx_hw_opt_t *hw_opt, int ncpus,
                               gmx_bool bAfterOpenmpInit);
 
+/* Sets the affinity of the calling thread to the mask the master rank
+ * had before gmx_set_thread_affinity() pinned its threads. Helper threads
+ * started by the master after pinning inherit the single-core mask of
+ * the master thread and should call this, so they do not compete with
+ * it for that core. Does nothing when no threads were pinned.
+ *
+ * Note that this will only work on Linux as we use a GNU feature.
+ */
+void
+gmx_reset_thread_affinity(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -127,6 +127,28 @@ void gmx_pme_calc_energy(gmx_pme_t pme, int n, rvec *x, real *q, real *V);
  * Currently does not work in parallel or with free energy.
  */
 
+/* We only define a maximum to be able to use local arrays without allocation.
+ * An order larger than 12 should never be needed, even for test cases.
+ * If needed it can be changed here.
+ */
+#define PME_ORDER_MAX 12
+
+void make_bsplines(splinevec theta, splinevec dtheta, int order,
+                   rvec fractx[], int nr, int ind[], real coefficient[],
+                   gmx_bool bDoSplines);
+/* Computes the B-spline coefficients theta and their derivatives dtheta
+ * of order order for the fractional offsets within a grid cell
+ * fractx[ind[i]], i=0..nr-1. theta[d][i*order+k] is the weight of grid
+ * point k of particle i along dimension d. Only the particles with
+ * non-zero coefficient[ind[i]] are handled, unless bDoSplines is set.
+ */
+
+void make_dft_mod(real *mod, real *data, int ndata);
+/* Sets mod to the squared modulus of the discrete Fourier transform of
+ * the ndata values in data, tiny values are replaced by the average of
+ * the neighbors.
+ */
+
 /* The following three routines are for PME/PP node splitting in pme_pp.c */
 
 /* Abstract type for PME <-> PP communication */
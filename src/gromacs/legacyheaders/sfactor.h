@@ -86,7 +86,8 @@ int do_scattering_intensity (const char* fnTPS, const char* fnNDX,
                              const char* fnXVG, const char *fnTRX,
                              const char* fnDAT,
                              real start_q, real end_q,
-                             real energy, int ng, const output_env_t oenv);
+                             real energy, int ng, int nthreads,
+                             const output_env_t oenv);
 
 t_complex *** rc_tensor_allocation(int x, int y, int z);
 
@@ -257,6 +257,239 @@ void calc_fit_R(int ndim, int natoms, real *w_rls, rvec *xp, rvec *x, matrix R)
     sfree(om);
 }
 
+real calc_fit_R_qcp(int natoms, real *w_rls, rvec *xp, rvec *x, matrix R)
+{
+    const double evalprec = 1e-11, evecprec = 1e-12;
+    int          n, i;
+    double       mn, wtot, ga, gb, e0, lambda, lambda_old, x2, a, b, delta;
+    double       Sxx, Sxy, Sxz, Syx, Syy, Syz, Szx, Szy, Szz;
+    double       Sxx2, Syy2, Szz2, Sxy2, Syz2, Sxz2, Syx2, Szy2, Szx2;
+    double       SyzSzymSyySzz2, Sxx2Syy2Szz2Syz2Szy2, Sxy2Sxz2Syx2Szx2;
+    double       SxzpSzx, SyzpSzy, SxypSyx, SyzmSzy, SxzmSzx, SxymSyx, SxxpSyy, SxxmSyy;
+    double       c0, c1, c2;
+    double       a11, a12, a13, a14, a21, a22, a23, a24, a31, a32, a33, a34, a41, a42, a43, a44;
+    double       a3344_4334, a3244_4234, a3243_4233, a3143_4133, a3144_4134, a3142_4132;
+    double       a1324_1423, a1224_1422, a1223_1322, a1124_1421, a1123_1321, a1122_1221;
+    double       q1, q2, q3, q4, qsqr, qnorm, qa2, qx2, qy2, qz2, xy, az, zx, ay, yz, ax;
+    double       u[DIM][DIM], dev, d;
+    matrix       Rloc;
+    rvec         xr;
+    gmx_bool     bExplicit;
+
+    /* The weighted inner products of the two structures */
+    for (i = 0; i < DIM; i++)
+    {
+        u[i][XX] = u[i][YY] = u[i][ZZ] = 0;
+    }
+    wtot = ga = gb = 0;
+    for (n = 0; n < natoms; n++)
+    {
+        if ((mn = w_rls[n]) != 0.0)
+        {
+            wtot += mn;
+            ga   += mn*iprod(xp[n], xp[n]);
+            gb   += mn*iprod(x[n], x[n]);
+            for (i = 0; i < DIM; i++)
+            {
+                u[i][XX] += mn*xp[n][i]*x[n][XX];
+                u[i][YY] += mn*xp[n][i]*x[n][YY];
+                u[i][ZZ] += mn*xp[n][i]*x[n][ZZ];
+            }
+        }
+    }
+    Sxx = u[XX][XX]; Sxy = u[XX][YY]; Sxz = u[XX][ZZ];
+    Syx = u[YY][XX]; Syy = u[YY][YY]; Syz = u[YY][ZZ];
+    Szx = u[ZZ][XX]; Szy = u[ZZ][YY]; Szz = u[ZZ][ZZ];
+
+    /* The coefficients of the characteristic polynomial
+     * lambda^4 + c2 lambda^2 + c1 lambda + c0 of the 4x4 key matrix
+     */
+    Sxx2 = Sxx*Sxx; Syy2 = Syy*Syy; Szz2 = Szz*Szz;
+    Sxy2 = Sxy*Sxy; Syz2 = Syz*Syz; Sxz2 = Sxz*Sxz;
+    Syx2 = Syx*Syx; Szy2 = Szy*Szy; Szx2 = Szx*Szx;
+
+    SyzSzymSyySzz2       = 2.0*(Syz*Szy - Syy*Szz);
+    Sxx2Syy2Szz2Syz2Szy2 = Syy2 + Szz2 - Sxx2 + Syz2 + Szy2;
+
+    c2 = -2.0*(Sxx2 + Syy2 + Szz2 + Sxy2 + Syx2 + Sxz2 + Szx2 + Syz2 + Szy2);
+    c1 = 8.0*(Sxx*Syz*Szy + Syy*Szx*Sxz + Szz*Sxy*Syx -
+              Sxx*Syy*Szz - Syz*Szx*Sxy - Szy*Syx*Sxz);
+
+    SxzpSzx = Sxz + Szx;
+    SyzpSzy = Syz + Szy;
+    SxypSyx = Sxy + Syx;
+    SyzmSzy = Syz - Szy;
+    SxzmSzx = Sxz - Szx;
+    SxymSyx = Sxy - Syx;
+    SxxpSyy = Sxx + Syy;
+    SxxmSyy = Sxx - Syy;
+
+    Sxy2Sxz2Syx2Szx2 = Sxy2 + Sxz2 - Syx2 - Szx2;
+
+    c0 = Sxy2Sxz2Syx2Szx2*Sxy2Sxz2Syx2Szx2
+        + (Sxx2Syy2Szz2Syz2Szy2 + SyzSzymSyySzz2)*(Sxx2Syy2Szz2Syz2Szy2 - SyzSzymSyySzz2)
+        + (-SxzpSzx*SyzmSzy + SxymSyx*(SxxmSyy - Szz))*(-SxzmSzx*SyzpSzy + SxymSyx*(SxxmSyy + Szz))
+        + (-SxzpSzx*SyzpSzy - SxypSyx*(SxxpSyy - Szz))*(-SxzmSzx*SyzmSzy - SxypSyx*(SxxpSyy + Szz))
+        + (SxypSyx*SyzpSzy + SxzpSzx*(SxxmSyy + Szz))*(-SxymSyx*SyzmSzy + SxzpSzx*(SxxpSyy + Szz))
+        + (SxypSyx*SyzmSzy + SxzmSzx*(SxxmSyy - Szz))*(-SxymSyx*SyzpSzy + SxzmSzx*(SxxpSyy - Szz));
+
+    /* Newton-Raphson for the largest root, which is bounded by (ga + gb)/2 */
+    e0     = 0.5*(ga + gb);
+    lambda = e0;
+    for (i = 0; i < 50; i++)
+    {
+        lambda_old = lambda;
+        x2         = lambda*lambda;
+        b          = (x2 + c2)*lambda;
+        a          = b + c1;
+        delta      = (a*lambda + c0)/(2.0*x2*lambda + b + a);
+        lambda    -= delta;
+        if (fabs(lambda - lambda_old) < fabs(evalprec*lambda))
+        {
+            break;
+        }
+    }
+
+    /* For nearly identical structures e0 - lambda suffers from cancellation,
+     * then we rotate and compute the deviation explicitly.
+     */
+    bExplicit = (e0 - lambda < 1e-5*e0);
+    if (bExplicit && R == NULL)
+    {
+        R = Rloc;
+    }
+
+    if (R != NULL)
+    {
+        /* The rotation is given by the quaternion that is the eigenvector
+         * of the key matrix for lambda, which we get from the cofactors
+         * of the key matrix minus lambda, using the first column
+         * with a significant cofactor.
+         */
+        a11 = SxxpSyy + Szz - lambda;
+        a12 = SyzmSzy;
+        a13 = -SxzmSzx;
+        a14 = SxymSyx;
+        a21 = SyzmSzy;
+        a22 = SxxmSyy - Szz - lambda;
+        a23 = SxypSyx;
+        a24 = SxzpSzx;
+        a31 = a13;
+        a32 = a23;
+        a33 = Syy - Sxx - Szz - lambda;
+        a34 = SyzpSzy;
+        a41 = a14;
+        a42 = a24;
+        a43 = a34;
+        a44 = Szz - SxxpSyy - lambda;
+
+        a3344_4334 = a33*a44 - a43*a34;
+        a3244_4234 = a32*a44 - a42*a34;
+        a3243_4233 = a32*a43 - a42*a33;
+        a3143_4133 = a31*a43 - a41*a33;
+        a3144_4134 = a31*a44 - a41*a34;
+        a3142_4132 = a31*a42 - a41*a32;
+        q1         =  a22*a3344_4334 - a23*a3244_4234 + a24*a3243_4233;
+        q2         = -a21*a3344_4334 + a23*a3144_4134 - a24*a3143_4133;
+        q3         =  a21*a3244_4234 - a22*a3144_4134 + a24*a3142_4132;
+        q4         = -a21*a3243_4233 + a22*a3143_4133 - a23*a3142_4132;
+        qsqr       = q1*q1 + q2*q2 + q3*q3 + q4*q4;
+
+        /* The cofactors scale with the 6th power of the coordinates */
+        if (qsqr < evecprec*e0*e0*e0*e0*e0*e0)
+        {
+            q1   =  a12*a3344_4334 - a13*a3244_4234 + a14*a3243_4233;
+            q2   = -a11*a3344_4334 + a13*a3144_4134 - a14*a3143_4133;
+            q3   =  a11*a3244_4234 - a12*a3144_4134 + a14*a3142_4132;
+            q4   = -a11*a3243_4233 + a12*a3143_4133 - a13*a3142_4132;
+            qsqr = q1*q1 + q2*q2 + q3*q3 + q4*q4;
+        }
+        if (qsqr < evecprec*e0*e0*e0*e0*e0*e0)
+        {
+            a1324_1423 = a13*a24 - a14*a23;
+            a1224_1422 = a12*a24 - a14*a22;
+            a1223_1322 = a12*a23 - a13*a22;
+            a1124_1421 = a11*a24 - a14*a21;
+            a1123_1321 = a11*a23 - a13*a21;
+            a1122_1221 = a11*a22 - a12*a21;
+
+            q1   =  a42*a1324_1423 - a43*a1224_1422 + a44*a1223_1322;
+            q2   = -a41*a1324_1423 + a43*a1124_1421 - a44*a1123_1321;
+            q3   =  a41*a1224_1422 - a42*a1124_1421 + a44*a1122_1221;
+            q4   = -a41*a1223_1322 + a42*a1123_1321 - a43*a1122_1221;
+            qsqr = q1*q1 + q2*q2 + q3*q3 + q4*q4;
+
+            if (qsqr < evecprec*e0*e0*e0*e0*e0*e0)
+            {
+                q1   =  a32*a1324_1423 - a33*a1224_1422 + a34*a1223_1322;
+                q2   = -a31*a1324_1423 + a33*a1124_1421 - a34*a1123_1321;
+                q3   =  a31*a1224_1422 - a32*a1124_1421 + a34*a1122_1221;
+                q4   = -a31*a1223_1322 + a32*a1123_1321 - a33*a1122_1221;
+                qsqr = q1*q1 + q2*q2 + q3*q3 + q4*q4;
+            }
+        }
+
+        if (qsqr < evecprec*e0*e0*e0*e0*e0*e0)
+        {
+            /* Degenerate eigenvalue, e.g. for identical structures,
+             * fall back to the Jacobi diagonalization
+             */
+            calc_fit_R(DIM, natoms, w_rls, xp, x, R);
+        }
+        else
+        {
+            qnorm = sqrt(qsqr);
+            q1   /= qnorm;
+            q2   /= qnorm;
+            q3   /= qnorm;
+            q4   /= qnorm;
+
+            qa2 = q1*q1;
+            qx2 = q2*q2;
+            qy2 = q3*q3;
+            qz2 = q4*q4;
+            xy  = q2*q3;
+            az  = q1*q4;
+            zx  = q4*q2;
+            ay  = q1*q3;
+            yz  = q3*q4;
+            ax  = q1*q2;
+
+            R[XX][XX] = qa2 + qx2 - qy2 - qz2;
+            R[XX][YY] = 2*(xy + az);
+            R[XX][ZZ] = 2*(zx - ay);
+            R[YY][XX] = 2*(xy - az);
+            R[YY][YY] = qa2 - qx2 + qy2 - qz2;
+            R[YY][ZZ] = 2*(yz + ax);
+            R[ZZ][XX] = 2*(zx + ay);
+            R[ZZ][YY] = 2*(yz - ax);
+            R[ZZ][ZZ] = qa2 - qx2 - qy2 + qz2;
+        }
+    }
+
+    if (wtot == 0)
+    {
+        return 0;
+    }
+    if (bExplicit)
+    {
+        dev = 0;
+        for (n = 0; n < natoms; n++)
+        {
+            if ((mn = w_rls[n]) != 0.0)
+            {
+                mvmul(R, x[n], xr);
+                d    = distance2(xp[n], xr);
+                dev += mn*d;
+            }
+        }
+
+        return sqrt(dev/wtot);
+    }
+
+    return sqrt(2.0*(e0 - lambda)/wtot);
+}
+
 void do_fit_ndim(int ndim, int natoms, real *w_rls, rvec *xp, rvec *x)
 {
     int    i, j, m, r, c;
@@ -73,6 +73,16 @@ void calc_fit_R(int ndim, int natoms, real *w_rls, rvec *xp, rvec *x,
  * x_rotated[i] = sum R[i][j]*x[j]
  */
 
+real calc_fit_R_qcp(int natoms, real *w_rls, rvec *xp, rvec *x, matrix R);
+/* Calculates the same rotation matrix R as calc_fit_R with ndim=3, using
+ * the quaternion characteristic polynomial (QCP) method of Theobald,
+ * Acta Cryst. A61, 478 (2005) and Liu et al., J. Comput. Chem. 31, 1561
+ * (2010), which is much cheaper than the Jacobi diagonalization.
+ * Returns the weighted RMSD between xp and the rotated x, which does not
+ * require rotating x. When R=NULL only the RMSD is calculated.
+ * Both xp and x should be centered round the origin.
+ */
+
 void do_fit_ndim(int ndim, int natoms, real *w_rls, rvec *xp, rvec *x);
 /* Do a least squares fit of x to xp. Atoms which have zero mass
  * (w_rls[i]) are not taken into account in fitting.
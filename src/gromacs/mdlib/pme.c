@@ -150,12 +150,6 @@ const real lb_scale_factor_symm[] = { 2.0/64, 12.0/64, 30.0/64, 20.0/64 };
  */
 #define GMX_CACHE_SEP 64
 
-/* We only define a maximum to be able to use local arrays without allocation.
- * An order larger than 12 should never be needed, even for test cases.
- * If needed it can be changed here.
- */
-#define PME_ORDER_MAX 12
-
 /* Internal datastructures */
 typedef struct {
     int send_index0;
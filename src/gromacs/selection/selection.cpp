@@ -103,6 +103,23 @@ SelectionData::SelectionData(SelectionTreeElement *elem,
 }
 
 
+SelectionData::SelectionData(const SelectionData *source)
+    : name_(source->name_), selectionText_(source->selectionText_),
+      posMass_(source->posMass_), posCharge_(source->posCharge_),
+      flags_(source->flags_), rootElement_(source->rootElement_),
+      coveredFractionType_(source->coveredFractionType_),
+      coveredFraction_(source->coveredFraction_),
+      averageCoveredFraction_(source->averageCoveredFraction_),
+      bDynamic_(source->bDynamic_),
+      bDynamicCoveredFraction_(source->bDynamicCoveredFraction_)
+{
+    gmx_ana_pos_copy(&rawPositions_,
+                     const_cast<gmx_ana_pos_t *>(&source->rawPositions_), true);
+    localAtoms_.reserve(source->rawPositions_.m.b.nra);
+    copyEvaluatedState(*source);
+}
+
+
 SelectionData::~SelectionData()
 {
 }
@@ -237,6 +254,26 @@ SelectionData::restoreOriginalPositions(const t_topology *top)
     }
 }
 
+
+void
+SelectionData::copyEvaluatedState(const SelectionData &source)
+{
+    gmx_ana_pos_t &p = rawPositions_;
+    gmx_ana_pos_copy(&p, const_cast<gmx_ana_pos_t *>(&source.rawPositions_),
+                     false);
+    if (p.m.mapb.nalloc_a == 0)
+    {
+        // gmx_ana_pos_copy() has made mapb.a point to the atoms of the
+        // source, which the next evaluation may overwrite.
+        localAtoms_.assign(p.m.mapb.a, p.m.mapb.a + p.m.mapb.nra);
+        p.m.mapb.a = localAtoms_.empty() ? NULL : &localAtoms_[0];
+    }
+    posMass_                = source.posMass_;
+    posCharge_              = source.posCharge_;
+    coveredFraction_        = source.coveredFraction_;
+    averageCoveredFraction_ = source.averageCoveredFraction_;
+}
+
 }   // namespace internal
 
 /********************************************************************
@@ -95,6 +95,23 @@ class SelectionData
          * \throws    std::bad_alloc if out of memory.
          */
         SelectionData(SelectionTreeElement *elem, const char *selstr);
+        /*! \brief
+         * Creates a frame-local copy of a selection.
+         *
+         * \param[in] source Selection to copy.
+         * \throws    std::bad_alloc if out of memory.
+         *
+         * The copy shares the evaluation tree of \p source, but it is never
+         * evaluated itself.  Instead, copyEvaluatedState() copies the
+         * positions of \p source after it has been evaluated, such that the
+         * copy can be used for analyzing a frame while \p source is evaluated
+         * for the next one.
+         * \p source should not have been evaluated yet, such that it
+         * contains the maximal set of positions.
+         *
+         * Called by SelectionCollection::initFrameLocalCopy().
+         */
+        explicit SelectionData(const SelectionData *source);
         ~SelectionData();
 
         //! Returns the name for this selection.
@@ -184,6 +201,16 @@ class SelectionData
          * Called by SelectionEvaluator::evaluateFinal().
          */
         void restoreOriginalPositions(const t_topology *top);
+        /*! \brief
+         * Copies the evaluated state of the selection this is a copy of.
+         *
+         * \param[in] source Selection given to the constructor.
+         *
+         * Does not allocate memory if \p source has not grown beyond the
+         * maximal set of positions.
+         * Called by SelectionCollection::copyEvaluatedState().
+         */
+        void copyEvaluatedState(const SelectionData &source);
 
     private:
         //! Name of the selection.
@@ -209,6 +236,13 @@ class SelectionData
         bool                      bDynamic_;
         //! true if the covered fraction depends on the frame.
         bool                      bDynamicCoveredFraction_;
+        /*! \brief
+         * Atoms of \a rawPositions_ for a frame-local copy.
+         *
+         * Used when the atoms of the source are not owned by its index
+         * mapping, and would change during the next evaluation.
+         */
+        std::vector<int>          localAtoms_;
 
         /*! \brief
          * Needed to wrap access to information.
@@ -172,6 +172,12 @@ class SelectionCollection::Impl
         bool                    bExternalGroupsSet_;
         //! External index groups (can be NULL).
         gmx_ana_indexgrps_t    *grps_;
+        /*! \brief
+         * Collection that this is a frame-local copy of (can be NULL).
+         *
+         * \see SelectionCollection::initFrameLocalCopy()
+         */
+        const SelectionCollection *source_;
 };
 
 /*! \internal
@@ -84,7 +84,7 @@ namespace gmx
  */
 
 SelectionCollection::Impl::Impl()
-    : debugLevel_(0), bExternalGroupsSet_(false), grps_(NULL)
+    : debugLevel_(0), bExternalGroupsSet_(false), grps_(NULL), source_(NULL)
 {
     sc_.nvars     = 0;
     sc_.varstrs   = NULL;
@@ -769,6 +769,56 @@ SelectionCollection::evaluateFinal(int nframes)
 }
 
 
+void
+SelectionCollection::initFrameLocalCopy(const SelectionCollection &source)
+{
+    GMX_RELEASE_ASSERT(impl_->sc_.sel.empty() && !impl_->sc_.root,
+                       "Frame-local copy should be made into an empty collection");
+    const SelectionDataList &sourceSel = source.impl_->sc_.sel;
+    impl_->sc_.sel.reserve(sourceSel.size());
+    for (size_t i = 0; i < sourceSel.size(); ++i)
+    {
+        SelectionDataPointer sel(new internal::SelectionData(sourceSel[i].get()));
+        impl_->sc_.sel.push_back(move(sel));
+    }
+    impl_->sc_.top = source.impl_->sc_.top;
+    impl_->source_ = &source;
+}
+
+
+void
+SelectionCollection::copyEvaluatedState()
+{
+    GMX_RELEASE_ASSERT(impl_->source_ != NULL,
+                       "copyEvaluatedState() called for a collection that is not a copy");
+    const SelectionDataList &sourceSel = impl_->source_->impl_->sc_.sel;
+    for (size_t i = 0; i < sourceSel.size(); ++i)
+    {
+        impl_->sc_.sel[i]->copyEvaluatedState(*sourceSel[i]);
+    }
+}
+
+
+Selection
+SelectionCollection::frameLocalSelection(const Selection &selection) const
+{
+    if (impl_->source_ == NULL)
+    {
+        return selection;
+    }
+    const SelectionDataList &sourceSel = impl_->source_->impl_->sc_.sel;
+    for (size_t i = 0; i < sourceSel.size(); ++i)
+    {
+        if (Selection(sourceSel[i].get()) == selection)
+        {
+            return Selection(impl_->sc_.sel[i].get());
+        }
+    }
+    GMX_ASSERT(false, "Selection is not part of the source collection");
+    return selection;
+}
+
+
 void
 SelectionCollection::printTree(FILE *fp, bool bValues) const
 {
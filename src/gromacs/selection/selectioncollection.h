@@ -336,6 +336,43 @@ class SelectionCollection
          */
         void evaluateFinal(int nframes);
 
+        /*! \brief
+         * Initializes this collection as a frame-local copy of another one.
+         *
+         * \param[in] source  Compiled selection collection to copy.
+         * \throws    std::bad_alloc if out of memory.
+         *
+         * This collection should be empty.  It gets a copy of each selection
+         * in \p source that is updated with copyEvaluatedState() instead of
+         * being evaluated, such that frames that have been evaluated in
+         * \p source can be analyzed concurrently while \p source is
+         * evaluated for the next frame.
+         * \p source should not have been evaluated yet, and it must remain
+         * valid as long as this collection exists.
+         */
+        void initFrameLocalCopy(const SelectionCollection &source);
+        /*! \brief
+         * Copies the evaluated selections from the source collection.
+         *
+         * \throws    std::bad_alloc if out of memory.
+         *
+         * Can only be called for a collection initialized with
+         * initFrameLocalCopy(), after evaluate() has been called for the
+         * source collection.
+         */
+        void copyEvaluatedState();
+        /*! \brief
+         * Returns the selection in this collection that corresponds to a
+         * given selection.
+         *
+         * \param[in] selection  Selection from the source collection.
+         * \returns   The frame-local copy of \p selection, or \p selection
+         *      itself if this collection is not a frame-local copy.
+         *
+         * Does not throw.
+         */
+        Selection frameLocalSelection(const Selection &selection) const;
+
         /*! \brief
          * Prints a human-readable version of the internal selection element
          * tree.
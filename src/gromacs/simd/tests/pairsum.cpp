@@ -0,0 +1,152 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cmath>
+
+#include <gtest/gtest.h>
+
+#include "gromacs/gmxana/pairsum.h"
+#include "gromacs/gmxana/qloop.h"
+#include "gromacs/legacyheaders/pbc.h"
+
+namespace
+{
+
+/*! \cond internal */
+/*! \addtogroup module_simd */
+/*! \{ */
+
+/*! \brief Number of q values, deliberately not a multiple of any SIMD width */
+const int c_nq = 23;
+
+/*! \brief Number of particles */
+const int c_natoms = 60;
+
+/*! \brief Number of weight sets */
+const int c_nchan = 3;
+
+/*! \brief Each channel of the multi-channel pair sum, which shares the
+ * pair search and the trigonometry between the weight sets, should match
+ * a single-channel pair sum with that channel's weights.
+ */
+void checkMultiAgainstSingle(int nthreads, gmx_bool bFade)
+{
+    matrix      box = {{3.1, 0, 0}, {0, 2.9, 0}, {0, 0, 3.3}};
+    t_pbc       pbc;
+    rvec        x[c_natoms], qvec[c_nq];
+    real        beta[c_nchan][c_natoms];
+    const real *betap[c_nchan];
+    real       *acc[c_nchan], *ref[c_nchan];
+    t_qvec_soa  qsoa;
+    t_pairsum  *ps;
+    real        rmax2 = 1.2*1.2;
+    unsigned    seed  = 12345;
+
+    for (int i = 0; i < c_natoms; i++)
+    {
+        for (int d = 0; d < DIM; d++)
+        {
+            seed    = seed*1103515245 + 12345;
+            x[i][d]  = box[d][d]*((seed >> 8) % 10000)*1e-4;
+        }
+        beta[0][i] = 1.0;
+        beta[1][i] = (i % 3 == 0 ? -0.8 : 0.4);
+        beta[2][i] = 0.01*(i + 1);
+    }
+    for (int k = 0; k < c_nq; k++)
+    {
+        qvec[k][XX] = 0.5*(k + 1)*0.48;
+        qvec[k][YY] = -0.5*(k + 1)*0.6;
+        qvec[k][ZZ] = 0.5*(k + 1)*0.64;
+    }
+    init_qvec_soa(&qsoa, c_nq, qvec);
+    set_pbc(&pbc, epbcXYZ, box);
+
+    ps = init_pairsum(NULL, epairsumCPU, nthreads, c_natoms, c_nchan, &qsoa,
+                      bFade, 0.9, 1/(4*(std::sqrt(rmax2) - 0.9)));
+    for (int c = 0; c < c_nchan; c++)
+    {
+        betap[c] = beta[c];
+        acc[c]   = qloop_snew(c_nq);
+        ref[c]   = qloop_snew(c_nq);
+        pairsum_calc(ps, &pbc, c_natoms, x, beta[c], rmax2, ref[c]);
+    }
+    pairsum_calc_multi(ps, &pbc, c_natoms, x, c_nchan, betap, rmax2, acc);
+
+    for (int c = 0; c < c_nchan; c++)
+    {
+        /* The summation order is the same, but allow for rounding
+         * relative to the sum of the absolute pair weights.
+         */
+        double scale = 0;
+        for (int i = 0; i < c_natoms; i++)
+        {
+            scale += std::fabs(beta[c][i]);
+        }
+        scale = scale*scale;
+        for (int k = 0; k < c_nq; k++)
+        {
+            EXPECT_NEAR(ref[c][k], acc[c][k], 100*GMX_REAL_EPS*scale)
+            << "channel " << c << ", k = " << k;
+        }
+        qloop_sfree(acc[c]);
+        qloop_sfree(ref[c]);
+    }
+    done_pairsum(ps);
+    done_qvec_soa(&qsoa);
+}
+
+TEST(PairsumTest, MultiChannelMatchesSingleChannel)
+{
+    checkMultiAgainstSingle(1, FALSE);
+}
+
+TEST(PairsumTest, MultiChannelMatchesSingleChannelWithFading)
+{
+    checkMultiAgainstSingle(1, TRUE);
+}
+
+TEST(PairsumTest, MultiChannelMatchesSingleChannelWithThreads)
+{
+    checkMultiAgainstSingle(3, TRUE);
+}
+
+/*! \} */
+/*! \endcond */
+
+}      // namespace
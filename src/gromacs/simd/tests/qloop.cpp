@@ -0,0 +1,350 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cmath>
+
+#include <gtest/gtest.h>
+
+#include "gromacs/gmxana/qloop.h"
+
+namespace
+{
+
+/*! \cond internal */
+/*! \addtogroup module_simd */
+/*! \{ */
+
+/*! \brief Number of q values, deliberately not a multiple of any SIMD width */
+const int c_nq = 37;
+
+/*! \brief Absolute tolerance for a single term with argument \p arg */
+double qloopTolerance(double arg)
+{
+    return 20*GMX_REAL_EPS*(1 + std::fabs(arg));
+}
+
+/*! \brief Fills a set of q vectors with |q| = qscale*(k + 1) */
+void fillQvecs(rvec qvec[], real q[], real qscale = 0.3)
+{
+    for (int k = 0; k < c_nq; k++)
+    {
+        q[k]        = qscale*(k + 1);
+        qvec[k][XX] = q[k]*0.48;
+        qvec[k][YY] = -q[k]*0.6;
+        qvec[k][ZZ] = q[k]*0.64;
+    }
+}
+
+TEST(QloopTest, PaddedSizeIsMultipleOfWidthAndLargeEnough)
+{
+    int w = qloop_padded_size(1);
+
+    EXPECT_GE(w, 1);
+    for (int n = 1; n < 40; n++)
+    {
+        int p = qloop_padded_size(n);
+        EXPECT_GE(p, n);
+        EXPECT_EQ(0, p % w);
+    }
+}
+
+TEST(QloopTest, SinQrMatchesReference)
+{
+    rvec  qvec[c_nq];
+    real *q   = qloop_snew(c_nq);
+    real *acc = qloop_snew(c_nq);
+    real  r   = 2.7;
+    real  w   = 0.85;
+
+    fillQvecs(qvec, q);
+    /* Accumulate twice to check that the kernel adds to acc */
+    qloop_sin_qr(c_nq, q, r, w, acc);
+    qloop_sin_qr(c_nq, q, r, w, acc);
+    for (int k = 0; k < c_nq; k++)
+    {
+        double ref = 2*w*std::sin(static_cast<double>(q[k])*r);
+        EXPECT_NEAR(ref, acc[k], 2*qloopTolerance(q[k]*r)) << "k = " << k;
+    }
+    qloop_sfree(q);
+    qloop_sfree(acc);
+}
+
+TEST(QloopTest, CosQdxMatchesReference)
+{
+    rvec       qvec[c_nq];
+    t_qvec_soa qsoa;
+    real      *q   = qloop_snew(c_nq);
+    real      *acc = qloop_snew(c_nq);
+    rvec       dx  = {1.3, -0.4, 2.2};
+    real       w   = -1.5;
+
+    fillQvecs(qvec, q);
+    init_qvec_soa(&qsoa, c_nq, qvec);
+    qloop_cos_qdx(&qsoa, dx, w, acc);
+    for (int k = 0; k < c_nq; k++)
+    {
+        double arg = (static_cast<double>(qvec[k][XX])*dx[XX] +
+                      static_cast<double>(qvec[k][YY])*dx[YY] +
+                      static_cast<double>(qvec[k][ZZ])*dx[ZZ]);
+        EXPECT_NEAR(w*std::cos(arg), acc[k], std::fabs(w)*qloopTolerance(arg)) << "k = " << k;
+    }
+    done_qvec_soa(&qsoa);
+    qloop_sfree(q);
+    qloop_sfree(acc);
+}
+
+TEST(QloopTest, CosSinQxMatchesReference)
+{
+    rvec       qvec[c_nq];
+    t_qvec_soa qsoa;
+    real      *q    = qloop_snew(c_nq);
+    real      *cacc = qloop_snew(c_nq);
+    real      *sacc = qloop_snew(c_nq);
+    rvec       x    = {-0.7, 3.1, 0.9};
+    real       w    = 0.6;
+
+    fillQvecs(qvec, q);
+    init_qvec_soa(&qsoa, c_nq, qvec);
+    qloop_cossin_qx(&qsoa, x, w, cacc, sacc);
+    for (int k = 0; k < c_nq; k++)
+    {
+        double arg = (static_cast<double>(qvec[k][XX])*x[XX] +
+                      static_cast<double>(qvec[k][YY])*x[YY] +
+                      static_cast<double>(qvec[k][ZZ])*x[ZZ]);
+        EXPECT_NEAR(w*std::cos(arg), cacc[k], w*qloopTolerance(arg)) << "k = " << k;
+        EXPECT_NEAR(w*std::sin(arg), sacc[k], w*qloopTolerance(arg)) << "k = " << k;
+    }
+    done_qvec_soa(&qsoa);
+    qloop_sfree(q);
+    qloop_sfree(cacc);
+    qloop_sfree(sacc);
+}
+
+/* The tests above stay below arguments of about 30 rad. Scattering at
+ * q up to 100 /nm over distances of several nm gives arguments of
+ * hundreds to thousands of rad, where the range reduction of the SIMD
+ * sin/cos determines the accuracy, so check that regime separately.
+ */
+TEST(QloopTest, SinQrMatchesReferenceForLargeArguments)
+{
+    rvec  qvec[c_nq];
+    real *q   = qloop_snew(c_nq);
+    real *acc = qloop_snew(c_nq);
+    real  r   = 8.3;
+    real  w   = 0.85;
+
+    /* q up to 111 /nm, q*r up to about 920 */
+    fillQvecs(qvec, q, 3.0);
+    qloop_sin_qr(c_nq, q, r, w, acc);
+    for (int k = 0; k < c_nq; k++)
+    {
+        double ref = w*std::sin(static_cast<double>(q[k])*r);
+        EXPECT_NEAR(ref, acc[k], qloopTolerance(q[k]*r)) << "k = " << k;
+    }
+    qloop_sfree(q);
+    qloop_sfree(acc);
+}
+
+TEST(QloopTest, CosSinQxMatchesReferenceForLargeArguments)
+{
+    rvec       qvec[c_nq];
+    t_qvec_soa qsoa;
+    real      *q    = qloop_snew(c_nq);
+    real      *dacc = qloop_snew(c_nq);
+    real      *cacc = qloop_snew(c_nq);
+    real      *sacc = qloop_snew(c_nq);
+    /* Absolute positions in a large box, |q.x| up to about 2400 */
+    rvec       x    = {-7.9, 13.4, 11.2};
+    real       w    = 0.6;
+
+    fillQvecs(qvec, q, 3.0);
+    init_qvec_soa(&qsoa, c_nq, qvec);
+    qloop_cos_qdx(&qsoa, x, w, dacc);
+    qloop_cossin_qx(&qsoa, x, w, cacc, sacc);
+    for (int k = 0; k < c_nq; k++)
+    {
+        double arg = (static_cast<double>(qvec[k][XX])*x[XX] +
+                      static_cast<double>(qvec[k][YY])*x[YY] +
+                      static_cast<double>(qvec[k][ZZ])*x[ZZ]);
+        EXPECT_NEAR(w*std::cos(arg), dacc[k], w*qloopTolerance(arg)) << "k = " << k;
+        EXPECT_NEAR(w*std::cos(arg), cacc[k], w*qloopTolerance(arg)) << "k = " << k;
+        EXPECT_NEAR(w*std::sin(arg), sacc[k], w*qloopTolerance(arg)) << "k = " << k;
+    }
+    done_qvec_soa(&qsoa);
+    qloop_sfree(q);
+    qloop_sfree(dacc);
+    qloop_sfree(cacc);
+    qloop_sfree(sacc);
+}
+
+/* The multi-channel kernels share the trigonometry between the weight
+ * sets, each channel should match a single-channel run with its weight.
+ * Check both the small and the large argument regime.
+ */
+TEST(QloopTest, CosQdxMultiMatchesSingleChannel)
+{
+    const int  nw = 3;
+    rvec       qvec[c_nq];
+    t_qvec_soa qsoa;
+    real      *q = qloop_snew(c_nq);
+    real      *acc[nw], *ref[nw];
+    rvec       dx    = {1.3, -0.4, 2.2};
+    real       w[nw] = {0.6, -2.1, 0.05};
+
+    for (int c = 0; c < nw; c++)
+    {
+        acc[c] = qloop_snew(c_nq);
+        ref[c] = qloop_snew(c_nq);
+    }
+    for (int s = 0; s < 2; s++)
+    {
+        fillQvecs(qvec, q, s == 0 ? 0.3 : 3.0);
+        init_qvec_soa(&qsoa, c_nq, qvec);
+        for (int c = 0; c < nw; c++)
+        {
+            for (int k = 0; k < c_nq; k++)
+            {
+                acc[c][k] = 0;
+                ref[c][k] = 0;
+            }
+            qloop_cos_qdx(&qsoa, dx, w[c], ref[c]);
+        }
+        qloop_cos_qdx_multi(&qsoa, dx, nw, w, acc);
+        for (int c = 0; c < nw; c++)
+        {
+            for (int k = 0; k < c_nq; k++)
+            {
+                EXPECT_NEAR(ref[c][k], acc[c][k], std::fabs(w[c])*qloopTolerance(0))
+                << "scale " << s << ", channel " << c << ", k = " << k;
+            }
+        }
+        done_qvec_soa(&qsoa);
+    }
+    for (int c = 0; c < nw; c++)
+    {
+        qloop_sfree(acc[c]);
+        qloop_sfree(ref[c]);
+    }
+    qloop_sfree(q);
+}
+
+TEST(QloopTest, CosSinQxMultiMatchesSingleChannel)
+{
+    const int  nw = 3;
+    rvec       qvec[c_nq];
+    t_qvec_soa qsoa;
+    real      *q = qloop_snew(c_nq);
+    real      *cacc[nw], *sacc[nw], *cref[nw], *sref[nw];
+    /* Absolute positions in a large box */
+    rvec       x     = {-7.9, 13.4, 11.2};
+    real       w[nw] = {0.6, -2.1, 0.05};
+
+    for (int c = 0; c < nw; c++)
+    {
+        cacc[c] = qloop_snew(c_nq);
+        sacc[c] = qloop_snew(c_nq);
+        cref[c] = qloop_snew(c_nq);
+        sref[c] = qloop_snew(c_nq);
+    }
+    for (int s = 0; s < 2; s++)
+    {
+        fillQvecs(qvec, q, s == 0 ? 0.3 : 3.0);
+        init_qvec_soa(&qsoa, c_nq, qvec);
+        for (int c = 0; c < nw; c++)
+        {
+            for (int k = 0; k < c_nq; k++)
+            {
+                cacc[c][k] = 0;
+                sacc[c][k] = 0;
+                cref[c][k] = 0;
+                sref[c][k] = 0;
+            }
+            qloop_cossin_qx(&qsoa, x, w[c], cref[c], sref[c]);
+        }
+        qloop_cossin_qx_multi(&qsoa, x, nw, w, cacc, sacc);
+        for (int c = 0; c < nw; c++)
+        {
+            for (int k = 0; k < c_nq; k++)
+            {
+                EXPECT_NEAR(cref[c][k], cacc[c][k], std::fabs(w[c])*qloopTolerance(0))
+                << "scale " << s << ", channel " << c << ", k = " << k;
+                EXPECT_NEAR(sref[c][k], sacc[c][k], std::fabs(w[c])*qloopTolerance(0))
+                << "scale " << s << ", channel " << c << ", k = " << k;
+            }
+        }
+        done_qvec_soa(&qsoa);
+    }
+    for (int c = 0; c < nw; c++)
+    {
+        qloop_sfree(cacc[c]);
+        qloop_sfree(sacc[c]);
+        qloop_sfree(cref[c]);
+        qloop_sfree(sref[c]);
+    }
+    qloop_sfree(q);
+}
+
+TEST(QloopTest, CosSinRecurrenceMatchesReference)
+{
+    const int nq    = 301;
+    real     *cacc  = qloop_snew(nq);
+    real     *sacc  = qloop_snew(nq);
+    real     *cacc2 = qloop_snew(nq);
+    real      a0    = 1.7;
+    real      da    = 0.31;
+    real      w     = 0.9;
+
+    qloop_cossin_recur(nq, a0, da, 64, w, cacc, sacc);
+    /* Without re-seeding the error grows, but sacc = NULL should work */
+    qloop_cossin_recur(nq, a0, da, nq, w, cacc2, NULL);
+    for (int k = 0; k < nq; k++)
+    {
+        double arg = a0 + k*static_cast<double>(da);
+        EXPECT_NEAR(w*std::cos(arg), cacc[k], w*qloopTolerance(arg)) << "k = " << k;
+        EXPECT_NEAR(w*std::sin(arg), sacc[k], w*qloopTolerance(arg)) << "k = " << k;
+        EXPECT_NEAR(w*std::cos(arg), cacc2[k], 4*w*qloopTolerance(arg)) << "k = " << k;
+    }
+    qloop_sfree(cacc);
+    qloop_sfree(sacc);
+    qloop_sfree(cacc2);
+}
+
+/*! \} */
+/*! \endcond */
+
+}      // namespace
@@ -114,6 +114,19 @@ class TrajectoryAnalysisSettings
              * \see setRmPBC()
              */
             efNoUserRmPBC    = 1<<5,
+            /*! \brief
+             * Allows analyzing several frames concurrently.
+             *
+             * If this flag is specified, the module promises that
+             * TrajectoryAnalysisModule::analyzeFrame() only modifies data in
+             * the TrajectoryAnalysisModuleData it is given and in data
+             * handles, and only accesses selections through
+             * TrajectoryAnalysisModuleData::parallelSelection().  The runner
+             * may then call it for different frames from different threads.
+             *
+             * \see TrajectoryAnalysisModule::startFrames()
+             */
+            efFrameParallel  = 1<<6,
         };
 
         //! Initializes default settings.
@@ -45,6 +45,9 @@
 #include "config.h"
 #endif
 
+#include <cstring>
+#include <vector>
+
 #include "gromacs/legacyheaders/pbc.h"
 #include "gromacs/legacyheaders/rmpbc.h"
 
@@ -54,19 +57,186 @@
 #include "gromacs/commandline/cmdlinemodule.h"
 #include "gromacs/commandline/cmdlinemodulemanager.h"
 #include "gromacs/commandline/cmdlineparser.h"
+#include "gromacs/fileio/trxio.h"
 #include "gromacs/options/options.h"
 #include "gromacs/selection/selectioncollection.h"
 #include "gromacs/selection/selectionoptionmanager.h"
 #include "gromacs/trajectoryanalysis/analysismodule.h"
 #include "gromacs/trajectoryanalysis/analysissettings.h"
 #include "gromacs/trajectoryanalysis/runnercommon.h"
+#include "gromacs/utility/common.h"
 #include "gromacs/utility/exceptions.h"
 #include "gromacs/utility/file.h"
 #include "gromacs/utility/gmxassert.h"
+#include "gromacs/utility/smalloc.h"
+#include "gromacs/utility/uniqueptr.h"
 
 namespace gmx
 {
 
+namespace
+{
+
+/*! \internal \brief
+ * Copies \p n vectors from \p src into \p dest, growing \p dest as needed.
+ *
+ * \returns \p *dest, or NULL if \p src is NULL.
+ */
+rvec *copyFrameVectors(const rvec *src, int n, rvec **dest, int *nalloc)
+{
+    if (src == NULL)
+    {
+        return NULL;
+    }
+    if (n > *nalloc)
+    {
+        srenew(*dest, n);
+        *nalloc = n;
+    }
+    std::memcpy(*dest, src, n*sizeof(rvec));
+    return *dest;
+}
+
+/*! \internal \brief
+ * State for one frame in a block of frames that are analyzed concurrently.
+ *
+ * Holds a private copy of the trajectory frame, the PBC information, and the
+ * frame-local selections and module data that are passed to
+ * TrajectoryAnalysisModule::analyzeFrame().
+ *
+ * \ingroup module_trajectoryanalysis
+ */
+class ParallelFrame
+{
+    public:
+        ParallelFrame()
+            : frameIndex_(-1), ppbc_(NULL), x_(NULL), v_(NULL), f_(NULL),
+              nallocX_(0), nallocV_(0), nallocF_(0)
+        {
+            clear_trxframe(&frame_, TRUE);
+        }
+        ~ParallelFrame()
+        {
+            sfree(x_);
+            sfree(v_);
+            sfree(f_);
+        }
+
+        //! Copies \p fr into this object such that it no longer aliases \p fr.
+        void copyFrame(const t_trxframe &fr)
+        {
+            frame_   = fr;
+            frame_.x = copyFrameVectors(fr.x, fr.natoms, &x_, &nallocX_);
+            frame_.v = copyFrameVectors(fr.v, fr.natoms, &v_, &nallocV_);
+            frame_.f = copyFrameVectors(fr.f, fr.natoms, &f_, &nallocF_);
+        }
+
+        //! Index of the frame in the trajectory.
+        int                                 frameIndex_;
+        //! Copy of the trajectory frame.
+        t_trxframe                          frame_;
+        //! PBC information for the frame.
+        t_pbc                               pbc_;
+        //! Points to \a pbc_, or NULL if PBC are not used.
+        t_pbc                              *ppbc_;
+        //! Selections evaluated for this frame.
+        SelectionCollection                 selections_;
+        //! Module data for the thread that analyzes this frame.
+        TrajectoryAnalysisModuleDataPointer pdata_;
+
+    private:
+        rvec                               *x_;
+        rvec                               *v_;
+        rvec                               *f_;
+        int                                 nallocX_;
+        int                                 nallocV_;
+        int                                 nallocF_;
+
+        GMX_DISALLOW_COPY_AND_ASSIGN(ParallelFrame);
+};
+
+//! Smart pointer to manage a ParallelFrame object.
+typedef gmx_unique_ptr<ParallelFrame>::type ParallelFramePointer;
+
+/*! \internal \brief
+ * Analyzes all remaining frames in blocks of \p nthreads frames.
+ *
+ * Frames are read and selections evaluated serially into the frame-local
+ * copies, after which each frame of the block is analyzed by a separate
+ * thread.  The data storage orders the frames, so the output is the same as
+ * for serial analysis.
+ *
+ * \returns The number of frames analyzed.
+ */
+int analyzeFramesInParallel(TrajectoryAnalysisModule         *module,
+                            TrajectoryAnalysisRunnerCommon   *common,
+                            const TrajectoryAnalysisSettings &settings,
+                            SelectionCollection              *selections,
+                            int                               nthreads)
+{
+    const TopologyInformation         &topology = common->topologyInformation();
+    AnalysisDataParallelOptions        dataOptions(nthreads);
+    std::vector<ParallelFramePointer>  frames;
+    for (int i = 0; i < nthreads; ++i)
+    {
+        ParallelFramePointer frame(new ParallelFrame);
+        frame->selections_.initFrameLocalCopy(*selections);
+        frame->pdata_ = module->startFrames(dataOptions, frame->selections_);
+        frames.push_back(move(frame));
+    }
+
+    int  nframes = 0;
+    bool bMore   = true;
+    while (bMore)
+    {
+        int nblock = 0;
+        do
+        {
+            common->initFrame();
+            ParallelFrame &pf = *frames[nblock];
+            pf.copyFrame(common->frame());
+            pf.ppbc_ = NULL;
+            if (settings.hasPBC())
+            {
+                set_pbc(&pf.pbc_, topology.ePBC(), pf.frame_.box);
+                pf.ppbc_ = &pf.pbc_;
+            }
+            selections->evaluate(&pf.frame_, pf.ppbc_);
+            pf.selections_.copyEvaluatedState();
+            pf.frameIndex_ = nframes++;
+            ++nblock;
+            bMore = common->readNextFrame();
+        }
+        while (bMore && nblock < nthreads);
+
+#pragma omp parallel for num_threads(nthreads) schedule(static, 1)
+        for (int i = 0; i < nblock; ++i)
+        {
+            try
+            {
+                ParallelFrame &pf = *frames[i];
+                module->analyzeFrame(pf.frameIndex_, pf.frame_, pf.ppbc_,
+                                     pf.pdata_.get());
+            }
+            GMX_CATCH_ALL_AND_EXIT_WITH_FATAL_ERROR;
+        }
+    }
+
+    for (size_t i = 0; i < frames.size(); ++i)
+    {
+        TrajectoryAnalysisModuleDataPointer &pdata = frames[i]->pdata_;
+        module->finishFrames(pdata.get());
+        if (pdata.get() != NULL)
+        {
+            pdata->finish();
+        }
+        pdata.reset();
+    }
+    return nframes;
+}
+
+}   // namespace
+
 /********************************************************************
  * TrajectoryAnalysisCommandLineRunner::Impl
  */
@@ -197,34 +367,43 @@ TrajectoryAnalysisCommandLineRunner::run(int argc, char *argv[])
     common.initFirstFrame();
     module->initAfterFirstFrame(common.frame());
 
-    t_pbc  pbc;
-    t_pbc *ppbc = settings.hasPBC() ? &pbc : NULL;
-
-    int    nframes = 0;
-    AnalysisDataParallelOptions         dataOptions;
-    TrajectoryAnalysisModuleDataPointer pdata(
-            module->startFrames(dataOptions, selections));
-    do
+    int          nframes  = 0;
+    const int    nthreads = common.frameThreadCount();
+    if (nthreads > 1)
+    {
+        nframes = analyzeFramesInParallel(module, &common, settings,
+                                          &selections, nthreads);
+    }
+    else
     {
-        common.initFrame();
-        t_trxframe &frame = common.frame();
-        if (ppbc != NULL)
+        t_pbc  pbc;
+        t_pbc *ppbc = settings.hasPBC() ? &pbc : NULL;
+
+        AnalysisDataParallelOptions         dataOptions;
+        TrajectoryAnalysisModuleDataPointer pdata(
+                module->startFrames(dataOptions, selections));
+        do
         {
-            set_pbc(ppbc, topology.ePBC(), frame.box);
-        }
+            common.initFrame();
+            t_trxframe &frame = common.frame();
+            if (ppbc != NULL)
+            {
+                set_pbc(ppbc, topology.ePBC(), frame.box);
+            }
 
-        selections.evaluate(&frame, ppbc);
-        module->analyzeFrame(nframes, frame, ppbc, pdata.get());
+            selections.evaluate(&frame, ppbc);
+            module->analyzeFrame(nframes, frame, ppbc, pdata.get());
 
-        nframes++;
-    }
-    while (common.readNextFrame());
-    module->finishFrames(pdata.get());
-    if (pdata.get() != NULL)
-    {
-        pdata->finish();
+            nframes++;
+        }
+        while (common.readNextFrame());
+        module->finishFrames(pdata.get());
+        if (pdata.get() != NULL)
+        {
+            pdata->finish();
+        }
+        pdata.reset();
     }
-    pdata.reset();
 
     if (common.hasTrajectory())
     {
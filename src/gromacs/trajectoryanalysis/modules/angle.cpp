@@ -313,7 +313,7 @@ Angle::~Angle()
 
 
 void
-Angle::initOptions(Options *options, TrajectoryAnalysisSettings * /*settings*/)
+Angle::initOptions(Options *options, TrajectoryAnalysisSettings *settings)
 {
     static const char *const desc[] = {
         "[THISMODULE] computes different types of angles between vectors.",
@@ -397,11 +397,13 @@ Angle::initOptions(Options *options, TrajectoryAnalysisSettings * /*settings*/)
                                        .dynamicMask().storeVector(&sel2_)
                                        .multiValue()
                                        .description("Second analysis/vector selection"));
+
+    settings->setFlag(TrajectoryAnalysisSettings::efFrameParallel);
 }
 
 
 void
-Angle::optionsFinished(Options *options, TrajectoryAnalysisSettings * /* settings */)
+Angle::optionsFinished(Options *options, TrajectoryAnalysisSettings *settings)
 {
     const bool bSingle = (g1type_[0] == 'a' || g1type_[0] == 'd');
 
@@ -436,7 +438,11 @@ Angle::optionsFinished(Options *options, TrajectoryAnalysisSettings * /* setting
         case 'n': natoms2_ = 0; break;
         case 'v': natoms2_ = 2; break;
         case 'p': natoms2_ = 3; break;
-        case 't': natoms2_ = 0; break;
+        case 't':
+            natoms2_ = 0;
+            // The reference vectors are taken from the first frame.
+            settings->setFlag(TrajectoryAnalysisSettings::efFrameParallel, false);
+            break;
         case 'z': natoms2_ = 0; break;
         case 's': natoms2_ = 1; break;
         default:
@@ -703,7 +709,7 @@ Angle::analyzeFrame(int frnr, const t_trxframe &fr, t_pbc *pbc,
                 clear_rvec(c2);
                 break;
             case 's':
-                copy_rvec(sel2_[g].position(0).x(), c2);
+                copy_rvec(sel2[g].position(0).x(), c2);
                 break;
         }
         dh.selectDataSet(g);
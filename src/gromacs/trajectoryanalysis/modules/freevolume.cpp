@@ -42,6 +42,7 @@
 #include "freevolume.h"
 
 #include <string>
+#include <vector>
 
 #include "gromacs/legacyheaders/atomprop.h"
 #include "gromacs/legacyheaders/copyrite.h"
@@ -62,6 +63,8 @@
 #include "gromacs/utility/arrayref.h"
 #include "gromacs/utility/exceptions.h"
 
+#include "thread_mpi/threads.h"
+
 namespace gmx
 {
 
@@ -118,6 +121,12 @@ class FreeVolume : public TrajectoryAnalysisModule
         double                            probeRadius_;
         gmx_rng_t                         rng_;
         int                               seed_, ninsert_;
+        //! Index of the next frame that may draw random numbers from \a rng_.
+        int                               nextRandomFrame_;
+        //! Protects \a rng_ and \a nextRandomFrame_.
+        tMPI_Thread_mutex_t               rngMutex_;
+        //! Signaled when \a nextRandomFrame_ changes.
+        tMPI_Thread_cond_t                rngCond_;
         AnalysisNeighborhood              nb_;
         //! The van der Waals radius per atom
         std::vector<double>               vdw_radius_;
@@ -137,13 +146,16 @@ FreeVolume::FreeVolume()
     data_.setColumnCount(0, 2);
     // Tell the analysis framework that this component exists
     registerAnalysisDataset(&data_, "freevolume");
-    rng_         = NULL;
-    nmol_        = 0;
-    mtot_        = 0;
-    cutoff_      = 0;
-    probeRadius_ = 0;
-    seed_        = -1;
-    ninsert_     = 1000;
+    rng_             = NULL;
+    nmol_            = 0;
+    mtot_            = 0;
+    cutoff_          = 0;
+    probeRadius_     = 0;
+    seed_            = -1;
+    ninsert_         = 1000;
+    nextRandomFrame_ = 0;
+    tMPI_Thread_mutex_init(&rngMutex_);
+    tMPI_Thread_cond_init(&rngCond_);
 }
 
 
@@ -155,6 +167,8 @@ FreeVolume::~FreeVolume()
     {
         gmx_rng_destroy(rng_);
     }
+    tMPI_Thread_cond_destroy(&rngCond_);
+    tMPI_Thread_mutex_destroy(&rngMutex_);
 }
 
 
@@ -221,7 +235,8 @@ FreeVolume::initOptions(Options                    *options,
 
     // Control input settings
     settings->setFlags(TrajectoryAnalysisSettings::efRequireTop |
-                       TrajectoryAnalysisSettings::efNoUserPBC);
+                       TrajectoryAnalysisSettings::efNoUserPBC |
+                       TrajectoryAnalysisSettings::efFrameParallel);
     settings->setPBC(true);
 }
 
@@ -342,19 +357,31 @@ FreeVolume::analyzeFrame(int frnr, const t_trxframe &fr, t_pbc *pbc,
     // Use neighborsearching tools!
     AnalysisNeighborhoodSearch nbsearch = nb_.initSearch(pbc, sel);
 
+    // Generate random numbers between 0 and 1 for all insertions.
+    // Frames may be analyzed concurrently, so wait for the turn of this
+    // frame to keep the sequence identical to that of serial analysis.
+    std::vector<real> rand(DIM*Ninsert);
+    tMPI_Thread_mutex_lock(&rngMutex_);
+    while (nextRandomFrame_ != frnr)
+    {
+        tMPI_Thread_cond_wait(&rngCond_, &rngMutex_);
+    }
+    for (int i = 0; (i < DIM*Ninsert); i++)
+    {
+        rand[i] = gmx_rng_uniform_real(rng_);
+    }
+    nextRandomFrame_++;
+    tMPI_Thread_cond_broadcast(&rngCond_);
+    tMPI_Thread_mutex_unlock(&rngMutex_);
+
     // Then loop over insertions
     int NinsTot = 0;
     for (int i = 0; (i < Ninsert); i++)
     {
-        rvec rand, ins, dx;
+        rvec ins, dx;
 
-        for (int m = 0; (m < DIM); m++)
-        {
-            // Generate random number between 0 and 1
-            rand[m] = gmx_rng_uniform_real(rng_);
-        }
         // Generate random 3D position within the box
-        mvmul(fr.box, rand, ins);
+        mvmul(fr.box, &rand[DIM*i], ins);
 
         // Find the first reference position within the cutoff.
         bool                           bOverlap = false;
@@ -50,6 +50,8 @@
 #include "gromacs/utility/smalloc.h"
 #include "nsc.h"
 
+#include "thread_mpi/threads.h"
+
 #define TEST_NSC 0
 
 #define TEST_ARC 0
@@ -63,6 +65,9 @@ real   *xpunsp = NULL;
 real    del_cube;
 int     n_dot, ico_cube, last_n_dot = 0, last_densit = 0, last_unsp = 0;
 int     last_cubus = 0;
+/* Protects the creation of the unit sphere above when several frames are
+ * analyzed concurrently. */
+static tMPI_Thread_mutex_t unsp_mutex = TMPI_THREAD_MUTEX_INITIALIZER;
 
 #define FOURPI (4.*M_PI)
 #define TORAD(A)     ((A)*0.017453293)
@@ -570,7 +575,11 @@ int make_unsp(int densit, int mode, int * num_dot, int cubus)
     /* determine distribution of points in elementary cubes */
     if (cubus)
     {
-        ico_cube = cubus;
+        /* Remember the cube count, such that nsc_dclm_pbc() only recreates
+         * the unit sphere when the parameters change; the sphere may be in
+         * use by other threads. */
+        ico_cube   = cubus;
+        last_cubus = cubus;
     }
     else
     {
@@ -685,14 +694,17 @@ int nsc_dclm_pbc(const rvec *coords, real *radius, int nat,
     int         iat_xx, jat_xx;
 
     distribution = unsp_type(densit);
+    tMPI_Thread_mutex_lock(&unsp_mutex);
     if (distribution != -last_unsp || last_cubus != 4 ||
         (densit != last_densit && densit != last_n_dot))
     {
         if (make_unsp(densit, (-distribution), &n_dot, 4))
         {
+            tMPI_Thread_mutex_unlock(&unsp_mutex);
             return 1;
         }
     }
+    tMPI_Thread_mutex_unlock(&unsp_mutex);
     xus = xpunsp;
 
     dotarea = FOURPI/(real) n_dot;
@@ -286,6 +286,8 @@ class Sasa : public TrajectoryAnalysisModule
 
         virtual void initOptions(Options                    *options,
                                  TrajectoryAnalysisSettings *settings);
+        virtual void optionsFinished(Options                    *options,
+                                     TrajectoryAnalysisSettings *settings);
         virtual void initAnalysis(const TrajectoryAnalysisSettings &settings,
                                   const TopologyInformation        &top);
 
@@ -486,6 +488,19 @@ Sasa::initOptions(Options *options, TrajectoryAnalysisSettings *settings)
 
     // Atom names etc. are required for the VdW radii lookup.
     settings->setFlag(TrajectoryAnalysisSettings::efRequireTop);
+    settings->setFlag(TrajectoryAnalysisSettings::efFrameParallel);
+}
+
+void
+Sasa::optionsFinished(Options                    * /*options*/,
+                      TrajectoryAnalysisSettings *settings)
+{
+    // connolly_plot() modifies the topology while the first frame is
+    // analyzed, so other frames cannot be analyzed at the same time.
+    if (!fnConnolly_.empty())
+    {
+        settings->setFlag(TrajectoryAnalysisSettings::efFrameParallel, false);
+    }
 }
 
 void
@@ -949,8 +964,8 @@ Sasa::analyzeFrame(int frnr, const t_trxframe &fr, t_pbc *pbc,
     {
         // This is somewhat nasty, as it modifies the atoms and symtab
         // structures.  But since it is only used in the first frame, and no
-        // one else uses the topology after initialization, it may just work
-        // even with future parallelization.
+        // one else uses the topology after initialization, it works as long
+        // as optionsFinished() disables frame-parallel analysis with -q.
         connolly_plot(fnConnolly_.c_str(),
                       nsurfacedots, surfacedots, fr.x, &top_->atoms,
                       &top_->symtab, fr.ePBC, fr.box, bIncludeSolute_);
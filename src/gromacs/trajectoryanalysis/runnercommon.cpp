@@ -63,6 +63,7 @@
 #include "gromacs/trajectoryanalysis/analysissettings.h"
 #include "gromacs/utility/exceptions.h"
 #include "gromacs/utility/gmxassert.h"
+#include "gromacs/utility/gmxomp.h"
 #include "gromacs/utility/programcontext.h"
 #include "gromacs/utility/smalloc.h"
 #include "gromacs/utility/stringutil.h"
@@ -92,6 +93,8 @@ class TrajectoryAnalysisRunnerCommon::Impl
         double                      startTime_;
         double                      endTime_;
         double                      deltaTime_;
+        //! Number of threads for frame-parallel analysis (0 = maximum).
+        int                         nthreads_;
 
         gmx_ana_indexgrps_t        *grps_;
         bool                        bTrajOpen_;
@@ -106,7 +109,7 @@ class TrajectoryAnalysisRunnerCommon::Impl
 
 TrajectoryAnalysisRunnerCommon::Impl::Impl(TrajectoryAnalysisSettings *settings)
     : settings_(*settings),
-      startTime_(0.0), endTime_(0.0), deltaTime_(0.0),
+      startTime_(0.0), endTime_(0.0), deltaTime_(0.0), nthreads_(1),
       grps_(NULL),
       bTrajOpen_(false), fr(NULL), gpbc_(NULL), status_(NULL), oenv_(NULL)
 {
@@ -214,6 +217,12 @@ TrajectoryAnalysisRunnerCommon::initOptions(Options *options)
                                .description("Use periodic boundary conditions for distance calculation"));
     }
 
+    if (settings.hasFlag(TrajectoryAnalysisSettings::efFrameParallel))
+    {
+        options->addOption(IntegerOption("nt").store(&impl_->nthreads_)
+                               .description("Number of threads for analyzing frames in parallel (0 uses all OpenMP threads)"));
+    }
+
     options->addOption(SelectionFileOption("sf"));
 }
 
@@ -447,6 +456,23 @@ TrajectoryAnalysisRunnerCommon::hasTrajectory() const
 }
 
 
+int
+TrajectoryAnalysisRunnerCommon::frameThreadCount() const
+{
+    if (!hasTrajectory()
+        || !impl_->settings_.hasFlag(TrajectoryAnalysisSettings::efFrameParallel))
+    {
+        return 1;
+    }
+    const int maxThreads = gmx_omp_get_max_threads();
+    if (impl_->nthreads_ <= 0 || impl_->nthreads_ > maxThreads)
+    {
+        return maxThreads;
+    }
+    return impl_->nthreads_;
+}
+
+
 const TopologyInformation &
 TrajectoryAnalysisRunnerCommon::topologyInformation() const
 {
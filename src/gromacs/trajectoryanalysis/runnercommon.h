@@ -119,6 +119,15 @@ class TrajectoryAnalysisRunnerCommon
 
         //! Returns true if input data comes from a trajectory.
         bool hasTrajectory() const;
+        /*! \brief
+         * Returns the number of frames to analyze concurrently.
+         *
+         * Returns one unless the module has set
+         * TrajectoryAnalysisSettings::efFrameParallel and there is a
+         * trajectory; otherwise, the value of -nt limited by the number of
+         * OpenMP threads.
+         */
+        int frameThreadCount() const;
         //! Returns the topology information object.
         const TopologyInformation &topologyInformation() const;
         //! Returns the currently loaded frame.
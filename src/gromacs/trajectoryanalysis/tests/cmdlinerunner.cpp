@@ -0,0 +1,228 @@
+/*
+ * This file is part of the GROMACS molecular simulation package.
+ *
+ * Copyright (c) 2014, by the GROMACS development team, led by
+ * Mark Abraham, David van der Spoel, Berk Hess, and Erik Lindahl,
+ * and including many others, as listed in the AUTHORS file in the
+ * top-level source directory and at http://www.gromacs.org.
+ *
+ * GROMACS is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * GROMACS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GROMACS; if not, see
+ * http://www.gnu.org/licenses, or write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ *
+ * If you want to redistribute modifications to GROMACS, please
+ * consider that scientific software is very special. Version
+ * control is crucial - bugs must be traceable. We will be happy to
+ * consider code for inclusion in the official distribution, but
+ * derived work must not be called official GROMACS. Details are found
+ * in the README & COPYING files - if they are missing, get the
+ * official version at http://www.gromacs.org.
+ *
+ * To help us fund GROMACS development, we humbly ask that you cite
+ * the research papers on the package. Check out http://www.gromacs.org.
+ */
+/*! \internal \file
+ * \brief
+ * Tests frame-parallel analysis in gmx::TrajectoryAnalysisCommandLineRunner.
+ *
+ * \ingroup module_trajectoryanalysis
+ */
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+
+#include <string>
+#include <vector>
+
+#include "gromacs/trajectoryanalysis/analysismodule.h"
+#include "gromacs/trajectoryanalysis/cmdlinerunner.h"
+#include "gromacs/trajectoryanalysis/modules/angle.h"
+#include "gromacs/trajectoryanalysis/modules/distance.h"
+#include "gromacs/trajectoryanalysis/modules/select.h"
+#include "gromacs/utility/file.h"
+#include "gromacs/utility/stringutil.h"
+
+#include "testutils/cmdlinetest.h"
+#include "testutils/testasserts.h"
+#include "testutils/testfilemanager.h"
+
+namespace
+{
+
+using gmx::test::CommandLine;
+
+/********************************************************************
+ * Tests for frame-parallel analysis with -nt.
+ */
+
+/*! \brief
+ * Test fixture that runs a module with different -nt values.
+ *
+ * The input trajectory is built from the first frame of a test structure
+ * by shearing it by a different amount in every frame, so that frames
+ * analyzed out of order or with the state of another frame show up as
+ * differences in the output.
+ */
+class FrameParallelTest : public ::testing::Test
+{
+    public:
+        //! Number of frames in the generated trajectory.
+        static const int c_frameCount = 11;
+
+        /*! \brief
+         * Writes a trajectory from the first frame of \p inputFile.
+         */
+        void createTrajectory(const char *inputFile)
+        {
+            const std::string        input
+                = gmx::File::readToString(fileManager_.getInputFilePath(inputFile));
+            std::vector<std::string> lines;
+            size_t                   pos = 0;
+            while (pos < input.size())
+            {
+                size_t end = input.find('\n', pos);
+                if (end == std::string::npos)
+                {
+                    end = input.size();
+                }
+                lines.push_back(input.substr(pos, end - pos));
+                pos = end + 1;
+            }
+            const int   natoms = std::atoi(lines[1].c_str());
+            std::string traj;
+            for (int frame = 0; frame < c_frameCount; ++frame)
+            {
+                const double shear = 0.02*frame;
+                traj.append(gmx::formatString("%s t= %d\n", lines[0].c_str(), frame));
+                traj.append(lines[1] + "\n");
+                for (int i = 0; i < natoms; ++i)
+                {
+                    const std::string &line = lines[2 + i];
+                    const double       x    = std::atof(line.substr(20, 8).c_str());
+                    const double       y    = std::atof(line.substr(28, 8).c_str());
+                    const double       z    = std::atof(line.substr(36, 8).c_str());
+                    traj.append(line.substr(0, 20));
+                    traj.append(gmx::formatString("%8.3f%8.3f%8.3f\n",
+                                                  x + shear*y, y + shear*z, z));
+                }
+                traj.append(lines[2 + natoms] + "\n");
+            }
+            topology_   = fileManager_.getInputFilePath(inputFile);
+            trajectory_ = fileManager_.getTemporaryFilePath("traj.gro");
+            gmx::File::writeFileFromString(trajectory_, traj);
+        }
+
+        /*! \brief
+         * Runs the module with \p nthreads frame threads.
+         *
+         * \returns The contents of the output file given with \p option,
+         *     without the comment lines that contain the command line.
+         */
+        template <class ModuleInfo>
+        std::string runModule(const CommandLine &args, const char *option,
+                              int nthreads)
+        {
+            const std::string outputFile = fileManager_.getTemporaryFilePath(
+                        gmx::formatString("%s%d.xvg", option, nthreads));
+            CommandLine       cmdline(args);
+            cmdline.append("-s");
+            cmdline.append(topology_);
+            cmdline.append("-f");
+            cmdline.append(trajectory_);
+            cmdline.append("-nt");
+            cmdline.append(gmx::formatString("%d", nthreads));
+            cmdline.append(gmx::formatString("-%s", option));
+            cmdline.append(outputFile);
+
+            gmx::TrajectoryAnalysisModulePointer module(ModuleInfo::create());
+            gmx::TrajectoryAnalysisCommandLineRunner runner(module.get());
+            runner.setUseDefaultGroups(false);
+            int rc = 0;
+            EXPECT_NO_THROW_GMX(rc = runner.run(cmdline.argc(), cmdline.argv()));
+            EXPECT_EQ(0, rc);
+
+            const std::string output = gmx::File::readToString(outputFile);
+            std::string       result;
+            pos_type          pos = 0;
+            while (pos < output.size())
+            {
+                pos_type end = output.find('\n', pos);
+                if (end == std::string::npos)
+                {
+                    end = output.size() - 1;
+                }
+                if (output[pos] != '#')
+                {
+                    result.append(output, pos, end + 1 - pos);
+                }
+                pos = end + 1;
+            }
+            return result;
+        }
+
+        /*! \brief
+         * Checks that -nt 1 and several threads give the same output.
+         */
+        template <class ModuleInfo>
+        void testThreadCounts(const CommandLine &args, const char *option)
+        {
+            const std::string serial = runModule<ModuleInfo>(args, option, 1);
+            EXPECT_FALSE(serial.empty());
+            EXPECT_EQ(serial, runModule<ModuleInfo>(args, option, 2));
+            EXPECT_EQ(serial, runModule<ModuleInfo>(args, option, 4));
+        }
+
+    private:
+        typedef std::string::size_type pos_type;
+
+        gmx::test::TestFileManager  fileManager_;
+        std::string                 topology_;
+        std::string                 trajectory_;
+};
+
+TEST_F(FrameParallelTest, DistanceMatchesSerial)
+{
+    const char *const cmdline[] = {
+        "distance",
+        "-select", "atomname S1 S2 and res_cog x < 2.8",
+        "resindex 1 to 4 and atomname CB merge resindex 2 to 5 and atomname CB",
+        "-len", "2", "-binw", "0.5"
+    };
+    createTrajectory("simple.gro");
+    testThreadCounts<gmx::analysismodules::DistanceInfo>(CommandLine(cmdline), "oall");
+}
+
+TEST_F(FrameParallelTest, AngleMatchesSerial)
+{
+    const char *const cmdline[] = {
+        "gangle",
+        "-g1", "vector", "-group1", "resname RV1 RV2 and name A1 A2",
+        "-g2", "vector", "-group2", "resname RV3 RV4 and name A1 A2",
+        "-binw", "60"
+    };
+    createTrajectory("angle.gro");
+    testThreadCounts<gmx::analysismodules::AngleInfo>(CommandLine(cmdline), "oall");
+}
+
+TEST_F(FrameParallelTest, SelectMatchesSerial)
+{
+    const char *const cmdline[] = {
+        "select",
+        "-select", "y < 2.5", "resname RA and x < 2.5"
+    };
+    createTrajectory("simple.gro");
+    testThreadCounts<gmx::analysismodules::SelectInfo>(CommandLine(cmdline), "os");
+}
+
+} // namespace
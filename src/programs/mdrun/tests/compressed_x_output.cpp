@@ -42,9 +42,11 @@
  */
 #include "moduletest.h"
 #include <gtest/gtest.h>
+#include <cstdlib>
 #include <string>
 #include "gromacs/options/filenameoption.h"
 #include "gromacs/tools/check.h"
+#include "gromacs/utility/file.h"
 #include "testutils/cmdlinetest.h"
 
 namespace
@@ -102,4 +104,47 @@ INSTANTIATE_TEST_CASE_P(WithDifferentMdpOptions, CompressedXOutputTest,
                             "compressed-x-grps = SecondWaterMolecule\n"
                             ));
 
+//! Test fixture for the mdrun XTC output thread
+typedef gmx::test::MdrunTestFixture CompressedXOutputThreadTest;
+
+/* The XTC output thread only changes where the frames are compressed,
+ * so the file has to be identical to the one written by the MD thread.
+ */
+TEST_F(CompressedXOutputThreadTest, WritesSameFileAsMdThread)
+{
+    useStringAsMdpFile("cutoff-scheme = Group\n"
+                       "rlist = 0.9\n"
+                       "rcoulomb = 0.9\n"
+                       "rvdw = 0.9\n"
+                       "nsteps = 20\n"
+                       "nstxout-compressed = 2\n");
+    useTopGroAndNdxFromDatabase("spc216");
+    ASSERT_EQ(0, callGrompp());
+
+    const std::string threadedFileName = fileManager_.getTemporaryFilePath("threaded.xtc");
+    reducedPrecisionTrajectoryFileName = threadedFileName;
+    ASSERT_EQ(0, callMdrun());
+
+    // TODO fix this when we have an encapsulation layer for handling
+    // environment variables
+#ifdef GMX_NATIVE_WINDOWS
+    _putenv("GMX_NO_XTC_THREAD=1");
+#else
+    setenv("GMX_NO_XTC_THREAD", "1", true);
+#endif
+    const std::string directFileName = fileManager_.getTemporaryFilePath("direct.xtc");
+    reducedPrecisionTrajectoryFileName = directFileName;
+    int               rc               = callMdrun();
+#ifdef GMX_NATIVE_WINDOWS
+    _putenv("GMX_NO_XTC_THREAD=");
+#else
+    unsetenv("GMX_NO_XTC_THREAD");
+#endif
+    ASSERT_EQ(0, rc);
+
+    const std::string threaded = gmx::File::readToString(threadedFileName);
+    EXPECT_FALSE(threaded.empty());
+    EXPECT_TRUE(threaded == gmx::File::readToString(directFileName));
+}
+
 } // namespace